@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#ifdef ALLOC_CHECK
+
+#include "alloc_check.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+
+#include <unistd.h>
+
+extern "C" {
+  void* __libc_malloc(size_t size);
+  void* __libc_calloc(size_t count, size_t size);
+  void* __libc_realloc(void* ptr, size_t size);
+}
+
+static uint64_t s_alloc_count = 0;
+
+extern "C" void* malloc(size_t size)
+{
+  __atomic_add_fetch(&s_alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+  __atomic_add_fetch(&s_alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+  __atomic_add_fetch(&s_alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+alloc_check_scope::alloc_check_scope(const char* what) noexcept :
+  what_(what),
+  start_count_(count())
+{}
+
+alloc_check_scope::~alloc_check_scope() noexcept
+{
+  auto allocs = count() - start_count_;
+  if (allocs && !std::uncaught_exception()) {
+    // don't use any formatting which might allocate
+    char buffer[160];
+    auto len = snprintf(buffer, sizeof(buffer),
+        "ALLOC_CHECK: %llu heap allocation(s) in %s\n", (unsigned long long)allocs, what_);
+    if (write(STDERR_FILENO, buffer, size_t(len)) < 0) {
+      // aborting anyway
+    }
+    abort();
+  }
+}
+
+uint64_t alloc_check_scope::count() noexcept
+{
+  return __atomic_load_n(&s_alloc_count, __ATOMIC_RELAXED);
+}
+
+#endif
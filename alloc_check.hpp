@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Test hook to detect heap allocations while processing events.
+ *
+ * When built with ALLOC_CHECK defined (cmake -DALLOC_CHECK=ON), malloc(),
+ * calloc() and realloc() are interposed to count allocations (operator new
+ * allocates via malloc()). An alloc_check_scope then aborts the process,
+ * if any allocation happened while it was active. Without ALLOC_CHECK,
+ * the scope is a no-op.
+ */
+#pragma once
+
+#include <cstdint>
+
+#ifdef ALLOC_CHECK
+
+/*!
+ * @brief Scope in which no heap allocation may happen.
+ */
+class alloc_check_scope
+{
+public:
+  /*!
+   * @brief Start checking.
+   *
+   * @param what description of the checked code for the failure message.
+   */
+  explicit alloc_check_scope(const char* what) noexcept;
+
+  /// Stop checking and abort, if an allocation happened.
+  ~alloc_check_scope() noexcept;
+
+  /// Get total count of allocations so far.
+  static uint64_t count() noexcept;
+
+private:
+  /// Description of the checked code.
+  const char* what_;
+  /// Allocation count at the start.
+  uint64_t start_count_;
+};
+
+#else
+
+class alloc_check_scope
+{
+public:
+  explicit alloc_check_scope(const char*) noexcept {}
+};
+
+#endif
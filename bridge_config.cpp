@@ -0,0 +1,579 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "bridge_config.hpp"
+#include "syslog_posix.hpp"
+
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+bridge_config::bridge_config(const hue_sensor_command_posix& bridge, const std::string& cache_dir) :
+  connection_(bridge.ip(), bridge.api_key(), bridge.sensor_id()),
+  active_(new table()),
+  pending_(new table())
+{
+  connection_.copy_settings(bridge);
+  connection_.set_deadline(FETCH_DEADLINE);
+  connection_.set_response_timeout(FETCH_TIMEOUT);
+  // the only request on this connection is a GET of the whole configuration
+  connection_.set_actions({ { std::string(), std::string() } });
+  connection_.set_body_tokenizer(this);
+  if (!cache_dir.empty()) {
+    auto ip = bridge.ip();
+    auto ip_addr = reinterpret_cast<const unsigned char*>(&ip);
+    char name[40];
+    if (*bridge.bridge_id())
+      snprintf(name, sizeof(name), "/bridge-%s.cache", bridge.bridge_id());  // address may change
+    else
+      snprintf(name, sizeof(name), "/bridge-%u.%u.%u.%u.cache", ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3]);
+    cache_path_ = cache_dir + name;
+    temp_path_ = cache_path_ + ".tmp";
+  }
+}
+
+uint16_t bridge_config::add_sensor(const std::string& uniqueid, const std::string& type, const std::string& name)
+{
+  std::string body = "{\"name\":\"" + name + "\",\"type\":\"" + type +
+      "\",\"modelid\":\"EnOceanContact\",\"manufacturername\":\"enocean_to_hue\","
+      "\"swversion\":\"1.0\",\"uniqueid\":\"" + uniqueid + "\",\"recycle\":false}";
+  sensor_request r;
+  r.uniqueid = uniqueid;
+  r.type = type;
+  r.action = connection_.add_action("POST", "sensors", body.c_str());
+  r.id = 0;
+  r.missing = false;
+  sensors_.push_back(r);
+  return uint16_t(sensors_.size() - 1);
+}
+
+void bridge_config::start()
+{
+  if (!cache_path_.empty() && load_cache()) {
+    known_ = true;
+    hash_ = hash(*active_);
+    updated();
+    resolve_sensors();
+    if (time(nullptr) - fetched_at_ < MAX_AGE)
+      return;
+  }
+  scheduled_ = true;
+  fetch_time_ = connection_.timestamp();
+  arm_timer();
+}
+
+void bridge_config::refresh() noexcept
+{
+  auto now = connection_.timestamp();
+  if (request_ == request::fetch || scheduled_ || (fresh_ && now - fetch_start_ < MIN_REFRESH))
+    return;
+  scheduled_ = true;
+  fetch_time_ = now;
+  arm_timer();
+}
+
+bool bridge_config::has_light(uint16_t id) const noexcept
+{
+  for (uint16_t i = 0; i < active_->light_count; ++i) {
+    if (active_->lights[i] == id)
+      return true;
+  }
+  return false;
+}
+
+bool bridge_config::has_group(uint16_t id) const noexcept
+{
+  if (!id)
+    return true;
+  for (uint16_t i = 0; i < active_->group_count; ++i) {
+    if (active_->groups[i] == id)
+      return true;
+  }
+  return false;
+}
+
+const bridge_config::scene* bridge_config::find_scene(const char* id) const noexcept
+{
+  for (uint16_t i = 0; i < active_->scene_count; ++i) {
+    if (strcmp(active_->scenes[i].id, id) == 0)
+      return &active_->scenes[i];
+  }
+  return nullptr;
+}
+
+const bridge_config::sensor* bridge_config::find_sensor(uint16_t id) const noexcept
+{
+  for (uint16_t i = 0; i < active_->sensor_count; ++i) {
+    if (active_->sensors[i].id == id)
+      return &active_->sensors[i];
+  }
+  return nullptr;
+}
+
+const bridge_config::sensor* bridge_config::find_sensor(const char* uniqueid) const noexcept
+{
+  for (uint16_t i = 0; i < active_->sensor_count; ++i) {
+    if (strcmp(active_->sensors[i].uniqueid, uniqueid) == 0)
+      return &active_->sensors[i];
+  }
+  return nullptr;
+}
+
+void bridge_config::set_timer_wheel(timer_wheel* wheel) noexcept
+{
+  if (wheel_)
+    wheel_->cancel(timer_);
+  wheel_ = wheel;
+  connection_.set_timer_wheel(wheel);
+  connection_.set_completion_timer(wheel ? &timer_ : nullptr);
+  arm_timer();
+}
+
+void bridge_config::check_timeouts(int64_t now)
+{
+  if (request_ != request::none) {
+    auto& stats = connection_.stats();
+    bool succeeded = stats.succeeded != succeeded_;
+    if (!succeeded && stats.failed + stats.lost + stats.expired + stats.dropped + stats.rejected == failed_)
+      return; // still in progress
+    auto r = request_;
+    request_ = request::none;
+    if (r == request::fetch)
+      fetch_done(succeeded && document_complete_, now);
+    else
+      create_done(succeeded && created_id_, now);
+  }
+  if (scheduled_ && now - fetch_time_ >= 0)
+    start_fetch(now);
+  else if (fresh_ && now - create_time_ >= 0)
+    start_create();
+  arm_timer();
+}
+
+void bridge_config::arm_timer() noexcept
+{
+  if (!wheel_)
+    return;
+  if (request_ != request::none) {
+    wheel_->cancel(timer_);   // expired by the connection when the request finished
+    return;
+  }
+  if (scheduled_) {
+    wheel_->schedule(timer_, fetch_time_);
+    return;
+  }
+  for (auto& r : sensors_) {
+    if (r.missing && fresh_) {
+      wheel_->schedule(timer_, create_time_);
+      return;
+    }
+  }
+  wheel_->cancel(timer_);
+}
+
+void bridge_config::start_fetch(int64_t now)
+{
+  scheduled_ = false;
+  request_ = request::fetch;
+  fetch_start_ = now;
+  document_complete_ = false;
+  memset(static_cast<void*>(pending_.get()), 0, sizeof(table));
+  auto& stats = connection_.stats();
+  succeeded_ = stats.succeeded;
+  failed_ = stats.failed + stats.lost + stats.expired + stats.dropped + stats.rejected;
+  connection_.post_action(0);
+}
+
+void bridge_config::fetch_done(bool complete, int64_t now)
+{
+  auto ip = connection_.ip();
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&ip);
+  if (!complete) {
+    syslog_printf(LOG_WARNING, "EnOcean bridge %u.%u.%u.%u: cannot fetch configuration, retrying in %lld s",
+        ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], (long long)(RETRY_INTERVAL / 1000));
+    scheduled_ = true;
+    fetch_time_ = now + RETRY_INTERVAL;
+    return;
+  }
+
+  active_.swap(pending_);
+  auto h = hash(*active_);
+  bool changed = !known_ || h != hash_;
+  hash_ = h;
+  known_ = true;
+  fresh_ = true;
+  fetched_at_ = time(nullptr);
+  auto& t = *active_;
+  syslog_printf(LOG_INFO, "EnOcean bridge %u.%u.%u.%u: configuration with %u lights, %u groups, %u scenes "
+      "and %u sensors fetched in %lld ms, %s",
+      ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], t.light_count, t.group_count, t.scene_count,
+      t.sensor_count, (long long)(now - fetch_start_), changed ? "changed" : "unchanged");
+  if (t.overflow)
+    syslog_printf(LOG_WARNING, "EnOcean bridge %u.%u.%u.%u: configuration too large, some entries ignored",
+        ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3]);
+  if (changed)
+    write_cache();
+  else if (!cache_path_.empty())
+    utimensat(AT_FDCWD, cache_path_.c_str(), nullptr, 0);  // age of the cache is its modification time
+  updated();
+  resolve_sensors();
+}
+
+void bridge_config::resolve_sensors()
+{
+  for (uint16_t i = 0; i < sensors_.size(); ++i) {
+    auto& r = sensors_[i];
+    if (r.id)
+      continue;
+    auto s = find_sensor(r.uniqueid.c_str());
+    if (s) {
+      r.id = s->id;
+      r.missing = false;
+      sensor_ready(i, r.id);
+    } else if (fresh_) {
+      r.missing = true;
+    } else {
+      refresh();  // maybe created after the cache was written
+    }
+  }
+}
+
+void bridge_config::start_create()
+{
+  for (uint16_t i = 0; i < sensors_.size(); ++i) {
+    if (!sensors_[i].missing)
+      continue;
+    request_ = request::create;
+    creating_ = i;
+    created_id_ = 0;
+    auto& stats = connection_.stats();
+    succeeded_ = stats.succeeded;
+    failed_ = stats.failed + stats.lost + stats.expired + stats.dropped + stats.rejected;
+    connection_.post_action(sensors_[i].action);
+    return;
+  }
+}
+
+void bridge_config::create_done(bool created, int64_t now)
+{
+  auto ip = connection_.ip();
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&ip);
+  auto& r = sensors_[creating_];
+  if (!created) {
+    syslog_printf(LOG_WARNING, "EnOcean bridge %u.%u.%u.%u: cannot create sensor '%s', retrying in %lld s",
+        ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], r.uniqueid.c_str(), (long long)(RETRY_INTERVAL / 1000));
+    create_time_ = now + RETRY_INTERVAL;
+    return;
+  }
+  r.id = created_id_;
+  r.missing = false;
+  syslog_printf(LOG_INFO, "EnOcean bridge %u.%u.%u.%u: created %s sensor %u '%s'",
+      ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], r.type.c_str(), r.id, r.uniqueid.c_str());
+  // record the new sensor, so the cache doesn't need to be refetched
+  auto& t = *active_;
+  if (t.sensor_count < MAX_SENSORS) {
+    auto& s = t.sensors[t.sensor_count++];
+    s.id = r.id;
+    snprintf(s.type, sizeof(s.type), "%s", r.type.c_str());
+    snprintf(s.uniqueid, sizeof(s.uniqueid), "%s", r.uniqueid.c_str());
+    hash_ = hash(t);
+    write_cache();
+  }
+  sensor_ready(creating_, r.id);
+  create_time_ = now;
+}
+
+void bridge_config::handle_token(token type, const char* text, uint8_t size) noexcept
+{
+  auto& t = *pending_;
+  if (depth() == 0) {
+    // the whole configuration is an object, replies to modifications are arrays
+    if (type == token::begin_object) {
+      memset(static_cast<void*>(&t), 0, sizeof(table));
+      document_complete_ = false;
+      reply_ = false;
+    } else if (type == token::begin_array) {
+      reply_ = true;
+      reply_id_ = false;
+    } else if (type == token::end_object) {
+      document_complete_ = true;
+    }
+    return;
+  }
+  if (reply_) {
+    // [{"success":{"id":"<id>"}}]
+    if (depth() == 3 && type == token::key)
+      reply_id_ = strcmp(text, "id") == 0;
+    else if (depth() == 3 && type == token::string && reply_id_)
+      created_id_ = uint16_t(atoi(text));
+    return;
+  }
+  switch (depth()) {
+    case 1:
+      // sections
+      if (type == token::key) {
+        if (strcmp(text, "lights") == 0)
+          section_ = section::lights;
+        else if (strcmp(text, "groups") == 0)
+          section_ = section::groups;
+        else if (strcmp(text, "scenes") == 0)
+          section_ = section::scenes;
+        else if (strcmp(text, "sensors") == 0)
+          section_ = section::sensors;
+        else
+          section_ = section::other;
+      }
+      break;
+
+    case 2:
+      // entries of a section by their ID
+      if (type == token::key)
+        add_entry(text, size);
+      break;
+
+    case 3:
+      // fields of an entry
+      if (!in_entry_)
+        break;
+      if (type == token::key) {
+        if (section_ == section::sensors && strcmp(text, "type") == 0)
+          field_ = field::type;
+        else if (section_ == section::sensors && strcmp(text, "uniqueid") == 0)
+          field_ = field::uniqueid;
+        else if (section_ == section::scenes && strcmp(text, "group") == 0)
+          field_ = field::group;
+        else
+          field_ = field::other;
+      } else if (type == token::string) {
+        switch (field_) {
+          case field::type:
+          {
+            auto& s = t.sensors[t.sensor_count - 1];
+            snprintf(s.type, sizeof(s.type), "%s", text);
+            break;
+          }
+          case field::uniqueid:
+          {
+            auto& s = t.sensors[t.sensor_count - 1];
+            snprintf(s.uniqueid, sizeof(s.uniqueid), "%s", text);
+            break;
+          }
+          case field::group:
+            t.scenes[t.scene_count - 1].group = uint16_t(atoi(text));
+            break;
+          default:
+            break;
+        }
+        field_ = field::other;
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+void bridge_config::add_entry(const char* key, uint8_t size) noexcept
+{
+  auto& t = *pending_;
+  in_entry_ = false;
+  field_ = field::other;
+  if (section_ == section::other)
+    return;
+  if (section_ == section::scenes) {
+    if (truncated() || size >= sizeof(t.scenes[0].id)) {
+      t.overflow = true;
+    } else if (t.scene_count == MAX_SCENES) {
+      t.overflow = true;
+    } else {
+      auto& s = t.scenes[t.scene_count++];
+      memcpy(s.id, key, size + 1U);
+      s.group = 0;
+      in_entry_ = true;
+    }
+    return;
+  }
+  char* end;
+  auto id = strtoul(key, &end, 10);
+  if (end == key || *end || id > 0xffff)
+    return;
+  switch (section_) {
+    case section::lights:
+      if (t.light_count == MAX_LIGHTS)
+        t.overflow = true;
+      else
+        t.lights[t.light_count++] = uint16_t(id);
+      break;
+    case section::groups:
+      if (t.group_count == MAX_GROUPS)
+        t.overflow = true;
+      else
+        t.groups[t.group_count++] = uint16_t(id);
+      break;
+    case section::sensors:
+      if (t.sensor_count == MAX_SENSORS) {
+        t.overflow = true;
+      } else {
+        auto& s = t.sensors[t.sensor_count++];
+        s.id = uint16_t(id);
+        s.type[0] = 0;
+        s.uniqueid[0] = 0;
+        in_entry_ = true;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+size_t bridge_config::render_entry(const table& t, size_t index, char* dest, size_t size) noexcept
+{
+  int len = 0;
+  if (index < t.light_count) {
+    len = snprintf(dest, size, "light %u\n", t.lights[index]);
+  } else if ((index -= t.light_count) < t.group_count) {
+    len = snprintf(dest, size, "group %u\n", t.groups[index]);
+  } else if ((index -= t.group_count) < t.scene_count) {
+    auto& s = t.scenes[index];
+    len = snprintf(dest, size, "scene %s %u\n", s.id, s.group);
+  } else if ((index -= t.scene_count) < t.sensor_count) {
+    // unique ID is last, it may contain spaces
+    auto& s = t.sensors[index];
+    len = snprintf(dest, size, "sensor %u %s %s\n", s.id, s.type[0] ? s.type : "-", s.uniqueid);
+  }
+  if (len <= 0)
+    return 0;
+  // line breaks and control characters in names would break the line structure
+  for (int i = 0; i < len - 1 && size_t(i) < size; ++i) {
+    if (static_cast<unsigned char>(dest[i]) < 0x20)
+      dest[i] = '?';
+  }
+  return size_t(len) < size ? size_t(len) : size - 1;
+}
+
+uint32_t bridge_config::hash(const table& t) noexcept
+{
+  // FNV-1a over rendered entries
+  uint32_t h = 2166136261U;
+  char line[128];
+  size_t len;
+  for (size_t i = 0; (len = render_entry(t, i, line, sizeof(line))) != 0; ++i) {
+    for (size_t j = 0; j < len; ++j) {
+      h ^= static_cast<unsigned char>(line[j]);
+      h *= 16777619U;
+    }
+  }
+  return h;
+}
+
+bool bridge_config::load_cache()
+{
+  std::ifstream infile(cache_path_, std::ios_base::in);
+  if (!infile.is_open())
+    return false;
+  auto& t = *active_;
+  memset(static_cast<void*>(&t), 0, sizeof(table));
+  std::string line;
+  unsigned stored_hash = 0;
+  struct stat st;
+  if (stat(cache_path_.c_str(), &st) < 0 ||
+      !std::getline(infile, line) || sscanf(line.c_str(), "hash %x", &stored_hash) != 1) {
+    syslog_printf(LOG_WARNING, "EnOcean configuration cache '%s' invalid, ignoring it", cache_path_.c_str());
+    return false;
+  }
+  while (std::getline(infile, line)) {
+    unsigned id, group;
+    int offset = 0;
+    char text[24];
+    auto str = line.c_str();
+    if (sscanf(str, "light %u", &id) == 1 && t.light_count < MAX_LIGHTS) {
+      t.lights[t.light_count++] = uint16_t(id);
+    } else if (sscanf(str, "group %u", &id) == 1 && t.group_count < MAX_GROUPS) {
+      t.groups[t.group_count++] = uint16_t(id);
+    } else if (sscanf(str, "scene %23s %u", text, &group) == 2 && t.scene_count < MAX_SCENES) {
+      auto& s = t.scenes[t.scene_count++];
+      snprintf(s.id, sizeof(s.id), "%s", text);
+      s.group = uint16_t(group);
+    } else if (sscanf(str, "sensor %u %23s %n", &id, text, &offset) == 2 && offset &&
+               t.sensor_count < MAX_SENSORS) {
+      auto& s = t.sensors[t.sensor_count++];
+      s.id = uint16_t(id);
+      snprintf(s.type, sizeof(s.type), "%s", strcmp(text, "-") ? text : "");
+      snprintf(s.uniqueid, sizeof(s.uniqueid), "%s", str + offset);
+    } else if (sscanf(str, "sensor %u %23s", &id, text) == 2 && t.sensor_count < MAX_SENSORS) {
+      // sensor without unique ID
+      auto& s = t.sensors[t.sensor_count++];
+      s.id = uint16_t(id);
+      snprintf(s.type, sizeof(s.type), "%s", strcmp(text, "-") ? text : "");
+      s.uniqueid[0] = 0;
+    } else {
+      syslog_printf(LOG_WARNING, "EnOcean configuration cache '%s' invalid, ignoring it", cache_path_.c_str());
+      return false;
+    }
+  }
+  if (hash(t) != stored_hash) {
+    syslog_printf(LOG_WARNING, "EnOcean configuration cache '%s' corrupted, ignoring it", cache_path_.c_str());
+    return false;
+  }
+  fetched_at_ = st.st_mtime;
+  syslog_printf(LOG_INFO, "EnOcean loaded configuration cache '%s' with %u lights, %u groups, %u scenes and %u sensors",
+      cache_path_.c_str(), t.light_count, t.group_count, t.scene_count, t.sensor_count);
+  return true;
+}
+
+void bridge_config::write_cache() noexcept
+{
+  if (cache_path_.empty())
+    return;
+  // written in the poll loop, so plain syscalls and a stack buffer only
+  int fd = ::open(temp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    syslog_printf(LOG_WARNING, "EnOcean cannot write configuration cache '%s': %s",
+        temp_path_.c_str(), strerror(errno));
+    return;
+  }
+  char buffer[4096];
+  auto len = size_t(snprintf(buffer, sizeof(buffer), "hash %08x\n", hash_));
+  bool ok = true;
+  for (size_t i = 0; ok; ++i) {
+    auto line = render_entry(*active_, i, buffer + len, sizeof(buffer) - len);
+    if (line && len + line < sizeof(buffer) - 1) {
+      len += line;
+      continue;
+    }
+    // buffer full or done, flush
+    ok = ::write(fd, buffer, len) == ssize_t(len);
+    len = 0;
+    if (!line)
+      break;
+    --i;  // render the entry again into the empty buffer
+  }
+  if (::close(fd) < 0)
+    ok = false;
+  if (!ok || ::rename(temp_path_.c_str(), cache_path_.c_str()) < 0) {
+    syslog_printf(LOG_WARNING, "EnOcean cannot write configuration cache '%s': %s",
+        cache_path_.c_str(), strerror(errno));
+    ::unlink(temp_path_.c_str());
+  }
+}
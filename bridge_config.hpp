@@ -0,0 +1,333 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Configuration of a Hue bridge fetched in the background and cached in a file.
+ */
+#pragma once
+
+#include "hue_sensor_command_posix.hpp"
+#include "embedded/json_tokenizer.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <ctime>
+
+/*!
+ * @brief Configuration of a Hue bridge fetched in the background and cached in a file.
+ *
+ * The whole configuration of the bridge (<tt>GET /api/&lt;api_key&gt;</tt>) has
+ * several hundred kB on large installations. It is fetched over a separate
+ * connection, so commands are not delayed by it, and it is tokenized while it
+ * streams in. Only IDs of lights, groups and scenes and IDs, types and unique
+ * IDs of sensors are kept in preallocated tables, so fetching doesn't allocate
+ * memory. The previous configuration stays valid until the new one is complete.
+ *
+ * The configuration is stored in a cache file, so a restarted process doesn't
+ * need to fetch it again. The bridge doesn't provide a version or a hash of its
+ * configuration, so the cache is refreshed after MAX_AGE or when a lookup misses
+ * (see refresh()). The file is only rewritten if the hash of the extracted
+ * entries changed.
+ *
+ * Further, CLIP sensors needed by the gateway are looked up by their unique ID
+ * and created on the bridge, if missing (see add_sensor()).
+ */
+class bridge_config : private json_tokenizer
+{
+public:
+  /// Maximum count of lights.
+  static constexpr uint16_t MAX_LIGHTS = 128;
+  /// Maximum count of groups.
+  static constexpr uint16_t MAX_GROUPS = 128;
+  /// Maximum count of scenes.
+  static constexpr uint16_t MAX_SCENES = 256;
+  /// Maximum count of sensors.
+  static constexpr uint16_t MAX_SENSORS = 256;
+
+  /// Sensor configured on the bridge.
+  struct sensor
+  {
+    uint16_t id;            ///< Sensor ID.
+    char type[24];          ///< Sensor type, e.g., CLIPGenericStatus.
+    char uniqueid[48];      ///< Unique ID (empty if none).
+  };
+
+  /// Scene configured on the bridge.
+  struct scene
+  {
+    char id[24];            ///< Scene ID.
+    uint16_t group;         ///< Group of a group scene (0 for light scenes).
+  };
+
+  /*!
+   * @brief Construct configuration of a bridge.
+   *
+   * @param bridge connection to the bridge, whose address and settings to use.
+   * @param cache_dir directory to store the cache file in (empty for no cache).
+   */
+  bridge_config(const hue_sensor_command_posix& bridge, const std::string& cache_dir);
+
+  virtual ~bridge_config() noexcept {}
+
+  bridge_config(const bridge_config&) = delete;
+  bridge_config& operator=(const bridge_config&) = delete;
+
+  /*!
+   * @brief Add a CLIP sensor to provision on the bridge before start().
+   *
+   * The sensor is looked up by its unique ID and created, if it doesn't exist.
+   * Then sensor_ready() is called with its ID.
+   *
+   * @param uniqueid unique ID of the sensor.
+   * @param type type of the sensor, e.g., CLIPOpenClose.
+   * @param name name of the sensor.
+   * @return index of the sensor passed to sensor_ready().
+   */
+  uint16_t add_sensor(const std::string& uniqueid, const std::string& type, const std::string& name);
+
+  /*!
+   * @brief Load the cached configuration and schedule fetching it, if needed.
+   *
+   * Calls updated() if the cached configuration is valid. The configuration
+   * is fetched if there is no valid cache or if the cache is older than MAX_AGE.
+   */
+  void start();
+
+  /*!
+   * @brief Fetch the configuration again, e.g., since a lookup missed.
+   *
+   * Ignored while fetching and for MIN_REFRESH after the last fetch.
+   */
+  void refresh() noexcept;
+
+  /// Check whether a configuration is known (cached or fetched).
+  bool known() const noexcept { return known_; }
+
+  /// Check whether the configuration was fetched by this process.
+  bool fresh() const noexcept { return fresh_; }
+
+  /// Check whether a light exists.
+  bool has_light(uint16_t id) const noexcept;
+
+  /// Check whether a group exists (group 0 with all lights always exists).
+  bool has_group(uint16_t id) const noexcept;
+
+  /// Find a scene by its ID, return @c nullptr if not found.
+  const scene* find_scene(const char* id) const noexcept;
+
+  /// Find a sensor by its ID, return @c nullptr if not found.
+  const sensor* find_sensor(uint16_t id) const noexcept;
+
+  /// Find a sensor by its unique ID, return @c nullptr if not found.
+  const sensor* find_sensor(const char* uniqueid) const noexcept;
+
+  /// Get connection used to fetch the configuration.
+  hue_sensor_command_posix& connection() noexcept { return connection_; }
+
+  /*!
+   * @brief Schedule fetching and handle its results in a timer wheel.
+   *
+   * The connection is scheduled in the same wheel and expires the timer of
+   * the configuration when its request finished.
+   *
+   * @param wheel timer wheel, which must outlive the configuration.
+   */
+  void set_timer_wheel(timer_wheel* wheel) noexcept;
+
+protected:
+  /// Called when the configuration was loaded from the cache or fetched.
+  virtual void updated() = 0;
+
+  /*!
+   * @brief Called when a sensor added by add_sensor() exists on the bridge.
+   *
+   * @param index index of the sensor returned by add_sensor().
+   * @param id ID of the sensor on the bridge.
+   */
+  virtual void sensor_ready(uint16_t index, uint16_t id) = 0;
+
+private:
+  /// Refetch configuration cached for longer than a day (in seconds).
+  static constexpr time_t MAX_AGE = 24 * 3600;
+  /// Minimum interval between fetches on request (in milliseconds).
+  static constexpr int64_t MIN_REFRESH = 300000;
+  /// Retry a failed fetch after a minute (in milliseconds).
+  static constexpr int64_t RETRY_INTERVAL = 60000;
+  /// Deadline for sending the request to the bridge (in milliseconds).
+  static constexpr int64_t FETCH_DEADLINE = 10000;
+  /// Timeout for receiving the whole configuration, which may be large (in milliseconds).
+  static constexpr int64_t FETCH_TIMEOUT = 30000;
+
+  /// Extracted entries of the configuration.
+  struct table
+  {
+    uint16_t light_count;             ///< Count of lights.
+    uint16_t group_count;             ///< Count of groups.
+    uint16_t scene_count;             ///< Count of scenes.
+    uint16_t sensor_count;            ///< Count of sensors.
+    bool overflow;                    ///< Set if some entries didn't fit.
+    uint16_t lights[MAX_LIGHTS];      ///< IDs of lights.
+    uint16_t groups[MAX_GROUPS];      ///< IDs of groups.
+    scene scenes[MAX_SCENES];         ///< Scenes.
+    sensor sensors[MAX_SENSORS];      ///< Sensors.
+  };
+
+  /// Section of the configuration being parsed.
+  enum class section : uint8_t
+  {
+    other, lights, groups, scenes, sensors
+  };
+
+  /// Field of an entry being parsed.
+  enum class field : uint8_t
+  {
+    other, type, uniqueid, group
+  };
+
+  /// Request in flight on the connection.
+  enum class request : uint8_t
+  {
+    none, fetch, create
+  };
+
+  /// CLIP sensor to provision.
+  struct sensor_request
+  {
+    std::string uniqueid;   ///< Unique ID of the sensor.
+    std::string type;       ///< Type of the sensor.
+    uint16_t action;        ///< Index of the action creating the sensor.
+    uint16_t id;            ///< ID on the bridge (0 if not known yet).
+    bool missing;           ///< Set if the sensor doesn't exist on the bridge.
+  };
+
+  /// Timer calling check_timeouts().
+  class timeout : public timer_wheel::timer
+  {
+  public:
+    explicit timeout(bridge_config& parent) noexcept : parent_(parent) {}
+
+  private:
+    virtual void expired(int64_t now) override { parent_.check_timeouts(now); }
+
+    bridge_config& parent_;
+  };
+
+  /// Handle progress of fetching and scheduled fetches.
+  void check_timeouts(int64_t now);
+
+  /// Schedule the timer for the next scheduled fetch or creation, if not waiting for a request.
+  void arm_timer() noexcept;
+
+  /// Handle a token of the configuration.
+  virtual void handle_token(token type, const char* text, uint8_t size) noexcept override;
+
+  /// Start a new entry in the current section.
+  void add_entry(const char* key, uint8_t size) noexcept;
+
+  /// Start fetching the configuration.
+  void start_fetch(int64_t now);
+
+  /// Finish fetching the configuration.
+  void fetch_done(bool complete, int64_t now);
+
+  /// Look up sensors to provision in the configuration.
+  void resolve_sensors();
+
+  /// Start creating the next missing sensor, if any.
+  void start_create();
+
+  /// Finish creating a sensor.
+  void create_done(bool created, int64_t now);
+
+  /// Load the cache file, return true if valid.
+  bool load_cache();
+
+  /// Write the cache file.
+  void write_cache() noexcept;
+
+  /*!
+   * @brief Render an entry of a table as a line of the cache file.
+   *
+   * @param t table to render.
+   * @param index index of the entry over all sections.
+   * @param dest,size buffer to render to.
+   * @return length of the line, 0 past the last entry.
+   */
+  static size_t render_entry(const table& t, size_t index, char* dest, size_t size) noexcept;
+
+  /// Compute hash of all entries of a table.
+  static uint32_t hash(const table& t) noexcept;
+
+  /// Connection to fetch the configuration.
+  hue_sensor_command_posix connection_;
+  /// Path to the cache file (empty for no cache).
+  std::string cache_path_;
+  /// Path to the temporary file to write the cache to.
+  std::string temp_path_;
+  /// Current configuration.
+  std::unique_ptr<table> active_;
+  /// Configuration being fetched.
+  std::unique_ptr<table> pending_;
+  /// Section being parsed.
+  section section_ = section::other;
+  /// Field being parsed.
+  field field_ = field::other;
+  /// Set if the current entry of the section was added.
+  bool in_entry_ = false;
+  /// Set if the fetched document is complete.
+  bool document_complete_ = false;
+  /// Set if the current document is a reply to a modification.
+  bool reply_ = false;
+  /// Set if the next value in the reply is the ID of a created resource.
+  bool reply_id_ = false;
+  /// ID of the resource created by the last request.
+  uint16_t created_id_ = 0;
+  /// Set if a configuration is known.
+  bool known_ = false;
+  /// Set if the configuration was fetched by this process.
+  bool fresh_ = false;
+  /// Request in flight.
+  request request_ = request::none;
+  /// Index of the sensor being created.
+  uint16_t creating_ = 0;
+  /// Time of the next attempt to create missing sensors.
+  int64_t create_time_ = 0;
+  /// Sensors to provision.
+  std::vector<sensor_request> sensors_;
+  /// Set if a fetch is scheduled.
+  bool scheduled_ = false;
+  /// Time of the scheduled fetch.
+  int64_t fetch_time_ = 0;
+  /// Time when the last fetch started.
+  int64_t fetch_start_ = 0;
+  /// Hash of the current configuration.
+  uint32_t hash_ = 0;
+  /// Wall-clock time when the current configuration was fetched.
+  time_t fetched_at_ = 0;
+  /// Count of succeeded requests of the connection before the fetch.
+  uint32_t succeeded_ = 0;
+  /// Count of failed requests of the connection before the fetch.
+  uint32_t failed_ = 0;
+  /// Timer wheel to schedule timeouts in, if any.
+  timer_wheel* wheel_ = nullptr;
+  /// Timer of the next timeout.
+  timeout timer_{*this};
+};
@@ -0,0 +1,303 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "bridge_resolver.hpp"
+#include "syslog_posix.hpp"
+
+#include <system_error>
+#include <cstring>
+#include <strings.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/// Service of Hue bridges.
+static constexpr char SERVICE[] = "_hue._tcp.local";
+
+bridge_resolver::~bridge_resolver() noexcept
+{
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+void bridge_resolver::open(uint32_t ip, uint16_t port)
+{
+  fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd_ < 0)
+    throw std::system_error(errno, std::generic_category(), "Cannot open mDNS socket");
+  auto flags = fcntl(fd_, F_GETFL);
+  if (flags < 0 || fcntl(fd_, F_SETFL, flags | O_NONBLOCK) < 0) {
+    auto err = errno;
+    close(fd_);
+    fd_ = -1;
+    throw std::system_error(err, std::generic_category(), "Cannot set mDNS socket's flags");
+  }
+  ip_ = ip;
+  port_ = htons(port);
+}
+
+void bridge_resolver::add_bridge(uint8_t index, const char* id) noexcept
+{
+  bridges_[index].id = id;
+}
+
+void bridge_resolver::resolve(uint8_t index, timestamp_t now) noexcept
+{
+  auto& b = bridges_[index];
+  if (!b.id || b.active || (b.started && now - b.start < MIN_INTERVAL))
+    return;
+  b.active = true;
+  b.started = true;
+  b.start = now;
+  b.queries = 0;
+  syslog_printf(LOG_INFO, "EnOcean bridge %s: resolving address", b.id);
+  send_query(now);
+  arm_timer();
+}
+
+void bridge_resolver::send_query(timestamp_t now) noexcept
+{
+  // header with one question, ID 0 and no flags
+  uint8_t msg[12 + sizeof(SERVICE) + 1 + 4] = { 0, 0, 0, 0, 0, 1 };
+  size_t len = 12;
+  for (auto label = SERVICE; *label; ) {
+    auto dot = strchr(label, '.');
+    auto label_len = dot ? size_t(dot - label) : strlen(label);
+    msg[len++] = uint8_t(label_len);
+    memcpy(msg + len, label, label_len);
+    len += label_len;
+    label += label_len + (dot ? 1 : 0);
+  }
+  msg[len++] = 0;
+  msg[len++] = 0;
+  msg[len++] = 12;      // PTR
+  msg[len++] = 0x80;    // unicast response requested
+  msg[len++] = 1;       // IN
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = ip_;
+  addr.sin_port = port_;
+  // lost queries are repeated, so ignore errors
+  sendto(fd_, msg, len, MSG_DONTWAIT, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+  for (auto& b : bridges_) {
+    if (b.active)
+      ++b.queries;
+  }
+  next_query_ = now + QUERY_INTERVAL;
+}
+
+void bridge_resolver::check_timeouts(timestamp_t now) noexcept
+{
+  if (now - next_query_ < 0) {
+    arm_timer();
+    return;
+  }
+  bool any = false;
+  for (auto& b : bridges_) {
+    if (!b.active)
+      continue;
+    if (b.queries >= MAX_QUERIES) {
+      b.active = false;
+      syslog_printf(LOG_WARNING, "EnOcean bridge %s: no mDNS response, keeping address", b.id);
+    } else {
+      any = true;
+    }
+  }
+  if (any)
+    send_query(now);
+  arm_timer();
+}
+
+bridge_resolver::timestamp_t bridge_resolver::next_timeout(timestamp_t now) const noexcept
+{
+  for (auto& b : bridges_) {
+    if (b.active) {
+      auto delta = next_query_ - now;
+      return delta < 0 ? 0 : delta;
+    }
+  }
+  return MIN_INTERVAL;
+}
+
+void bridge_resolver::set_timer_wheel(timer_wheel* wheel) noexcept
+{
+  if (wheel_)
+    wheel_->cancel(timer_);
+  wheel_ = wheel;
+  arm_timer();
+}
+
+void bridge_resolver::arm_timer() noexcept
+{
+  if (!wheel_)
+    return;
+  for (auto& b : bridges_) {
+    if (b.active) {
+      wheel_->schedule(timer_, next_query_);
+      return;
+    }
+  }
+  wheel_->cancel(timer_);
+}
+
+void bridge_resolver::poll()
+{
+  uint8_t msg[1500];
+  struct sockaddr_in remote;
+  for (;;) {
+    socklen_t addr_len = sizeof(remote);
+    auto len = recvfrom(fd_, msg, sizeof(msg), 0, reinterpret_cast<sockaddr*>(&remote), &addr_len);
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      if (errno == EINTR || errno == ECONNREFUSED)
+        continue;   // ICMP error of a previous query
+      throw std::system_error(errno, std::generic_category(), "Error receiving mDNS response");
+    }
+    uint32_t ip;
+    auto index = parse(msg, size_t(len), remote.sin_addr.s_addr, ip);
+    if (index >= 0) {
+      bridges_[index].active = false;
+      resolved(uint8_t(index), ip);
+    }
+  }
+}
+
+size_t bridge_resolver::read_name(const uint8_t* msg, size_t size, size_t offset, char* name, size_t name_size) noexcept
+{
+  size_t end = 0;     // offset past the name in the original position
+  size_t len = 0;
+  for (uint8_t jumps = 0; jumps < 16; ) {
+    if (offset >= size)
+      return 0;
+    auto label_len = msg[offset];
+    if ((label_len & 0xc0) == 0xc0) {
+      // compression pointer
+      if (offset + 1 >= size)
+        return 0;
+      if (!end)
+        end = offset + 2;
+      offset = size_t(label_len & 0x3f) << 8 | msg[offset + 1];
+      ++jumps;
+      continue;
+    }
+    if (label_len & 0xc0)
+      return 0;
+    ++offset;
+    if (!label_len) {
+      name[len] = 0;
+      return end ? end : offset;
+    }
+    if (offset + label_len > size || len + label_len + 2 > name_size)
+      return 0;
+    if (len)
+      name[len++] = '.';
+    memcpy(name + len, msg + offset, label_len);
+    len += label_len;
+    offset += label_len;
+  }
+  return 0;   // pointer loop
+}
+
+/// Read big-endian 16-bit value.
+static uint16_t read16(const uint8_t* p) noexcept
+{
+  return uint16_t(p[0] << 8 | p[1]);
+}
+
+int bridge_resolver::parse(const uint8_t* msg, size_t size, uint32_t source, uint32_t& ip) const noexcept
+{
+  if (size < 12 || !(msg[2] & 0x80))
+    return -1;  // not a response
+  auto questions = read16(msg + 4);
+  auto records = unsigned(read16(msg + 6)) + read16(msg + 8) + read16(msg + 10);
+  char name[256];
+  size_t offset = 12;
+  for (unsigned i = 0; i < questions; ++i) {
+    offset = read_name(msg, size, offset, name, sizeof(name));
+    if (!offset || offset + 4 > size)
+      return -1;
+    offset += 4;
+  }
+
+  // collect bridge ID, SRV target and A records of the response
+  static constexpr uint8_t MAX_ADDRESSES = 4;
+  char bridge_id[20] = "";
+  char target[256] = "";
+  char hosts[MAX_ADDRESSES][256];
+  uint32_t addresses[MAX_ADDRESSES];
+  uint8_t address_count = 0;
+  for (unsigned i = 0; i < records; ++i) {
+    offset = read_name(msg, size, offset, name, sizeof(name));
+    if (!offset || offset + 10 > size)
+      return -1;
+    auto type = read16(msg + offset);
+    auto rdata = offset + 10;
+    auto rdata_len = read16(msg + offset + 8);
+    if (rdata + rdata_len > size)
+      return -1;
+    offset = rdata + rdata_len;
+    switch (type) {
+      case 1:   // A
+        if (rdata_len == 4 && address_count < MAX_ADDRESSES) {
+          memcpy(&addresses[address_count], msg + rdata, 4);
+          memcpy(hosts[address_count], name, sizeof(name));
+          ++address_count;
+        }
+        break;
+      case 16:  // TXT
+        for (auto p = rdata; p < offset; p += 1U + msg[p]) {
+          size_t len = msg[p];
+          if (p + 1 + len > offset)
+            break;
+          if (len > 9 && len - 9 < sizeof(bridge_id) && strncasecmp(reinterpret_cast<const char*>(msg + p + 1), "bridgeid=", 9) == 0) {
+            memcpy(bridge_id, msg + p + 10, len - 9);
+            bridge_id[len - 9] = 0;
+          }
+        }
+        break;
+      case 33:  // SRV
+        if (rdata_len < 7 || !read_name(msg, size, rdata + 6, target, sizeof(target)))
+          target[0] = 0;
+        break;
+      default:
+        break;
+    }
+  }
+  if (!bridge_id[0])
+    return -1;
+
+  for (uint8_t index = 0; index < MAX_BRIDGES; ++index) {
+    auto id = bridges_[index].id;
+    if (!id || strcasecmp(id, bridge_id) != 0)
+      continue;
+    // bridges answer for themselves, so the source is the fallback
+    ip = address_count ? addresses[0] : source;
+    for (uint8_t i = 0; i < address_count; ++i) {
+      if (strcasecmp(hosts[i], target) == 0)
+        ip = addresses[i];
+    }
+    return index;
+  }
+  return -1;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Resolver of bridge addresses by bridge ID via mDNS.
+ */
+#pragma once
+
+#include "embedded/hue_sensor_command.hpp"
+
+#include <cstddef>
+
+/*!
+ * @brief Resolver of bridge addresses by bridge ID via mDNS.
+ *
+ * Hue bridges announce themselves as <tt>_hue._tcp.local</tt> services
+ * with their bridge ID in the <tt>bridgeid</tt> TXT entry. The resolver
+ * sends a PTR query for the service from an ephemeral port, so responders
+ * answer directly to it (legacy unicast), and takes the address from the
+ * A record of the SRV target of the bridge or from the source of the
+ * response. The query is repeated up to MAX_QUERIES times per resolution.
+ *
+ * Resolution is started on request, e.g., at startup or when a bridge
+ * became unreachable, but at most once per MIN_INTERVAL per bridge.
+ * It runs in the background of the poll loop and doesn't allocate memory.
+ */
+class bridge_resolver
+{
+public:
+  using timestamp_t = hue_sensor_command::timestamp_t;
+
+  /// Maximum count of bridges.
+  static constexpr uint8_t MAX_BRIDGES = 8;
+  /// Repeat queries after 1 second.
+  static constexpr timestamp_t QUERY_INTERVAL = 1000;
+  /// Give up after 3 queries without answer.
+  static constexpr uint8_t MAX_QUERIES = 3;
+  /// Resolve a bridge at most every 10 seconds.
+  static constexpr timestamp_t MIN_INTERVAL = 10000;
+
+  bridge_resolver() noexcept {}
+  virtual ~bridge_resolver() noexcept;
+
+  bridge_resolver(const bridge_resolver&) = delete;
+  bridge_resolver& operator=(const bridge_resolver&) = delete;
+
+  /*!
+   * @brief Open socket for queries.
+   *
+   * @param ip,port address to send queries to (network order IP, host order port),
+   *    usually the mDNS group 224.0.0.251:5353.
+   */
+  void open(uint32_t ip, uint16_t port);
+
+  /// Check whether the resolver is open.
+  bool enabled() const noexcept { return fd_ >= 0; }
+
+  /*!
+   * @brief Add a bridge to resolve.
+   *
+   * @param index index of the bridge.
+   * @param id bridge ID (16 hex digits), which must stay valid.
+   */
+  void add_bridge(uint8_t index, const char* id) noexcept;
+
+  /// Start resolving a bridge, unless resolving it already or resolved recently.
+  void resolve(uint8_t index, timestamp_t now) noexcept;
+
+  /// Get time when a bridge can be resolved again.
+  timestamp_t next_resolve(uint8_t index) const noexcept { return bridges_[index].start + MIN_INTERVAL; }
+
+  /// Get FD to poll on.
+  int get_fd() const noexcept { return fd_; }
+
+  /// Process responses.
+  void poll();
+
+  /// Repeat queries and give up on bridges without answer.
+  void check_timeouts(timestamp_t now) noexcept;
+
+  /// Get milliseconds until check_timeouts() needs to be called.
+  timestamp_t next_timeout(timestamp_t now) const noexcept;
+
+  /*!
+   * @brief Schedule check_timeouts() in a timer wheel while resolving.
+   *
+   * @param wheel timer wheel, which must outlive the resolver, or @c nullptr
+   *    to let the caller call check_timeouts().
+   */
+  void set_timer_wheel(timer_wheel* wheel) noexcept;
+
+protected:
+  /*!
+   * @brief Called when the address of a bridge was resolved.
+   *
+   * @param index index of the bridge.
+   * @param ip IP address of the bridge (network order).
+   */
+  virtual void resolved(uint8_t index, uint32_t ip) = 0;
+
+private:
+  /// State of a bridge.
+  struct bridge
+  {
+    const char* id;         ///< Bridge ID (@c nullptr if not resolved).
+    bool active;            ///< Set while resolving.
+    bool started;           ///< Set if resolved at least once.
+    uint8_t queries;        ///< Count of queries sent in the current resolution.
+    timestamp_t start;      ///< Start of the last resolution.
+  };
+
+  /// Timer calling check_timeouts().
+  class timeout : public timer_wheel::timer
+  {
+  public:
+    explicit timeout(bridge_resolver& parent) noexcept : parent_(parent) {}
+
+  private:
+    virtual void expired(timestamp_t now) override { parent_.check_timeouts(now); }
+
+    bridge_resolver& parent_;
+  };
+
+  /// Schedule the timer for the next query, if resolving any bridge.
+  void arm_timer() noexcept;
+
+  /// Send a query for all bridges being resolved.
+  void send_query(timestamp_t now) noexcept;
+
+  /// Parse a response, return index of the resolved bridge or -1.
+  int parse(const uint8_t* msg, size_t size, uint32_t source, uint32_t& ip) const noexcept;
+
+  /*!
+   * @brief Read a possibly compressed name from a DNS message.
+   *
+   * @param msg,size DNS message.
+   * @param offset offset of the name.
+   * @param name,name_size buffer for the dotted name.
+   * @return offset past the name or 0, if malformed.
+   */
+  static size_t read_name(const uint8_t* msg, size_t size, size_t offset, char* name, size_t name_size) noexcept;
+
+  /// Socket to send queries and receive responses on.
+  int fd_ = -1;
+  /// Address to send queries to (network order).
+  uint32_t ip_ = 0;
+  /// Port to send queries to (network order).
+  uint16_t port_ = 0;
+  /// Time of the next query.
+  timestamp_t next_query_ = 0;
+  /// Bridges.
+  bridge bridges_[MAX_BRIDGES] = {};
+  /// Timer wheel to schedule timeouts in, if any.
+  timer_wheel* wheel_ = nullptr;
+  /// Timer of the next query.
+  timeout timer_{*this};
+};
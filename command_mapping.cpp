@@ -18,10 +18,16 @@
  */
 
 #include "command_mapping.hpp"
+#include "embedded/crc8.hpp"
 
 #include <fstream>
 #include <sstream>
 #include <system_error>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
 
 #include <arpa/inet.h>
 
@@ -30,7 +36,13 @@ command_mapping::command_mapping()
   // NOP for now
 }
 
-std::pair<int32_t, uint8_t> command_mapping::map(const enocean_event& e)
+/// Get priority class of a mapping, using the default for the event, if not set.
+static rate_limiter::priority priority_of(uint8_t priority, rate_limiter::priority automatic) noexcept
+{
+  return priority == command_mapping::AUTO_PRIORITY ? automatic : rate_limiter::priority(priority);
+}
+
+command_mapping::command command_mapping::map(const enocean_event& e)
 {
   if (e.hdr.packet_type == enocean_packet_type::RADIO_ERP1) {
     switch (e.erp1.event_type) {
@@ -40,15 +52,17 @@ std::pair<int32_t, uint8_t> command_mapping::map(const enocean_event& e)
         auto id = e.erp1.switch_event.sender;
         auto i = mapping_.find(std::make_pair(id, button));
         if (i != mapping_.end()) {
-          auto res = i->second;
-          auto& last = last_value_[id];
-          if (i->second.first == RELEASE) {
+          command res = { i->second.value, i->second.bridge_set,
+              priority_of(i->second.priority, rate_limiter::priority::interactive) };
+          auto& last = last_values_[slots_.find(id)->second];
+          if (i->second.value == RELEASE) {
             // special handling for button release - send last negated
-            res.first = -last;
-            last = 0;
+            // (direct actions and frames have no release counterpart)
+            res.value = is_direct(last.value) ? 0 : -last.value;
+            store(last, 0);
           } else {
             // store value for button release
-            last = res.first;
+            store(last, res.value);
           }
           return res;
         }
@@ -59,18 +73,56 @@ std::pair<int32_t, uint8_t> command_mapping::map(const enocean_event& e)
         bool closed = e.erp1.contact_event.is_closed();
         auto id = e.erp1.contact_event.sender;
         auto i = mapping_.find(std::make_pair(id, closed ? 1 : 0));
-        if (i != mapping_.end())
-          return i->second;
+        if (i != mapping_.end()) {
+          command res = { i->second.value, i->second.bridge_set,
+              priority_of(i->second.priority, rate_limiter::priority::background) };
+          return res;
+        }
         break;
       }
       default:
         break;
     }
   }
-  return std::make_pair(0, 0);
+  command none = { 0, 0, rate_limiter::priority::normal };
+  return none;
+}
+
+uint16_t command_mapping::attach(last_value* table) noexcept
+{
+  uint16_t reset = 0;
+  for (auto& s : slots_) {
+    auto& entry = table[s.second];
+    if (entry.sender != s.first.raw() ||
+        entry.check != crc8::checksum(&entry, offsetof(last_value, check)))
+    {
+      entry.sender = s.first.raw();
+      store(entry, 0);
+      ++reset;
+    }
+  }
+  last_values_ = table;
+  return reset;
 }
 
-void command_mapping::add_mapping(enocean_id id, int8_t button, int32_t value, uint8_t bridge_set)
+uint8_t command_mapping::sensor_index(uint32_t sender, uint8_t bridge) const noexcept
+{
+  auto i = sensor_indices_.find(sender);
+  if (i == sensor_indices_.end())
+    return 0;
+  if (i->second != AUTO_SENSOR)
+    return i->second;   // checked against the pool of each bridge on load
+  return uint8_t(sender % uint32_t(sensors_[bridge].size() + 1));
+}
+
+void command_mapping::store(last_value& entry, int32_t value) noexcept
+{
+  entry.value = value;
+  entry.check = crc8::checksum(&entry, offsetof(last_value, check));
+}
+
+void command_mapping::add_mapping(enocean_id id, int8_t button, int32_t value, uint8_t bridge_set,
+    uint8_t priority)
 {
   if (value <= 0 && value != RELEASE && !(value == -1 && button == 0))
     throw std::runtime_error("Value to send must be positive");
@@ -79,18 +131,247 @@ void command_mapping::add_mapping(enocean_id id, int8_t button, int32_t value, u
 
   if (button < 0) {
     if (button == -3)
-      add_mapping(id, 0, RELEASE, bridge_set);
+      add_mapping(id, 0, RELEASE, bridge_set, priority);
     for (button = ((button == -2) ? 0 : 1); button <= 8; ++button)
-      add_mapping(id, button, value + button, bridge_set);
+      add_mapping(id, button, value + button, bridge_set, priority);
     return;
   }
   if (button == 0 && value == -1)
     value = RELEASE;
-  mapping_.emplace(std::make_pair(id, button), std::make_pair(value, bridge_set));
-  last_value_[id] = 0;
+  if (slots_.find(id) == slots_.end()) {
+    if (slots_.size() == MAX_SENDERS)
+      throw std::runtime_error("Too many distinct senders in the mapping");
+    auto slot = uint16_t(slots_.size());
+    slots_.emplace(id, slot);
+    auto& entry = last_values_[slot];
+    entry.sender = id.raw();
+    store(entry, 0);
+  }
+  target t = { value, bridge_set, priority };
+  mapping_.emplace(std::make_pair(id, button), t);
+  if (is_action(value))
+    action_bridges_[action_index(value)] |= bridge_set;
+  else if (is_frame(value))
+    frame_bridges_[frame_index(value)] |= bridge_set;
+  else if (is_state_action(value)) {
+    state_action_bridges_[state_action_index(value)] |= bridge_set;
+    for (auto a : state_actions_[state_action_index(value)].actions)
+      action_bridges_[a] |= bridge_set;
+  }
   printf("Added mapping for %x: %d -> %u/%x\n", ntohl(id.raw()), button, value, bridge_set);
 }
 
+int32_t command_mapping::parse_action(const char* str)
+{
+  std::string resource, body;
+  int id, group = 0, offset = 0;
+  char scene[64];
+  if (sscanf(str, "light %d %n", &id, &offset) == 1 && offset) {
+    resource = "lights/" + std::to_string(id) + "/state";
+    body = str + offset;
+  } else if (sscanf(str, "group %d %n", &id, &offset) == 1 && offset) {
+    resource = "groups/" + std::to_string(id) + "/action";
+    body = str + offset;
+  } else if (strncmp(str, "stream ", 7) == 0) {
+    return parse_frame(str + 7);
+  } else if (strncmp(str, "toggle ", 7) == 0) {
+    return parse_state_action(state_action::kind::toggle, str + 7);
+  } else if (strncmp(str, "step ", 5) == 0) {
+    return parse_state_action(state_action::kind::step, str + 5);
+  } else if (strncmp(str, "cycle ", 6) == 0) {
+    return parse_state_action(state_action::kind::cycle, str + 6);
+  } else if (sscanf(str, "scene %63s %d", scene, &group) >= 1) {
+    id = group;
+    resource = "groups/" + std::to_string(group) + "/action";
+    body = std::string("{\"scene\":\"") + scene + "\"}";
+  } else {
+    throw std::runtime_error("Expected value or direct action (light, group, scene, toggle, step, cycle or stream)");
+  }
+  if (id < 0)
+    throw std::runtime_error("Expected non-negative light or group ID");
+  // strip trailing comment and whitespace
+  auto end = body.rfind('}');
+  if (end != std::string::npos) {
+    auto rest = body.find_first_not_of(" \t\r", end + 1);
+    if (rest == std::string::npos || body[rest] == '#')
+      body.resize(end + 1);
+  }
+  if (body.size() < 2 || body.front() != '{' || body.back() != '}')
+    throw std::runtime_error("Expected JSON object as body of direct action");
+  return add_action(resource, body);
+}
+
+int32_t command_mapping::add_action(const std::string& resource, const std::string& body)
+{
+  // reuse the same action, if already defined
+  auto action = std::make_pair(resource, body);
+  size_t index = 0;
+  while (index < actions_.size() && actions_[index] != action)
+    ++index;
+  if (index == actions_.size()) {
+    if (actions_.size() == MAX_ACTIONS)
+      throw std::runtime_error("Too many distinct direct actions in the mapping");
+    actions_.push_back(action);
+    action_bridges_.push_back(0);
+    printf("Added direct action %u: /%s %s\n", unsigned(index), resource.c_str(), body.c_str());
+  }
+  return ACTION_BASE + int32_t(index);
+}
+
+int32_t command_mapping::parse_state_action(state_action::kind type, const char* str)
+{
+  state_action a;
+  a.type = type;
+  a.step = 0;
+  char target[8];
+  unsigned id;
+  int offset = 0;
+  if (sscanf(str, "%7s %u%n", target, &id, &offset) != 2 || id > 65535 ||
+      (strcmp(target, "light") != 0 && strcmp(target, "group") != 0))
+    throw std::runtime_error("Expected target of the action as light <id> or group <id>");
+  a.group = target[0] == 'g';
+  a.target = uint16_t(id);
+  std::istringstream args(str + offset);
+  std::string arg;
+  std::vector<int> numbers;
+  while (args >> arg && arg[0] != '#') {
+    char* end;
+    auto n = strtol(arg.c_str(), &end, 10);
+    if (*end || n < -254 || n > 254)
+      throw std::runtime_error("Expected brightness between -254 and 254");
+    numbers.push_back(int(n));
+  }
+  auto resource = (a.group ? "groups/" : "lights/") + std::to_string(id) + (a.group ? "/action" : "/state");
+  switch (type) {
+    case state_action::kind::toggle:
+      if (!numbers.empty())
+        throw std::runtime_error("Unexpected arguments of toggle");
+      a.actions.push_back(action_index(add_action(resource, "{\"on\":true}")));
+      a.actions.push_back(action_index(add_action(resource, "{\"on\":false}")));
+      break;
+    case state_action::kind::step:
+      if (numbers.size() != 1 || !numbers[0])
+        throw std::runtime_error("Expected non-zero brightness step");
+      a.step = int16_t(numbers[0]);
+      a.actions.push_back(action_index(add_action(resource,
+          "{\"on\":true,\"bri\":" + std::to_string(a.step > 0 ? a.step : 1) + "}")));
+      a.actions.push_back(action_index(add_action(resource, "{\"bri_inc\":" + std::to_string(a.step) + "}")));
+      break;
+    case state_action::kind::cycle:
+      if (numbers.size() < 2)
+        throw std::runtime_error("Expected at least two brightness levels to cycle through");
+      for (auto n : numbers) {
+        if (n < 0)
+          throw std::runtime_error("Expected brightness levels between 0 and 254");
+        a.levels.push_back(uint8_t(n));
+        a.actions.push_back(action_index(add_action(resource,
+            n ? "{\"on\":true,\"bri\":" + std::to_string(n) + "}" : std::string("{\"on\":false}"))));
+      }
+      break;
+  }
+
+  // reuse the same action, if already defined
+  size_t index = 0;
+  while (index < state_actions_.size() &&
+      (state_actions_[index].type != a.type || state_actions_[index].actions != a.actions))
+    ++index;
+  if (index == state_actions_.size()) {
+    if (state_actions_.size() == MAX_STATE_ACTIONS)
+      throw std::runtime_error("Too many distinct state actions in the mapping");
+    state_actions_.push_back(a);
+    state_action_bridges_.push_back(0);
+    printf("Added state action %u on %s %u\n", unsigned(index), target, id);
+  }
+  return STATE_ACTION_BASE + int32_t(index);
+}
+
+int32_t command_mapping::parse_frame(const char* str)
+{
+  std::vector<light_color> frame;
+  std::istringstream colors(str);
+  std::string color;
+  while (colors >> color) {
+    if (color[0] == '#')
+      break;
+    unsigned light, rgb;
+    int offset = 0;
+    if (sscanf(color.c_str(), "%u:%6x%n", &light, &rgb, &offset) != 2 || size_t(offset) != color.size() ||
+        color.size() - color.find(':') != 7 || light < 1 || light > 65535)
+      throw std::runtime_error("Expected light colors in form <light id>:<rrggbb>");
+    for (auto& c : frame) {
+      if (c.light == light)
+        throw std::runtime_error("Light specified twice in a streamed frame");
+    }
+    if (frame.size() == MAX_STREAM_LIGHTS)
+      throw std::runtime_error("Too many lights in a streamed frame");
+    light_color c = { uint16_t(light), uint8_t(rgb >> 16), uint8_t(rgb >> 8), uint8_t(rgb) };
+    frame.push_back(c);
+  }
+  if (frame.empty())
+    throw std::runtime_error("Expected at least one light color in a streamed frame");
+
+  // reuse the same frame, if already defined
+  auto same = [&frame](const std::vector<light_color>& other) {
+    if (other.size() != frame.size())
+      return false;
+    for (size_t i = 0; i < frame.size(); ++i) {
+      if (other[i].light != frame[i].light || other[i].red != frame[i].red ||
+          other[i].green != frame[i].green || other[i].blue != frame[i].blue)
+        return false;
+    }
+    return true;
+  };
+  size_t index = 0;
+  while (index < frames_.size() && !same(frames_[index]))
+    ++index;
+  if (index == frames_.size()) {
+    if (frames_.size() == MAX_FRAMES)
+      throw std::runtime_error("Too many distinct streamed frames in the mapping");
+    frames_.push_back(frame);
+    frame_bridges_.push_back(0);
+    printf("Added streamed frame %u with %u lights\n", unsigned(index), unsigned(frame.size()));
+  }
+  return FRAME_BASE + int32_t(index);
+}
+
+void command_mapping::add_contact_sensor(enocean_id id, const char* type, uint8_t bridge_set, uint8_t priority)
+{
+  const char* state;
+  contact_sensor sensor;
+  if (strcmp(type, "openclose") == 0) {
+    sensor.type = "CLIPOpenClose";
+    state = "open";
+  } else if (strcmp(type, "presence") == 0) {
+    sensor.type = "CLIPPresence";
+    state = "presence";
+  } else {
+    throw std::runtime_error("Expected contact sensor type openclose or presence");
+  }
+  for (auto& s : contact_sensors_) {
+    if (s.sender == id)
+      throw std::runtime_error("Contact already has a sensor");
+  }
+  char buffer[64];
+  auto raw = id.raw();
+  snprintf(buffer, sizeof(buffer), "enocean-%08x-%s", raw, type);
+  sensor.uniqueid = buffer;
+  snprintf(buffer, sizeof(buffer), "EnOcean %02x:%02x:%02x:%02x",
+      raw >> 24, (raw >> 16) & 0xff, (raw >> 8) & 0xff, raw & 0xff);
+  sensor.name = buffer;
+  sensor.sender = id;
+  sensor.bridge_set = bridge_set;
+  // the sensor ID differs per bridge and is only known after provisioning,
+  // so the resource is bound per bridge later and names the unique ID until then
+  auto resource = "sensors/" + sensor.uniqueid + "/state";
+  auto open = add_action(resource, std::string("{\"") + state + "\":true}");
+  auto closed = add_action(resource, std::string("{\"") + state + "\":false}");
+  sensor.open_action = action_index(open);
+  sensor.closed_action = action_index(closed);
+  contact_sensors_.push_back(sensor);
+  add_mapping(id, 0, open, bridge_set, priority);
+  add_mapping(id, 1, closed, bridge_set, priority);
+}
+
 void command_mapping::load(const char* filename)
 {
   std::ifstream infile(filename, std::ios_base::in);
@@ -98,6 +379,9 @@ void command_mapping::load(const char* filename)
     throw std::runtime_error("Cannot open mapping file");
   std::string line;
   uint32_t bridge_set = 1U; // defaults to single bridge #0
+  uint8_t sensor = 0;       // defaults to the sensor from the command line
+  uint8_t max_sensor[8] = {};  // highest sensor index used per bridge
+  uint8_t priority = AUTO_PRIORITY;
   while (std::getline(infile, line)) {
     if (line.length() == 0 || line[0] == '#')
       continue;
@@ -122,15 +406,197 @@ void command_mapping::load(const char* filename)
       bridge_set = new_bridge_set;
       continue;
     }
-    auto res = sscanf(str, "%x:%x:%x:%x %d %d", &a, &b, &c, &d, &button, &value);
-    if (res != 6)
+    int window;
+    if (sscanf(str, "duplicate_window %d", &window) == 1) {
+      if (window < 0 || window > 10000)
+        throw std::runtime_error("Expected duplicate window between 0 and 10000 ms");
+      duplicate_window_ = window;
+      continue;
+    }
+    int deadline;
+    if (sscanf(str, "deadline %d", &deadline) == 1) {
+      if (deadline < 50 || deadline > 60000)
+        throw std::runtime_error("Expected deadline between 50 and 60000 ms");
+      for (uint8_t i = 0; i < 8; ++i) {
+        if (bridge_set & (1U << i))
+          deadlines_[i] = deadline;
+      }
+      continue;
+    }
+    int connections;
+    if (sscanf(str, "connections %d", &connections) == 1) {
+      if (connections < 1 || connections > MAX_CONNECTIONS)
+        throw std::runtime_error("Expected connection count between 1 and 4");
+      for (uint8_t i = 0; i < 8; ++i) {
+        if (bridge_set & (1U << i))
+          connections_[i] = uint8_t(connections);
+      }
+      continue;
+    }
+    int ids[MAX_SENSORS - 1];
+    if ((count = sscanf(str, "sensors %d %d %d %d %d %d %d",
+                        &ids[0], &ids[1], &ids[2], &ids[3], &ids[4], &ids[5], &ids[6])) > 0)
+    {
+      std::vector<int> pool;
+      for (int i = 0; i < count; ++i) {
+        if (ids[i] < 1 || ids[i] > 255)
+          throw std::runtime_error("Expected sensor ID in range [1,255]");
+        pool.push_back(ids[i]);
+      }
+      for (uint8_t i = 0; i < 8; ++i) {
+        if (!(bridge_set & (1U << i)))
+          continue;
+        if (max_sensor[i] > pool.size())
+          throw std::runtime_error("Sensor pool too small for sensor indices of earlier mappings");
+        sensors_[i] = pool;
+      }
+      continue;
+    }
+    int index;
+    if (sscanf(str, "sensor %d", &index) == 1) {
+      if (index < 0 || index >= MAX_SENSORS)
+        throw std::runtime_error("Expected sensor index between 0 and 7");
+      sensor = uint8_t(index);
+      continue;
+    }
+    if (line.compare(0, 11, "sensor auto") == 0) {
+      sensor = AUTO_SENSOR;
+      continue;
+    }
+    char name[16];
+    if (sscanf(str, "priority %15s", name) == 1) {
+      if (strcmp(name, "interactive") == 0)
+        priority = uint8_t(rate_limiter::priority::interactive);
+      else if (strcmp(name, "normal") == 0)
+        priority = uint8_t(rate_limiter::priority::normal);
+      else if (strcmp(name, "background") == 0)
+        priority = uint8_t(rate_limiter::priority::background);
+      else if (strcmp(name, "auto") == 0)
+        priority = AUTO_PRIORITY;
+      else
+        throw std::runtime_error("Expected priority interactive, normal, background or auto");
+      continue;
+    }
+    char path[256];
+    if (sscanf(str, "state_file %255s", path) == 1) {
+      state_file_ = path;
+      continue;
+    }
+    if (sscanf(str, "config_cache %255s", path) == 1) {
+      config_cache_ = path;
+      continue;
+    }
+    unsigned port;
+    if (sscanf(str, "listen_port %u", &port) == 1) {
+      if (port == 0 || port > 65535)
+        throw std::runtime_error("Expected listen port between 1 and 65535");
+      listen_port_ = uint16_t(port);
+      continue;
+    }
+    unsigned group;
+    char key[64];
+    if (sscanf(str, "entertainment %u %63s", &group, key) == 2) {
+      if (group < 1 || group > 65535)
+        throw std::runtime_error("Expected entertainment group ID in range [1,65535]");
+      if (strlen(key) != 32 || strspn(key, "0123456789abcdefABCDEF") != 32)
+        throw std::runtime_error("Expected client key of 32 hex digits");
+      for (uint8_t i = 0; i < 8; ++i) {
+        if (bridge_set & (1U << i)) {
+          entertainment_[i].group = uint16_t(group);
+          entertainment_[i].client_key = key;
+        }
+      }
+      continue;
+    }
+    if (line.compare(0, 5, "mdns ") == 0) {
+      char address[64];
+      if (sscanf(str + 5, "%63s", address) != 1)
+        throw std::runtime_error("Expected mDNS address");
+      std::string host = address;
+      port = 5353;
+      auto colon = host.find(':');
+      if (colon != std::string::npos) {
+        if (sscanf(host.c_str() + colon + 1, "%u", &port) != 1 || port == 0 || port > 65535)
+          throw std::runtime_error("Expected mDNS port between 1 and 65535");
+        host.resize(colon);
+      }
+      struct in_addr addr;
+      if (!inet_aton(host.c_str(), &addr))
+        throw std::runtime_error("Cannot parse mDNS IP address");
+      mdns_ = std::make_pair(uint32_t(addr.s_addr), uint16_t(port));
+      continue;
+    }
+    if (line.compare(0, 8, "cluster ") == 0) {
+      std::istringstream masters(line.substr(8));
+      std::string master;
+      cluster_.clear();
+      while (masters >> master) {
+        if (master[0] == '#')
+          break;
+        port = listen_port_;
+        auto colon = master.find(':');
+        if (colon != std::string::npos) {
+          if (sscanf(master.c_str() + colon + 1, "%u", &port) != 1 || port == 0 || port > 65535)
+            throw std::runtime_error("Expected cluster master port between 1 and 65535");
+          master.resize(colon);
+        }
+        struct in_addr addr;
+        if (!inet_aton(master.c_str(), &addr))
+          throw std::runtime_error("Cannot parse cluster master IP address");
+        if (cluster_.size() == 8)
+          throw std::runtime_error("At most 8 masters are supported in a cluster");
+        cluster_.emplace_back(addr.s_addr, uint16_t(port));
+      }
+      continue;
+    }
+    char type[16];
+    if (sscanf(str, "%x:%x:%x:%x contact %15s", &a, &b, &c, &d, type) == 5) {
+      if (a > 255 || b > 255 || c > 255 || d > 255)
+        throw std::runtime_error("ID must contain only hexadecimal values up to 0xff");
+      enocean_id id;
+      id.set(uint8_t(a), uint8_t(b), uint8_t(c), uint8_t(d));
+      add_contact_sensor(id, type, uint8_t(bridge_set), priority);
+      continue;
+    }
+    int offset = 0;
+    auto res = sscanf(str, "%x:%x:%x:%x %d %n%d", &a, &b, &c, &d, &button, &offset, &value);
+    if (res == 5 && offset) {
+      if (button < 0)
+        throw std::runtime_error("Direct action must be mapped to a single button");
+      value = parse_action(str + offset);
+    } else if (res != 6) {
       throw std::runtime_error("Expected line in form XX:XX:XX:XX # #####");
+    } else if (value >= ACTION_BASE - 8) {
+      throw std::runtime_error("Value to send is too big");
+    }
     if (a > 255 || b > 255 || c > 255 || d > 255)
       throw std::runtime_error("ID must contain only hexadecimal values up to 0xff");
     if (button < -3 || button > 8)
       throw std::runtime_error("Button ID must be in range [-3,8]");
     enocean_id id;
     id.set(uint8_t(a), uint8_t(b), uint8_t(c), uint8_t(d));
-    add_mapping(id, int8_t(button), value, uint8_t(bridge_set));
+    add_mapping(id, int8_t(button), value, uint8_t(bridge_set), priority);
+    if (!is_direct(value)) {
+      if (sensor != AUTO_SENSOR) {
+        for (uint8_t i = 0; i < 8; ++i) {
+          if (!(bridge_set & (1U << i)))
+            continue;
+          if (sensor > sensors_[i].size())
+            throw std::runtime_error("Sensor index exceeds the sensor pool of a bridge in the bridge set");
+          if (sensor > max_sensor[i])
+            max_sensor[i] = sensor;
+        }
+      }
+      // all values of a device go to the same sensor, so releases follow presses
+      auto res = sensor_indices_.emplace(id.raw(), sensor);
+      if (res.first->second != sensor)
+        throw std::runtime_error("Device already posts to another sensor");
+    }
+  }
+  for (size_t i = 0; i < frames_.size(); ++i) {
+    for (uint8_t b = 0; b < 8; ++b) {
+      if ((frame_bridges_[i] & (1U << b)) && !entertainment_[b].group)
+        throw std::runtime_error("Streamed frame mapped to a bridge without entertainment area");
+    }
   }
 }
@@ -20,9 +20,12 @@
 #pragma once
 
 #include "embedded/enocean.hpp"
+#include "embedded/rate_limiter.hpp"
 
 #include <map>
 #include <limits>
+#include <string>
+#include <vector>
 
 /*!
  * @brief Command mapping class from Enocean events to Hue sensor value.
@@ -30,16 +33,124 @@
 class command_mapping
 {
 public:
+  /// Maximum count of distinct senders in the mapping.
+  static constexpr uint16_t MAX_SENDERS = 256;
+  /// Maximum count of distinct direct actions in the mapping.
+  static constexpr uint16_t MAX_ACTIONS = 1024;
+  /// Maximum count of distinct actions resolved by the state of their target.
+  static constexpr uint16_t MAX_STATE_ACTIONS = 1024;
+  /// Maximum count of distinct streamed frames in the mapping.
+  static constexpr uint16_t MAX_FRAMES = 1024;
+  /// Maximum count of lights in the entertainment area of a bridge.
+  static constexpr uint8_t MAX_STREAM_LIGHTS = 10;
+  /// Command values from this one on denote direct actions.
+  static constexpr int32_t ACTION_BASE = 0x70000000;
+  /// Command values from this one on denote actions resolved by the state of their target.
+  static constexpr int32_t STATE_ACTION_BASE = 0x74000000;
+  /// Command values from this one on denote frames streamed to an entertainment area.
+  static constexpr int32_t FRAME_BASE = 0x78000000;
+
+  /// Maximum concurrent connections to a bridge.
+  static constexpr uint8_t MAX_CONNECTIONS = 4;
+  /// Maximum count of sensors per bridge to spread commands over.
+  static constexpr uint8_t MAX_SENSORS = 8;
+  /// Priority of mappings selected by the event (interactive for switches, background for contacts).
+  static constexpr uint8_t AUTO_PRIORITY = 0xff;
+
+  /// Check whether a command value denotes a direct action.
+  static bool is_action(int32_t value) noexcept { return value >= ACTION_BASE && value < STATE_ACTION_BASE; }
+
+  /// Get index of the direct action denoted by a command value.
+  static uint16_t action_index(int32_t value) noexcept { return uint16_t(value - ACTION_BASE); }
+
+  /// Check whether a command value denotes an action resolved by the state of its target.
+  static bool is_state_action(int32_t value) noexcept { return value >= STATE_ACTION_BASE && value < FRAME_BASE; }
+
+  /// Get index of the state action denoted by a command value.
+  static uint16_t state_action_index(int32_t value) noexcept { return uint16_t(value - STATE_ACTION_BASE); }
+
+  /// Check whether a command value is sent to the bridge other than via a sensor.
+  static bool is_direct(int32_t value) noexcept { return value >= ACTION_BASE; }
+
+  /// Check whether a command value denotes a frame streamed to an entertainment area.
+  static bool is_frame(int32_t value) noexcept { return value >= FRAME_BASE; }
+
+  /// Get index of the frame denoted by a command value.
+  static uint16_t frame_index(int32_t value) noexcept { return uint16_t(value - FRAME_BASE); }
+
+  /// Action on a light or group resolved by its current state.
+  struct state_action
+  {
+    /// Type of the action.
+    enum class kind : uint8_t
+    {
+      toggle,   ///< Switch on if off, off otherwise.
+      step,     ///< Change brightness by a step, switch on with a positive step.
+      cycle     ///< Go to the next brightness of a list (0 for off).
+    };
+
+    kind type;                      ///< Type of the action.
+    bool group;                     ///< Set if the target is a group, light otherwise.
+    uint16_t target;                ///< ID of the light or group.
+    int16_t step;                   ///< Brightness step.
+    std::vector<uint8_t> levels;    ///< Brightness levels to cycle through.
+    /// Direct actions to choose from (toggle: on, off; step: on, increment; cycle: per level).
+    std::vector<uint16_t> actions;
+  };
+
+  /// Color of a light in a streamed frame.
+  struct light_color
+  {
+    uint16_t light;           ///< Light ID.
+    uint8_t red;              ///< Red component.
+    uint8_t green;            ///< Green component.
+    uint8_t blue;             ///< Blue component.
+  };
+
+  /// Entertainment area of a bridge to stream frames to.
+  struct entertainment_area
+  {
+    uint16_t group;           ///< ID of the entertainment group (0 if none).
+    std::string client_key;   ///< Client key for DTLS (32 hex digits).
+  };
+
+  /// CLIP sensor on the bridges representing a contact directly.
+  struct contact_sensor
+  {
+    enocean_id sender;        ///< Sender ID of the contact.
+    std::string type;         ///< Type of the sensor (CLIPOpenClose or CLIPPresence).
+    std::string uniqueid;     ///< Unique ID of the sensor.
+    std::string name;         ///< Name of the sensor.
+    uint16_t open_action;     ///< Direct action to set the sensor to open.
+    uint16_t closed_action;   ///< Direct action to set the sensor to closed.
+    uint8_t bridge_set;       ///< Set of bridges to provision the sensor on (as bitmask).
+  };
+
+  /// Command to post for an event.
+  struct command
+  {
+    int32_t value;                    ///< Command value to send to Hue bridge (0 if no mapping).
+    uint8_t bridge_set;               ///< Set of bridges to send the command to (as bitmask).
+    rate_limiter::priority priority;  ///< Priority class of the command.
+  };
+
+  /// Last value sent for a sender (to use for RELEASE events).
+  struct last_value
+  {
+    uint32_t sender;  ///< Sender ID.
+    int32_t value;    ///< Last value sent.
+    uint8_t check;    ///< Checksum of the above fields to detect torn writes.
+  };
+
   command_mapping();
 
   /*!
    * @brief Map an event to a value.
    *
    * @param e received event.
-   * @return pair of command value to send to Hue bridge (or 0 if no mapping)
-   *    and bridge set with bridge bitmask.
+   * @return command to send to Hue bridge (with value 0 if no mapping).
    */
-  std::pair<int32_t, uint8_t> map(const enocean_event& e);
+  command map(const enocean_event& e);
 
   /*!
    * @brief Add a new mapping.
@@ -49,8 +160,10 @@ public:
    *    buttons as value + button, -2 as -1 + button release as value).
    * @param value value to send for the button.
    * @param bridge_set set of bridges to send button value to (as bitmask).
+   * @param priority priority class of the command (rate_limiter::priority or AUTO_PRIORITY).
    */
-  void add_mapping(enocean_id id, int8_t button, int32_t value, uint8_t bridge_set);
+  void add_mapping(enocean_id id, int8_t button, int32_t value, uint8_t bridge_set,
+      uint8_t priority = AUTO_PRIORITY);
 
   /*!
    * @brief Load mappings from a file.
@@ -66,18 +179,197 @@ public:
    * release to the specified value). Value specifies value to send when this
    * button is detected (or base for value range if mapping all buttons).
    *
+   * Contacts can also get their own sensor on the bridges, which is set
+   * directly by the gateway instead of via values and rules:
+   *   - <tt>ID contact openclose</tt> - CLIPOpenClose sensor with state <tt>open</tt>
+   *   - <tt>ID contact presence</tt> - CLIPPresence sensor with state <tt>presence</tt> (set while open)
+   *
+   * Instead of a value, a direct action can be specified, which is sent
+   * to the bridge directly, bypassing rules:
+   *   - <tt>light &lt;id&gt; &lt;json&gt;</tt> - PUT JSON body to <tt>/lights/&lt;id&gt;/state</tt>
+   *   - <tt>group &lt;id&gt; &lt;json&gt;</tt> - PUT JSON body to <tt>/groups/&lt;id&gt;/action</tt>
+   *   - <tt>scene &lt;scene id&gt; [&lt;group id&gt;]</tt> - recall a scene (via group 0 by default)
+   *   - <tt>stream &lt;light id&gt;:&lt;rrggbb&gt;...</tt> - set colors of lights of the entertainment area
+   *
+   * Further, actions on a light or group can depend on its current state, which
+   * is tracked by the gateway:
+   *   - <tt>toggle light|group &lt;id&gt;</tt> - switch on if off, off otherwise
+   *   - <tt>step light|group &lt;id&gt; &lt;step&gt;</tt> - change brightness (switch on with a positive step)
+   *   - <tt>cycle light|group &lt;id&gt; &lt;brightness&gt;...</tt> - go to the next brightness (0 for off)
+   *
+   * Each bridge has a pool of sensors, the one from the command line (index 0)
+   * and additional ones set by the <tt>sensors</tt> directive. Values of a device
+   * are posted to the sensor selected by the <tt>sensor</tt> directive before
+   * its first mapping. With <tt>sensor auto</tt>, the index is the device ID
+   * modulo the count of sensors of the bridge. Indices past the count of sensors
+   * of a bridge wrap around.
+   *
    * The file can contain empty lines and comments starting with '#'.
    *
+   * Further, the file can contain directives:
+   *   - <tt>bridge &lt;index&gt; [&lt;index&gt;]...</tt> - set bridges for following mappings
+   *   - <tt>duplicate_window &lt;ms&gt;</tt> - window for duplicate telegram filter
+   *   - <tt>deadline &lt;ms&gt;</tt> - deadline for sending commands to bridges of the current bridge set
+   *   - <tt>connections &lt;count&gt;</tt> - concurrent connections to bridges of the current bridge set
+   *   - <tt>sensors &lt;id&gt; [&lt;id&gt;]...</tt> - additional sensors of bridges of the current bridge set
+   *   - <tt>sensor &lt;index&gt;|auto</tt> - sensor in the pool for devices of following mappings
+   *   - <tt>priority interactive|normal|background|auto</tt> - priority class of following mappings
+   *   - <tt>state_file &lt;path&gt;</tt> - file to keep persistent state in
+   *   - <tt>config_cache &lt;directory&gt;</tt> - directory to cache configurations of bridges in
+   *   - <tt>listen_port &lt;port&gt;</tt> - UDP port for repeaters and cluster peers
+   *   - <tt>entertainment &lt;group id&gt; &lt;client key&gt;</tt> - entertainment area of bridges of the current bridge set
+   *   - <tt>mdns &lt;ip&gt;[:&lt;port&gt;]</tt> - address to send mDNS queries to resolve bridges given by ID
+   *   - <tt>cluster &lt;ip&gt;[:&lt;port&gt;]...</tt> - all masters of the cluster, in the same order on each master
+   *
    * @param filename file to read.
    */
   void load(const char* filename);
 
+  /// Get window in milliseconds for filtering duplicate telegrams.
+  int32_t duplicate_window() const noexcept { return duplicate_window_; }
+
+  /// Get deadline in milliseconds for sending commands to a bridge (0 for default).
+  int32_t deadline(uint8_t bridge) const noexcept { return deadlines_[bridge]; }
+
+  /// Get count of concurrent connections to a bridge.
+  uint8_t connections(uint8_t bridge) const noexcept { return connections_[bridge]; }
+
+  /// Get IDs of additional sensors of a bridge (the sensor from the command line has index 0).
+  const std::vector<int>& sensors(uint8_t bridge) const noexcept { return sensors_[bridge]; }
+
+  /*!
+   * @brief Get index of the sensor in the pool of a bridge to post values of a device to.
+   *
+   * @param sender sender ID of the device.
+   * @param bridge index of the bridge.
+   * @return index of the sensor, 0 for the sensor from the command line.
+   */
+  uint8_t sensor_index(uint32_t sender, uint8_t bridge) const noexcept;
+
+  /// Get path to the state file or empty string, if state is not persisted.
+  const std::string& state_file() const noexcept { return state_file_; }
+
+  /// Get directory to cache bridge configurations in or empty string, if not fetched.
+  const std::string& config_cache() const noexcept { return config_cache_; }
+
+  /*!
+   * @brief Use external table of last values, e.g., from persistent state.
+   *
+   * Entries in the table which don't match the current mapping or which
+   * were torn by a crash are reset.
+   *
+   * @param table table with MAX_SENDERS entries.
+   * @return count of entries which had to be reset.
+   */
+  uint16_t attach(last_value* table) noexcept;
+
+  /// Get UDP port to listen on for repeaters and cluster peers.
+  uint16_t listen_port() const noexcept { return listen_port_; }
+
+  /// Get address to send mDNS queries to as pair of IP address (network order) and port.
+  const std::pair<uint32_t, uint16_t>& mdns() const noexcept { return mdns_; }
+
+  /// Get direct actions as pairs of resource path after the API key and JSON body.
+  const std::vector<std::pair<std::string, std::string>>& actions() const noexcept { return actions_; }
+
+  /// Get actions resolved by the state of their target.
+  const std::vector<state_action>& state_actions() const noexcept { return state_actions_; }
+
+  /// Get set of bridges a state action is sent to (as bitmask).
+  uint8_t state_action_bridges(uint16_t action) const noexcept { return state_action_bridges_[action]; }
+
+  /// Get entertainment area of a bridge (group 0 if none).
+  const entertainment_area& entertainment(uint8_t bridge) const noexcept { return entertainment_[bridge]; }
+
+  /// Get frames to stream to entertainment areas.
+  const std::vector<std::vector<light_color>>& frames() const noexcept { return frames_; }
+
+  /// Get set of bridges a frame is streamed to (as bitmask).
+  uint8_t frame_bridges(uint16_t frame) const noexcept { return frame_bridges_[frame]; }
+
+  /// Get CLIP sensors of contacts to provision on the bridges.
+  const std::vector<contact_sensor>& contact_sensors() const noexcept { return contact_sensors_; }
+
+  /// Get set of bridges a direct action is sent to (as bitmask).
+  uint8_t action_bridges(uint16_t action) const noexcept { return action_bridges_[action]; }
+
+  /// Get masters of the cluster as pairs of IP address (network order) and port.
+  const std::vector<std::pair<uint32_t, uint16_t>>& cluster() const noexcept { return cluster_; }
+
 private:
   /// Special mapping to indicate button release event.
   static constexpr int32_t RELEASE = std::numeric_limits<int32_t>::min();
+  /// Sensor index to select the sensor by the device ID.
+  static constexpr uint8_t AUTO_SENSOR = 0xff;
+
+  /// Target of a mapping.
+  struct target
+  {
+    int32_t value;          ///< Value to send.
+    uint8_t bridge_set;     ///< Set of bridges to send the value to.
+    uint8_t priority;       ///< Priority class (rate_limiter::priority or AUTO_PRIORITY).
+  };
 
   /// Mapping to use.
-  std::map<std::pair<enocean_id, uint8_t>, std::pair<int32_t, uint8_t>> mapping_;
-  /// Last value sent for ID (to use for RELEASE events).
-  std::map<enocean_id, int32_t> last_value_;
+  std::map<std::pair<enocean_id, uint8_t>, target> mapping_;
+  /// Store last value for a sender.
+  static void store(last_value& entry, int32_t value) noexcept;
+
+  /// Parse direct action from a mapping line and return its command value.
+  int32_t parse_action(const char* str);
+
+  /// Add a direct action, reusing the same one, if already defined, and return its command value.
+  int32_t add_action(const std::string& resource, const std::string& body);
+
+  /// Parse an action resolved by the state of its target and return its command value.
+  int32_t parse_state_action(state_action::kind type, const char* str);
+
+  /// Parse a frame to stream from a mapping line and return its command value.
+  int32_t parse_frame(const char* str);
+
+  /// Add a CLIP sensor of given type for a contact.
+  void add_contact_sensor(enocean_id id, const char* type, uint8_t bridge_set, uint8_t priority);
+
+  /// Slot of each sender in the table of last values.
+  std::map<enocean_id, uint16_t> slots_;
+  /// Table of last values used.
+  last_value* last_values_ = own_last_values_;
+  /// Own table of last values, if not attached to persistent state.
+  last_value own_last_values_[MAX_SENDERS];
+  /// Window for filtering duplicate telegrams.
+  int32_t duplicate_window_ = 200;
+  /// Deadlines for sending commands to bridges (0 for default).
+  int32_t deadlines_[8] = {};
+  /// Counts of concurrent connections to bridges.
+  uint8_t connections_[8] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+  /// IDs of additional sensors of bridges.
+  std::vector<int> sensors_[8];
+  /// Sensor index selected for each device by sender ID.
+  std::map<uint32_t, uint8_t> sensor_indices_;
+  /// Path to the state file.
+  std::string state_file_;
+  /// Directory to cache bridge configurations in.
+  std::string config_cache_;
+  /// UDP port to listen on.
+  uint16_t listen_port_ = 22554;
+  /// Masters of the cluster.
+  std::vector<std::pair<uint32_t, uint16_t>> cluster_;
+  /// Address to send mDNS queries to (224.0.0.251:5353 by default).
+  std::pair<uint32_t, uint16_t> mdns_{ htonl(0xe00000fb), 5353 };
+  /// Direct actions.
+  std::vector<std::pair<std::string, std::string>> actions_;
+  /// Set of bridges each direct action is sent to.
+  std::vector<uint8_t> action_bridges_;
+  /// CLIP sensors of contacts.
+  std::vector<contact_sensor> contact_sensors_;
+  /// Actions resolved by the state of their target.
+  std::vector<state_action> state_actions_;
+  /// Set of bridges each state action is sent to.
+  std::vector<uint8_t> state_action_bridges_;
+  /// Entertainment areas of bridges.
+  entertainment_area entertainment_[8] = {};
+  /// Frames to stream.
+  std::vector<std::vector<light_color>> frames_;
+  /// Set of bridges each frame is streamed to.
+  std::vector<uint8_t> frame_bridges_;
 };
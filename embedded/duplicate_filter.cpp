@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "duplicate_filter.hpp"
+#include "crc8.hpp"
+
+#include <cstddef>
+#include <cstring>
+
+void duplicate_filter::reset() noexcept
+{
+  memset(table_, 0, sizeof(table_));
+  memset(receivers_, 0, sizeof(receivers_));
+  receiver_count_ = 1;  // local receiver always has index 0
+  evictions_ = 0;
+}
+
+uint16_t duplicate_filter::validate() noexcept
+{
+  uint16_t dropped = 0;
+  for (auto& e : table_) {
+    if (e.sender && e.check != checksum(e)) {
+      memset(&e, 0, sizeof(e));
+      ++dropped;
+    }
+  }
+  if (receiver_count_ < 1 || receiver_count_ > MAX_RECEIVERS) {
+    memset(receivers_, 0, sizeof(receivers_));
+    receiver_count_ = 1;
+  }
+  return dropped;
+}
+
+uint8_t duplicate_filter::checksum(const entry& e) noexcept
+{
+  return crc8::checksum(&e, offsetof(entry, check));
+}
+
+uint8_t duplicate_filter::receiver_index(uint32_t ip) noexcept
+{
+  if (!ip)
+    return 0;
+  for (uint8_t i = 1; i < receiver_count_; ++i) {
+    if (receivers_[i].ip == ip)
+      return i;
+  }
+  if (receiver_count_ == MAX_RECEIVERS)
+    return MAX_RECEIVERS - 1; // shared by all remaining receivers
+  receivers_[receiver_count_].ip = ip;
+  return receiver_count_++;
+}
+
+bool duplicate_filter::check(
+    uint32_t sender, int32_t value, uint8_t receiver, uint8_t repeater_count, timestamp_t now) noexcept
+{
+  auto& stats = receivers_[receiver];
+  ++stats.received;
+
+  // Fibonacci hashing to pick the bucket
+  auto bucket = &table_[((sender * 2654435769U) >> 26) * WAYS];
+  static_assert(BUCKETS == (1 << (32 - 26)), "Hash shift must match bucket count");
+
+  auto path = path_bit(receiver, repeater_count);
+  entry* victim = nullptr;
+  for (uint8_t i = 0; i < WAYS; ++i) {
+    auto& e = bucket[i];
+    if (e.sender == sender) {
+      if (e.value == value && is_live(e, now) && !(e.paths & path)) {
+        // copy of the same telegram via another path
+        e.paths |= path;
+        e.check = checksum(e);
+        ++stats.suppressed;
+        return false;
+      }
+      victim = &e;
+      break;
+    }
+    if (!victim || !e.sender ||
+        (victim->sender && now - e.timestamp > now - victim->timestamp))
+      victim = &e;  // prefer free entry, else the oldest one
+  }
+
+  if (victim->sender && victim->sender != sender && is_live(*victim, now))
+    ++evictions_;
+  victim->sender = sender;
+  victim->value = value;
+  victim->timestamp = now;
+  victim->paths = path;
+  victim->check = checksum(*victim);
+  return true;
+}
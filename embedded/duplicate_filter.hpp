@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Filter for duplicate copies of the same telegram.
+ */
+#pragma once
+
+#include "hue_sensor_command.hpp"
+
+#include <cstdint>
+
+/*!
+ * @brief Filter for duplicate copies of the same telegram.
+ *
+ * The same telegram is typically received by several receivers (local
+ * USB300 stick and remote receivers forwarding via UDP) and possibly also
+ * repeated by EnOcean repeaters. All these copies carry the same sender
+ * and value and arrive within few milliseconds.
+ *
+ * For each sender, the filter remembers the last value, the time of its
+ * first copy and the set of receive paths (receiver and repeater count)
+ * which delivered it. A telegram with the same value within the window
+ * is a duplicate, if it came via a path which didn't deliver it yet.
+ * A telegram via an already-seen path is a new press, since the receiver
+ * doesn't deliver the same telegram twice over the same path.
+ *
+ * The table has fixed capacity organized in set-associative buckets of
+ * @c WAYS entries. Entries expire implicitly when their window passes,
+ * so both insert and expiry are O(1). If all entries in a bucket are
+ * live, the oldest one is evicted.
+ *
+ * The filter has fixed layout without pointers, so it can be placed in
+ * a persistent memory-mapped state. Each entry is protected by a checksum,
+ * so an entry torn by a crash in the middle of an update is detected and
+ * dropped by validate().
+ */
+class duplicate_filter
+{
+public:
+  using timestamp_t = hue_sensor_command::timestamp_t;
+
+  /// Number of buckets (power of 2).
+  static constexpr uint16_t BUCKETS = 64;
+  /// Number of entries per bucket.
+  static constexpr uint8_t WAYS = 4;
+  /// Maximum number of distinct receivers tracked.
+  static constexpr uint8_t MAX_RECEIVERS = 8;
+  /// Default window for duplicates in milliseconds.
+  static constexpr timestamp_t DEFAULT_WINDOW = 200;
+
+  /// Statistics per receiver.
+  struct receiver_stats
+  {
+    uint32_t ip;            ///< IP address of the receiver (0 for local receiver).
+    uint32_t received;      ///< Count of telegrams received via this receiver.
+    uint32_t suppressed;    ///< Count of copies suppressed as duplicates.
+  };
+
+  duplicate_filter() noexcept { reset(); }
+
+  /// Forget all entries and statistics.
+  void reset() noexcept;
+
+  /*!
+   * @brief Validate the filter after attaching to persistent state.
+   *
+   * @return count of entries dropped due to checksum mismatch.
+   */
+  uint16_t validate() noexcept;
+
+  /// Set window in milliseconds in which copies of a telegram are considered duplicates.
+  void set_window(timestamp_t window) noexcept { window_ = window; }
+
+  /// Get window in milliseconds.
+  timestamp_t get_window() const noexcept { return window_; }
+
+  /*!
+   * @brief Get index of a receiver.
+   *
+   * @param ip IP address of the receiver or 0 for local receiver.
+   * @return index of the receiver. If too many receivers are known,
+   *    the last index is shared for all remaining ones.
+   */
+  uint8_t receiver_index(uint32_t ip) noexcept;
+
+  /*!
+   * @brief Check a telegram and record it.
+   *
+   * @param sender sender ID.
+   * @param value value the telegram maps to.
+   * @param receiver index of the receiver as returned by receiver_index().
+   * @param repeater_count repeater count from telegram's status byte.
+   * @param now current timestamp.
+   * @return @c true, if this is a new telegram to process, @c false,
+   *    if it is a duplicate copy of an already-processed telegram.
+   */
+  bool check(uint32_t sender, int32_t value, uint8_t receiver, uint8_t repeater_count, timestamp_t now) noexcept;
+
+  /// Get count of known receivers.
+  uint8_t receiver_count() const noexcept { return receiver_count_; }
+
+  /// Get statistics for a receiver.
+  const receiver_stats& stats(uint8_t receiver) const noexcept { return receivers_[receiver]; }
+
+  /// Get count of live entries evicted due to full bucket.
+  uint32_t evictions() const noexcept { return evictions_; }
+
+private:
+  /// One entry of the table.
+  struct entry
+  {
+    uint32_t sender;        ///< Sender ID (0 for unused entry).
+    int32_t value;          ///< Last value.
+    timestamp_t timestamp;  ///< Time of the first copy of the last value.
+    uint32_t paths;         ///< Bitmask of receive paths which delivered the value.
+    uint8_t check;          ///< Checksum of the above fields.
+  };
+
+  /// Checksum of an entry.
+  static uint8_t checksum(const entry& e) noexcept;
+
+  /// Check whether the entry's value is still in the window.
+  bool is_live(const entry& e, timestamp_t now) const noexcept
+  {
+    auto age = now - e.timestamp;
+    return age >= 0 && age < window_;
+  }
+
+  /// Compute receive path bit for a receiver and repeater count.
+  static uint32_t path_bit(uint8_t receiver, uint8_t repeater_count) noexcept
+  {
+    if (repeater_count > 3)
+      repeater_count = 3;
+    return uint32_t(1) << (((receiver & 7) << 2) | repeater_count);
+  }
+
+  /// Window for duplicates.
+  timestamp_t window_ = DEFAULT_WINDOW;
+  /// Count of evicted live entries.
+  uint32_t evictions_ = 0;
+  /// Count of known receivers.
+  uint8_t receiver_count_ = 0;
+  /// Receiver statistics.
+  receiver_stats receivers_[MAX_RECEIVERS];
+  /// Table of entries.
+  entry table_[BUCKETS * WAYS];
+};
@@ -33,6 +33,8 @@
 
 #include "enocean.hpp"
 #include "enocean_serial_esp8266.hpp"
+#include "gateway_core.hpp"
+#include "hue_sensor_command_embedded.hpp"
 #include "debug.hpp"
 #include "embedded_syslog.hpp"
 extern "C" {
@@ -49,6 +51,46 @@ const char* extract_ssid(const char* id) { return id; }
 template<typename Fnc>
 const char* extract_ssid(Fnc& f) { return f(); }
 
+/// Core mapping events per generated mapping and posting them directly to the bridge.
+class embedded_core : public gateway_core
+{
+public:
+  embedded_core(duplicate_filter& filter, hue_sensor_command& bridge) noexcept
+  {
+    set_filter(&filter);
+    if (bridge_sensor_id)
+      set_bridge(0, &bridge);
+  }
+
+private:
+  virtual void map(const enocean_event& event, command& cmd) override
+  {
+    (void) event;
+    // generated mapping returns the value with the group in the top byte,
+    // all groups go to the only bridge of the repeater
+    auto action = map_action(cmd.sender, uint8_t(cmd.button));
+    cmd.value = action & 0xffffff;
+    if (cmd.value)
+      cmd.bridge_set = 1;
+  }
+
+  virtual void received(const enocean_event& event, const command& cmd) noexcept override
+  {
+    if (s_debug)
+      debug_stream::instance() << F("Received EnOcean event, addr ") <<
+          showbase << hex << cmd.sender << dec << F(", button ") << cmd.button <<
+          F(", index ") << cmd.index;
+    syslog_P(LOG_INFO, PSTR("EnOcean event, addr %lx, button %d => ID %ld, RSSI -%u"),
+             cmd.sender, cmd.button, long(cmd.value), event.erp1.contact_event.subtel[0].dbm);
+  }
+
+  virtual void suppressed(const command& cmd) noexcept override
+  {
+    syslog_P(LOG_INFO, PSTR("EnOcean suppressed duplicate: %ld, repeater count %u"),
+             long(cmd.value), cmd.repeater_count);
+  }
+};
+
 void setup_wifi()
 {
   auto real_ssid = extract_ssid(ssid);
@@ -148,29 +190,18 @@ void loop()
   static long led_off_time = 0;
   static long led_on_time = 0;
   static long last_dot_time = millis();
-  static uint32_t total_event_count = 0;
   static udp_pcb* master_conn = nullptr;
+  static duplicate_filter filter;
+  static hue_sensor_command_embedded bridge(
+      bridge_sensor_id ? uint32_t(bridge_ip) : 0, bridge_api_key, bridge_sensor_id);
+  static embedded_core core(filter, bridge);
   static enocean_serial_esp serial(
       [](const enocean_event& event) {
         led_off_time = set_led(millis(), 100);
-        // event received, map to external ID for the bridge and push it
-        uint32_t addr = 0;
-        int8_t button = 0;
-        switch (event.erp1.event_type) {
-          case enocean_erp1_type::CONTACT:
-            addr = event.erp1.contact_event.sender.raw();
-            button = event.erp1.contact_event.is_closed() ? 1 : 0;
-            break;
-          case enocean_erp1_type::SWITCH:
-            addr = event.erp1.switch_event.sender.raw();
-            button = event.erp1.switch_event.button_id();
-            break;
-        }
-        ++total_event_count;
-        if (s_debug)
-          debug_stream::instance() << F("Received EnOcean event, addr ") <<
-              showbase << hex << addr << dec << F(", button ") << button <<
-              F(", index ") << total_event_count;
+        // event received, map to external ID and post it directly to the bridge
+        core.handle_event(event, 0, bridge.timestamp());
+        if (bridge_sensor_id && !mirror_to_masters)
+          return;
         if (!master_conn) {
           // prepare UDP connection
           master_conn = udp_new_ip_type(IPADDR_TYPE_V4);
@@ -182,14 +213,6 @@ void loop()
               debug_stream::instance() << F("Proxy: cannot bind local side of UDP socket, err=") << int32_t(err) << '\n';;
               udp_remove(master_conn);
               master_conn = nullptr;
-            } else {
-              uint32_t ip_addr = master;
-              err = udp_connect(master_conn, reinterpret_cast<const ip_addr_t*>(&ip_addr), master_port);
-              if (err != ERR_OK) {
-                debug_stream::instance() << F("Proxy: cannot bind remote side of UDP socket, err=") << int32_t(err) << '\n';;
-                udp_remove(master_conn);
-                master_conn = nullptr;
-              }
             }
           }
         }
@@ -200,18 +223,20 @@ void loop()
             debug_stream::instance() << F("Proxy: cannot allocate UDP buffer\n");
           } else {
             pbuf_take(p, &event, len);
-            auto err = udp_send(master_conn, p);
-            if (err != ERR_OK) {
-              debug_stream::instance() << F("Proxy: cannot send UDP packet, err=") << int32_t(err) << '\n';;
-              udp_remove(master_conn);
-              master_conn = nullptr;
+            // send to all masters, they agree among themselves who posts the command
+            for (auto& master : masters) {
+              uint32_t ip_addr = master;
+              auto err = udp_sendto(master_conn, p, reinterpret_cast<const ip_addr_t*>(&ip_addr), master_port);
+              if (err != ERR_OK) {
+                debug_stream::instance() << F("Proxy: cannot send UDP packet, err=") << int32_t(err) << '\n';;
+                udp_remove(master_conn);
+                master_conn = nullptr;
+                break;
+              }
             }
             pbuf_free(p);
           }
         }
-
-        syslog_P(LOG_INFO, PSTR("EnOcean event, addr %lx, button %d, RSSI -%u"),
-                 addr, button, event.erp1.contact_event.subtel[0].dbm);
       }
     );
 
@@ -267,6 +292,8 @@ void loop()
 
   // now process events
   serial.poll();
+  if (bridge_sensor_id)
+    bridge.poll();
   ArduinoOTA.handle();
 }
 
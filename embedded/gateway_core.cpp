@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "gateway_core.hpp"
+
+gateway_core::result gateway_core::handle_event(const enocean_event& event, uint32_t receiver_ip, timestamp_t now)
+{
+  command cmd;
+  cmd.sender = 0;
+  cmd.button = 0;
+  switch (event.erp1.event_type) {
+    case enocean_erp1_type::CONTACT:
+      cmd.sender = event.erp1.contact_event.sender.raw();
+      cmd.button = event.erp1.contact_event.is_closed() ? 1 : 0;
+      break;
+    case enocean_erp1_type::SWITCH:
+      cmd.sender = event.erp1.switch_event.sender.raw();
+      cmd.button = event.erp1.switch_event.button_id();
+      break;
+  }
+  cmd.value = 0;
+  cmd.bridge_set = 0;
+  cmd.priority = rate_limiter::priority::normal;
+  cmd.receiver_ip = receiver_ip;
+  cmd.receiver = 0;
+  cmd.repeater_count = uint8_t(event.erp1.switch_event.status & 0x0f);
+  cmd.index = ++event_count_;
+  cmd.timestamp = now;
+  map(event, cmd);
+
+  // a command to the bridges of this sender likely follows, connect ahead
+  prewarm(cmd);
+  received(event, cmd);
+  if (!cmd.value)
+    return result::unmapped;
+
+  if (filter_) {
+    // The same telegram can be received by multiple receivers and repeated by
+    // repeaters, so filter out copies which arrived via another receive path
+    // within the duplicate window. A press arriving via an already-seen path
+    // is a genuine new press, even if it is fast.
+    cmd.receiver = filter_->receiver_index(receiver_ip);
+    if (!filter_->check(cmd.sender, cmd.value, cmd.receiver, cmd.repeater_count, now)) {
+      suppressed(cmd);
+      return result::duplicate;
+    }
+  }
+  if (!accept(cmd))
+    return result::declined;
+  post(cmd);
+  return result::posted;
+}
+
+void gateway_core::prewarm(const command& cmd)
+{
+  uint32_t set = cmd.bridge_set;
+  while (set) {
+    auto index = uint8_t(__builtin_ctz(set));
+    set &= set - 1;
+    if (auto b = bridge(index))
+      b->prewarm();
+  }
+}
+
+void gateway_core::post(const command& cmd)
+{
+  uint32_t set = cmd.bridge_set;
+  while (set) {
+    auto index = uint8_t(__builtin_ctz(set));
+    set &= set - 1;
+    if (auto b = bridge(index))
+      b->post(cmd.value, cmd.priority);
+  }
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Portable core of the gateway from EnOcean events to Hue bridges.
+ */
+#pragma once
+
+#include "enocean.hpp"
+#include "duplicate_filter.hpp"
+#include "hue_sensor_command.hpp"
+
+#include <cstdint>
+
+/*!
+ * @brief Portable core of the gateway from EnOcean events to Hue bridges.
+ *
+ * The core maps an event to a command, filters copies of telegrams
+ * received via several receive paths and posts the command to command
+ * handlers of the bridges. It doesn't depend on the platform, so the
+ * POSIX gateway and the ESP8266 firmware both drive the same core, the
+ * latter posting to the bridge directly instead of via a master.
+ *
+ * Front ends provide the mapping and can override further steps, e.g.,
+ * to log events, to let a cluster of masters decide who posts a command
+ * or to route commands to other connections than the default handler of
+ * each bridge.
+ */
+class gateway_core
+{
+public:
+  using timestamp_t = hue_sensor_command::timestamp_t;
+
+  /// Maximum count of bridges.
+  static constexpr uint8_t MAX_BRIDGES = 8;
+
+  /// Command mapped from an event.
+  struct command
+  {
+    uint32_t sender;        ///< Address of the sender.
+    int8_t button;          ///< Button of a switch or state of a contact (1 closed).
+    int32_t value;          ///< Value or action to post (0 if not mapped).
+    uint8_t bridge_set;     ///< Bridges to post to (as bitmask).
+    rate_limiter::priority priority;  ///< Priority class of the command.
+    uint32_t receiver_ip;   ///< IP address of the receiver (0 for the local one).
+    uint8_t receiver;       ///< Index of the receive path in the duplicate filter.
+    uint8_t repeater_count; ///< Count of repeaters the telegram passed.
+    uint32_t index;         ///< Count of events handled, including this one.
+    timestamp_t timestamp;  ///< Time of reception.
+  };
+
+  /// Result of handling an event.
+  enum class result : uint8_t
+  {
+    unmapped,     ///< Event not mapped to a command.
+    duplicate,    ///< Copy of a telegram handled already.
+    declined,     ///< Command not accepted, e.g., posted by another master.
+    posted        ///< Command posted.
+  };
+
+  gateway_core() noexcept = default;
+
+  virtual ~gateway_core() noexcept {}
+
+  gateway_core(const gateway_core&) = delete;
+  gateway_core& operator=(const gateway_core&) = delete;
+
+  /*!
+   * @brief Set the filter of copies of telegrams.
+   *
+   * @param filter filter, which must stay valid while set, or @c nullptr to not filter.
+   */
+  void set_filter(duplicate_filter* filter) noexcept { filter_ = filter; }
+
+  /*!
+   * @brief Set the command handler of a bridge.
+   *
+   * @param index index of the bridge.
+   * @param bridge handler, which must stay valid while set, or @c nullptr if none.
+   */
+  void set_bridge(uint8_t index, hue_sensor_command* bridge) noexcept
+  {
+    if (index < MAX_BRIDGES)
+      bridges_[index] = bridge;
+  }
+
+  /*!
+   * @brief Handle an event received from EnOcean.
+   *
+   * @param event event to handle.
+   * @param receiver_ip IP address of the receiver which forwarded the event
+   *    (0 for the local receiver).
+   * @param now current timestamp.
+   * @return result of handling the event.
+   */
+  result handle_event(const enocean_event& event, uint32_t receiver_ip, timestamp_t now);
+
+  /// Get count of events handled.
+  uint32_t event_count() const noexcept { return event_count_; }
+
+protected:
+  /*!
+   * @brief Map an event to a command.
+   *
+   * @param event event to map.
+   * @param cmd command with sender and button set, to set value, bridge set
+   *    and priority in (value 0 if not mapped).
+   */
+  virtual void map(const enocean_event& event, command& cmd) = 0;
+
+  /// Connect to the bridges of a mapped command ahead of posting it.
+  virtual void prewarm(const command& cmd);
+
+  /// Inform about a received event, after mapping it.
+  virtual void received(const enocean_event& event, const command& cmd) noexcept
+  {
+    (void) event; (void) cmd;
+  }
+
+  /// Inform about a command suppressed as a copy of a telegram handled already.
+  virtual void suppressed(const command& cmd) noexcept
+  {
+    (void) cmd;
+  }
+
+  /// Decide whether to post a command, which is not a duplicate.
+  virtual bool accept(const command& cmd)
+  {
+    (void) cmd;
+    return true;
+  }
+
+  /// Post a command to the bridges of its bridge set.
+  virtual void post(const command& cmd);
+
+  /// Get the command handler of a bridge (@c nullptr if none).
+  hue_sensor_command* bridge(uint8_t index) const noexcept
+  {
+    return index < MAX_BRIDGES ? bridges_[index] : nullptr;
+  }
+
+private:
+  /// Filter of copies of telegrams, if any.
+  duplicate_filter* filter_ = nullptr;
+  /// Command handlers of bridges.
+  hue_sensor_command* bridges_[MAX_BRIDGES] = {};
+  /// Count of events handled.
+  uint32_t event_count_ = 0;
+};
@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "http_response_parser.hpp"
+#include "json_tokenizer.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <strings.h>
+
+void http_response_parser::reset() noexcept
+{
+  state_ = state::status_line;
+  started_ = false;
+  chunked_ = false;
+  has_length_ = false;
+  keep_alive_ = true;
+  status_ = 0;
+  line_len_ = 0;
+  remaining_ = 0;
+  in_string_ = false;
+  escape_ = false;
+  key_pending_ = false;
+  in_error_type_ = false;
+  token_len_ = 0;
+  successes_ = 0;
+  errors_ = 0;
+  error_type_ = 0;
+  if (body_tokenizer_)
+    body_tokenizer_->reset();
+}
+
+http_response_parser::result http_response_parser::parse(
+    const char* data, size_t size, size_t& consumed) noexcept
+{
+  size_t i = 0;
+  if (size)
+    started_ = true;
+  while (i < size && state_ != state::done && state_ != state::failed) {
+    switch (state_) {
+      case state::body:
+      case state::chunk_data:
+      {
+        // consume body data in bulk
+        auto n = size - i;
+        if (n > remaining_)
+          n = remaining_;
+        scan_body(data + i, n);
+        i += n;
+        remaining_ -= uint32_t(n);
+        if (!remaining_)
+          state_ = (state_ == state::body) ? state::done : state::chunk_end;
+        break;
+      }
+
+      case state::body_eof:
+        scan_body(data + i, size - i);
+        i = size;
+        break;
+
+      default:
+      {
+        // line-oriented states
+        char c = data[i++];
+        if (c != '\n') {
+          if (line_len_ < sizeof(line_) - 1)
+            line_[line_len_++] = c;
+          break;
+        }
+        if (line_len_ && line_[line_len_ - 1] == '\r')
+          --line_len_;
+        line_[line_len_] = 0;
+        switch (state_) {
+          case state::status_line:
+            if (!status_line())
+              state_ = state::failed;
+            else
+              state_ = state::header_line;
+            break;
+          case state::header_line:
+            if (line_len_)
+              header_line();
+            else
+              end_of_headers();
+            break;
+          case state::chunk_size:
+          {
+            char* end;
+            remaining_ = uint32_t(strtoul(line_, &end, 16));
+            if (end == line_)
+              state_ = state::failed;
+            else if (remaining_)
+              state_ = state::chunk_data;
+            else
+              state_ = state::trailer;
+            break;
+          }
+          case state::chunk_end:
+            state_ = line_len_ ? state::failed : state::chunk_size;
+            break;
+          case state::trailer:
+            if (!line_len_)
+              state_ = state::done;
+            break;
+          default:
+            break;
+        }
+        line_len_ = 0;
+        break;
+      }
+    }
+  }
+  consumed = i;
+  if (state_ == state::done)
+    return result::complete;
+  else if (state_ == state::failed)
+    return result::error;
+  else
+    return result::incomplete;
+}
+
+http_response_parser::result http_response_parser::finish() noexcept
+{
+  keep_alive_ = false;
+  if (state_ == state::body_eof || state_ == state::done) {
+    state_ = state::done;
+    return result::complete;
+  }
+  state_ = state::failed;
+  return result::error;
+}
+
+bool http_response_parser::status_line() noexcept
+{
+  // HTTP/1.x NNN reason
+  if (line_len_ < 12 || memcmp(line_, "HTTP/1.", 7) != 0 || line_[8] != ' ')
+    return false;
+  if (line_[7] == '0')
+    keep_alive_ = false;  // HTTP/1.0 closes by default
+  status_ = uint16_t(atoi(line_ + 9));
+  return status_ >= 100 && status_ < 600;
+}
+
+bool http_response_parser::is_header(const char* name, size_t len) const noexcept
+{
+  if (line_len_ <= len || line_[len] != ':')
+    return false;
+  for (size_t i = 0; i < len; ++i) {
+    if (tolower(static_cast<unsigned char>(line_[i])) != name[i])
+      return false;
+  }
+  return true;
+}
+
+const char* http_response_parser::header_value() const noexcept
+{
+  auto p = strchr(line_, ':') + 1;
+  while (*p == ' ' || *p == '\t')
+    ++p;
+  return p;
+}
+
+void http_response_parser::header_line() noexcept
+{
+  if (is_header("content-length", 14)) {
+    remaining_ = uint32_t(strtoul(header_value(), nullptr, 10));
+    has_length_ = true;
+  } else if (is_header("transfer-encoding", 17)) {
+    auto value = header_value();
+    if (strncasecmp(value, "chunked", 7) == 0)
+      chunked_ = true;
+  } else if (is_header("connection", 10)) {
+    auto value = header_value();
+    if (strncasecmp(value, "close", 5) == 0)
+      keep_alive_ = false;
+    else if (strncasecmp(value, "keep-alive", 10) == 0)
+      keep_alive_ = true;
+  }
+}
+
+void http_response_parser::end_of_headers() noexcept
+{
+  if (status_ < 200) {
+    // interim response (e.g., 100 Continue), real response follows
+    state_ = state::status_line;
+    has_length_ = chunked_ = false;
+  } else if (status_ == 204 || status_ == 304) {
+    state_ = state::done;
+  } else if (chunked_) {
+    state_ = state::chunk_size;
+  } else if (has_length_) {
+    state_ = remaining_ ? state::body : state::done;
+  } else {
+    state_ = state::body_eof;
+    keep_alive_ = false;
+  }
+}
+
+void http_response_parser::scan_body(const char* data, size_t size) noexcept
+{
+  if (body_tokenizer_)
+    body_tokenizer_->parse(data, size);
+  for (size_t i = 0; i < size; ++i) {
+    char c = data[i];
+    if (in_string_) {
+      if (escape_) {
+        escape_ = false;
+      } else if (c == '\\') {
+        escape_ = true;
+      } else if (c == '"') {
+        in_string_ = false;
+        key_pending_ = true;
+      } else if (token_len_ <= sizeof(token_)) {
+        if (token_len_ < sizeof(token_))
+          token_[token_len_] = c;
+        ++token_len_;
+      }
+    } else if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+      // skip whitespace
+    } else if (c == '"') {
+      in_string_ = true;
+      key_pending_ = false;
+      token_len_ = 0;
+    } else if (key_pending_) {
+      key_pending_ = false;
+      if (c == ':')
+        body_key();
+    } else if (in_error_type_) {
+      if (c >= '0' && c <= '9')
+        error_type_ = uint16_t(error_type_ * 10 + (c - '0'));
+      else
+        in_error_type_ = false;
+    }
+  }
+}
+
+void http_response_parser::body_key() noexcept
+{
+  if (token_len_ == 7 && memcmp(token_, "success", 7) == 0) {
+    if (successes_ < 255)
+      ++successes_;
+  } else if (token_len_ == 5 && memcmp(token_, "error", 5) == 0) {
+    if (errors_ < 255)
+      ++errors_;
+  } else if (token_len_ == 4 && memcmp(token_, "type", 4) == 0) {
+    // type of the first error only
+    in_error_type_ = errors_ == 1 && !error_type_;
+  }
+}
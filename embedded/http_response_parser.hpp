@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Incremental parser of HTTP responses.
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+class json_tokenizer;
+
+/*!
+ * @brief Incremental parser of HTTP responses.
+ *
+ * The parser processes response data as they arrive, without allocating
+ * memory. It parses status line and headers and determines the end of
+ * the response from Content-Length header or chunked transfer encoding,
+ * so the connection can be kept alive for further requests. Responses
+ * without length are terminated by EOF.
+ *
+ * The JSON body is scanned for keys of Hue bridge replies, which are in
+ * the form <tt>[{"success":{...}},{"error":{"type":N,...}}]</tt>, so a
+ * request rejected by the bridge is recognized even with status 200.
+ * Additionally, the body can be passed to a JSON tokenizer to extract
+ * further data from it while it streams in.
+ */
+class http_response_parser
+{
+public:
+  /// Result of parsing.
+  enum class result : uint8_t
+  {
+    incomplete,   ///< More data needed.
+    complete,     ///< Response complete.
+    error         ///< Malformed response.
+  };
+
+  http_response_parser() noexcept { reset(); }
+
+  /// Reset the parser (and the body tokenizer, if any) for the next response.
+  void reset() noexcept;
+
+  /// Set tokenizer to pass response bodies to (or @c nullptr for none).
+  void set_body_tokenizer(json_tokenizer* tokenizer) noexcept { body_tokenizer_ = tokenizer; }
+
+  /*!
+   * @brief Parse response data.
+   *
+   * @param data,size data received.
+   * @param consumed set to count of bytes consumed. Bytes past the end
+   *    of the response belong to the next response.
+   * @return parsing result.
+   */
+  result parse(const char* data, size_t size, size_t& consumed) noexcept;
+
+  /*!
+   * @brief Inform the parser about EOF on the connection.
+   *
+   * @return @c complete, if the response is terminated by EOF, @c error otherwise.
+   */
+  result finish() noexcept;
+
+  /// Check whether any data of the response were received.
+  bool started() const noexcept { return started_; }
+
+  /// Get HTTP status code (valid after status line was parsed).
+  uint16_t status() const noexcept { return status_; }
+
+  /// Check whether the connection can be kept alive after this response.
+  bool keep_alive() const noexcept { return keep_alive_; }
+
+  /// Get count of "success" entries in the body.
+  uint8_t successes() const noexcept { return successes_; }
+
+  /// Get count of "error" entries in the body.
+  uint8_t errors() const noexcept { return errors_; }
+
+  /// Get type of the first error in the body (0 if none).
+  uint16_t error_type() const noexcept { return error_type_; }
+
+  /// Check whether the request succeeded (2xx status and no error in the body).
+  bool succeeded() const noexcept { return status_ >= 200 && status_ < 300 && !errors_; }
+
+private:
+  /// Parser state.
+  enum class state : uint8_t
+  {
+    status_line,    ///< Reading status line.
+    header_line,    ///< Reading header lines.
+    body,           ///< Reading body with known length.
+    body_eof,       ///< Reading body terminated by EOF.
+    chunk_size,     ///< Reading chunk size line.
+    chunk_data,     ///< Reading chunk data.
+    chunk_end,      ///< Reading CRLF after chunk data.
+    trailer,        ///< Reading trailer lines after last chunk.
+    done,           ///< Response complete.
+    failed          ///< Malformed response.
+  };
+
+  /// Process complete status line.
+  bool status_line() noexcept;
+
+  /// Process complete header line.
+  void header_line() noexcept;
+
+  /// Process end of headers.
+  void end_of_headers() noexcept;
+
+  /// Check whether the current line starts with given lowercase header name.
+  bool is_header(const char* name, size_t len) const noexcept;
+
+  /// Get header value of current line (past the colon and spaces).
+  const char* header_value() const noexcept;
+
+  /// Scan body data for keys of the Hue reply.
+  void scan_body(const char* data, size_t size) noexcept;
+
+  /// Process a key found in the body.
+  void body_key() noexcept;
+
+  /// Current state.
+  state state_;
+  /// Set if any data received.
+  bool started_;
+  /// Set if body is chunked.
+  bool chunked_;
+  /// Set if Content-Length is known.
+  bool has_length_;
+  /// Set if the connection can be kept alive.
+  bool keep_alive_;
+  /// HTTP status code.
+  uint16_t status_;
+  /// Length of the current line.
+  uint8_t line_len_;
+  /// Remaining body or chunk length.
+  uint32_t remaining_;
+  /// Current line (truncated, if too long).
+  char line_[64];
+
+  /// Set if inside of a JSON string in the body.
+  bool in_string_;
+  /// Set if the previous character in a JSON string was a backslash.
+  bool escape_;
+  /// Set if a JSON string just ended, which is a key if followed by a colon.
+  bool key_pending_;
+  /// Set if reading the value of the type of the first error.
+  bool in_error_type_;
+  /// Length of the current JSON string (more than size of token_ if too long).
+  uint8_t token_len_;
+  /// Start of the current JSON string.
+  char token_[8];
+  /// Count of "success" entries.
+  uint8_t successes_;
+  /// Count of "error" entries.
+  uint8_t errors_;
+  /// Type of the first error.
+  uint16_t error_type_;
+  /// Tokenizer to pass the body to, if any.
+  json_tokenizer* body_tokenizer_ = nullptr;
+};
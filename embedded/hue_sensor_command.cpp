@@ -22,68 +22,611 @@
 #include <cstdio>
 #include <cstring>
 
-void hue_sensor_command::post(int32_t value)
+void hue_sensor_command::enqueue(int32_t value, uint16_t target, bool coalesce, rate_limiter::priority prio)
 {
-  if (queue_size_ == MAX_QUEUE_SIZE) {
-    // drop the oldest
-    memmove(&queue_[0], &queue_[1], sizeof(queue_[0]) * (MAX_QUEUE_SIZE - 1));
-    --queue_size_;
+  auto now = timestamp();
+  if (backoff_ && state_ == state::idle && now - probe_time_ < 0) {
+    // bridge unreachable, don't let commands wait for it
+    ++stats_.rejected;
+    arm_timer();
+    return;
   }
-  auto& q = queue_[queue_size_++];
-  q.value = value;
-  q.timestamp = timestamp();
-  if (state_ == state::idle) {
-    request_finished(); // will start next connect
+  drop_expired(now);
+  queue_element* q = nullptr;
+  bool replaced = false;
+  if (coalesce) {
+    for (uint8_t i = 0; i < queue_.size(); ++i) {
+      if (queue_[i].target == target) {
+        // replace older command for the same target, in place if of the same priority class
+        if (queue_[i].priority == prio)
+          q = &queue_[i];
+        else
+          queue_.erase(i);
+        replaced = true;
+        ++stats_.coalesced;
+        break;
+      }
+    }
+  }
+  if (!q) {
+    if (!replaced && queue_.full()) {
+      // drop the oldest command of the lowest priority class
+      uint8_t victim = 0;
+      for (uint8_t i = 1; i < queue_.size(); ++i) {
+        if (queue_[i].priority > queue_[victim].priority)
+          victim = i;
+      }
+      ++stats_.dropped;
+      if (queue_[victim].priority < prio)
+        return;   // all queued commands are more important
+      queue_.erase(victim);
+    }
+    // keep the queue ordered by priority class, in order of posting within a class,
+    // but never ahead of an older command for the same target
+    auto index = queue_.size();
+    while (index && queue_[uint8_t(index - 1)].priority > prio &&
+        (!target || queue_[uint8_t(index - 1)].target != target))
+      --index;
+    q = &queue_.insert(index);
+    q->priority = prio;
+  }
+  q->value = value;
+  q->timestamp = now;
+  q->retry_time = now;
+  q->target = target;
+  q->attempts = 0;
+  if (state_ == state::idle || state_ == state::connecting)
+    ++stats_.cold;
+  start_next();
+  arm_timer();
+}
+
+void hue_sensor_command::readdress(uint32_t ip)
+{
+  // requests in flight are rendered with the old prefix, never patch them while sending
+  if (state_ != state::idle)
+    retry(false);
+  ip_ = ip;
+  render_prefix();
+  render_actions();
+  if (backoff_)
+    probe_time_ = timestamp();
+  else if (!queue_.empty())
+    start_next();
+  arm_timer();
+}
+
+void hue_sensor_command::prewarm()
+{
+  if (state_ != state::idle || !queue_.empty() || backoff_)
+    return; // unreachable bridges are only probed after backoff
+  if (!ip_)
+    return; // address not resolved yet
+  ++stats_.prewarmed;
+  reconnect();
+  arm_timer();
+}
+
+void hue_sensor_command::check_timeouts(timestamp_t now)
+{
+  switch (state_) {
+    case state::open:
+      if (now - idle_since_ >= IDLE_TIMEOUT)
+        retry(false);
+      break;
+    case state::connecting:
+    case state::sending:
+    case state::receiving:
+      if (io_deadline() - now <= 0) {
+        // bridge not responding, e.g., powered off, link down or overloaded
+        if (limiter_ && state_ != state::connecting)
+          limiter_->response(now - inflight_.front().sent, true, now);
+        close_connection();
+        connection_failed();
+      }
+      break;
+    case state::idle:
+      if (backoff_ && now - probe_time_ >= 0)
+        reconnect();  // probe the unreachable bridge
+      break;
+    default:
+      break;
+  }
+  // send commands whose retry backoff elapsed
+  if (!queue_.empty() && !backing_off(queue_.front(), now))
+    start_next();
+  arm_timer();
+}
+
+hue_sensor_command::timestamp_t hue_sensor_command::io_deadline() const noexcept
+{
+  if (state_ == state::connecting)
+    return connect_time_ + CONNECT_TIMEOUT;
+  // the oldest request must be answered in time, even if others are still sent
+  bool waiting = state_ == state::receiving || send_first_ || send_segment_ >= 2;
+  auto deadline = waiting ? response_time_ + response_timeout_ : send_time_ + SEND_TIMEOUT;
+  if (state_ == state::sending && waiting && send_time_ + SEND_TIMEOUT - deadline < 0)
+    deadline = send_time_ + SEND_TIMEOUT;
+  return deadline;
+}
+
+hue_sensor_command::timestamp_t hue_sensor_command::next_timeout(timestamp_t now) const noexcept
+{
+  timestamp_t delta = IDLE_TIMEOUT;
+  switch (state_) {
+    case state::open:
+      delta = idle_since_ + IDLE_TIMEOUT - now;
+      break;
+    case state::connecting:
+    case state::sending:
+    case state::receiving:
+      delta = io_deadline() - now;
+      break;
+    case state::idle:
+      if (backoff_)
+        delta = probe_time_ - now;
+      break;
+    default:
+      break;
+  }
+  if (!queue_.empty() && backing_off(queue_.front(), now)) {
+    auto retry = queue_.front().retry_time - now;
+    if (retry < delta)
+      delta = retry;
+  } else if (!queue_.empty() && limiter_) {
+    // wait for the rate limit (0 if not limited, then sent as soon as possible)
+    auto limit = limiter_->delay(queue_.front().priority, now);
+    if (limit && limit < delta)
+      delta = limit;
   }
+  return delta < 0 ? 0 : delta;
+}
+
+void hue_sensor_command::set_timer_wheel(timer_wheel* wheel) noexcept
+{
+  if (wheel_)
+    wheel_->cancel(timer_);
+  wheel_ = wheel;
+  arm_timer();
+}
+
+void hue_sensor_command::set_completion_timer(timer_wheel::timer* t) noexcept
+{
+  completion_ = t;
+  completed_ = finished();
+}
+
+uint32_t hue_sensor_command::finished() const noexcept
+{
+  return stats_.succeeded + stats_.failed + stats_.lost + stats_.expired + stats_.dropped + stats_.rejected;
+}
+
+void hue_sensor_command::reachability_changed() noexcept
+{
+  report_reachability(backoff_);
+  if (reachability_ && wheel_)
+    wheel_->schedule(*reachability_, timestamp());
+}
+
+void hue_sensor_command::arm_timer() noexcept
+{
+  update_interest();
+  if (!wheel_)
+    return;
+  if (completion_ && finished() != completed_) {
+    completed_ = finished();
+    wheel_->schedule(*completion_, timestamp());
+  }
+  if (state_ == state::idle && !backoff_ && queue_.empty()) {
+    wheel_->cancel(timer_);   // nothing to wait for
+    return;
+  }
+  auto now = timestamp();
+  wheel_->schedule(timer_, now + next_timeout(now));
+}
+
+void hue_sensor_command::drop_expired(timestamp_t now) noexcept
+{
+  while (!queue_.empty() && expired(queue_.front(), now)) {
+    queue_.pop_front();
+    ++stats_.expired;
+  }
+}
+
+void hue_sensor_command::render_prefix() noexcept
+{
+  char resource[24];
+  snprintf(resource, sizeof(resource), "sensors/%d", sensor_id_);
+  auto len = render_prefix(prefix_, sizeof(prefix_), resource);
+  prefix_len_ = uint16_t(len < sizeof(prefix_) ? len : sizeof(prefix_) - 1);
+}
+
+size_t hue_sensor_command::render_prefix(char* dest, size_t size, const char* resource, const char* method) const noexcept
+{
+  auto len = snprintf(
+        dest, size,
+        "%s /api/%s%s%s HTTP/1.1\r\n"
+        "Host: %d.%d.%d.%d\r\n"
+        "Accept: */*\r\n"
+        "User-Agent: enocean-gw/0.1\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: ",
+        method, api_key_, *resource ? "/" : "", resource,
+        ip_ & 0xff, (ip_ >> 8) & 0xff, (ip_ >> 16) & 0xff, ip_ >> 24);
+  return len < 0 ? 0 : size_t(len);
+}
+
+size_t hue_sensor_command::render_tail(char* dest, size_t size, const char* body) noexcept
+{
+  auto len = snprintf(dest, size, "%u\r\n\r\n%s", unsigned(strlen(body)), body);
+  return len < 0 ? 0 : size_t(len);
+}
+
+/// Format an integer into a buffer, return length.
+static uint8_t format_int(char* dest, int32_t value) noexcept
+{
+  char tmp[11];
+  uint8_t len = 0;
+  auto u = uint32_t(value);
+  if (value < 0)
+    u = 0U - u;
+  do {
+    tmp[len++] = char('0' + u % 10);
+    u /= 10;
+  } while (u);
+  uint8_t pos = 0;
+  if (value < 0)
+    dest[pos++] = '-';
+  while (len)
+    dest[pos++] = tmp[--len];
+  return pos;
+}
+
+uint8_t hue_sensor_command::render_tail(char* dest, int32_t value) noexcept
+{
+  static constexpr char BODY_START[] = "{\"state\":{\"status\": ";
+  static constexpr char BODY_END[] = "}}";
+  char digits[11];
+  auto digits_len = format_int(digits, value);
+  auto pos = format_int(dest, int32_t(sizeof(BODY_START) - 1 + digits_len + sizeof(BODY_END) - 1));
+  memcpy(dest + pos, "\r\n\r\n", 4);
+  pos += 4;
+  memcpy(dest + pos, BODY_START, sizeof(BODY_START) - 1);
+  pos += sizeof(BODY_START) - 1;
+  memcpy(dest + pos, digits, digits_len);
+  pos += digits_len;
+  memcpy(dest + pos, BODY_END, sizeof(BODY_END) - 1);
+  return uint8_t(pos + sizeof(BODY_END) - 1);
 }
 
 bool hue_sensor_command::prepare_buffer(timestamp_t timestamp) noexcept
 {
-  // pick first valid element and prepare buffer with it
-  // return true, if valid, false on empty queue
-  for (uint8_t i = 0; i < queue_size_; ++i) {
-    auto& q = queue_[i];
-    auto delta = timestamp - q.timestamp;
-    if (delta >= 0 && delta <= MAX_EVENT_AGE) {
-      // use this one
-      char tmp[64];
-      auto cl = snprintf(tmp, sizeof(tmp),
-            "{\"state\":{\"status\": %d}}", q.value);
-      send_total_size_ = send_outstanding_size_ = uint16_t(snprintf(
-            buffer_, sizeof(buffer_),
-            "PUT /api/%s/sensors/%d HTTP/1.1\r\n"
-            "Host: %d.%d.%d.%d\r\n"
-            "Accept: */*\r\n"
-            "User-Agent: enocean-gw/0.1\r\n"
-            "Content-Type: application/json\r\n"
-            "Content-Length: %d\r\n"
-            "Connection: close\r\n"
-            "\r\n%s",
-            api_key_, sensor_id_,
-            ip_ & 0xff, (ip_ >> 8) & 0xff, (ip_ >> 16) & 0xff, ip_ >> 24,
-            cl, tmp));
-      send_ptr_ = reinterpret_cast<const uint8_t*>(buffer_);
-      if (++i < queue_size_)
-        memmove(&queue_[0], &queue_[i], sizeof(queue_[0]) * (queue_size_ - i));
-      queue_size_ -= i;
-      return true;
+  // move valid elements to the pipeline and drop expired ones,
+  // return true if any request was prepared
+  send_first_ = inflight_.size();
+  send_segment_ = 0;
+  send_offset_ = 0;
+  size_t size = 0;
+  while (!queue_.empty() && !inflight_.full()) {
+    auto& q = queue_.front();
+    if (expired(q, timestamp)) {
+      ++stats_.expired;
+    } else if (backing_off(q, timestamp)) {
+      break;  // following commands must not overtake it
+    } else if (limiter_ && !limiter_->admit(q.priority, timestamp)) {
+      break;  // rate limit reached, following commands have lower priority
+    } else {
+      auto& r = inflight_.push_back();
+      r.command = q;
+      r.sent = timestamp;
+      if (q.target) {
+        auto& action = actions_[q.target - 1];
+        size += action.prefix_size + action.tail_size;
+      } else {
+        r.tail_size = render_tail(r.tail, q.value);
+        size += prefix_len_ + r.tail_size;
+      }
     }
+    queue_.pop_front();
   }
 
-  // didn't find any usable
-  queue_size_ = 0;
-  return false;
+  if (!size)
+    return false;
+  send_total_size_ = send_outstanding_size_ = uint16_t(size);
+  return true;
+}
+
+bool hue_sensor_command::send_segment(uint8_t n, const char*& data, size_t& size) const noexcept
+{
+  auto segment = uint8_t(send_segment_ + n);
+  auto index = uint8_t(send_first_ + segment / 2);
+  if (index >= inflight_.size())
+    return false;
+  auto& r = inflight_[index];
+  if (r.command.target) {
+    auto& action = actions_[r.command.target - 1];
+    if (segment & 1) {
+      data = action.tail;
+      size = action.tail_size;
+    } else {
+      data = action.prefix;
+      size = action.prefix_size;
+    }
+  } else if (segment & 1) {
+    data = r.tail;
+    size = r.tail_size;
+  } else {
+    data = prefix_;
+    size = prefix_len_;
+  }
+  if (!n) {
+    data += send_offset_;
+    size -= send_offset_;
+  }
+  return true;
+}
+
+void hue_sensor_command::data_sent(size_t size)
+{
+  send_outstanding_size_ = uint16_t(send_outstanding_size_ - size);
+  const char* data;
+  size_t len;
+  while (size && send_segment(0, data, len)) {
+    if (size < len) {
+      send_offset_ = uint16_t(send_offset_ + size);
+      break;
+    }
+    size -= len;
+    send_offset_ = 0;
+    if (++send_segment_ == 2 && !send_first_)
+      response_time_ = timestamp();  // oldest request sent, wait for its response
+  }
+  send_time_ = timestamp();
+  if (!send_outstanding_size_)
+    request_sent();
+}
+
+void hue_sensor_command::start_next()
+{
+  // new requests can be added only after the buffer was sent completely
+  if (state_ != state::idle && state_ != state::open && state_ != state::receiving)
+    return;
+  if (!prepare_buffer(timestamp()))
+    return; // nothing to send
+  if (state_ == state::idle) {
+    reconnect();
+  } else {
+    send_time_ = timestamp();
+    state_ = state::sending;
+  }
+}
+
+void hue_sensor_command::reconnect()
+{
+  answered_ = false;
+  parser_.reset();
+  connect_time_ = timestamp();
+  switch (start_connect()) {
+    case connect_result::connected:
+      connected();
+      break;
+    case connect_result::pending:
+      if (state_ == state::idle)
+        state_ = state::connecting;
+      break;
+    case connect_result::failed:
+      connection_failed();
+      break;
+  }
 }
 
-void hue_sensor_command::request_finished() noexcept
+void hue_sensor_command::retry(bool count_attempt) noexcept
 {
+  close_connection();
   state_ = state::idle;
-  if (prepare_buffer(timestamp())) {
-    // next request pending
-    if (start_connect())
-      state_ = state::sending;
-    else if (state_ == state::idle)
-      state_ = state::connecting;
+
+  // put requests to retry in front of their priority class in the queue,
+  // from the newest one, so the oldest ones are dropped on overflow
+  auto now = timestamp();
+  timestamp_t retry_time = now;
+  while (!inflight_.empty()) {
+    auto& q = inflight_.back().command;
+    if (count_attempt && ++q.attempts >= MAX_ATTEMPTS) {
+      ++stats_.lost;  // give up on this one
+    } else if (expired(q, now)) {
+      ++stats_.expired;
+    } else if (superseded(q)) {
+      ++stats_.coalesced;
+    } else if (queue_.full()) {
+      ++stats_.dropped;
+    } else {
+      if (count_attempt) {
+        // all requests retry at the same time to keep their order
+        if (retry_time == now)
+          retry_time = now + retry_delay(q.attempts);
+        q.retry_time = retry_time;
+        ++stats_.retried;
+      }
+      uint8_t index = 0;
+      while (index < queue_.size() && queue_[index].priority < q.priority)
+        ++index;
+      queue_.insert(index) = q;
+    }
+    inflight_.pop_back();
+  }
+}
+
+bool hue_sensor_command::superseded(const queue_element& q) const noexcept
+{
+  // only direct actions are replaced by newer ones, sensor values trigger distinct rules
+  if (!q.target)
+    return false;
+  for (uint8_t i = 0; i < queue_.size(); ++i) {
+    if (queue_[i].target == q.target)
+      return true;
   }
+  return false;
+}
+
+hue_sensor_command::timestamp_t hue_sensor_command::retry_delay(uint8_t attempts) noexcept
+{
+  // xorshift, seeded differently per handler, so handlers don't retry in lockstep
+  if (!jitter_)
+    jitter_ = uint32_t(ip_ ^ uintptr_t(this)) | 1;
+  jitter_ ^= jitter_ << 13;
+  jitter_ ^= jitter_ >> 17;
+  jitter_ ^= jitter_ << 5;
+  auto backoff = RETRY_BACKOFF << (attempts - 1);
+  return backoff / 2 + timestamp_t(jitter_ % uint32_t(backoff / 2 + 1));
 }
 
+void hue_sensor_command::connection_failed()
+{
+  report_connection_failure(state_);
+  retry(true);
+  if (++failures_ < MAX_FAILURES) {
+    start_next();
+    return;
+  }
+
+  // circuit breaker: drop commands and probe the bridge with increasing backoff
+  if (!backoff_) {
+    backoff_ = MIN_BACKOFF;
+    ++stats_.outages;
+    reachability_changed();
+  } else if (backoff_ < MAX_BACKOFF) {
+    backoff_ = backoff_ * 2 < MAX_BACKOFF ? backoff_ * 2 : MAX_BACKOFF;
+  }
+  probe_time_ = timestamp() + backoff_;
+  stats_.rejected += queue_.size();
+  queue_.clear();
+}
+
+void hue_sensor_command::connected()
+{
+  auto now = timestamp();
+  if (backoff_) {
+    // probe succeeded, commands are accepted again; if the bridge accepts
+    // connections, but doesn't answer, requests time out and reopen the breaker
+    failures_ = 0;
+    backoff_ = 0;
+    reachability_changed();
+  }
+  if (!inflight_.empty()) {
+    // latency of requests starts now, not with connecting
+    for (uint8_t i = 0; i < inflight_.size(); ++i)
+      inflight_[i].sent = now;
+    send_time_ = now;
+    state_ = state::sending;
+    return;
+  }
+  // connection opened ahead, send commands posted while connecting
+  state_ = state::open;
+  idle_since_ = timestamp();
+  start_next();
+}
+
+void hue_sensor_command::request_finished()
+{
+  if (state_ == state::sending && !send_first_ && send_segment_ < 2) {
+    // answer to a request not sent completely, can't continue on this connection
+    retry(true);
+    start_next();
+    return;
+  }
+  answered_ = true;
+  failures_ = 0;
+  if (backoff_) {
+    backoff_ = 0;
+    reachability_changed();
+  }
+  if (limiter_) {
+    // bridge throttles requests with 429 or 503 or fails them with internal error 901
+    auto status = parser_.status();
+    bool congested = status == 429 || status == 503 || parser_.error_type() == 901;
+    auto now = timestamp();
+    limiter_->response(now - inflight_.front().sent, congested, now);
+  }
+  if (parser_.succeeded()) {
+    ++stats_.succeeded;
+    if (inflight_.front().command.attempts)
+      ++stats_.recovered;
+  } else {
+    ++stats_.failed;
+    report_failure(inflight_.front().command, parser_.status(), parser_.error_type());
+  }
+  inflight_.pop_front();
+  if (send_first_)
+    --send_first_;
+  else if (state_ == state::sending)
+    send_segment_ = uint8_t(send_segment_ - 2);  // answered while sending the rest of the batch
+  // the bridge answers requests in order, so the next one is processed now
+  response_time_ = timestamp();
+  if (!parser_.keep_alive()) {
+    // bridge closes the connection, send the rest over a new one
+    retry(false);
+  } else {
+    parser_.reset();
+    if (inflight_.empty() && state_ == state::receiving) {
+      state_ = state::open;
+      idle_since_ = timestamp();
+    }
+  }
+  start_next();
+  prewarm();
+}
+
+void hue_sensor_command::request_failed()
+{
+  if (!inflight_.empty()) {
+    ++stats_.failed;
+    report_failure(inflight_.front().command, 0, 0);
+    inflight_.pop_front();
+  }
+  retry(true);
+  start_next();
+}
+
+void hue_sensor_command::response_received(const char* data, size_t size)
+{
+  while (size) {
+    if (inflight_.empty() || (state_ != state::sending && state_ != state::receiving)) {
+      // unsolicited data, connection is not usable anymore
+      request_failed();
+      return;
+    }
+    size_t consumed;
+    auto res = parser_.parse(data, size, consumed);
+    data += consumed;
+    size -= consumed;
+    if (res == http_response_parser::result::incomplete)
+      return;
+    if (res == http_response_parser::result::error) {
+      request_failed();
+      return;
+    }
+    request_finished();
+    if (state_ != state::sending && state_ != state::receiving && state_ != state::open)
+      return; // connection closed
+  }
+}
+
+void hue_sensor_command::connection_closed()
+{
+  if (state_ == state::connecting) {
+    connection_failed();
+    return;
+  }
+  if (!inflight_.empty()) {
+    if (parser_.finish() == http_response_parser::result::complete) {
+      request_finished();
+      return;
+    }
+    // if the bridge closed a kept-alive connection before processing
+    // further requests, it doesn't count as a failed attempt
+    retry(parser_.started() || !answered_);
+  } else {
+    retry(true);
+  }
+  start_next();
+}
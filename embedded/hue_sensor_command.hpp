@@ -23,7 +23,13 @@
  */
 #pragma once
 
+#include "http_response_parser.hpp"
+#include "ring_queue.hpp"
+#include "rate_limiter.hpp"
+#include "timer_wheel.hpp"
+
 #include <cstdint>
+#include <cstddef>
 
 /*!
  * @brief Command handler to post commands to Hue bridge via virtual sensor.
@@ -50,6 +56,38 @@
  * Use created sensor ID as constructor argument. Posting to the command
  * handler, you can change value of the sensor. Rules can then react on
  * the change of the sensor value.
+ *
+ * The connection to the bridge is kept alive between requests. The end
+ * of a response is determined from its framing, not from EOF. If the
+ * bridge closes an idle connection before it sees the next request, the
+ * request is transparently resent on a new connection.
+ *
+ * Queued commands are pipelined on the connection, i.e., all of them are
+ * sent without waiting for the responses, which are then matched to the
+ * requests in order. If the connection breaks, requests without response
+ * are retried on a new connection.
+ *
+ * The constant prefix of the request (up to the Content-Length value) is
+ * rendered once when the handler is (re)initialized. Only the length and
+ * the body are formatted per request and both parts are sent using
+ * scatter-gather I/O.
+ *
+ * Besides setting the sensor, the handler can send direct actions to
+ * lights, groups or scenes, bypassing rules on the bridge. Requests for
+ * these are precompiled and set via set_actions(). They use the same
+ * queue and connection, but a newer action replaces the same action still
+ * waiting in the queue.
+ *
+ * Commands are queued by their priority class. Optionally, a rate limiter
+ * shared by all handlers of the bridge adapts the request rate to the
+ * latency and errors of the bridge and lets interactive commands go ahead
+ * of lower-priority ones.
+ *
+ * Connecting, sending and waiting for the response to each request have
+ * their own deadlines (CONNECT_TIMEOUT, SEND_TIMEOUT and RESPONSE_TIMEOUT),
+ * idle connections are closed after IDLE_TIMEOUT. Handlers either have
+ * check_timeouts() called per next_timeout() by the caller or schedule
+ * it in a timer wheel shared with other handlers.
  */
 class hue_sensor_command
 {
@@ -94,20 +132,163 @@ public:
     ip_ = ip;
     api_key_ = api_key;
     sensor_id_ = sensor_id;
+    render_prefix();
   }
 
   virtual ~hue_sensor_command() noexcept {}
 
+  /*!
+   * @brief Send further requests to another address of the bridge.
+   *
+   * The current connection, if any, is closed and requests in flight are
+   * moved back to the queue, since they are rendered for the old address.
+   * Queued requests are sent to the new address. If the bridge is considered
+   * unreachable, it is probed at the new address immediately.
+   *
+   * @param ip new IP address of the bridge.
+   */
+  void readdress(uint32_t ip);
+
   /*!
    * @brief Post a value to the sensor.
    *
    * The queue with values is not arbitrarily long. Only recent values
-   * will be actually posted, too old values will be lost, if not confirmed
-   * by the bridge in time.
+   * will be actually posted, values which couldn't be sent before the
+   * deadline are dropped. If the queue is full, the oldest command of
+   * the lowest priority class is dropped.
    *
    * @param value value to post.
+   * @param prio priority class of the command.
+   */
+  void post(int32_t value, rate_limiter::priority prio = rate_limiter::priority::normal)
+  {
+    enqueue(value, 0, false, prio);
+  }
+
+  /// Precompiled request of a direct action.
+  struct action_request
+  {
+    const char* prefix;     ///< Request up to the Content-Length value.
+    const char* tail;       ///< Content-Length value, end of headers and body.
+    uint16_t prefix_size;   ///< Size of the prefix.
+    uint16_t tail_size;     ///< Size of the tail.
+  };
+
+  /*!
+   * @brief Set precompiled direct actions.
+   *
+   * @param actions,count actions, which must stay valid while set.
+   */
+  void set_actions(const action_request* actions, uint16_t count) noexcept
+  {
+    actions_ = actions;
+    action_count_ = count;
+  }
+
+  /*!
+   * @brief Post a direct action.
+   *
+   * @param action index of the action set via set_actions().
+   * @param prio priority class of the command.
    */
-  void post(int32_t value);
+  void post_action(uint16_t action, rate_limiter::priority prio = rate_limiter::priority::normal)
+  {
+    if (action < action_count_)
+      enqueue(0, uint16_t(action + 1), true, prio);
+  }
+
+  /*!
+   * @brief Render request prefix for a resource up to the Content-Length value.
+   *
+   * @param dest,size buffer to render to.
+   * @param resource resource path after the API key, e.g., <tt>groups/1/action</tt>
+   *    (empty for the whole configuration).
+   * @param method HTTP method of the request.
+   * @return length of the prefix (may be more than size, if truncated).
+   */
+  size_t render_prefix(char* dest, size_t size, const char* resource, const char* method = "PUT") const noexcept;
+
+  /*!
+   * @brief Render request tail for a constant body.
+   *
+   * @param dest,size buffer to render to.
+   * @param body JSON body.
+   * @return length of the tail (may be more than size, if truncated).
+   */
+  static size_t render_tail(char* dest, size_t size, const char* body) noexcept;
+
+  /*!
+   * @brief Connect to the bridge ahead of commands, if not connected yet.
+   *
+   * Called on sender activity, at startup and after requests, so post()
+   * usually finds an established connection. A connection without requests
+   * is closed after IDLE_TIMEOUT.
+   */
+  void prewarm();
+
+  /*!
+   * @brief Handle timeouts.
+   *
+   * Closes connections idle for longer than IDLE_TIMEOUT, fails connections
+   * which missed a connect, send or response deadline and probes an unreachable bridge when
+   * the backoff of the circuit breaker elapsed.
+   */
+  void check_timeouts(timestamp_t now);
+
+  /// Get milliseconds until check_timeouts() needs to be called.
+  timestamp_t next_timeout(timestamp_t now) const noexcept;
+
+  /*!
+   * @brief Schedule check_timeouts() in a timer wheel.
+   *
+   * The timer is rescheduled after each call which changes the next
+   * timeout, so the caller only needs to advance the wheel.
+   *
+   * @param wheel timer wheel, which must outlive the handler, or @c nullptr
+   *    to let the caller call check_timeouts().
+   */
+  void set_timer_wheel(timer_wheel* wheel) noexcept;
+
+  /*!
+   * @brief Expire a timer of the owner of the handler when requests finish.
+   *
+   * The timer is scheduled in the timer wheel of the handler after requests
+   * succeeded, failed or were dropped, so the owner can process the result
+   * without polling the statistics.
+   *
+   * @param t timer to expire, or @c nullptr.
+   */
+  void set_completion_timer(timer_wheel::timer* t) noexcept;
+
+  /*!
+   * @brief Expire a timer when the circuit breaker opens or closes.
+   *
+   * @param t timer to expire in the timer wheel of the handler, or @c nullptr.
+   */
+  void set_reachability_timer(timer_wheel::timer* t) noexcept { reachability_ = t; }
+
+  /// Check whether the bridge is considered unreachable.
+  bool unreachable() const noexcept { return backoff_ != 0; }
+
+  /// Set deadline in milliseconds for sending a command after it was posted.
+  void set_deadline(timestamp_t deadline) noexcept { deadline_ = deadline; }
+
+  /// Set timeout in milliseconds for the response to a request (RESPONSE_TIMEOUT by default).
+  void set_response_timeout(timestamp_t timeout) noexcept { response_timeout_ = timeout; }
+
+  /*!
+   * @brief Limit the rate of requests.
+   *
+   * @param limiter rate limiter shared by all handlers of the bridge, or @c nullptr.
+   */
+  void set_rate_limiter(rate_limiter* limiter) noexcept { limiter_ = limiter; }
+
+  /*!
+   * @brief Pass bodies of responses to a JSON tokenizer.
+   *
+   * @param tokenizer tokenizer, which is reset for each response, or @c nullptr.
+   */
+  void set_body_tokenizer(json_tokenizer* tokenizer) noexcept { parser_.set_body_tokenizer(tokenizer); }
 
   /// Process events on file descriptor.
   virtual void poll() = 0;
@@ -115,9 +296,84 @@ public:
   /// Get current timestamp.
   virtual timestamp_t timestamp() noexcept = 0;
 
+  /// Statistics of requests.
+  struct statistics
+  {
+    uint32_t succeeded;     ///< Requests confirmed by the bridge.
+    uint32_t failed;        ///< Requests rejected by the bridge or with invalid response.
+    uint32_t lost;          ///< Requests given up after connection errors.
+    uint32_t expired;       ///< Commands dropped after their deadline.
+    uint32_t dropped;       ///< Commands dropped due to full queue.
+    uint32_t coalesced;     ///< Commands replaced by a newer one for the same target.
+    uint32_t prewarmed;     ///< Connections opened ahead of commands.
+    uint32_t cold;          ///< Commands posted while not connected.
+    uint32_t rejected;      ///< Commands dropped while the bridge was unreachable.
+    uint32_t outages;       ///< Times the bridge became unreachable.
+    uint32_t retried;       ///< Commands queued again after a failed attempt.
+    uint32_t recovered;     ///< Commands confirmed after a failed attempt.
+  };
+
+  /// Get IP address of the bridge.
+  uint32_t ip() const noexcept { return ip_; }
+
+  /// Get API key assigned by the bridge.
+  const char* api_key() const noexcept { return api_key_; }
+
+  /// Get sensor ID to post to.
+  int sensor_id() const noexcept { return sensor_id_; }
+
+  /// Get statistics of requests.
+  const statistics& stats() const noexcept { return stats_; }
+
+protected:
+  /// Result of starting a connection.
+  enum class connect_result
+  {
+    pending,        ///< Connecting, connected() or connection_closed() will follow.
+    connected,      ///< Connected immediately.
+    failed          ///< Connection could not be started.
+  };
+
 private:
-  /// Start connecting to the remote side. Returns true if connected immediately.
-  virtual bool start_connect() = 0;
+  /// Start connecting to the remote side.
+  virtual connect_result start_connect() = 0;
+
+  /// Close the current connection, if any (must be idempotent).
+  virtual void close_connection() noexcept = 0;
+
+  /*!
+   * @brief Queue a command and send it, if possible.
+   *
+   * @param value value to post.
+   * @param target target of the command (0 for the sensor, action index + 1 for direct actions).
+   * @param coalesce if set, replace a command for the same target which
+   *    is still queued, instead of queueing a new one.
+   * @param prio priority class of the command.
+   */
+  void enqueue(int32_t value, uint16_t target, bool coalesce, rate_limiter::priority prio);
+
+  /// Render constant prefix of requests to the sensor.
+  void render_prefix() noexcept;
+
+  /// Render variable tail of a request (length and body) for a value.
+  static uint8_t render_tail(char* dest, int32_t value) noexcept;
+
+  /// Start sending next requests from the queue, if any and if possible.
+  void start_next();
+
+  /// (Re)connect to the remote side for the prepared requests.
+  void reconnect();
+
+  /*!
+   * @brief Close the connection and move requests in flight back to the queue.
+   *
+   * @param count_attempt if set, count this as a failed attempt for requests
+   *    in flight, dropping those which exceeded MAX_ATTEMPTS.
+   */
+  void retry(bool count_attempt) noexcept;
+
+  /// Handle a failed connection, open the circuit breaker on repeated failures.
+  void connection_failed();
 
 protected:
   /// Current state of the handler.
@@ -126,7 +382,8 @@ protected:
     idle,           ///< No connection and queue empty.
     connecting,     ///< Connecting to the remote side.
     sending,        ///< Sending data to the remote side.
-    receiving,      ///< Receiving reply from the remote side.
+    receiving,      ///< All requests sent, receiving replies from the remote side.
+    open,           ///< Connection open, no request in flight.
     unknown         ///< Unknown state.
   };
 
@@ -135,36 +392,149 @@ protected:
   {
     int32_t value;          ///< Value to post.
     timestamp_t timestamp;  ///< Milliseconds since some common point in time.
+    timestamp_t retry_time; ///< Time when the command may be sent again after a failed attempt.
+    uint16_t target;        ///< Target of the command.
+    uint8_t attempts;       ///< Count of failed attempts to send.
+    rate_limiter::priority priority;  ///< Priority class of the command.
   };
 
+  /// Check whether a command waits for retry.
+  static bool backing_off(const queue_element& q, timestamp_t now) noexcept
+  {
+    return now - q.retry_time < 0;
+  }
+
+  /// Check whether a command is past its deadline.
+  bool expired(const queue_element& q, timestamp_t now) const noexcept
+  {
+    auto delta = now - q.timestamp;
+    return delta < 0 || delta > deadline_;
+  }
+
   /// Get current request state.
   state get_state() const noexcept { return state_; }
 
-  /// Prepare buffer with the first command in queue.
+  /// Get the deadline of the current connect, send or response phase.
+  timestamp_t io_deadline() const noexcept;
+
+  /// Get count of requests which succeeded, failed or were dropped.
+  uint32_t finished() const noexcept;
+
+  /// Report a change of reachability and expire the reachability timer, if any.
+  void reachability_changed() noexcept;
+
+  /// Update interest in events and schedule the timer for the next timeout, if using a timer wheel.
+  void arm_timer() noexcept;
+
+  /// Update interest in events after the state may have changed (nothing by default).
+  virtual void update_interest() noexcept {}
+
+  /// Render direct actions for a new address of the bridge, while no request is in flight (nothing by default).
+  virtual void render_actions() noexcept {}
+
+  /// Drop expired commands from the front of the queue.
+  void drop_expired(timestamp_t now) noexcept;
+
+  /// Prepare requests for commands from the queue, which fit into the pipeline.
   bool prepare_buffer(timestamp_t timestamp) noexcept;
 
+  /*!
+   * @brief Get a segment of request data remaining to send.
+   *
+   * @param n index of the segment, starting with 0 for the current one.
+   * @param data,size set to data of the segment.
+   * @return @c true if the segment exists, @c false past the last one.
+   *
+   * Segments with even index are constant while the handler is not reinitialized,
+   * so they don't need to be copied for sending.
+   */
+  bool send_segment(uint8_t n, const char*& data, size_t& size) const noexcept;
+
+  /// Inform the handler that data of given size was sent from the current segment on.
+  void data_sent(size_t size);
+
+  /// Check whether any request is in flight.
+  bool busy() const noexcept { return !inflight_.empty(); }
+
   /// The connection is established, send data now.
-  void connected() noexcept
+  void connected();
+
+  /// Request data has been sent, now receiving responses.
+  void request_sent()
   {
-    state_ = state::sending;
+    state_ = state::receiving;
+    start_next(); // pipeline commands queued in the meantime
   }
 
-  /// Request data has been sent, now receiving response.
-  void request_sent() noexcept
+  /// Inform the handler that the oldest request in flight has been confirmed.
+  void request_finished();
+
+  /// Inform the handler that the oldest request in flight failed.
+  void request_failed();
+
+  /// Inform the handler about response data received.
+  void response_received(const char* data, size_t size);
+
+  /// Inform the handler that the remote side closed the connection or connecting failed.
+  void connection_closed();
+
+  /*!
+   * @brief Report a request failed by the bridge.
+   *
+   * @param command command posted.
+   * @param status HTTP status (0 if response was invalid).
+   * @param error_type type of the first Hue error in the response (0 if none).
+   */
+  virtual void report_failure(const queue_element& command, uint16_t status, uint16_t error_type) noexcept
   {
-    state_ = state::receiving;
+    (void) command; (void) status; (void) error_type;
   }
 
-  /// Inform the handler that the command has been sent and confirmed.
-  void request_finished() noexcept;
+  /*!
+   * @brief Report a change of reachability of the bridge.
+   *
+   * @param backoff time until the next probe, if the bridge became
+   *    unreachable, 0 if it is reachable again.
+   */
+  virtual void report_reachability(timestamp_t backoff) noexcept
+  {
+    (void) backoff;
+  }
 
-  /// Inform the handler that the request failed.
-  void request_failed() noexcept { request_finished(); }
+  /*!
+   * @brief Report a failed connection, before its requests are retried.
+   *
+   * @param s state in which the connection failed.
+   */
+  virtual void report_connection_failure(state s) noexcept
+  {
+    (void) s;
+  }
 
-  /// Maximum 4 commands in the queue.
-  static constexpr auto MAX_QUEUE_SIZE = 4;
-  /// Maximum 0.5 seconds for the bridge to accept the command.
-  static constexpr timestamp_t MAX_EVENT_AGE = 500000;
+  /// Maximum 8 commands in the queue.
+  static constexpr uint8_t MAX_QUEUE_SIZE = 8;
+  /// Maximum 4 requests in flight on the connection.
+  static constexpr uint8_t MAX_PIPELINE = 4;
+  /// Maximum attempts to send a request on a broken connection.
+  static constexpr uint8_t MAX_ATTEMPTS = 3;
+  /// Backoff before the first retry of a failed request, doubled for further retries.
+  static constexpr timestamp_t RETRY_BACKOFF = 20;
+  /// Default deadline of 0.5 seconds to send the command to the bridge.
+  static constexpr timestamp_t DEFAULT_DEADLINE = 500;
+  /// Close connections idle for 20 seconds.
+  static constexpr timestamp_t IDLE_TIMEOUT = 20000;
+  /// Fail connections not established within 3 seconds (including TLS handshake).
+  static constexpr timestamp_t CONNECT_TIMEOUT = 3000;
+  /// Fail connections on which sending makes no progress for 2 seconds.
+  static constexpr timestamp_t SEND_TIMEOUT = 2000;
+  /// Fail connections on which a request is not answered within 3 seconds by default.
+  static constexpr timestamp_t RESPONSE_TIMEOUT = 3000;
+  /// Consider the bridge unreachable after 2 consecutive failed connections.
+  static constexpr uint8_t MAX_FAILURES = 2;
+  /// Initial backoff of 1 second before probing an unreachable bridge.
+  static constexpr timestamp_t MIN_BACKOFF = 1000;
+  /// Backoff is doubled up to 1 minute.
+  static constexpr timestamp_t MAX_BACKOFF = 60000;
 
   /// Remote IP address.
   uint32_t ip_;
@@ -173,22 +543,99 @@ protected:
   /// Sensor ID to post to.
   int sensor_id_;
 
-  /// Send pointer.
-  const uint8_t* send_ptr_ = nullptr;
+  /// Index of the first request in flight being sent.
+  uint8_t send_first_ = 0;
+  /// Current segment being sent (two segments per request).
+  uint8_t send_segment_ = 0;
+  /// Offset in the current segment.
+  uint16_t send_offset_ = 0;
   /// Outstanding send size.
   uint16_t send_outstanding_size_ = 0;
   /// Total send size.
   uint16_t send_total_size_ = 0;
 
-  /// Send/receive buffer with current command or response.
-  char buffer_[512];
+  /// Constant prefix of requests up to the Content-Length value.
+  char prefix_[256];
+  /// Length of the prefix.
+  uint16_t prefix_len_ = 0;
+
+  /// Parser of the response to the oldest request in flight.
+  http_response_parser parser_;
+  /// Set if any response was received on the current connection.
+  bool answered_ = false;
+  /// Time since which the connection is open without requests.
+  timestamp_t idle_since_ = 0;
+  /// Time connecting started.
+  timestamp_t connect_time_ = 0;
+  /// Time of the last progress in sending requests.
+  timestamp_t send_time_ = 0;
+  /// Time the oldest request in flight started waiting for its response.
+  timestamp_t response_time_ = 0;
+  /// Consecutive failed connections since the last response.
+  uint8_t failures_ = 0;
+  /// State of the pseudo-random generator for retry jitter.
+  uint32_t jitter_ = 0;
+  /// Current backoff of the circuit breaker (0 if the bridge is reachable).
+  timestamp_t backoff_ = 0;
+  /// Time of the next probe of an unreachable bridge.
+  timestamp_t probe_time_ = 0;
+  /// Statistics of requests.
+  statistics stats_ = {};
+  /// Deadline in milliseconds for sending a command after it was posted.
+  timestamp_t deadline_ = DEFAULT_DEADLINE;
+  /// Timeout in milliseconds for the response to a request.
+  timestamp_t response_timeout_ = RESPONSE_TIMEOUT;
+  /// Precompiled direct actions.
+  const action_request* actions_ = nullptr;
+  /// Count of direct actions.
+  uint16_t action_count_ = 0;
+  /// Rate limiter of the bridge, if any.
+  rate_limiter* limiter_ = nullptr;
 
 private:
-  /// Current queue size.
-  uint8_t queue_size_ = 0;
+  /// Timer calling check_timeouts().
+  class timeout : public timer_wheel::timer
+  {
+  public:
+    explicit timeout(hue_sensor_command& parent) noexcept : parent_(parent) {}
+
+  private:
+    virtual void expired(timestamp_t now) override { parent_.check_timeouts(now); }
+
+    hue_sensor_command& parent_;
+  };
+
+  /// Check whether a newer command for the same target is queued.
+  bool superseded(const queue_element& q) const noexcept;
+
+  /// Get jittered delay before retrying a request after given count of failed attempts.
+  timestamp_t retry_delay(uint8_t attempts) noexcept;
+
   /// Queue with commands to send.
-  queue_element queue_[MAX_QUEUE_SIZE];
+  ring_queue<queue_element, MAX_QUEUE_SIZE> queue_;
+
+  /// Request in flight.
+  struct request
+  {
+    queue_element command;  ///< Command sent.
+    timestamp_t sent;       ///< Time when the request was sent (to measure latency).
+    uint8_t tail_size;      ///< Size of the tail (for sensor commands).
+    char tail[47];          ///< Content-Length value, end of headers and body (for sensor commands).
+  };
+  /// Requests sent or being sent, waiting for response, in order.
+  ring_queue<request, MAX_PIPELINE> inflight_;
 
   /// Current state of the connection.
   state state_ = state::idle;
+
+  /// Timer wheel to schedule timeouts in, if any.
+  timer_wheel* wheel_ = nullptr;
+  /// Timer of the next timeout.
+  timeout timer_{*this};
+  /// Timer of the owner to expire when requests finish, if any.
+  timer_wheel::timer* completion_ = nullptr;
+  /// Count of finished requests when the completion timer was last scheduled.
+  uint32_t completed_ = 0;
+  /// Timer to expire when the reachability of the bridge changes, if any.
+  timer_wheel::timer* reachability_ = nullptr;
 };
@@ -33,34 +33,9 @@ extern bool s_debug;
 
 void hue_sensor_command_embedded::poll()
 {
-  auto s = get_state();
-  if (s != state::idle && s < state::unknown && pcb_ && report_time_) {
-    // check for long-running requests
-    unsigned long time = millis();
-    auto delta = time - connect_time_;
-    if (delta >= report_time_) {
-      syslog_P(LOG_WARNING, PSTR("EnOcean Request still not done after %lums, state %d, to_send %u/%u"),
-        delta, int(s), unsigned(send_outstanding_size_), unsigned(send_total_size_));
-      report_time_ *= 2;
-      if (report_time_ > 8000) {
-        // way too long request, abort it
-        syslog_P(LOG_WARNING, PSTR("EnOcean Aborting request, restarting"));
-        auto err = tcp_close(pcb_);
-        if (err != ERR_OK) {
-          if (s_debug)
-            debug_stream::instance() << F("EnOcean Error closing socket, aborting socket; err=") << int(err);
-          tcp_abort(pcb_);
-        }
-        pcb_ = nullptr;
-        report_time_ = 0;
-        request_failed();
-        ESP.restart();  // to be on the safe side
-        return;
-      }
-    }
-  }
-
-  switch (s) {
+  // stuck connections are failed by timeout, without restarting the device
+  check_timeouts(timestamp());
+  switch (get_state()) {
     case state::connecting:
       // connect is in progress
       break;
@@ -68,37 +43,47 @@ void hue_sensor_command_embedded::poll()
     case state::sending:
     {
       // socket writable, write remaining stuff
-      auto to_send = tcp_sndbuf(pcb_);
-      if (send_outstanding_size_ < to_send)
-        to_send = send_outstanding_size_;
-      if (to_send == 0)
+      if (!tcp_sndbuf(pcb_))
         break; // no send space
       if (s_debug && send_outstanding_size_ == send_total_size_) {
         auto& stream = debug_stream::instance();
         stream << F("Sending request to Hue bridge:\n");
-        stream.write(send_ptr_, send_outstanding_size_);
+        const char* data;
+        size_t size;
+        for (uint8_t i = 0; send_segment(i, data, size); ++i)
+          stream.write(reinterpret_cast<const uint8_t*>(data), size);
+        stream << '\n';
       }
-      auto err = tcp_write(pcb_, send_ptr_, to_send, 0);
-      if (err == ERR_MEM) {
-        if (s_debug)
-          debug_stream::instance() << F("\nOUT OF MEMORY\n");
-        break; // will retry again
-      } else if (err != ERR_OK) {
-        // some other error
-        if (s_debug)
-          debug_stream::instance() << F("\nERROR");
-        connection_error(this, err);
-        break;
-      } else if (s_debug) {
-        debug_stream::instance() << '\n';
-      }
-      send_outstanding_size_ -= to_send;
-      send_ptr_ += to_send;
-      if (send_outstanding_size_ == 0) {
-        // all written
-        tcp_output(pcb_);
-        request_sent();
+      const char* data;
+      size_t size;
+      while (send_segment(0, data, size)) {
+        size_t space = tcp_sndbuf(pcb_);
+        if (!space)
+          break;
+        if (size > space)
+          size = space;
+        // constant prefix is sent without copying, the tail is copied,
+        // since tails are moved when earlier requests finish
+        uint8_t flags = TCP_WRITE_FLAG_MORE;
+        if (send_segment_ & 1)
+          flags |= TCP_WRITE_FLAG_COPY;
+        auto err = tcp_write(pcb_, data, uint16_t(size), flags);
+        if (err == ERR_MEM) {
+          if (s_debug)
+            debug_stream::instance() << F("OUT OF MEMORY\n");
+          break; // will retry again
+        } else if (err != ERR_OK) {
+          // some other error
+          if (s_debug)
+            debug_stream::instance() << F("ERROR\n");
+          syslog_P(LOG_ERR, PSTR("EnOcean TCP write error %d"), int(err));
+          close_connection();
+          connection_closed();
+          return;
+        }
+        data_sent(size);
       }
+      tcp_output(pcb_);
       break;
     }
 
@@ -117,7 +102,7 @@ hue_sensor_command::timestamp_t hue_sensor_command_embedded::timestamp() noexcep
   return millis();
 }
 
-bool hue_sensor_command_embedded::start_connect()
+hue_sensor_command::connect_result hue_sensor_command_embedded::start_connect()
 {
   // ensure we have a valid socket
   if (pcb_) {
@@ -127,36 +112,72 @@ bool hue_sensor_command_embedded::start_connect()
   pcb_ = tcp_new();
   if (!pcb_) {
     syslog_P(LOG_ERR, PSTR("EnOcean OUT OF MEMORY on start_connect()"));
-    restart_connect_ = true;
-    report_time_ = 0;
-    return false;
+    return connect_result::failed;
   }
   tcp_arg(pcb_, this);
   tcp_err(pcb_, connection_error);
   tcp_recv(pcb_, data_received);
 
-  connect_time_ = millis();
-  report_time_ = 500; // give some time for proper request handling initially
   auto err = tcp_connect(pcb_, reinterpret_cast<const ip_addr_t*>(&ip_), 80, connection_established);
   if (err != ERR_OK) {
     syslog_P(LOG_ERR, PSTR("EnOcean OUT OF MEMORY on connect()"));
     tcp_abort(pcb_);
     pcb_ = nullptr;
-    restart_connect_ = true;
-    return false;
+    return connect_result::failed;
   }
 
-  restart_connect_ = false;
-  return false;
+  return connect_result::pending;
 }
 
 void hue_sensor_command_embedded::connection_error(void* arg, err_t err)
 {
   syslog_P(LOG_ERR, PSTR("EnOcean TCP error %d"), int(err));
   auto self = reinterpret_cast<hue_sensor_command_embedded*>(arg);
+  // socket is already freed by lwIP
   self->pcb_ = nullptr;
-  self->report_time_ = 0;
-  self->request_failed();
+  self->connection_closed();
+}
+
+void hue_sensor_command_embedded::close_connection() noexcept
+{
+  if (!pcb_)
+    return;
+  tcp_arg(pcb_, nullptr);
+  tcp_sent(pcb_, nullptr);
+  tcp_recv(pcb_, nullptr);
+  tcp_err(pcb_, nullptr);
+  auto err = tcp_close(pcb_);
+  if (err != ERR_OK) {
+    if (s_debug)
+      debug_stream::instance() << F("EnOcean Error closing socket, aborting socket; err=") << int(err);
+    tcp_abort(pcb_);
+    aborted_ = true;
+  }
+  pcb_ = nullptr;
+}
+
+void hue_sensor_command_embedded::report_failure(const queue_element& command, uint16_t status, uint16_t error_type) noexcept
+{
+  if (command.target)
+    syslog_P(LOG_WARNING, PSTR("EnOcean Action %u failed, HTTP status %u, Hue error type %u"),
+      command.target - 1U, unsigned(status), unsigned(error_type));
+  else
+    syslog_P(LOG_WARNING, PSTR("EnOcean Command %ld failed, HTTP status %u, Hue error type %u"),
+      long(command.value), unsigned(status), unsigned(error_type));
+}
+
+void hue_sensor_command_embedded::report_reachability(timestamp_t backoff) noexcept
+{
+  if (backoff)
+    syslog_P(LOG_ERR, PSTR("EnOcean Bridge unreachable, dropping commands, probing in %ldms"), long(backoff));
+  else
+    syslog_P(LOG_WARNING, PSTR("EnOcean Bridge reachable again"));
+}
+
+void hue_sensor_command_embedded::report_connection_failure(state s) noexcept
+{
+  syslog_P(LOG_WARNING, PSTR("EnOcean Connection failed, state %d, to_send %u/%u"),
+    int(s), unsigned(send_outstanding_size_), unsigned(send_total_size_));
 }
 
 err_t hue_sensor_command_embedded::connection_established(void* arg, tcp_pcb* tpcb, err_t err)
@@ -167,8 +188,7 @@ err_t hue_sensor_command_embedded::connection_established(void* arg, tcp_pcb* tp
     self->pcb_ = nullptr;
     if (tpcb)
       tcp_abort(tpcb);
-    self->report_time_ = 0;
-    self->request_failed();
+    self->connection_closed();
     return err;
   }
   if (s_debug)
@@ -180,32 +200,28 @@ err_t hue_sensor_command_embedded::connection_established(void* arg, tcp_pcb* tp
 err_t hue_sensor_command_embedded::data_received(void* arg, tcp_pcb* tpcb, pbuf* p, err_t err)
 {
   auto self = reinterpret_cast<hue_sensor_command_embedded*>(arg);
+  self->aborted_ = false;
   if (p == nullptr) {
-    // last segment received, EOF, close connection
+    // EOF, close connection
     if (s_debug)
-      debug_stream::instance() << F("Request completed\n");
-    tcp_sent(tpcb, nullptr);
-    tcp_recv(tpcb, nullptr);
-    tcp_err(tpcb, nullptr);
-    err = tcp_close(tpcb);
-    if (err != ERR_OK) {
-      if (s_debug)
-        debug_stream::instance() << F("Error closing socket, aborting socket; err=") << int(err);
-      tcp_abort(tpcb);
-    }
-    self->pcb_ = nullptr;
-    self->report_time_ = 0;
-    self->request_finished();
-  } else {
-    // else just confirm data, ignore contents
+      debug_stream::instance() << F("Connection closed by bridge\n");
+    self->close_connection();
+    self->connection_closed();
+    return self->aborted_ ? ERR_ABRT : ERR_OK;
+  }
+
+  tcp_recved(tpcb, p->tot_len);
+  for (auto q = p; q && self->pcb_ == tpcb; q = q->next) {
     if (s_debug) {
       auto& stream = debug_stream::instance();
       stream << F("Received data:\n");
-      stream.write(reinterpret_cast<const uint8_t*>(p->payload), p->len);
+      stream.write(reinterpret_cast<const uint8_t*>(q->payload), q->len);
       stream << '\n';
     }
-    tcp_recved(tpcb, p->len);
+    self->response_received(reinterpret_cast<const char*>(q->payload), q->len);
   }
+  pbuf_free(p);
+  return self->aborted_ ? ERR_ABRT : ERR_OK;
 }
 
 #endif
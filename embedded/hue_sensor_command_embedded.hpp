@@ -59,7 +59,19 @@ public:
 
 private:
   /// Start connecting to the remote side.
-  virtual bool start_connect() override;
+  virtual connect_result start_connect() override;
+
+  /// Close the current connection, if any.
+  virtual void close_connection() noexcept override;
+
+  /// Report a request failed by the bridge.
+  virtual void report_failure(const queue_element& command, uint16_t status, uint16_t error_type) noexcept override;
+
+  /// Report a change of reachability of the bridge.
+  virtual void report_reachability(timestamp_t backoff) noexcept override;
+
+  /// Report a failed connection.
+  virtual void report_connection_failure(state s) noexcept override;
 
   /// Callback on connection error.
   static void connection_error(void* arg, err_t err);
@@ -72,10 +84,6 @@ private:
 
   /// Socket.
   tcp_pcb* pcb_ = nullptr;
-  /// Force restarting connect in poll(), if it failed due to OOM.
-  bool restart_connect_ = false;
-  /// Time of the connect.
-  unsigned long connect_time_ = 0;
-  /// Time when to start reporting slow connection.
-  unsigned long report_time_ = 0;
+  /// Set if the socket was aborted in close_connection().
+  bool aborted_ = false;
 };
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "json_tokenizer.hpp"
+
+#include <cstring>
+
+void json_tokenizer::reset() noexcept
+{
+  state_ = state::value;
+  is_key_ = false;
+  truncated_ = false;
+  depth_ = 0;
+  text_len_ = 0;
+  hex_digits_ = 0;
+  code_point_ = 0;
+  objects_ = 0;
+  text_[0] = 0;
+}
+
+bool json_tokenizer::parse(const char* data, size_t size) noexcept
+{
+  size_t i = 0;
+  while (i < size && state_ != state::failed) {
+    if (process(data[i]))
+      ++i;
+  }
+  return state_ != state::failed;
+}
+
+bool json_tokenizer::process(char c) noexcept
+{
+  switch (state_) {
+    case state::string:
+      if (c == '"') {
+        emit(is_key_ ? token::key : token::string);
+      } else if (c == '\\') {
+        state_ = state::escape;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        state_ = state::failed;
+      } else {
+        append(c);
+      }
+      return true;
+
+    case state::escape:
+      state_ = state::string;
+      switch (c) {
+        case '"': case '\\': case '/': append(c); break;
+        case 'b': append('\b'); break;
+        case 'f': append('\f'); break;
+        case 'n': append('\n'); break;
+        case 'r': append('\r'); break;
+        case 't': append('\t'); break;
+        case 'u':
+          state_ = state::unicode;
+          hex_digits_ = 0;
+          code_point_ = 0;
+          break;
+        default:
+          state_ = state::failed;
+          break;
+      }
+      return true;
+
+    case state::unicode:
+    {
+      uint16_t digit;
+      if (c >= '0' && c <= '9')
+        digit = uint16_t(c - '0');
+      else if (c >= 'a' && c <= 'f')
+        digit = uint16_t(c - 'a' + 10);
+      else if (c >= 'A' && c <= 'F')
+        digit = uint16_t(c - 'A' + 10);
+      else {
+        state_ = state::failed;
+        return true;
+      }
+      code_point_ = uint16_t(code_point_ * 16 + digit);
+      if (++hex_digits_ < 4)
+        return true;
+      // encode as UTF-8, surrogates are not combined
+      state_ = state::string;
+      if (code_point_ < 0x80) {
+        append(char(code_point_));
+      } else if (code_point_ < 0x800) {
+        append(char(0xc0 | (code_point_ >> 6)));
+        append(char(0x80 | (code_point_ & 0x3f)));
+      } else if (code_point_ >= 0xd800 && code_point_ < 0xe000) {
+        append('?');
+      } else {
+        append(char(0xe0 | (code_point_ >> 12)));
+        append(char(0x80 | ((code_point_ >> 6) & 0x3f)));
+        append(char(0x80 | (code_point_ & 0x3f)));
+      }
+      return true;
+    }
+
+    case state::scalar:
+      if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+          c == '-' || c == '+' || c == '.' || c == 'E') {
+        append(c);
+        return true;
+      }
+      end_scalar();
+      return false;  // process the delimiter
+
+    default:
+      break;
+  }
+
+  if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+    return true;
+
+  switch (state_) {
+    case state::value_or_end:
+      if (c == ']') {
+        end(false);
+        return true;
+      }
+      // fall through
+    case state::value:
+      text_len_ = 0;
+      truncated_ = false;
+      if (c == '{') {
+        begin(true);
+      } else if (c == '[') {
+        begin(false);
+      } else if (c == '"') {
+        is_key_ = false;
+        state_ = state::string;
+      } else if (c == '-' || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')) {
+        state_ = state::scalar;
+        append(c);
+      } else {
+        state_ = state::failed;
+      }
+      return true;
+
+    case state::key_or_end:
+      if (c == '}') {
+        end(true);
+        return true;
+      }
+      // fall through
+    case state::key:
+      if (c == '"') {
+        text_len_ = 0;
+        truncated_ = false;
+        is_key_ = true;
+        state_ = state::string;
+      } else {
+        state_ = state::failed;
+      }
+      return true;
+
+    case state::colon:
+      state_ = (c == ':') ? state::value : state::failed;
+      return true;
+
+    case state::next:
+      if (c == ',')
+        state_ = in_object() ? state::key : state::value;
+      else if (c == '}' && in_object())
+        end(true);
+      else if (c == ']' && depth_ && !in_object())
+        end(false);
+      else
+        state_ = state::failed;
+      return true;
+
+    default:
+      // trailing garbage after the document
+      state_ = state::failed;
+      return true;
+  }
+}
+
+void json_tokenizer::begin(bool object) noexcept
+{
+  if (depth_ == MAX_DEPTH) {
+    state_ = state::failed;
+    return;
+  }
+  text_[0] = 0;
+  handle_token(object ? token::begin_object : token::begin_array, text_, 0);
+  if (object)
+    objects_ |= uint32_t(1) << depth_;
+  else
+    objects_ &= ~(uint32_t(1) << depth_);
+  ++depth_;
+  state_ = object ? state::key_or_end : state::value_or_end;
+}
+
+void json_tokenizer::end(bool object) noexcept
+{
+  --depth_;
+  text_[0] = 0;
+  handle_token(object ? token::end_object : token::end_array, text_, 0);
+  state_ = depth_ ? state::next : state::done;
+}
+
+void json_tokenizer::emit(token type) noexcept
+{
+  text_[text_len_] = 0;
+  handle_token(type, text_, text_len_);
+  if (type == token::key)
+    state_ = state::colon;
+  else
+    state_ = depth_ ? state::next : state::done;
+}
+
+void json_tokenizer::end_scalar() noexcept
+{
+  text_[text_len_] = 0;
+  if (text_[0] == '-' || (text_[0] >= '0' && text_[0] <= '9')) {
+    emit(token::number);
+  } else if (strcmp(text_, "true") == 0 || strcmp(text_, "false") == 0 || strcmp(text_, "null") == 0) {
+    emit(token::literal);
+  } else {
+    state_ = state::failed;
+  }
+}
+
+void json_tokenizer::append(char c) noexcept
+{
+  if (text_len_ < MAX_TOKEN)
+    text_[text_len_++] = c;
+  else
+    truncated_ = true;
+}
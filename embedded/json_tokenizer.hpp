@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Incremental SAX-style JSON tokenizer.
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/*!
+ * @brief Incremental SAX-style JSON tokenizer.
+ *
+ * The tokenizer processes a JSON document as it arrives in arbitrary
+ * pieces, without allocating memory, and reports tokens to the derived
+ * class. Only the text of the current token is buffered, so documents
+ * of any size can be processed with constant memory. Strings longer than
+ * MAX_TOKEN are truncated, nesting is limited to MAX_DEPTH.
+ */
+class json_tokenizer
+{
+public:
+  /// Maximum nesting of objects and arrays.
+  static constexpr uint8_t MAX_DEPTH = 32;
+  /// Maximum length of the text of a token, longer ones are truncated.
+  static constexpr uint8_t MAX_TOKEN = 63;
+
+  /// Type of a token.
+  enum class token : uint8_t
+  {
+    begin_object,   ///< Start of an object.
+    end_object,     ///< End of an object.
+    begin_array,    ///< Start of an array.
+    end_array,      ///< End of an array.
+    key,            ///< Key of an object member.
+    string,         ///< String value.
+    number,         ///< Number value.
+    literal         ///< Literal value (true, false or null).
+  };
+
+  json_tokenizer() noexcept { reset(); }
+
+  virtual ~json_tokenizer() noexcept {}
+
+  /// Reset the tokenizer for the next document.
+  void reset() noexcept;
+
+  /*!
+   * @brief Parse the next piece of the document.
+   *
+   * @param data,size data of the document.
+   * @return @c false, if the document is malformed (further data are
+   *    ignored until reset()).
+   */
+  bool parse(const char* data, size_t size) noexcept;
+
+  /// Check whether a complete document was parsed.
+  bool complete() const noexcept { return state_ == state::done; }
+
+  /// Check whether the document is malformed.
+  bool failed() const noexcept { return state_ == state::failed; }
+
+protected:
+  /*!
+   * @brief Handle a token.
+   *
+   * @param type type of the token.
+   * @param text,size text of keys and values (unescaped and NUL-terminated),
+   *    empty for other tokens.
+   *
+   * The nesting level of the token (count of enclosing objects and arrays)
+   * is available via depth(). It is the same for the beginning and the end
+   * of an object or array.
+   */
+  virtual void handle_token(token type, const char* text, uint8_t size) noexcept = 0;
+
+  /// Get nesting level of the current token.
+  uint8_t depth() const noexcept { return depth_; }
+
+  /// Check whether the text of the current token was truncated.
+  bool truncated() const noexcept { return truncated_; }
+
+private:
+  /// Parser state.
+  enum class state : uint8_t
+  {
+    value,          ///< Expecting a value.
+    value_or_end,   ///< Expecting the first value of an array or its end.
+    key,            ///< Expecting a key.
+    key_or_end,     ///< Expecting the first key of an object or its end.
+    colon,          ///< Expecting colon after a key.
+    next,           ///< Expecting comma or end of the enclosing object or array.
+    string,         ///< Inside of a string.
+    escape,         ///< After backslash in a string.
+    unicode,        ///< Reading hex digits of a Unicode escape.
+    scalar,         ///< Inside of a number or literal.
+    done,           ///< Document complete.
+    failed          ///< Malformed document.
+  };
+
+  /// Process one character, return false if it has to be processed again.
+  bool process(char c) noexcept;
+
+  /// Start an object or array.
+  void begin(bool object) noexcept;
+
+  /// End an object or array.
+  void end(bool object) noexcept;
+
+  /// Report the current token and continue after the value.
+  void emit(token type) noexcept;
+
+  /// Finish a number or literal.
+  void end_scalar() noexcept;
+
+  /// Append a character to the text of the current token.
+  void append(char c) noexcept;
+
+  /// Check whether the innermost container is an object.
+  bool in_object() const noexcept { return depth_ && (objects_ >> (depth_ - 1)) & 1; }
+
+  /// Current state.
+  state state_;
+  /// Set if the current string is a key.
+  bool is_key_;
+  /// Set if the text of the current token was truncated.
+  bool truncated_;
+  /// Nesting level.
+  uint8_t depth_;
+  /// Length of the text of the current token.
+  uint8_t text_len_;
+  /// Count of hex digits of a Unicode escape read so far.
+  uint8_t hex_digits_;
+  /// Code point of a Unicode escape.
+  uint16_t code_point_;
+  /// Bit per nesting level, set for objects, clear for arrays.
+  uint32_t objects_;
+  /// Text of the current token.
+  char text_[MAX_TOKEN + 1];
+};
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "rate_limiter.hpp"
+
+bool rate_limiter::admit(priority prio, timestamp_t now) noexcept
+{
+  if (due_ - now < 0)
+    due_ = now;   // idle, no backlog
+  if (due_ - now > tolerance(prio))
+    return false;
+  due_ += 1000 / rate_;
+  return true;
+}
+
+rate_limiter::timestamp_t rate_limiter::delay(priority prio, timestamp_t now) const noexcept
+{
+  auto delta = due_ - now - tolerance(prio);
+  return delta < 0 ? 0 : delta;
+}
+
+void rate_limiter::response(timestamp_t latency, bool congested, timestamp_t now) noexcept
+{
+  if (congested || latency > TARGET_LATENCY) {
+    if (decreased_ && now - decrease_time_ < HOLD_TIME)
+      return;
+    decreased_ = true;
+    decrease_time_ = now;
+    ++decreases_;
+    rate_ = rate_ / 2 > MIN_RATE ? uint16_t(rate_ / 2) : MIN_RATE;
+  } else if (rate_ < MAX_RATE) {
+    ++rate_;
+  }
+}
+
+rate_limiter::timestamp_t rate_limiter::tolerance(priority prio) const noexcept
+{
+  timestamp_t interval = 1000 / rate_;
+  switch (prio) {
+    case priority::interactive:
+      return interval * (BURST - 1);
+    case priority::normal:
+      return interval * (BURST / 2 - 1);
+    default:
+      return 0;
+  }
+}
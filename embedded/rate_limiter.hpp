@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Adaptive rate limit of requests to a bridge with priority classes.
+ */
+#pragma once
+
+#include <cstdint>
+
+/*!
+ * @brief Adaptive rate limit of requests to a bridge with priority classes.
+ *
+ * The bridge throttles requests and responds slowly when overloaded, so
+ * requests are admitted at a rate adapted by additive increase and
+ * multiplicative decrease (AIMD): each fast response increases the rate
+ * by one request per second, a slow or throttled response halves it (at
+ * most once per HOLD_TIME, since pipelined responses report the same
+ * congestion).
+ *
+ * Admission uses the generic cell rate algorithm, i.e., a theoretical
+ * time of the next request advanced by the interval of each admitted one.
+ * Priority classes differ in the tolerated burst: interactive commands may
+ * use the whole burst, normal ones half of it and background ones are only
+ * admitted when no backlog is left. So while the rate limit is reached,
+ * interactive commands go ahead of lower-priority ones, also on other
+ * connections to the same bridge.
+ */
+class rate_limiter
+{
+public:
+#ifdef ARDUINO
+  using timestamp_t = int32_t;
+#else
+  using timestamp_t = int64_t;
+#endif
+
+  /// Priority class of a command.
+  enum class priority : uint8_t
+  {
+    interactive,    ///< Command the user waits for, e.g., a switch press.
+    normal,         ///< Ordinary command.
+    background      ///< Command nobody waits for, e.g., a contact state.
+  };
+
+  /// Minimum rate of 2 requests per second.
+  static constexpr uint16_t MIN_RATE = 2;
+  /// Maximum rate of 40 requests per second.
+  static constexpr uint16_t MAX_RATE = 40;
+  /// Burst of up to 8 requests tolerated for interactive commands.
+  static constexpr uint8_t BURST = 8;
+  /// Responses slower than 300 ms indicate an overloaded bridge.
+  static constexpr timestamp_t TARGET_LATENCY = 300;
+  /// Decrease the rate at most once per 500 ms.
+  static constexpr timestamp_t HOLD_TIME = 500;
+
+  /*!
+   * @brief Admit a request.
+   *
+   * @param prio priority of the request.
+   * @param now current timestamp.
+   * @return @c true, if the request may be sent now (and is accounted for).
+   */
+  bool admit(priority prio, timestamp_t now) noexcept;
+
+  /// Get milliseconds until a request of given priority would be admitted.
+  timestamp_t delay(priority prio, timestamp_t now) const noexcept;
+
+  /*!
+   * @brief Adapt the rate to a response.
+   *
+   * @param latency milliseconds from sending the request to the response.
+   * @param congested set if the bridge throttled or failed the request due
+   *    to overload or didn't respond at all.
+   * @param now current timestamp.
+   */
+  void response(timestamp_t latency, bool congested, timestamp_t now) noexcept;
+
+  /// Get current rate in requests per second.
+  uint16_t rate() const noexcept { return rate_; }
+
+  /// Get count of times the rate was decreased.
+  uint32_t decreases() const noexcept { return decreases_; }
+
+private:
+  /// Get tolerated backlog for a priority class in milliseconds.
+  timestamp_t tolerance(priority prio) const noexcept;
+
+  /// Current rate in requests per second.
+  uint16_t rate_ = MAX_RATE;
+  /// Set if a decrease happened already.
+  bool decreased_ = false;
+  /// Time of the last decrease.
+  timestamp_t decrease_time_ = 0;
+  /// Theoretical time when the next request is due.
+  timestamp_t due_ = 0;
+  /// Count of times the rate was decreased.
+  uint32_t decreases_ = 0;
+};
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Fixed-capacity ring queue.
+ */
+#pragma once
+
+#include <cstdint>
+
+/*!
+ * @brief Fixed-capacity ring queue.
+ *
+ * Elements are addressed relative to the front of the queue. Elements
+ * can be added and removed at both ends without moving other elements.
+ * The caller is responsible for checking capacity before adding and
+ * for checking emptiness before removing.
+ *
+ * @tparam T type of elements (trivially copyable).
+ * @tparam N capacity, must be a power of two and at most 128.
+ */
+template<typename T, uint8_t N>
+class ring_queue
+{
+  static_assert(N && (N & (N - 1)) == 0 && N <= 128, "Capacity must be a power of two up to 128");
+
+public:
+  /// Get count of elements.
+  uint8_t size() const noexcept { return size_; }
+
+  /// Check whether the queue is empty.
+  bool empty() const noexcept { return !size_; }
+
+  /// Check whether the queue is full.
+  bool full() const noexcept { return size_ == N; }
+
+  /// Get element at given index, counted from the front.
+  T& operator[](uint8_t index) noexcept { return elements_[(head_ + index) & (N - 1)]; }
+
+  /// Get element at given index, counted from the front.
+  const T& operator[](uint8_t index) const noexcept { return elements_[(head_ + index) & (N - 1)]; }
+
+  /// Get the first element.
+  T& front() noexcept { return (*this)[0]; }
+
+  /// Get the first element.
+  const T& front() const noexcept { return (*this)[0]; }
+
+  /// Get the last element.
+  T& back() noexcept { return (*this)[uint8_t(size_ - 1)]; }
+
+  /// Add an element at the end, return reference to it.
+  T& push_back() noexcept { return (*this)[size_++]; }
+
+  /// Add an element at the front, return reference to it.
+  T& push_front() noexcept
+  {
+    head_ = uint8_t((head_ - 1) & (N - 1));
+    ++size_;
+    return front();
+  }
+
+  /// Remove the first element.
+  void pop_front() noexcept
+  {
+    head_ = uint8_t((head_ + 1) & (N - 1));
+    --size_;
+  }
+
+  /// Remove the last element.
+  void pop_back() noexcept { --size_; }
+
+  /// Insert an element at given index, moving following elements, return reference to it.
+  T& insert(uint8_t index) noexcept
+  {
+    for (uint8_t i = size_++; i > index; --i)
+      (*this)[i] = (*this)[uint8_t(i - 1)];
+    return (*this)[index];
+  }
+
+  /// Remove element at given index, moving following elements.
+  void erase(uint8_t index) noexcept
+  {
+    for (++index; index < size_; ++index)
+      (*this)[uint8_t(index - 1)] = (*this)[index];
+    --size_;
+  }
+
+  /// Remove all elements.
+  void clear() noexcept { head_ = size_ = 0; }
+
+private:
+  /// Index of the first element.
+  uint8_t head_ = 0;
+  /// Count of elements.
+  uint8_t size_ = 0;
+  /// Elements.
+  T elements_[N];
+};
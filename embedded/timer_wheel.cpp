@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "timer_wheel.hpp"
+
+timer_wheel::timer::~timer() noexcept
+{
+  if (wheel_)
+    wheel_->cancel(*this);
+}
+
+timer_wheel::~timer_wheel() noexcept
+{
+  for (auto& level : slots_) {
+    for (auto t : level) {
+      for (; t; t = t->next_)
+        t->wheel_ = nullptr;
+    }
+  }
+}
+
+void timer_wheel::schedule(timer& t, timestamp_t when) noexcept
+{
+  if (t.wheel_)
+    t.wheel_->cancel(t);
+  // the current tick is already processed
+  if (when - now_ <= 0)
+    when = now_ + 1;
+  t.when_ = when;
+  t.wheel_ = this;
+  ++size_;
+  insert(t);
+}
+
+void timer_wheel::cancel(timer& t) noexcept
+{
+  if (t.wheel_ != this)
+    return;
+  unlink(t);
+  t.wheel_ = nullptr;
+  --size_;
+}
+
+void timer_wheel::insert(timer& t) noexcept
+{
+  // slot times are compared as differences of shifted times masked to
+  // their width, so wrapping timestamps work, too
+  auto when = utime_t(t.when_);
+  auto now = utime_t(now_);
+  uint8_t level = 0;
+  uint8_t shift = 0;
+  for (;;) {
+    auto diff = ((when >> shift) - (now >> shift)) & (utime_t(-1) >> shift);
+    if (diff < SLOTS)
+      break;
+    if (level == LEVELS - 1) {
+      // too far ahead, move on from the last slot of the highest level
+      when = ((now >> shift) + SLOTS - 1) << shift;
+      break;
+    }
+    ++level;
+    shift = uint8_t(shift + SLOT_BITS);
+  }
+  auto slot = uint8_t((when >> shift) & (SLOTS - 1));
+  auto& head = slots_[level][slot];
+  t.level_ = level;
+  t.slot_ = slot;
+  t.prev_ = nullptr;
+  t.next_ = head;
+  if (head)
+    head->prev_ = &t;
+  head = &t;
+  occupied_[level] |= uint64_t(1) << slot;
+}
+
+void timer_wheel::unlink(timer& t) noexcept
+{
+  auto& head = slots_[t.level_][t.slot_];
+  if (t.prev_)
+    t.prev_->next_ = t.next_;
+  else
+    head = t.next_;
+  if (t.next_)
+    t.next_->prev_ = t.prev_;
+  if (!head)
+    occupied_[t.level_] &= ~(uint64_t(1) << t.slot_);
+  t.next_ = t.prev_ = nullptr;
+}
+
+timer_wheel::timestamp_t timer_wheel::next_event() const noexcept
+{
+  auto now = utime_t(now_);
+  bool found = false;
+  utime_t best = 0;
+  for (uint8_t level = 0; level < LEVELS; ++level) {
+    auto bits = occupied_[level];
+    if (!bits)
+      continue;
+    // first occupied slot after the current one
+    auto shift = uint8_t(level * SLOT_BITS);
+    auto current = uint8_t((now >> shift) & (SLOTS - 1));
+    if (current)
+      bits = (bits >> current) | (bits << (SLOTS - current));
+    auto distance = utime_t(__builtin_ctzll(bits));
+    auto delta = (((now >> shift) + distance) << shift) - now;
+    if (!found || delta < best)
+      best = delta;
+    found = true;
+  }
+  return timestamp_t(now + best);
+}
+
+void timer_wheel::advance(timestamp_t now)
+{
+  while (size_) {
+    auto next = next_event();
+    if (next - now > 0)
+      break;
+    now_ = next;
+    auto time = utime_t(next);
+    // move timers of slots of higher levels starting now to lower levels,
+    // from the highest one, so they don't end up in slots processed already
+    for (uint8_t level = LEVELS - 1; level > 0; --level) {
+      auto shift = uint8_t(level * SLOT_BITS);
+      if (time & ((utime_t(1) << shift) - 1))
+        continue;
+      auto slot = uint8_t((time >> shift) & (SLOTS - 1));
+      while (auto t = slots_[level][slot]) {
+        unlink(*t);
+        insert(*t);
+      }
+    }
+    // expire timers of the current tick, which may schedule timers for later ticks
+    auto slot = uint8_t(time & (SLOTS - 1));
+    while (auto t = slots_[0][slot]) {
+      unlink(*t);
+      t->wheel_ = nullptr;
+      --size_;
+      t->expired(next);
+    }
+  }
+  if (now - now_ > 0)
+    now_ = now;
+}
+
+timer_wheel::timestamp_t timer_wheel::next_timeout(timestamp_t now, timestamp_t max) const noexcept
+{
+  if (!size_)
+    return max;
+  auto delta = next_event() - now;
+  if (delta < 0)
+    return 0;
+  return delta < max ? delta : max;
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Hierarchical timer wheel.
+ */
+#pragma once
+
+#include <cstdint>
+
+/*!
+ * @brief Hierarchical timer wheel.
+ *
+ * Timers are kept in LEVELS wheels of SLOTS slots each. A slot of level 0
+ * covers one millisecond, a slot of each further level covers a whole
+ * turn of the level below. A timer is put to the lowest level which
+ * reaches its expiration time and moved to lower levels when time reaches
+ * its slot. Scheduling and canceling a timer takes constant time and the
+ * time until the next timer expires is found via bitmaps of occupied
+ * slots, without visiting timers.
+ *
+ * Timers are intrusive, so the wheel doesn't allocate memory. A timer
+ * can be scheduled only in one wheel at a time and is canceled when
+ * destroyed. Expiration times past the highest level are capped, such
+ * timers are rescheduled when time reaches the last slot.
+ */
+class timer_wheel
+{
+public:
+#ifdef ARDUINO
+  using timestamp_t = int32_t;
+#else
+  using timestamp_t = int64_t;
+#endif
+
+  /// Count of levels.
+  static constexpr uint8_t LEVELS = 4;
+  /// Bits of the slot index in one level.
+  static constexpr uint8_t SLOT_BITS = 6;
+  /// Count of slots in one level.
+  static constexpr uint8_t SLOTS = 1 << SLOT_BITS;
+
+  /// Timer to schedule in the wheel.
+  class timer
+  {
+  public:
+    timer() noexcept = default;
+
+    virtual ~timer() noexcept;
+
+    timer(const timer&) = delete;
+    timer& operator=(const timer&) = delete;
+
+    /// Check whether the timer is scheduled.
+    bool scheduled() const noexcept { return wheel_ != nullptr; }
+
+    /// Get expiration time of a scheduled timer.
+    timestamp_t when() const noexcept { return when_; }
+
+  protected:
+    /*!
+     * @brief Handle expiration of the timer.
+     *
+     * The timer is not scheduled anymore and can be scheduled again.
+     *
+     * @param now current time.
+     */
+    virtual void expired(timestamp_t now) = 0;
+
+  private:
+    friend class timer_wheel;
+
+    /// Wheel the timer is scheduled in, if any.
+    timer_wheel* wheel_ = nullptr;
+    /// Next timer in the slot.
+    timer* next_ = nullptr;
+    /// Previous timer in the slot.
+    timer* prev_ = nullptr;
+    /// Expiration time.
+    timestamp_t when_ = 0;
+    /// Level of the slot.
+    uint8_t level_ = 0;
+    /// Index of the slot.
+    uint8_t slot_ = 0;
+  };
+
+  /// Construct empty wheel starting at given time.
+  explicit timer_wheel(timestamp_t now = 0) noexcept : now_(now) {}
+
+  /// Destroy the wheel, timers still scheduled are unscheduled.
+  ~timer_wheel() noexcept;
+
+  timer_wheel(const timer_wheel&) = delete;
+  timer_wheel& operator=(const timer_wheel&) = delete;
+
+  /*!
+   * @brief Schedule a timer, rescheduling it if already scheduled.
+   *
+   * @param t timer to schedule.
+   * @param when expiration time (a time in the past expires on the next advance()).
+   */
+  void schedule(timer& t, timestamp_t when) noexcept;
+
+  /// Cancel a timer, if scheduled.
+  void cancel(timer& t) noexcept;
+
+  /*!
+   * @brief Advance time and expire timers due.
+   *
+   * Expired timers may schedule timers again.
+   *
+   * @param now current time.
+   */
+  void advance(timestamp_t now);
+
+  /*!
+   * @brief Get milliseconds until advance() needs to be called.
+   *
+   * This is the time until the next timer expires or moves to a lower level.
+   *
+   * @param now current time.
+   * @param max time to return if no timer is scheduled.
+   */
+  timestamp_t next_timeout(timestamp_t now, timestamp_t max) const noexcept;
+
+  /// Get count of scheduled timers.
+  uint16_t size() const noexcept { return size_; }
+
+private:
+#ifdef ARDUINO
+  using utime_t = uint32_t;
+#else
+  using utime_t = uint64_t;
+#endif
+
+  /// Put a timer to the slot for its expiration time.
+  void insert(timer& t) noexcept;
+
+  /// Remove a timer from its slot.
+  void unlink(timer& t) noexcept;
+
+  /// Get time when something needs to be done (only if any timer is scheduled).
+  timestamp_t next_event() const noexcept;
+
+  /// Slots with lists of timers.
+  timer* slots_[LEVELS][SLOTS] = {};
+  /// Bitmaps of occupied slots.
+  uint64_t occupied_[LEVELS] = {};
+  /// Current time of the wheel.
+  timestamp_t now_;
+  /// Count of scheduled timers.
+  uint16_t size_ = 0;
+};
@@ -12,12 +12,29 @@ IPAddress syslog_host(192, 168, 1, 127);
 /// Syslog server port. Set to 0 to not use syslog facility.
 uint16_t syslog_port = 514;
 
+// Direct connection to the Hue bridge (standalone modus)
+
+/// IP address of the Hue bridge.
+IPAddress bridge_ip(192, 168, 1, 128);
+
+/// API key assigned by the bridge.
+const char* bridge_api_key = "MY_API_KEY";
+
+/// ID of the sensor to post to. Set to 0 to only send telegrams to masters.
+int bridge_sensor_id = 0;
+
+/// Also send telegrams to masters when posting directly (e.g., for logging).
+bool mirror_to_masters = false;
+
 // Indirect connection via server (repeater modus)
 
-/// IP address of the master server.
-IPAddress master(192, 168, 1, 129);
+/// IP addresses of the master servers (telegrams are sent to each of them).
+IPAddress masters[] = {
+  IPAddress(192, 168, 1, 129),
+  IPAddress(192, 168, 1, 130)
+};
 
-/// Port of the master server.
+/// Port of the master servers.
 uint16_t master_port = 22554;
 
 /// Password for OTA updates.
@@ -18,15 +18,22 @@
  */
 
 #include "enocean_to_hue_bridge.hpp"
+#include "syslog_posix.hpp"
+#include "alloc_check.hpp"
 
 // Define to prevent answering proxy calls and handle only local data.
 //#define NO_PROXY
 
 #include <system_error>
+#include <map>
+#include <string>
+#include <ctime>
+#include <cstdio>
+#include <cstring>
 #include <poll.h>
-#include <syslog.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <ifaddrs.h>
 
 enocean_to_hue_bridge::enocean_to_hue_bridge(
     const char* port,
@@ -36,6 +43,148 @@ enocean_to_hue_bridge::enocean_to_hue_bridge(
   hnd_(port, *this)
 {
   map_.load(map_file);
+  if (!map_.state_file().empty()) {
+    if (state_.attach(map_.state_file().c_str()))
+      syslog_printf(LOG_INFO, "EnOcean re-attached to state file '%s'", map_.state_file().c_str());
+  }
+  auto reset = map_.attach(state_.last_values());
+  if (reset && !map_.state_file().empty())
+    syslog_printf(LOG_INFO, "EnOcean reset %u last values not matching the mapping", reset);
+  state_.filter().set_window(map_.duplicate_window());
+  core_.set_filter(&state_.filter());
+  wheel_.advance(bridges_[0].timestamp());
+  // direct actions on the same resource use the same connection to keep
+  // their order, different resources are spread over connections
+  std::map<std::string, uint16_t> resources;
+  for (auto& a : map_.actions()) {
+    auto res = resources.emplace(a.first, uint16_t(resources.size()));
+    action_resources_.push_back(res.first->second);
+  }
+  for (uint8_t index = 0; index < bridges_.size(); ++index) {
+    auto& b = bridges_[index];
+    if (*b.bridge_id()) {
+      // address resolved by an earlier process, if any
+      if (!resolver_.enabled()) {
+        resolver_.open(map_.mdns().first, map_.mdns().second);
+        resolver_.set_timer_wheel(&wheel_);
+      }
+      resolver_.add_bridge(index, b.bridge_id());
+      auto ip = state_.bridge_address(index, b.bridge_id());
+      if (ip) {
+        b.readdress(ip);
+        auto ip_addr = reinterpret_cast<const unsigned char*>(&ip);
+        syslog_printf(LOG_INFO, "EnOcean bridge %s: using address %u.%u.%u.%u resolved before",
+            b.bridge_id(), ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3]);
+      } else {
+        resolver_.resolve(index, b.timestamp());
+      }
+    }
+    connection_count_[index] = map_.connections(index);
+    connections_[index][0] = &b;
+    for (uint8_t i = 1; i < connection_count_[index]; ++i) {
+      extra_connections_.emplace_back(b.ip(), b.api_key(), b.sensor_id());
+      extra_connections_.back().copy_settings(b);
+      connections_[index][i] = &extra_connections_.back();
+    }
+    for (uint8_t i = 0; i < connection_count_[index]; ++i) {
+      auto c = connections_[index][i];
+      all_connections_[all_connection_count_++] = c;
+      if (map_.deadline(index))
+        c->set_deadline(map_.deadline(index));
+      c->set_rate_limiter(&limiters_[index]);
+      c->set_actions(map_.actions());
+      c->set_timer_wheel(&wheel_);
+      c->set_event_loop(&loop_);
+      if (*b.bridge_id())
+        c->set_reachability_timer(&address_check_);
+      c->prewarm();
+    }
+    // each sensor gets its own connection and queue, so values posted to
+    // different sensors don't wait for each other
+    auto& sensors = map_.sensors(index);
+    sensor_count_[index] = uint8_t(sensors.size() + 1);
+    sensor_connections_[index][0] = &b;
+    for (uint8_t i = 1; i < sensor_count_[index]; ++i) {
+      extra_connections_.emplace_back(b.ip(), b.api_key(), sensors[i - 1]);
+      auto c = &extra_connections_.back();
+      c->copy_settings(b);
+      if (map_.deadline(index))
+        c->set_deadline(map_.deadline(index));
+      c->set_rate_limiter(&limiters_[index]);
+      c->set_timer_wheel(&wheel_);
+      c->set_event_loop(&loop_);
+      if (*b.bridge_id())
+        c->set_reachability_timer(&address_check_);
+      c->prewarm();
+      sensor_connections_[index][i] = c;
+      all_connections_[all_connection_count_++] = c;
+    }
+  }
+  auto& contacts = map_.contact_sensors();
+  action_contacts_.resize(map_.actions().size(), -1);
+  contact_bridges_.resize(contacts.size(), 0);
+  for (uint16_t i = 0; i < contacts.size(); ++i) {
+    action_contacts_[contacts[i].open_action] = int16_t(i);
+    action_contacts_[contacts[i].closed_action] = int16_t(i);
+  }
+  if (!map_.config_cache().empty() || !contacts.empty()) {
+    // fetched in the background, so EnOcean events are handled meanwhile
+    for (uint8_t index = 0; index < bridges_.size(); ++index) {
+      configs_.emplace_back(bridges_[index], map_.config_cache(), *this, index);
+      for (uint16_t i = 0; i < contacts.size(); ++i) {
+        if (contacts[i].bridge_set & (1U << index))
+          configs_.back().add_contact(i, contacts[i]);
+      }
+    }
+    for (auto& c : configs_) {
+      c.connection().set_event_loop(&loop_);
+      c.set_timer_wheel(&wheel_);
+      c.start();
+    }
+  }
+  auto& frames = map_.frames();
+  for (uint8_t index = 0; index < bridges_.size(); ++index) {
+    // the stream takes over lights of the area, so only stream if frames need it
+    uint16_t i = 0;
+    while (i < frames.size() && !(map_.frame_bridges(i) & (1U << index)))
+      ++i;
+    if (i == frames.size())
+      continue;
+    if (!hue_entertainment::supported())
+      throw std::runtime_error("Streaming to entertainment areas requires DTLS support (OpenSSL)");
+    streams_.emplace_back(bridges_[index], map_.entertainment(index));
+    auto& s = streams_.back();
+    for (; i < frames.size(); ++i) {
+      if (map_.frame_bridges(i) & (1U << index)) {
+        for (auto& c : frames[i])
+          s.add_light(c.light);
+      }
+    }
+    bridge_streams_[index] = &s;
+    s.set_event_loop(&loop_);
+    s.set_timer_wheel(&wheel_);
+    s.start();
+  }
+  auto& state_actions = map_.state_actions();
+  for (uint8_t index = 0; index < bridges_.size(); ++index) {
+    // only keep the event stream open if actions depend on the state
+    light_state_cache* cache = nullptr;
+    for (uint16_t i = 0; i < state_actions.size(); ++i) {
+      if (!(map_.state_action_bridges(i) & (1U << index)))
+        continue;
+      if (!cache) {
+        state_caches_.emplace_back(bridges_[index]);
+        cache = &state_caches_.back();
+      }
+      cache->track(state_actions[i].group, state_actions[i].target);
+    }
+    if (cache) {
+      bridge_state_caches_[index] = cache;
+      cache->set_event_loop(&loop_);
+      cache->set_timer_wheel(&wheel_);
+      cache->start();
+    }
+  }
 #ifndef NO_PROXY
   proxy_server_fd_ = socket(AF_INET, SOCK_DGRAM, 0);
   if (proxy_server_fd_ < 0)
@@ -63,7 +212,7 @@ enocean_to_hue_bridge::enocean_to_hue_bridge(
   memset(&servaddr, 0, sizeof(servaddr));
   servaddr.sin_family    = AF_INET; // IPv4
   servaddr.sin_addr.s_addr = INADDR_ANY;
-  servaddr.sin_port = htons(22554);
+  servaddr.sin_port = htons(map_.listen_port());
   if (bind(proxy_server_fd_, reinterpret_cast<const struct sockaddr*>(&servaddr), sizeof(servaddr)) < 0)
   {
     auto err = errno;
@@ -71,71 +220,225 @@ enocean_to_hue_bridge::enocean_to_hue_bridge(
     proxy_server_fd_ = -1;
     throw std::system_error(err, std::generic_category(), "Cannot bind proxy socket");
   }
+  setup_cluster();
 #endif
+  // these descriptors don't change, so they are registered once
+  serial_poller_.set_loop(&loop_);
+  serial_poller_.watch(hnd_.get_fd(), POLLIN);
+  proxy_poller_.set_loop(&loop_);
+  proxy_poller_.watch(proxy_server_fd_, POLLIN);
+  resolver_poller_.set_loop(&loop_);
+  resolver_poller_.watch(resolver_.get_fd(), POLLIN);
+}
+
+void enocean_to_hue_bridge::setup_cluster()
+{
+  auto& masters = map_.cluster();
+  if (masters.size() < 2)
+    return;
+
+  // find ourselves in the list of masters by listen port and local address
+  struct ifaddrs* ifaddr;
+  if (getifaddrs(&ifaddr) < 0)
+    throw std::system_error(errno, std::generic_category(), "Cannot get local addresses");
+  uint32_t addrs[master_cluster::MAX_MASTERS];
+  uint16_t ports[master_cluster::MAX_MASTERS];
+  int self = -1;
+  for (size_t i = 0; i < masters.size(); ++i) {
+    addrs[i] = masters[i].first;
+    ports[i] = htons(masters[i].second);
+    if (masters[i].second != map_.listen_port())
+      continue;
+    bool local = (ntohl(addrs[i]) >> 24) == 127;
+    for (auto ifa = ifaddr; ifa && !local; ifa = ifa->ifa_next) {
+      if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET &&
+          reinterpret_cast<const sockaddr_in*>(ifa->ifa_addr)->sin_addr.s_addr == addrs[i])
+        local = true;
+    }
+    if (local) {
+      if (self >= 0) {
+        freeifaddrs(ifaddr);
+        throw std::runtime_error("This master found more than once in the cluster");
+      }
+      self = int(i);
+    }
+  }
+  freeifaddrs(ifaddr);
+  if (self < 0)
+    throw std::runtime_error("This master not found in the cluster");
+
+  cluster_.configure(proxy_server_fd_, addrs, ports, uint8_t(masters.size()),
+      uint8_t(self), map_.duplicate_window(), bridges_[0].timestamp());
+  syslog_printf(LOG_INFO, "EnOcean cluster of %u masters, this is master %d",
+      unsigned(masters.size()), self + 1);
 }
 
 void enocean_to_hue_bridge::run_poll_loop()
 {
   time_t starttime;
   time(&starttime);
-  syslog(LOG_INFO, "EnOcean child process start time %ld", starttime);
+  syslog_printf(LOG_INFO, "EnOcean child process start time %ld", starttime);
+  auto restart_time = bridges_[0].timestamp() + 3600 * 1000;
   for (;;)
   {
-    struct pollfd fds[11];
-    nfds_t cnt = 1;
-    fds[0].fd = hnd_.get_fd();
-    fds[0].events = POLLERR | POLLIN;
-    fds[0].revents = 0;
-#ifndef NO_PROXY
-    fds[1].fd = proxy_server_fd_;
-    fds[1].events = POLLERR | POLLIN;
-    fds[1].revents = 0;
-    ++cnt;
-#endif
-    for (auto& b : bridges_) {
-      fds[cnt].fd = b.get_fd();
-      if (fds[cnt].fd >= 0) {
-        fds[cnt].events = b.get_events() | POLLERR;
-        fds[cnt].revents = 0;
-        ++cnt;
-      }
-    }
-    auto res = poll(fds, cnt, 600000);  // wake up at least every 5min
-    if (res < 0) {
-      if (errno == EINTR || errno == EAGAIN)
-        continue; // interrupted by signal or out of resources, retry
-      throw std::system_error(
-          std::error_code(errno, std::generic_category()),
-          "Error polling file descriptors");
+    // wake up at least every 10min or when the cluster or bridges need it
+    auto now = bridges_[0].timestamp();
+    auto timeout = wheel_.next_timeout(now, cluster_.next_timeout(now));
+    auto ready = loop_.wait(now + timeout);
+    {
+      // steady state must not allocate, checked if built with ALLOC_CHECK
+      alloc_check_scope check("event processing");
+      loop_.dispatch();
+      now = bridges_[0].timestamp();
+      cluster_.poll(now);
+      wheel_.advance(now);
     }
-    if (fds[0].revents)
-      hnd_.poll();
-    cnt = 1;
-#ifndef NO_PROXY
-    if (fds[1].revents)
-      proxy_poll();
-    ++cnt;
-#endif
-    for (auto& b : bridges_) {
-      if (fds[cnt].revents)
-        b.poll();
-      ++cnt;
-    }
-    time_t curtime;
-    time(&curtime);
-    if (curtime - starttime >= 3600 && res == 0)
+    if (now - restart_time >= 0 && ready == 0)
     {
-      syslog(LOG_INFO, "EnOcean child process auto-restart at %ld", curtime);
+      time_t curtime;
+      time(&curtime);
+      syslog_printf(LOG_INFO, "EnOcean child process auto-restart at %ld", curtime);
+      log_statistics();
       _exit(0);
     }
   }
 }
 
+void enocean_to_hue_bridge::resolver::resolved(uint8_t index, uint32_t ip)
+{
+  parent_.readdress(index, ip);
+}
+
+void enocean_to_hue_bridge::check_addresses(int64_t now)
+{
+  bool any = false;
+  int64_t next = 0;
+  for (uint8_t index = 0; index < bridges_.size(); ++index) {
+    if (!*bridges_[index].bridge_id())
+      continue;
+    // repeated connection failures opened the circuit breaker, maybe the address changed
+    bool unreachable = false;
+    for (uint8_t i = 0; i < connection_count_[index]; ++i)
+      unreachable |= connections_[index][i]->unreachable();
+    for (uint8_t i = 1; i < sensor_count_[index]; ++i)
+      unreachable |= sensor_connections_[index][i]->unreachable();
+    if (unreachable) {
+      resolver_.resolve(index, now);
+      auto t = resolver_.next_resolve(index);
+      if (!any || t - next < 0)
+        next = t;
+      any = true;
+    }
+  }
+  if (any)
+    wheel_.schedule(address_check_, next);  // resolve again while unreachable
+}
+
+void enocean_to_hue_bridge::readdress(uint8_t index, uint32_t ip)
+{
+  auto& b = bridges_[index];
+  if (ip == b.ip())
+    return;
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&ip);
+  syslog_printf(LOG_WARNING, "EnOcean bridge %s: switching to address %u.%u.%u.%u",
+      b.bridge_id(), ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3]);
+  for (uint8_t i = 0; i < connection_count_[index]; ++i)
+    connections_[index][i]->readdress(ip);
+  for (uint8_t i = 1; i < sensor_count_[index]; ++i)
+    sensor_connections_[index][i]->readdress(ip);
+  if (index < configs_.size())
+    configs_[index].connection().readdress(ip);
+  if (bridge_streams_[index])
+    bridge_streams_[index]->readdress(ip);
+  if (bridge_state_caches_[index])
+    bridge_state_caches_[index]->readdress(ip);
+  state_.set_bridge_address(index, b.bridge_id(), ip);
+}
+
+void enocean_to_hue_bridge::config::updated()
+{
+  parent_.check_config(index_, *this);
+}
+
+void enocean_to_hue_bridge::config::sensor_ready(uint16_t index, uint16_t id)
+{
+  parent_.bind_contact(index_, contacts_[index], id);
+}
+
+void enocean_to_hue_bridge::bind_contact(uint8_t index, uint16_t contact, uint16_t id)
+{
+  auto& sensor = map_.contact_sensors()[contact];
+  char resource[32];
+  snprintf(resource, sizeof(resource), "sensors/%u/state", id);
+  for (uint8_t i = 0; i < connection_count_[index]; ++i) {
+    // placeholder resource naming the unique ID is always longer
+    connections_[index][i]->bind_action(sensor.open_action, resource);
+    connections_[index][i]->bind_action(sensor.closed_action, resource);
+  }
+  contact_bridges_[contact] |= uint8_t(1U << index);
+  auto ip = bridges_[index].ip();
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&ip);
+  syslog_printf(LOG_INFO, "EnOcean bridge %u.%u.%u.%u: contact %08x uses sensor %u",
+      ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], sensor.sender.raw(), id);
+}
+
+void enocean_to_hue_bridge::check_config(uint8_t index, bridge_config& config)
+{
+  auto ip = bridges_[index].ip();
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&ip);
+  bool missing = false;
+  for (uint8_t i = 0; i < sensor_count_[index]; ++i) {
+    auto sensor_id = sensor_connections_[index][i]->sensor_id();
+    auto sensor = config.find_sensor(uint16_t(sensor_id));
+    if (!sensor) {
+      missing = true;
+      if (config.fresh())
+        syslog_printf(LOG_WARNING, "EnOcean bridge %u.%u.%u.%u: sensor %d not found",
+            ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], sensor_id);
+    } else if (strcmp(sensor->type, "CLIPGenericStatus") != 0) {
+      syslog_printf(LOG_WARNING, "EnOcean bridge %u.%u.%u.%u: sensor %d has type %s, expected CLIPGenericStatus",
+          ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], sensor_id, sensor->type);
+    }
+  }
+  auto& actions = map_.actions();
+  for (uint16_t i = 0; i < actions.size(); ++i) {
+    if (!(map_.action_bridges(i) & (1U << index)))
+      continue;
+    auto resource = actions[i].first.c_str();
+    auto body = actions[i].second.c_str();
+    unsigned id;
+    char scene[24];
+    bool found = true;
+    if (sscanf(resource, "lights/%u/", &id) == 1)
+      found = config.has_light(uint16_t(id));
+    else if (sscanf(resource, "groups/%u/", &id) == 1)
+      found = config.has_group(uint16_t(id));
+    if (found && sscanf(body, "{\"scene\":\"%23[^\"]\"", scene) == 1)
+      found = config.find_scene(scene) != nullptr;
+    if (!found) {
+      missing = true;
+      if (config.fresh())
+        syslog_printf(LOG_WARNING, "EnOcean bridge %u.%u.%u.%u: target of direct action %u not found: /%s %s",
+            ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], i, resource, body);
+    }
+  }
+  // the cached configuration may be outdated, check the current one
+  if (missing && !config.fresh())
+    config.refresh();
+}
+
 void enocean_to_hue_bridge::handler::handle_event(const enocean_event& event)
 {
+  parent_.cluster_.forward(event);
   parent_.handle_event(event);
 }
 
+void enocean_to_hue_bridge::cluster::post(uint32_t sender, int32_t value, uint8_t bridge_set,
+    rate_limiter::priority priority)
+{
+  parent_.post(sender, value, bridge_set, priority);
+}
+
 static void hexdump(char* dest, size_t dest_rem, const void* ptr, size_t size) noexcept
 {
   if (!size || dest_rem < 4) {
@@ -157,80 +460,167 @@ static void hexdump(char* dest, size_t dest_rem, const void* ptr, size_t size) n
 
 void enocean_to_hue_bridge::handle_event(const enocean_event& event, uint32_t remote_ip)
 {
-  uint32_t addr = 0;
-  int8_t button = 0;
-  switch (event.erp1.event_type) {
-    case enocean_erp1_type::CONTACT:
-      addr = event.erp1.contact_event.sender.raw();
-      button = event.erp1.contact_event.is_closed() ? 1 : 0;
-      break;
-    case enocean_erp1_type::SWITCH:
-      addr = event.erp1.switch_event.sender.raw();
-      button = event.erp1.switch_event.button_id();
-      break;
-  }
+  core_.handle_event(event, remote_ip, bridges_[0].timestamp());
+}
+
+void enocean_to_hue_bridge::core::map(const enocean_event& event, command& cmd)
+{
+  auto mapping = parent_.map_.map(event);
+  cmd.value = mapping.value;
+  cmd.bridge_set = mapping.bridge_set;
+  cmd.priority = mapping.priority;
+}
 
-  auto mapping = map_.map(event);
-  auto id = mapping.first;
-  auto bridge_set = mapping.second;
+void enocean_to_hue_bridge::core::prewarm(const command& cmd)
+{
+  parent_.prewarm(cmd.sender, cmd.bridge_set);
+}
 
+void enocean_to_hue_bridge::core::received(const enocean_event& event, const command& cmd) noexcept
+{
   char data[128];
   hexdump(data, sizeof(data), &event.buffer, event.hdr.total_size());
 
-  ++total_event_count_;
-  auto ip_addr = reinterpret_cast<const unsigned char*>(&remote_ip);
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&cmd.receiver_ip);
   auto dbm = event.erp1.contact_event.subtel[0].dbm;
-  auto ts = bridges_[0].timestamp();
-  syslog(LOG_INFO,
+  syslog_printf(LOG_INFO,
       "EnOcean event, addr %x, button %d => ID %d@%x, RSSI -%u, index %lu, ts %lld, source %u.%u.%u.%u, data %s",
-      addr, button, id, bridge_set, dbm, total_event_count_,
-      ts, ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], data);
-
-  //printf("\aGot event %d, type=%d: %s", ++count, int(event.hdr.packet_type), data);
-  bool do_send = false;
-  if (id) {
-#ifdef NO_PROXY
-    syslog(LOG_INFO, "EnOcean post command: %d, bridge set %x", value, bridge_set);
-    do_send = true;
-#else
-    // The same command can be received by multiple receivers. So we are posting only
-    // in case enough time has passed since the occurrence of the same command.
-    // Typically, all commands arrive within a millisecond or so, so let's test for
-    // 200 ms time difference to out filter duplicates. This gives us 5 commands/second
-    // from the same switch. Nobody is going to press the switch that fast :-).
-    auto res = command_states_.emplace(addr, std::make_pair(ts, id));
-    int64_t last_ts = 0;
-    int32_t last_id = -1;
-    if (res.second) {
-      // new entry
-      do_send = true;
-    } else {
-      // check ID or time difference
-      auto& data = res.first->second;
-      last_id = data.second;
-      last_ts = data.first;
-      if (uint64_t(ts - last_ts) >= 200 || last_id != id) {
-        do_send = true;
+      cmd.sender, cmd.button, cmd.value, cmd.bridge_set, dbm, (unsigned long)cmd.index,
+      (long long)cmd.timestamp, ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], data);
+}
+
+void enocean_to_hue_bridge::core::suppressed(const command& cmd) noexcept
+{
+  auto& filter = parent_.state_.filter();
+  syslog_printf(LOG_INFO,
+      "EnOcean suppressed duplicate: %d, repeater count %u, receiver %u, suppressed %u/%u",
+      cmd.value, cmd.repeater_count, cmd.receiver, filter.stats(cmd.receiver).suppressed,
+      filter.stats(cmd.receiver).received);
+}
+
+bool enocean_to_hue_bridge::core::accept(const command& cmd)
+{
+  // handled by another master, if it isn't this one's turn
+  return parent_.cluster_.command(cmd.sender, cmd.value, cmd.bridge_set, cmd.priority, cmd.timestamp);
+}
+
+void enocean_to_hue_bridge::core::post(const command& cmd)
+{
+  syslog_printf(LOG_INFO,
+      "EnOcean post command: %d, bridge set %x, priority %u, ts %lld, repeater count %u, receiver %u",
+      cmd.value, cmd.bridge_set, unsigned(cmd.priority), (long long)cmd.timestamp, cmd.repeater_count,
+      cmd.receiver);
+  parent_.post(cmd.sender, cmd.value, cmd.bridge_set, cmd.priority);
+}
+
+void enocean_to_hue_bridge::post(uint32_t sender, int32_t id, uint8_t bridge_set,
+    rate_limiter::priority priority)
+{
+  uint32_t set = bridge_set;
+  while (set) {
+    auto index = __builtin_ctz(set);
+    set &= set - 1;
+    if (index >= int(bridges_.size()))
+      continue;
+    if (command_mapping::is_frame(id)) {
+      // colors go directly to the lights via the entertainment stream
+      auto& frame = map_.frames()[command_mapping::frame_index(id)];
+      if (!bridge_streams_[index]->show(frame.data(), frame.size()))
+        syslog_printf(LOG_WARNING, "EnOcean entertainment stream to bridge %d not established, dropping frame",
+            index + 1);
+    } else if (command_mapping::is_direct(id)) {
+      // spread actions over connections other than the one of the first sensor
+      int action = command_mapping::action_index(id);
+      if (command_mapping::is_state_action(id)) {
+        // resolve to a direct action by the cached state of the target
+        auto& state_action = map_.state_actions()[command_mapping::state_action_index(id)];
+        action = bridge_state_caches_[index]->apply(state_action);
+        if (action < 0)
+          continue;
       }
-      data.second = id;
-      data.first = ts;
-    }
-#endif
-    if (do_send) {
-      syslog(LOG_INFO,
-          "EnOcean post command: %d (last %d), bridge set %x, ts %lld (last %lld, diff %lld)",
-          id, last_id, bridge_set, ts, last_ts, ts - last_ts);
-
-      uint32_t bit = 1;
-      for (auto& b : bridges_) {
-        if (bridge_set & bit)
-          b.post(id);
-        bit <<= 1;
+      auto contact = action_contacts_[action];
+      if (contact >= 0 && !(contact_bridges_[contact] & (1U << index))) {
+        syslog_printf(LOG_WARNING, "EnOcean sensor of contact %08x not provisioned on bridge %d yet, dropping command",
+            map_.contact_sensors()[contact].sender.raw(), index + 1);
+        continue;
       }
+      auto count = connection_count_[index];
+      auto c = count > 1 ? (action_resources_[action] + 1) % count : 0;
+      connections_[index][c]->post_action(action, priority);
+    } else {
+      sensor_connections_[index][map_.sensor_index(sender, uint8_t(index))]->post(id, priority);
+    }
+  }
+}
+
+void enocean_to_hue_bridge::prewarm(uint32_t sender, uint8_t bridge_set)
+{
+  uint32_t set = bridge_set;
+  while (set) {
+    auto index = __builtin_ctz(set);
+    set &= set - 1;
+    if (index >= int(bridges_.size()))
+      continue;
+    for (uint8_t i = 0; i < connection_count_[index]; ++i)
+      connections_[index][i]->prewarm();
+    auto sensor = map_.sensor_index(sender, uint8_t(index));
+    if (sensor)
+      sensor_connections_[index][sensor]->prewarm();
+  }
+}
+
+void enocean_to_hue_bridge::log_statistics()
+{
+  auto& filter = state_.filter();
+  for (uint8_t i = 0; i < filter.receiver_count(); ++i) {
+    auto& stats = filter.stats(i);
+    auto ip_addr = reinterpret_cast<const unsigned char*>(&stats.ip);
+    syslog_printf(LOG_INFO, "EnOcean receiver %u.%u.%u.%u: %u telegrams, %u duplicates suppressed",
+        ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], stats.received, stats.suppressed);
+  }
+  if (filter.evictions())
+    syslog_printf(LOG_INFO, "EnOcean duplicate filter evicted %u live entries", filter.evictions());
+  for (uint8_t index = 0; index < bridges_.size(); ++index) {
+    for (uint8_t i = 0; i < connection_count_[index]; ++i)
+      log_statistics(index, "connection", i + 1U, *connections_[index][i]);
+    for (uint8_t i = 1; i < sensor_count_[index]; ++i)
+      log_statistics(index, "sensor", unsigned(sensor_connections_[index][i]->sensor_id()),
+          *sensor_connections_[index][i]);
+    auto ip = bridges_[index].ip();
+    auto ip_addr = reinterpret_cast<const unsigned char*>(&ip);
+    syslog_printf(LOG_INFO, "EnOcean bridge %u.%u.%u.%u: rate limit %u requests/s, decreased %u times",
+        ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], limiters_[index].rate(), limiters_[index].decreases());
+    if (bridge_streams_[index]) {
+      auto& stats = bridge_streams_[index]->stats();
+      syslog_printf(LOG_INFO, "EnOcean bridge %u.%u.%u.%u: entertainment stream of %u frames in %u sessions, "
+          "%u failures, %u frames shown, %u dropped",
+          ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], stats.frames, stats.sessions, stats.failures,
+          stats.shown, stats.dropped);
+    }
+    if (bridge_state_caches_[index]) {
+      auto& stats = bridge_state_caches_[index]->stats();
+      syslog_printf(LOG_INFO, "EnOcean bridge %u.%u.%u.%u: light state of %u events (%u updates) in %u streams, "
+          "%u failures, %u actions resolved, %u without known state",
+          ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], stats.events, stats.updates, stats.connects,
+          stats.failures, stats.resolved, stats.unknown);
     }
   }
 }
 
+void enocean_to_hue_bridge::log_statistics(uint8_t index, const char* what, unsigned number,
+    const hue_sensor_command_posix& c)
+{
+  auto& stats = c.stats();
+  auto ip = bridges_[index].ip();
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&ip);
+  syslog_printf(LOG_INFO, "EnOcean bridge %u.%u.%u.%u %s %u: %u commands confirmed, %u failed, %u lost, "
+      "%u expired, %u dropped, %u coalesced, %u posted without connection, %u connections prewarmed, "
+      "%u rejected while unreachable in %u outages, %u retried, %u recovered",
+      ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], what, number, stats.succeeded, stats.failed, stats.lost,
+      stats.expired, stats.dropped, stats.coalesced, stats.cold, stats.prewarmed,
+      stats.rejected, stats.outages, stats.retried, stats.recovered);
+}
+
 void enocean_to_hue_bridge::proxy_poll()
 {
   uint64_t buffer[128];
@@ -246,6 +636,15 @@ void enocean_to_hue_bridge::proxy_poll()
           std::error_code(errno, std::generic_category()),
           "Error polling data from proxy socket");
     }
-    handle_event(*reinterpret_cast<enocean_event*>(&buffer), remote.sin_addr.s_addr);
+    if (cluster_.message(&buffer, size_t(msg_len), bridges_[0].timestamp()))
+      continue;
+    auto& event = *reinterpret_cast<enocean_event*>(&buffer);
+    if (size_t(msg_len) < sizeof(event.hdr) ||
+        size_t(msg_len) < sizeof(event.hdr) + event.hdr.total_size())
+    {
+      syslog_printf(LOG_WARNING, "EnOcean ignoring truncated proxy message of %ld bytes", long(msg_len));
+      continue;
+    }
+    handle_event(event, remote.sin_addr.s_addr);
   }
 }
@@ -26,9 +26,17 @@
 #include "enocean_serial_posix.hpp"
 #include "hue_sensor_command_posix.hpp"
 #include "command_mapping.hpp"
+#include "gateway_state.hpp"
+#include "master_cluster.hpp"
+#include "bridge_config.hpp"
+#include "bridge_resolver.hpp"
+#include "hue_entertainment.hpp"
+#include "light_state_cache.hpp"
+#include "embedded/gateway_core.hpp"
+#include "event_loop.hpp"
 
-#include <map>
 #include <deque>
+#include <vector>
 
 /*!
  * @brief Bridge to translate Enocean sensors to Hue bridge's internal sensor.
@@ -60,14 +68,194 @@ private:
     enocean_to_hue_bridge& parent_;
   };
 
+  /// Core mapping events and filtering duplicates, with logging and routing of this gateway.
+  class core : public gateway_core
+  {
+  public:
+    explicit core(enocean_to_hue_bridge& parent) noexcept : parent_(parent) {}
+
+  private:
+    virtual void map(const enocean_event& event, command& cmd) override;
+
+    virtual void prewarm(const command& cmd) override;
+
+    virtual void received(const enocean_event& event, const command& cmd) noexcept override;
+
+    virtual void suppressed(const command& cmd) noexcept override;
+
+    virtual bool accept(const command& cmd) override;
+
+    virtual void post(const command& cmd) override;
+
+    enocean_to_hue_bridge& parent_;
+  };
+
+  /// Cluster of masters posting commands on behalf of the bridge.
+  class cluster : public master_cluster
+  {
+  public:
+    explicit cluster(enocean_to_hue_bridge& parent) noexcept : parent_(parent) {}
+
+  private:
+    virtual void post(uint32_t sender, int32_t value, uint8_t bridge_set, rate_limiter::priority priority) override;
+
+    enocean_to_hue_bridge& parent_;
+  };
+
+  /// Configuration of a bridge, checked against the mapping when updated.
+  class config : public bridge_config
+  {
+  public:
+    config(const hue_sensor_command_posix& bridge, const std::string& cache_dir,
+        enocean_to_hue_bridge& parent, uint8_t index) :
+      bridge_config(bridge, cache_dir), parent_(parent), index_(index)
+    {}
+
+    /// Provision the CLIP sensor of a contact on this bridge.
+    void add_contact(uint16_t contact, const command_mapping::contact_sensor& sensor)
+    {
+      add_sensor(sensor.uniqueid, sensor.type, sensor.name);
+      contacts_.push_back(contact);
+    }
+
+  private:
+    virtual void updated() override;
+
+    virtual void sensor_ready(uint16_t index, uint16_t id) override;
+
+    enocean_to_hue_bridge& parent_;
+    uint8_t index_;
+    /// Index of the contact sensor in the mapping per provisioned sensor.
+    std::vector<uint16_t> contacts_;
+  };
+
+  /// Resolver of addresses of bridges given by bridge ID.
+  class resolver : public bridge_resolver
+  {
+  public:
+    explicit resolver(enocean_to_hue_bridge& parent) noexcept : parent_(parent) {}
+
+  private:
+    virtual void resolved(uint8_t index, uint32_t ip) override;
+
+    enocean_to_hue_bridge& parent_;
+  };
+
+  /// Timer checking addresses of unreachable bridges.
+  class address_check : public timer_wheel::timer
+  {
+  public:
+    explicit address_check(enocean_to_hue_bridge& parent) noexcept : parent_(parent) {}
+
+  private:
+    virtual void expired(int64_t now) override { parent_.check_addresses(now); }
+
+    enocean_to_hue_bridge& parent_;
+  };
+
+  /// Handler calling a poll method of an object on events in the event loop.
+  template<typename T, void (T::*Poll)()>
+  class poller : public event_loop::handler
+  {
+  public:
+    explicit poller(T& target) noexcept : target_(target) {}
+
+  private:
+    virtual void ready(uint32_t) override { (target_.*Poll)(); }
+
+    T& target_;
+  };
+
+  /// Maximum connections to a bridge (for direct actions and for additional sensors).
+  static constexpr uint8_t MAX_BRIDGE_CONNECTIONS =
+      command_mapping::MAX_CONNECTIONS + command_mapping::MAX_SENSORS - 1;
+
+  /// Set up cluster of masters, if configured.
+  void setup_cluster();
+
+  /// Check that the sensor and targets of direct actions of a bridge exist.
+  void check_config(uint8_t index, bridge_config& config);
+
+  /// Send further requests to a bridge to a new address.
+  void readdress(uint8_t index, uint32_t ip);
+
+  /*!
+   * @brief Resolve addresses of bridges given by ID, which became unreachable.
+   *
+   * Called when the circuit breaker of a connection opens or closes and
+   * repeated every MIN_INTERVAL of the resolver while a bridge is unreachable.
+   */
+  void check_addresses(int64_t now);
+
+  /// Bind direct actions of a contact sensor to its sensor ID on a bridge.
+  void bind_contact(uint8_t index, uint16_t contact, uint16_t id);
+
+  /// Post a command of a sender to all bridges in the bridge set.
+  void post(uint32_t sender, int32_t id, uint8_t bridge_set, rate_limiter::priority priority);
+
+  /// Connect to all bridges in the bridge set ahead of a command of a sender.
+  void prewarm(uint32_t sender, uint8_t bridge_set);
+
   void handle_event(const enocean_event& event, uint32_t remote_ip = 0);
 
   void proxy_poll();
 
+  /// Log statistics of duplicate filter.
+  void log_statistics();
+
+  /// Log statistics of a connection to a bridge.
+  void log_statistics(uint8_t index, const char* what, unsigned number, const hue_sensor_command_posix& c);
+
   command_mapping map_;
   std::deque<hue_sensor_command_posix>& bridges_;
+  /// Event loop watching all file descriptors.
+  event_loop loop_;
+  /// Timeouts of connections to bridges and other components.
+  timer_wheel wheel_;
+  /// Timer checking addresses of unreachable bridges.
+  address_check address_check_{*this};
+  /// Additional connections to bridges configured with more than one connection.
+  std::deque<hue_sensor_command_posix> extra_connections_;
+  /// Connections to each bridge by index for direct access by bridge set bits.
+  hue_sensor_command_posix* connections_[8][command_mapping::MAX_CONNECTIONS];
+  /// Count of connections to each bridge.
+  uint8_t connection_count_[8] = {};
+  /// Connections to sensors of each bridge by index in the pool of sensors.
+  hue_sensor_command_posix* sensor_connections_[8][command_mapping::MAX_SENSORS];
+  /// Count of sensors of each bridge.
+  uint8_t sensor_count_[8] = {};
+  /// Rate limits of bridges, shared by all connections to a bridge.
+  rate_limiter limiters_[8];
+  /// All connections in polling order.
+  hue_sensor_command_posix* all_connections_[8 * MAX_BRIDGE_CONNECTIONS];
+  /// Count of all connections.
+  uint8_t all_connection_count_ = 0;
+  /// Index of the distinct resource of each direct action.
+  std::vector<uint16_t> action_resources_;
+  /// Configurations of bridges, if fetched.
+  std::deque<config> configs_;
+  /// Streams to entertainment areas of bridges.
+  std::deque<hue_entertainment> streams_;
+  /// Stream to the entertainment area of each bridge, if any.
+  hue_entertainment* bridge_streams_[8] = {};
+  /// Caches of light state of bridges.
+  std::deque<light_state_cache> state_caches_;
+  /// Cache of light state of each bridge, if any.
+  light_state_cache* bridge_state_caches_[8] = {};
+  /// Index of the contact sensor of each direct action (-1 for other actions).
+  std::vector<int16_t> action_contacts_;
+  /// Set of bridges each contact sensor is provisioned on (as bitmask).
+  std::vector<uint8_t> contact_bridges_;
   handler hnd_;
-  std::map<int32_t, std::pair<hue_sensor_command::timestamp_t, int32_t>> command_states_;
+  gateway_state state_;
+  cluster cluster_{*this};
+  resolver resolver_{*this};
+  core core_{*this};
   int proxy_server_fd_ = -1;
-  unsigned long total_event_count_ = 0;
+  /// Handler of events of the serial port.
+  poller<enocean_serial_posix, &enocean_serial_posix::poll> serial_poller_{hnd_};
+  /// Handler of events of the proxy socket.
+  poller<enocean_to_hue_bridge, &enocean_to_hue_bridge::proxy_poll> proxy_poller_{*this};
+  /// Handler of events of the mDNS socket.
+  poller<bridge_resolver, &bridge_resolver::poll> resolver_poller_{resolver_};
 };
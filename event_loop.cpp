@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "event_loop.hpp"
+#include "syslog_posix.hpp"
+
+#include <system_error>
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+event_loop::handler::~handler() noexcept
+{
+  set_loop(nullptr);
+}
+
+void event_loop::handler::set_loop(event_loop* loop) noexcept
+{
+  if (loop == loop_)
+    return;
+  if (loop_) {
+    forget();
+    if (prev_)
+      prev_->next_ = next_;
+    else
+      loop_->handlers_ = next_;
+    if (next_)
+      next_->prev_ = prev_;
+    next_ = prev_ = nullptr;
+  }
+  loop_ = loop;
+  if (loop_) {
+    next_ = loop_->handlers_;
+    if (next_)
+      next_->prev_ = this;
+    loop_->handlers_ = this;
+  }
+}
+
+void event_loop::handler::watch(int fd, uint32_t events) noexcept
+{
+  if (!loop_)
+    return;
+  if (fd < 0) {
+    forget();
+    return;
+  }
+  if (fd == fd_ && events == events_)
+    return;   // no change, most common case
+
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = this;
+  int res;
+  if (fd == fd_) {
+    res = epoll_ctl(loop_->epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+    if (res < 0 && errno == ENOENT)
+      res = epoll_ctl(loop_->epoll_fd_, EPOLL_CTL_ADD, fd, &ev);  // closed and reopened meanwhile
+  } else {
+    forget();
+    res = epoll_ctl(loop_->epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+  }
+  if (res < 0) {
+    syslog_printf(LOG_ERR, "EnOcean cannot watch file descriptor %d: %s", fd, strerror(errno));
+    fd_ = -1;
+    events_ = 0;
+    return;
+  }
+  fd_ = fd;
+  events_ = events;
+}
+
+void event_loop::handler::forget() noexcept
+{
+  if (loop_ && fd_ >= 0) {
+    // the descriptor may be closed already, then it's not in the set anymore
+    epoll_ctl(loop_->epoll_fd_, EPOLL_CTL_DEL, fd_, nullptr);
+    // events not dispatched yet belong to this descriptor, not to a reopened one
+    for (int i = 0; i < loop_->count_; ++i) {
+      if (loop_->events_[i].data.ptr == this)
+        loop_->events_[i].data.ptr = nullptr;
+    }
+  }
+  fd_ = -1;
+  events_ = 0;
+}
+
+event_loop::event_loop()
+{
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0)
+    throw std::system_error(errno, std::generic_category(), "Cannot create epoll set");
+  timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd_ < 0) {
+    auto err = errno;
+    close(epoll_fd_);
+    throw std::system_error(err, std::generic_category(), "Cannot create timer");
+  }
+  // the timer is identified by null data, it is read on each expiration
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = nullptr;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &ev) < 0) {
+    auto err = errno;
+    close(timer_fd_);
+    close(epoll_fd_);
+    throw std::system_error(err, std::generic_category(), "Cannot watch timer");
+  }
+}
+
+event_loop::~event_loop() noexcept
+{
+  while (handlers_)
+    handlers_->set_loop(nullptr);
+  close(timer_fd_);
+  close(epoll_fd_);
+}
+
+void event_loop::arm(timestamp_t deadline)
+{
+  if (deadline == deadline_)
+    return;
+  // zero time would disarm the timer
+  if (deadline <= 0)
+    deadline = 1;
+  struct itimerspec spec = {};
+  spec.it_value.tv_sec = time_t(deadline / 1000);
+  spec.it_value.tv_nsec = long(deadline % 1000) * 1000000;
+  if (timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr) < 0)
+    throw std::system_error(errno, std::generic_category(), "Cannot set timer");
+  deadline_ = deadline;
+}
+
+int event_loop::wait(timestamp_t deadline)
+{
+  arm(deadline);
+  count_ = epoll_wait(epoll_fd_, events_, MAX_EVENTS, -1);
+  if (count_ < 0) {
+    auto err = errno;
+    count_ = 0;
+    if (err == EINTR)
+      return 0; // interrupted by signal, retry
+    throw std::system_error(err, std::generic_category(), "Error waiting for events");
+  }
+  int ready = count_;
+  for (int i = 0; i < count_; ++i) {
+    if (!events_[i].data.ptr) {
+      // timer expired and is disarmed, so the same deadline must be set again
+      uint64_t expirations;
+      auto res = read(timer_fd_, &expirations, sizeof(expirations));
+      (void) res; // nothing to read, if rearmed meanwhile
+      deadline_ = -1;
+      --ready;
+    }
+  }
+  return ready;
+}
+
+void event_loop::dispatch()
+{
+  for (int i = 0; i < count_; ++i) {
+    auto h = static_cast<handler*>(events_[i].data.ptr);
+    // events of handlers which stopped watching during dispatch were cleared
+    if (h)
+      h->ready(events_[i].events);
+  }
+  count_ = 0;
+}
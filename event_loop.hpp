@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Event loop based on epoll with persistent registrations.
+ */
+#pragma once
+
+#include <cstdint>
+
+#include <sys/epoll.h>
+
+/*!
+ * @brief Event loop based on epoll with persistent registrations.
+ *
+ * File descriptors stay registered in the epoll set between iterations.
+ * Handlers update their registration when their file descriptor or
+ * interest changes, which calls epoll_ctl() only if something changed,
+ * so the cost of waiting doesn't depend on the count of descriptors.
+ *
+ * The wakeup time is kept in a timerfd, which is rearmed only when the
+ * deadline changes. Descriptors are level-triggered, since handlers
+ * process a bounded amount of data per call, only the timerfd is
+ * edge-triggered.
+ */
+class event_loop
+{
+public:
+  using timestamp_t = int64_t;
+
+  /// Handler of events on a file descriptor.
+  class handler
+  {
+  public:
+    handler() noexcept = default;
+
+    /// Destroy the handler, stop watching its file descriptor.
+    virtual ~handler() noexcept;
+
+    handler(const handler&) = delete;
+    handler& operator=(const handler&) = delete;
+
+    /*!
+     * @brief Set the loop to watch the file descriptor in.
+     *
+     * @param loop event loop, or @c nullptr to not watch anymore.
+     */
+    void set_loop(event_loop* loop) noexcept;
+
+    /*!
+     * @brief Watch a file descriptor, if the handler is in a loop.
+     *
+     * The registration is only updated if the descriptor or events changed.
+     *
+     * @param fd file descriptor, negative to stop watching.
+     * @param events events to wait for as for poll() (errors are always reported).
+     */
+    void watch(int fd, uint32_t events) noexcept;
+
+    /// Stop watching the file descriptor, must be called before closing it (drops its pending events).
+    void forget() noexcept;
+
+  protected:
+    /*!
+     * @brief Process events on the file descriptor.
+     *
+     * @param events events reported as for poll().
+     */
+    virtual void ready(uint32_t events) = 0;
+
+  private:
+    friend class event_loop;
+
+    /// Loop the handler is in, if any.
+    event_loop* loop_ = nullptr;
+    /// Next handler in the loop.
+    handler* next_ = nullptr;
+    /// Previous handler in the loop.
+    handler* prev_ = nullptr;
+    /// Registered file descriptor (negative if none).
+    int fd_ = -1;
+    /// Registered events.
+    uint32_t events_ = 0;
+  };
+
+  /// Create the epoll set and the timer.
+  event_loop();
+
+  /// Destroy the loop, handlers still in the loop are removed from it.
+  ~event_loop() noexcept;
+
+  event_loop(const event_loop&) = delete;
+  event_loop& operator=(const event_loop&) = delete;
+
+  /*!
+   * @brief Wait for events or a deadline.
+   *
+   * @param deadline time to wake up at, as returned by hue_sensor_command_posix::timestamp().
+   * @return count of file descriptors with events, excluding the timer.
+   */
+  int wait(timestamp_t deadline);
+
+  /// Call handlers of file descriptors reported by the last wait().
+  void dispatch();
+
+private:
+  /// Maximum count of events processed per wait().
+  static constexpr int MAX_EVENTS = 32;
+
+  /// Set the deadline of the timer, if it changed.
+  void arm(timestamp_t deadline);
+
+  /// Epoll set.
+  int epoll_fd_ = -1;
+  /// Timer waking up at the deadline.
+  int timer_fd_ = -1;
+  /// Deadline the timer is armed for.
+  timestamp_t deadline_ = -1;
+  /// Handlers in the loop.
+  handler* handlers_ = nullptr;
+  /// Count of events reported by the last wait().
+  int count_ = 0;
+  /// Events reported by the last wait().
+  struct epoll_event events_[MAX_EVENTS];
+};
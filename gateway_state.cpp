@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "gateway_state.hpp"
+#include "syslog_posix.hpp"
+#include "embedded/crc8.hpp"
+
+#include <system_error>
+#include <new>
+#include <cstddef>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+gateway_state::gateway_state() noexcept :
+  state_(&local_)
+{
+  initialize(&local_);
+}
+
+gateway_state::~gateway_state() noexcept
+{
+  if (mapping_)
+    munmap(mapping_, sizeof(layout));
+}
+
+void gateway_state::initialize(layout* state) noexcept
+{
+  memset(static_cast<void*>(state), 0, sizeof(layout));
+  state->version = VERSION;
+  state->size = sizeof(layout);
+  new(&state->filter) duplicate_filter();
+  // magic last, so an interrupted initialization is detected
+  __atomic_store_n(&state->magic, MAGIC, __ATOMIC_RELEASE);
+}
+
+bool gateway_state::attach(const char* path)
+{
+  int fd = ::open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    throw std::system_error(
+        std::error_code(errno, std::generic_category()),
+        std::string("Cannot open state file '") + path + '\'');
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      (st.st_size != off_t(sizeof(layout)) && ftruncate(fd, sizeof(layout)) < 0))
+  {
+    auto err = errno;
+    ::close(fd);
+    throw std::system_error(
+        std::error_code(err, std::generic_category()),
+        std::string("Cannot size state file '") + path + '\'');
+  }
+
+  auto ptr = mmap(nullptr, sizeof(layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  auto err = errno;
+  ::close(fd);  // mapping stays valid
+  if (ptr == MAP_FAILED)
+    throw std::system_error(
+        std::error_code(err, std::generic_category()),
+        std::string("Cannot map state file '") + path + '\'');
+
+  if (mapping_)
+    munmap(mapping_, sizeof(layout));
+  mapping_ = ptr;
+  state_ = static_cast<layout*>(ptr);
+
+  if (state_->magic != MAGIC || state_->version != VERSION || state_->size != sizeof(layout)) {
+    syslog_printf(LOG_WARNING, "EnOcean state file '%s' invalid, reinitializing", path);
+    initialize(state_);
+    return false;
+  }
+
+  auto dropped = state_->filter.validate();
+  if (dropped)
+    syslog_printf(LOG_WARNING, "EnOcean state file '%s': dropped %u torn duplicate filter entries", path, dropped);
+  return true;
+}
+
+uint32_t gateway_state::bridge_address(uint8_t index, const char* id) const noexcept
+{
+  auto& a = state_->addresses[index];
+  if (a.check != crc8::checksum(&a, offsetof(address, check)) ||
+      strncmp(a.id, id, sizeof(a.id)) != 0)
+    return 0;
+  return a.ip;
+}
+
+void gateway_state::set_bridge_address(uint8_t index, const char* id, uint32_t ip) noexcept
+{
+  auto& a = state_->addresses[index];
+  memset(&a, 0, sizeof(a));
+  strncpy(a.id, id, sizeof(a.id) - 1);
+  a.ip = ip;
+  a.check = crc8::checksum(&a, offsetof(address, check));
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Persistent state of the gateway in a memory-mapped file.
+ */
+#pragma once
+
+#include "command_mapping.hpp"
+#include "embedded/duplicate_filter.hpp"
+
+/*!
+ * @brief Persistent state of the gateway in a memory-mapped file.
+ *
+ * The hot mutable state (duplicate filter, last values sent per sender and
+ * resolved addresses of bridges) is kept in a fixed-layout, versioned region of a shared memory-mapping.
+ * Updates are plain memory writes, which survive a crash or restart of the
+ * process without any syscall per event. The restarted process re-attaches
+ * to the state by just mapping the file.
+ *
+ * A file with wrong magic, version or size is reinitialized. Individual
+ * records are protected by checksums, so records torn by a crash in the
+ * middle of an update are detected and reset when attaching.
+ *
+ * If no file is attached, the state is kept in process memory.
+ */
+class gateway_state
+{
+public:
+  gateway_state() noexcept;
+  ~gateway_state() noexcept;
+
+  gateway_state(const gateway_state&) = delete;
+  gateway_state& operator=(const gateway_state&) = delete;
+
+  /*!
+   * @brief Attach to a state file, creating or reinitializing it as needed.
+   *
+   * @param path path to the state file.
+   * @return @c true, if existing state was reused, @c false if initialized.
+   */
+  bool attach(const char* path);
+
+  /// Get duplicate filter.
+  duplicate_filter& filter() noexcept { return state_->filter; }
+
+  /// Get table of last values (with command_mapping::MAX_SENDERS entries).
+  command_mapping::last_value* last_values() noexcept { return state_->last_values; }
+
+  /*!
+   * @brief Get resolved address of a bridge.
+   *
+   * @param index index of the bridge.
+   * @param id bridge ID.
+   * @return IP address (network order) or 0, if not known for this bridge ID.
+   */
+  uint32_t bridge_address(uint8_t index, const char* id) const noexcept;
+
+  /// Store resolved address of a bridge.
+  void set_bridge_address(uint8_t index, const char* id, uint32_t ip) noexcept;
+
+private:
+  /// Magic number of the state file.
+  static constexpr uint32_t MAGIC = 0x48554553; // "SEUH"
+  /// Version of the layout, increment on each layout change.
+  static constexpr uint32_t VERSION = 2;
+
+  /// Resolved address of a bridge.
+  struct address
+  {
+    char id[20];        ///< Bridge ID (NUL-terminated).
+    uint32_t ip;        ///< IP address (network order).
+    uint8_t check;      ///< Checksum of the above fields to detect torn writes.
+  };
+
+  /// Layout of the state.
+  struct layout
+  {
+    uint32_t magic;     ///< Magic number, written last on initialization.
+    uint32_t version;   ///< Version of the layout.
+    uint32_t size;      ///< Size of the layout.
+    uint32_t reserved;  ///< Padding.
+    /// Duplicate filter.
+    duplicate_filter filter;
+    /// Table of last values.
+    command_mapping::last_value last_values[command_mapping::MAX_SENDERS];
+    /// Resolved addresses of bridges.
+    address addresses[8];
+  };
+
+  /// Initialize state in given memory.
+  static void initialize(layout* state) noexcept;
+
+  /// Current state (either local or mapped).
+  layout* state_;
+  /// Mapped file, if any.
+  void* mapping_ = nullptr;
+  /// Local state, if not mapped.
+  layout local_;
+};
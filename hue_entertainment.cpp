@@ -0,0 +1,436 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "hue_entertainment.hpp"
+#include "syslog_posix.hpp"
+
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+hue_entertainment::hue_entertainment(const hue_sensor_command_posix& bridge,
+    const command_mapping::entertainment_area& area) :
+  connection_(bridge.ip(), bridge.api_key(), bridge.sensor_id())
+{
+  connection_.copy_settings(bridge);
+  connection_.set_deadline(ACTIVATE_DEADLINE);
+  // the only request on this connection activates streaming of the group
+  connection_.set_actions({ { "groups/" + std::to_string(area.group), "{\"stream\":{\"active\":true}}" } });
+  for (size_t i = 0; i < sizeof(psk_); ++i) {
+    unsigned byte;
+    if (sscanf(area.client_key.c_str() + 2 * i, "%2x", &byte) != 1)
+      throw std::runtime_error("Cannot parse client key of entertainment area");
+    psk_[i] = uint8_t(byte);
+  }
+}
+
+hue_entertainment::~hue_entertainment() noexcept
+{
+  close_session();
+}
+
+void hue_entertainment::add_light(uint16_t id)
+{
+  for (uint8_t i = 0; i < light_count_; ++i) {
+    if (lights_[i].id == id)
+      return;
+  }
+  if (light_count_ == MAX_LIGHTS)
+    throw std::runtime_error("Too many lights streamed to an entertainment area");
+  auto& l = lights_[light_count_++];
+  memset(&l, 0, sizeof(l));
+  l.id = id;
+}
+
+void hue_entertainment::start() noexcept
+{
+  started_ = true;
+  retry_time_ = connection_.timestamp();
+  arm_timer();
+}
+
+bool hue_entertainment::show(const command_mapping::light_color* colors, size_t count) noexcept
+{
+  if (state_ != state::streaming) {
+    ++stats_.dropped;
+    return false;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    for (uint8_t j = 0; j < light_count_; ++j) {
+      auto& l = lights_[j];
+      if (l.id != colors[i].light)
+        continue;
+      l.set = true;
+      l.red = colors[i].red;
+      l.green = colors[i].green;
+      l.blue = colors[i].blue;
+    }
+  }
+  ++stats_.shown;
+  auto now = connection_.timestamp();
+  changed_ = now;
+  send_frame(now);
+  arm_timer();
+  return true;
+}
+
+void hue_entertainment::readdress(uint32_t ip)
+{
+  connection_.readdress(ip);
+  if (state_ == state::handshake || state_ == state::streaming) {
+    // the session is bound to the old address
+    close_session();
+    state_ = state::idle;
+    retry_time_ = connection_.timestamp();
+    arm_timer();
+  }
+}
+
+void hue_entertainment::set_event_loop(event_loop* loop) noexcept
+{
+  connection_.set_event_loop(loop);
+  watcher_.set_loop(loop);
+  update_interest();
+}
+
+void hue_entertainment::update_interest() noexcept
+{
+  watcher_.watch(fd_, POLLIN);
+}
+
+void hue_entertainment::set_timer_wheel(timer_wheel* wheel) noexcept
+{
+  if (wheel_)
+    wheel_->cancel(timer_);
+  wheel_ = wheel;
+  connection_.set_timer_wheel(wheel);
+  connection_.set_completion_timer(wheel ? &timer_ : nullptr);
+  arm_timer();
+}
+
+void hue_entertainment::check_timeouts(int64_t now) noexcept
+{
+  switch (state_) {
+    case state::idle:
+      if (started_ && now - retry_time_ >= 0)
+        activate(now);
+      break;
+
+    case state::activating:
+    {
+      auto& stats = connection_.stats();
+      bool succeeded = stats.succeeded != succeeded_;
+      if (!succeeded && stats.failed + stats.lost + stats.expired + stats.dropped + stats.rejected == failed_)
+        break;  // still in progress
+      if (succeeded)
+        start_session(now);
+      else
+        fail("cannot activate streaming", now);
+      break;
+    }
+
+    case state::handshake:
+      if (now - handshake_start_ >= HANDSHAKE_TIMEOUT)
+        fail("DTLS handshake timed out", now);
+#ifdef WITH_TLS
+      else if (DTLSv1_handle_timeout(ssl_) < 0)
+        fail("DTLS handshake failed", now);
+#endif
+      break;
+
+    case state::streaming:
+      if (now - next_frame_ >= 0)
+        send_frame(now);
+      break;
+  }
+  arm_timer();
+}
+
+void hue_entertainment::arm_timer() noexcept
+{
+  update_interest();
+  if (!wheel_)
+    return;
+  int64_t when;
+  switch (state_) {
+    case state::idle:
+      if (!started_) {
+        wheel_->cancel(timer_);
+        return;
+      }
+      when = retry_time_;
+      break;
+    case state::activating:
+      wheel_->cancel(timer_);   // expired by the connection when the activation finished
+      return;
+    case state::handshake:
+      when = handshake_start_ + HANDSHAKE_TIMEOUT;
+#ifdef WITH_TLS
+      {
+        struct timeval tv;
+        if (DTLSv1_get_timeout(ssl_, &tv)) {
+          auto retransmit = connection_.timestamp() + int64_t(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+          if (retransmit < when)
+            when = retransmit;
+        }
+      }
+#endif
+      break;
+    case state::streaming:
+      when = next_frame_;
+      break;
+  }
+  wheel_->schedule(timer_, when);
+}
+
+void hue_entertainment::activate(int64_t) noexcept
+{
+  state_ = state::activating;
+  auto& stats = connection_.stats();
+  succeeded_ = stats.succeeded;
+  failed_ = stats.failed + stats.lost + stats.expired + stats.dropped + stats.rejected;
+  connection_.post_action(0, rate_limiter::priority::interactive);
+}
+
+void hue_entertainment::fail(const char* what, int64_t now) noexcept
+{
+  auto ip = connection_.ip();
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&ip);
+  syslog_printf(LOG_WARNING, "EnOcean bridge %u.%u.%u.%u: entertainment stream: %s, retrying in %lld s",
+      ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], what, (long long)(RETRY_INTERVAL / 1000));
+  ++stats_.failures;
+  close_session();
+  state_ = state::idle;
+  retry_time_ = now + RETRY_INTERVAL;
+}
+
+#ifdef WITH_TLS
+
+bool hue_entertainment::supported() noexcept
+{
+  return true;
+}
+
+ssl_ctx_st* hue_entertainment::dtls_context()
+{
+  static SSL_CTX* ctx = nullptr;
+  if (ctx)
+    return ctx;
+  ctx = SSL_CTX_new(DTLS_client_method());
+  if (!ctx)
+    throw std::runtime_error("Cannot create DTLS context");
+  // the bridge only supports DTLS 1.2 with this PSK cipher suite
+  SSL_CTX_set_min_proto_version(ctx, DTLS1_2_VERSION);
+  SSL_CTX_set_max_proto_version(ctx, DTLS1_2_VERSION);
+  SSL_CTX_set_cipher_list(ctx, "PSK-AES128-GCM-SHA256");
+  SSL_CTX_set_psk_client_callback(ctx, psk_client);
+  return ctx;
+}
+
+unsigned hue_entertainment::psk_client(ssl_st* ssl, const char*, char* identity, unsigned max_identity_len,
+    unsigned char* psk, unsigned max_psk_len) noexcept
+{
+  auto self = reinterpret_cast<hue_entertainment*>(SSL_get_app_data(ssl));
+  // the identity is the API key of the application
+  auto len = strlen(self->connection_.api_key());
+  if (len >= max_identity_len || sizeof(self->psk_) > max_psk_len)
+    return 0;
+  memcpy(identity, self->connection_.api_key(), len + 1);
+  memcpy(psk, self->psk_, sizeof(self->psk_));
+  return sizeof(self->psk_);
+}
+
+void hue_entertainment::start_session(int64_t now) noexcept
+{
+  fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd_ < 0) {
+    fail("cannot create socket", now);
+    return;
+  }
+  auto flags = fcntl(fd_, F_GETFL);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = connection_.ip();
+  addr.sin_port = htons(PORT);
+  if (flags < 0 || fcntl(fd_, F_SETFL, flags | O_NONBLOCK) < 0 ||
+      connect(fd_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0)
+  {
+    fail("cannot connect socket", now);
+    return;
+  }
+  SSL_CTX* ctx;
+  try {
+    ctx = dtls_context();
+  } catch (std::exception&) {
+    fail("cannot create DTLS context", now);
+    return;
+  }
+  ssl_ = SSL_new(ctx);
+  auto bio = BIO_new_dgram(fd_, BIO_NOCLOSE);
+  if (!ssl_ || !bio) {
+    if (bio)
+      BIO_free(bio);
+    fail("cannot create DTLS session", now);
+    return;
+  }
+  BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, &addr);
+  SSL_set_bio(ssl_, bio, bio);
+  SSL_set_app_data(ssl_, this);
+  SSL_set_connect_state(ssl_);
+  state_ = state::handshake;
+  handshake_start_ = now;
+  handshake(now);
+}
+
+void hue_entertainment::handshake(int64_t now) noexcept
+{
+  ERR_clear_error();
+  auto res = SSL_do_handshake(ssl_);
+  if (res != 1) {
+    auto err = SSL_get_error(ssl_, res);
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+      fail("DTLS handshake failed", now);
+    return;
+  }
+  auto ip = connection_.ip();
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&ip);
+  syslog_printf(LOG_INFO, "EnOcean bridge %u.%u.%u.%u: entertainment stream established in %lld ms",
+      ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], (long long)(now - handshake_start_));
+  ++stats_.sessions;
+  state_ = state::streaming;
+  send_frame(now);
+}
+
+void hue_entertainment::poll() noexcept
+{
+  auto now = connection_.timestamp();
+  if (state_ == state::handshake) {
+    handshake(now);
+    return;
+  }
+  if (state_ != state::streaming)
+    return;
+  // the bridge doesn't send data, but alerts and errors end the session
+  for (;;) {
+    char buffer[256];
+    ERR_clear_error();
+    auto res = SSL_read(ssl_, buffer, sizeof(buffer));
+    if (res > 0)
+      continue;
+    auto err = SSL_get_error(ssl_, res);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+      return;
+    fail(err == SSL_ERROR_ZERO_RETURN ? "stream closed by the bridge" : "stream broken", now);
+    return;
+  }
+}
+
+void hue_entertainment::send_frame(int64_t now) noexcept
+{
+  // protocol version 1.0, RGB color space, 16-bit components
+  uint8_t msg[16 + 9 * MAX_LIGHTS] = { 'H', 'u', 'e', 'S', 't', 'r', 'e', 'a', 'm', 1, 0 };
+  msg[11] = sequence_++;
+  size_t len = 16;
+  for (uint8_t i = 0; i < light_count_; ++i) {
+    auto& l = lights_[i];
+    if (!l.set)
+      continue;   // keep lights not shown yet as they are
+    msg[len++] = 0;   // light
+    msg[len++] = uint8_t(l.id >> 8);
+    msg[len++] = uint8_t(l.id);
+    for (auto c : { l.red, l.green, l.blue }) {
+      // scale to 16 bits
+      msg[len++] = c;
+      msg[len++] = c;
+    }
+  }
+  ERR_clear_error();
+  auto res = SSL_write(ssl_, msg, int(len));
+  if (res <= 0) {
+    auto err = SSL_get_error(ssl_, res);
+    if (err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ) {
+      fail("cannot send frame", now);
+      return;
+    }
+    // socket buffer full, the next frame repeats the colors
+  } else {
+    ++stats_.frames;
+  }
+  next_frame_ = now + ((now - changed_ < HOLD_TIME) ? FRAME_INTERVAL : KEEPALIVE_INTERVAL);
+}
+
+void hue_entertainment::close_session() noexcept
+{
+  if (ssl_) {
+    SSL_free(ssl_);   // frees the BIO, too
+    ssl_ = nullptr;
+  }
+  if (fd_ >= 0) {
+    watcher_.forget();
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+#else
+
+bool hue_entertainment::supported() noexcept
+{
+  return false;
+}
+
+void hue_entertainment::start_session(int64_t now) noexcept
+{
+  fail("DTLS support not compiled in", now);
+}
+
+void hue_entertainment::handshake(int64_t) noexcept
+{
+}
+
+void hue_entertainment::poll() noexcept
+{
+}
+
+void hue_entertainment::send_frame(int64_t) noexcept
+{
+}
+
+void hue_entertainment::close_session() noexcept
+{
+  if (fd_ >= 0) {
+    watcher_.forget();
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+#endif
@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Stream of frames to an entertainment area of a Hue bridge.
+ */
+#pragma once
+
+#include "hue_sensor_command_posix.hpp"
+#include "command_mapping.hpp"
+
+struct ssl_ctx_st;
+struct ssl_st;
+
+/*!
+ * @brief Stream of frames to an entertainment area of a Hue bridge.
+ *
+ * Requests via the REST API take a round of rule evaluation and the
+ * bridge processes them one after another. Instead, colors of lights of
+ * an entertainment area can be streamed to the bridge over UDP secured
+ * by DTLS 1.2 with a pre-shared key (the client key of the application),
+ * which the bridge applies to the lights within one frame.
+ *
+ * Streaming of the group is activated via the REST API over a separate
+ * connection. Then the DTLS session is kept open and the current colors
+ * of all lights set so far are sent at the stream rate for HOLD_TIME
+ * after a change (frames are not acknowledged, so repeating them covers
+ * lost datagrams) and every KEEPALIVE_INTERVAL afterwards, so the bridge
+ * doesn't end the stream. A failed session is set up again after
+ * RETRY_INTERVAL. Frames shown while no session is established are
+ * dropped, so lights never react late.
+ */
+class hue_entertainment
+{
+public:
+  /// Maximum count of lights in the area.
+  static constexpr uint8_t MAX_LIGHTS = command_mapping::MAX_STREAM_LIGHTS;
+  /// UDP port of the streaming endpoint of the bridge.
+  static constexpr uint16_t PORT = 2100;
+  /// Send frames at 50 Hz after a change.
+  static constexpr int64_t FRAME_INTERVAL = 20;
+  /// Keep the stream rate for 1 second after a change.
+  static constexpr int64_t HOLD_TIME = 1000;
+  /// Repeat frames every 2 seconds otherwise (the bridge ends the stream after 10 s).
+  static constexpr int64_t KEEPALIVE_INTERVAL = 2000;
+  /// Give up DTLS handshake after 3 seconds.
+  static constexpr int64_t HANDSHAKE_TIMEOUT = 3000;
+  /// Set up a failed session again after 5 seconds.
+  static constexpr int64_t RETRY_INTERVAL = 5000;
+
+  /// Statistics of the stream.
+  struct statistics
+  {
+    uint32_t frames;        ///< Frames sent.
+    uint32_t shown;         ///< Frames of the mapping shown.
+    uint32_t dropped;       ///< Frames of the mapping dropped without session.
+    uint32_t sessions;      ///< Sessions established.
+    uint32_t failures;      ///< Failed activations and sessions.
+  };
+
+  /*!
+   * @brief Construct stream to an entertainment area of a bridge.
+   *
+   * @param bridge connection to the bridge, whose address and settings to use.
+   * @param area entertainment group and client key.
+   */
+  hue_entertainment(const hue_sensor_command_posix& bridge, const command_mapping::entertainment_area& area);
+
+  ~hue_entertainment() noexcept;
+
+  hue_entertainment(const hue_entertainment&) = delete;
+  hue_entertainment& operator=(const hue_entertainment&) = delete;
+
+  /// Check whether DTLS support is compiled in.
+  static bool supported() noexcept;
+
+  /// Add a light to stream colors of before start(), throw if too many.
+  void add_light(uint16_t id);
+
+  /// Start activating the stream.
+  void start() noexcept;
+
+  /*!
+   * @brief Set colors of lights and send the frame immediately.
+   *
+   * @param colors,count colors of lights added by add_light().
+   * @return @c false, if no session is established and the frame was dropped.
+   */
+  bool show(const command_mapping::light_color* colors, size_t count) noexcept;
+
+  /// Stream to another address of the bridge.
+  void readdress(uint32_t ip);
+
+  /// Get connection used to activate streaming.
+  hue_sensor_command_posix& connection() noexcept { return connection_; }
+
+  /// Get FD of the DTLS session to poll on, if any.
+  int get_fd() const noexcept { return fd_; }
+
+  /*!
+   * @brief Watch the session and the connection in an event loop.
+   *
+   * @param loop event loop, which must outlive the stream, or @c nullptr
+   *    to let the caller poll.
+   */
+  void set_event_loop(event_loop* loop) noexcept;
+
+  /*!
+   * @brief Schedule activation, handshake timeouts and frames in a timer wheel.
+   *
+   * The connection is scheduled in the same wheel and expires the timer of
+   * the stream when the activation finished.
+   *
+   * @param wheel timer wheel, which must outlive the stream.
+   */
+  void set_timer_wheel(timer_wheel* wheel) noexcept;
+
+  /// Process datagrams of the DTLS session.
+  void poll() noexcept;
+
+  /// Get statistics.
+  const statistics& stats() const noexcept { return stats_; }
+
+private:
+  /// Deadline for activating the stream (in milliseconds).
+  static constexpr int64_t ACTIVATE_DEADLINE = 5000;
+
+  /// State of the stream.
+  enum class state : uint8_t
+  {
+    idle,         ///< Not started or waiting to retry.
+    activating,   ///< Activating streaming of the group.
+    handshake,    ///< DTLS handshake in progress.
+    streaming     ///< Session established.
+  };
+
+  /// Current color of a light.
+  struct light
+  {
+    uint16_t id;          ///< Light ID.
+    bool set;             ///< Set if the color was shown at least once.
+    uint8_t red;          ///< Red component.
+    uint8_t green;        ///< Green component.
+    uint8_t blue;         ///< Blue component.
+  };
+
+  /// Timer calling check_timeouts().
+  class timeout : public timer_wheel::timer
+  {
+  public:
+    explicit timeout(hue_entertainment& parent) noexcept : parent_(parent) {}
+
+  private:
+    virtual void expired(int64_t now) override { parent_.check_timeouts(now); }
+
+    hue_entertainment& parent_;
+  };
+
+  /// Handle timeouts, activation and sending of frames.
+  void check_timeouts(int64_t now) noexcept;
+
+  /// Update the watched socket and schedule the timer for the next timeout, if any.
+  void arm_timer() noexcept;
+
+  /// Request activation of streaming.
+  void activate(int64_t now) noexcept;
+
+  /// Open the socket and start the DTLS handshake.
+  void start_session(int64_t now) noexcept;
+
+  /// Continue DTLS handshake.
+  void handshake(int64_t now) noexcept;
+
+  /// Send current colors of lights.
+  void send_frame(int64_t now) noexcept;
+
+  /// Log a failure, close the session and retry later.
+  void fail(const char* what, int64_t now) noexcept;
+
+  /// Close the session, if any.
+  void close_session() noexcept;
+
+  /// Update the socket of the session watched in the event loop.
+  void update_interest() noexcept;
+
+  /// Get DTLS context shared by all streams.
+  static ssl_ctx_st* dtls_context();
+
+  /// Callback of OpenSSL to provide PSK identity and key.
+  static unsigned psk_client(ssl_st* ssl, const char* hint, char* identity, unsigned max_identity_len,
+      unsigned char* psk, unsigned max_psk_len) noexcept;
+
+  /// Connection to activate streaming.
+  hue_sensor_command_posix connection_;
+  /// Pre-shared key (client key of the application).
+  uint8_t psk_[16];
+  /// Lights of the area.
+  light lights_[MAX_LIGHTS];
+  /// Count of lights of the area.
+  uint8_t light_count_ = 0;
+  /// State of the stream.
+  state state_ = state::idle;
+  /// Set if started.
+  bool started_ = false;
+  /// Sequence number of the next frame.
+  uint8_t sequence_ = 0;
+  /// UDP socket of the session, if any.
+  int fd_ = -1;
+  /// DTLS session, if any.
+  ssl_st* ssl_ = nullptr;
+  /// Time of the next activation attempt.
+  int64_t retry_time_ = 0;
+  /// Start of the current DTLS handshake.
+  int64_t handshake_start_ = 0;
+  /// Time of the next frame.
+  int64_t next_frame_ = 0;
+  /// Time of the last change of colors.
+  int64_t changed_ = 0;
+  /// Count of succeeded requests of the connection before activation.
+  uint32_t succeeded_ = 0;
+  /// Count of failed requests of the connection before activation.
+  uint32_t failed_ = 0;
+  /// Statistics.
+  statistics stats_ = {};
+  /// Timer wheel to schedule timeouts in, if any.
+  timer_wheel* wheel_ = nullptr;
+  /// Timer of the next timeout.
+  timeout timer_{*this};
+
+  /// Handler of events on the socket of the session.
+  class watcher : public event_loop::handler
+  {
+  public:
+    explicit watcher(hue_entertainment& parent) noexcept : parent_(parent) {}
+
+  private:
+    virtual void ready(uint32_t) override
+    {
+      parent_.poll();
+      parent_.arm_timer();
+    }
+
+    hue_entertainment& parent_;
+  };
+
+  /// Handler of events in the event loop, if any.
+  watcher watcher_{*this};
+};
@@ -18,92 +18,194 @@
  */
 
 #include "hue_sensor_command_posix.hpp"
+#include "syslog_posix.hpp"
 
-#include <system_error>
+#include <stdexcept>
+#include <cstdio>
 
 #include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <poll.h>
 #include <string.h>
+#include <signal.h>
+
+#ifdef WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#endif
 
 short hue_sensor_command_posix::get_events() const noexcept
 {
-  if (get_state() != state::receiving)
-    return POLLOUT;
-  else
-    return POLLIN;
+  switch (get_state()) {
+    case state::connecting:
+      return (ssl_ && want_read_) ? POLLIN : POLLOUT;
+    case state::sending:
+      return POLLOUT | POLLIN;  // responses to pipelined requests may arrive
+    default:
+      return POLLIN;
+  }
 }
 
 void hue_sensor_command_posix::poll()
 {
+  handle_events();
+  arm_timer();
+}
+
+void hue_sensor_command_posix::handle_events()
+{
+  if (get_state() == state::connecting) {
+    if (!ssl_ && !check_connect())
+      return;
+#ifdef WITH_TLS
+    if (tls_ && !handshake())
+      return;
+#endif
+    connected();
+  }
   for (;;) {
-    switch (get_state()) {
-    case state::connecting:
-      connected();
-      // fall throught to send first block
-    case state::sending:
-    {
-      // socket writable, write remaining stuff
-      auto res = ::write(fd_, send_ptr_, send_outstanding_size_);
+    auto s = get_state();
+    if (s == state::sending) {
+      auto res = write_data();
       if (res < 0) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) {
-          // cannot write any more data
-          return; // will retry later
-        } else if (errno == EINTR) {
-          continue;
-        }
-        throw std::system_error(
-            std::error_code(errno, std::generic_category()),
-            "Error writing data to socket");
-      } else if (res == send_outstanding_size_) {
-        // all written
-        request_sent();
-        continue;
-      } else if (res < send_outstanding_size_) {
-        send_outstanding_size_ -= res;
-        send_ptr_ += res;
-        continue;
-      } else {
+        // kept-alive connection closed by the bridge
+        connection_closed();
+        return;
+      } else if (res > send_outstanding_size_) {
         // impossible
         throw std::runtime_error("Wrote too much data to the socket");
-      }
-    }
-    case state::receiving:
-    {
-      auto res = ::read(fd_, buffer_, sizeof(buffer_));
-      if (res < 0) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) {
-          // will retry later
-          return;
-        } else if (errno == EINTR) {
-          continue;
-        }
-        throw std::system_error(
-            std::error_code(errno, std::generic_category()),
-            "Error reading data from socket");
-      } else if (res == 0) {
-        // EOF
-        close(fd_);
-        fd_ = -1;
-        request_finished();
-        return;
-      } else {
-        // more data pending
+      } else if (res > 0) {
+        data_sent(size_t(res));
         continue;
       }
+      // cannot write any more data now, check for responses
+    } else if (s != state::receiving && s != state::open) {
+      // nothing to do
+      return;
     }
-    default:
-      // ignore
+
+    char buffer[512];
+    auto res = read_data(buffer, sizeof(buffer));
+    if (res < 0) {
+      close_connection();
+      connection_closed();
       return;
+    } else if (res == 0) {
+      // will retry later
+      return;
+    } else {
+      response_received(buffer, size_t(res));
     }
   }
 }
 
+bool hue_sensor_command_posix::check_connect()
+{
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+    err = errno;
+  if (!err)
+    return true;
+  errno = err;
+  socket_error("cannot connect");
+  connection_closed();
+  return false;
+}
+
+ssize_t hue_sensor_command_posix::write_data()
+{
+#ifdef WITH_TLS
+  if (ssl_) {
+    // gather pipelined requests into one TLS record
+    char buffer[4096];
+    size_t len = 0;
+    const char* data;
+    size_t size;
+    for (uint8_t i = 0; len < sizeof(buffer) && send_segment(i, data, size); ++i) {
+      if (size > sizeof(buffer) - len)
+        size = sizeof(buffer) - len;
+      memcpy(buffer + len, data, size);
+      len += size;
+    }
+    ERR_clear_error();
+    auto res = SSL_write(ssl_, buffer, int(len));
+    if (res > 0)
+      return res;
+    auto err = SSL_get_error(ssl_, res);
+    if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+      return 0;
+    return -1;
+  }
+#endif
+
+  // write directly from request segments
+  struct iovec iov[2 * MAX_PIPELINE];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  const char* data;
+  size_t size;
+  while (msg.msg_iovlen < 2 * MAX_PIPELINE && send_segment(uint8_t(msg.msg_iovlen), data, size)) {
+    iov[msg.msg_iovlen].iov_base = const_cast<char*>(data);
+    iov[msg.msg_iovlen].iov_len = size;
+    ++msg.msg_iovlen;
+  }
+  for (;;) {
+    auto res = ::sendmsg(fd_, &msg, MSG_NOSIGNAL);
+    if (res >= 0)
+      return res;
+    if (errno == EINTR)
+      continue;
+    if (errno == EPIPE || errno == ECONNRESET)
+      return -1;
+    if (errno == EWOULDBLOCK || errno == EAGAIN)
+      return 0;
+    socket_error("error writing data to socket");
+    return -1;
+  }
+}
+
+ssize_t hue_sensor_command_posix::read_data(char* buffer, size_t size)
+{
+#ifdef WITH_TLS
+  if (ssl_) {
+    ERR_clear_error();
+    auto res = SSL_read(ssl_, buffer, int(size));
+    if (res > 0)
+      return res;
+    auto err = SSL_get_error(ssl_, res);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+      return 0;
+    return -1;
+  }
+#endif
+
+  for (;;) {
+    auto res = ::read(fd_, buffer, size);
+    if (res > 0)
+      return res;
+    if (res == 0)
+      return -1;  // EOF
+    if (errno == EINTR)
+      continue;
+    if (errno == EWOULDBLOCK || errno == EAGAIN)
+      return 0;
+    if (errno == ECONNRESET)
+      return -1;
+    socket_error("error reading data from socket");
+    return -1;
+  }
+}
+
 hue_sensor_command::timestamp_t hue_sensor_command_posix::timestamp() noexcept
 {
   struct timespec tp;
@@ -111,44 +213,333 @@ hue_sensor_command::timestamp_t hue_sensor_command_posix::timestamp() noexcept
   return tp.tv_nsec / 1000000 + tp.tv_sec * 1000;
 }
 
-bool hue_sensor_command_posix::start_connect()
+hue_sensor_command_posix::connect_result hue_sensor_command_posix::start_connect()
 {
+  if (!ip_) {
+    // bridge given by ID, whose address is not resolved yet
+    syslog_printf(LOG_WARNING, "EnOcean bridge %s: address not resolved yet", bridge_id_);
+    return connect_result::failed;
+  }
+
   fd_ = socket(AF_INET, SOCK_STREAM, 0);
-  if (fd_ < 0)
-    throw std::system_error(
-        std::error_code(errno, std::generic_category()),
-        "Cannot create socket for sending Hue request");
+  if (fd_ < 0) {
+    socket_error("cannot create socket");
+    return connect_result::failed;
+  }
 
   int one = 1;
-  if (setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
-    throw std::system_error(
-        std::error_code(errno, std::generic_category()),
-        "Cannot set socket's TCP_NODELAY option");
+  if (setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+    socket_error("cannot set socket's TCP_NODELAY option");
+    return connect_result::failed;
+  }
 
   auto flags = fcntl(fd_, F_GETFL);
-  if (flags < 0)
-    throw std::system_error(
-        std::error_code(errno, std::generic_category()),
-        "Cannot get socket's flags");
-
-  if (fcntl(fd_, F_SETFL, flags | O_NONBLOCK) < 0)
-    throw std::system_error(
-        std::error_code(errno, std::generic_category()),
-        "Cannot set socket's flags");
+  if (flags < 0 || fcntl(fd_, F_SETFL, flags | O_NONBLOCK) < 0) {
+    socket_error("cannot set socket's flags");
+    return connect_result::failed;
+  }
 
   struct sockaddr_in addr;
   memset(&addr, 0, sizeof(addr));
   addr.sin_family = AF_INET;
-  addr.sin_port = htons(80);
+  addr.sin_port = htons(port());
   addr.sin_addr.s_addr = ip_;
   if (connect(fd_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0) {
-    if (errno != EINPROGRESS)
-      throw std::system_error(
-          std::error_code(errno, std::generic_category()),
-          "Error connecting the socket");
-    return false;
+    if (errno != EINPROGRESS) {
+      socket_error("cannot connect");
+      return connect_result::failed;
+    }
+    return connect_result::pending;
+  } else if (tls_) {
+    // immediately connected, next poll will start TLS handshake
+    return connect_result::pending;
   } else {
     // immediately connected, next poll will send
-    return true;
+    return connect_result::connected;
+  }
+}
+
+void hue_sensor_command_posix::socket_error(const char* what) noexcept
+{
+  auto err = errno;
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&ip_);
+  syslog_printf(LOG_WARNING, "EnOcean bridge %u.%u.%u.%u: %s: %s",
+      ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], what, strerror(err));
+  close_connection();
+}
+
+void hue_sensor_command_posix::close_connection() noexcept
+{
+#ifdef WITH_TLS
+  if (ssl_) {
+    // mark as shut down, so the session stays resumable after an abortive close
+    SSL_set_shutdown(ssl_, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_free(ssl_);
+    ssl_ = nullptr;
   }
+#endif
+  if (fd_ >= 0) {
+    watcher_.forget();
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+void hue_sensor_command_posix::set_event_loop(event_loop* loop) noexcept
+{
+  watcher_.set_loop(loop);
+  update_interest();
 }
+
+void hue_sensor_command_posix::update_interest() noexcept
+{
+  watcher_.watch(fd_, uint32_t(get_events()));
+}
+
+void hue_sensor_command_posix::report_failure(const queue_element& command, uint16_t status, uint16_t error_type) noexcept
+{
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&ip_);
+  char what[32];
+  if (command.target)
+    snprintf(what, sizeof(what), "action %u", command.target - 1U);
+  else
+    snprintf(what, sizeof(what), "command %d", command.value);
+  if (!status)
+    syslog_printf(LOG_WARNING, "EnOcean bridge %u.%u.%u.%u: invalid response to %s",
+        ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], what);
+  else
+    syslog_printf(LOG_WARNING, "EnOcean bridge %u.%u.%u.%u: %s failed, HTTP status %u, Hue error type %u",
+        ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], what, status, error_type);
+}
+
+void hue_sensor_command_posix::report_reachability(timestamp_t backoff) noexcept
+{
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&ip_);
+  if (backoff)
+    syslog_printf(LOG_ERR, "EnOcean bridge %u.%u.%u.%u: unreachable, dropping commands, probing in %lld ms",
+        ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], (long long)backoff);
+  else
+    syslog_printf(LOG_WARNING, "EnOcean bridge %u.%u.%u.%u: reachable again",
+        ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3]);
+}
+
+void hue_sensor_command_posix::copy_settings(const hue_sensor_command_posix& other) noexcept
+{
+  port_ = other.port_;
+  tls_ = other.tls_;
+  memcpy(fingerprint_, other.fingerprint_, sizeof(fingerprint_));
+  bridge_id_ = other.bridge_id_;
+}
+
+void hue_sensor_command_posix::render_actions() noexcept
+{
+  // patch the Host header of precompiled direct actions in place
+  auto ip = ip_;
+  char host[16];
+  auto host_len = snprintf(host, sizeof(host), "%u.%u.%u.%u",
+      ip & 0xff, (ip >> 8) & 0xff, (ip >> 16) & 0xff, ip >> 24);
+  char buffer[512];
+  for (size_t i = 0; i < action_requests_.size(); ++i) {
+    auto& prefix = action_data_[2 * i];
+    auto start = prefix.find("\r\nHost: ");
+    auto end = prefix.find("\r\n", start + 2);
+    if (start == std::string::npos || end == std::string::npos)
+      continue;
+    start += 8;
+    auto len = start + size_t(host_len) + prefix.size() - end;
+    if (len > sizeof(buffer) || len > prefix.capacity())
+      continue;
+    memcpy(buffer, prefix.data(), start);
+    memcpy(buffer + start, host, size_t(host_len));
+    memcpy(buffer + start + host_len, prefix.data() + end, prefix.size() - end);
+    prefix.assign(buffer, len);
+    action_requests_[i].prefix = prefix.data();
+    action_requests_[i].prefix_size = uint16_t(len);
+  }
+}
+
+void hue_sensor_command_posix::set_actions(const std::vector<std::pair<std::string, std::string>>& actions)
+{
+  hue_sensor_command::set_actions(nullptr, 0);
+  action_data_.clear();
+  action_requests_.clear();
+  for (auto& a : actions)
+    add_action(a.second.empty() ? "GET" : "PUT", a.first.c_str(), a.second.c_str());
+}
+
+uint16_t hue_sensor_command_posix::add_action(const char* method, const char* resource, const char* body)
+{
+  char buffer[512];
+  auto len = render_prefix(buffer, sizeof(buffer), resource, method);
+  if (len >= sizeof(buffer))
+    throw std::runtime_error("Direct action request too long");
+  action_data_.emplace_back(buffer, len);
+  // room for a longer address, so readdress() doesn't allocate
+  action_data_.back().reserve(len + 8);
+  len = render_tail(buffer, sizeof(buffer), body);
+  if (len >= sizeof(buffer))
+    throw std::runtime_error("Direct action body too long");
+  action_data_.emplace_back(buffer, len);
+
+  // strings may have moved, so point all requests to their current data
+  action_requests_.clear();
+  for (size_t i = 0; i < action_data_.size(); i += 2) {
+    action_request r;
+    r.prefix = action_data_[i].data();
+    r.prefix_size = uint16_t(action_data_[i].size());
+    r.tail = action_data_[i + 1].data();
+    r.tail_size = uint16_t(action_data_[i + 1].size());
+    action_requests_.push_back(r);
+  }
+  hue_sensor_command::set_actions(action_requests_.data(), uint16_t(action_requests_.size()));
+  return uint16_t(action_requests_.size() - 1);
+}
+
+bool hue_sensor_command_posix::bind_action(uint16_t action, const char* resource) noexcept
+{
+  char buffer[512];
+  auto len = render_prefix(buffer, sizeof(buffer), resource);
+  auto& prefix = action_data_[2U * action];
+  if (len > prefix.capacity())
+    return false;
+  // assigning a string fitting the capacity reuses its buffer
+  prefix.assign(buffer, len);
+  action_requests_[action].prefix = prefix.data();
+  action_requests_[action].prefix_size = uint16_t(len);
+  return true;
+}
+
+hue_sensor_command_posix::~hue_sensor_command_posix() noexcept
+{
+  close_connection();
+#ifdef WITH_TLS
+  if (session_)
+    SSL_SESSION_free(session_);
+#endif
+}
+
+#ifdef WITH_TLS
+
+SSL_CTX* hue_sensor_command_posix::tls_context()
+{
+  static SSL_CTX* ctx = nullptr;
+  if (ctx)
+    return ctx;
+  ctx = SSL_CTX_new(TLS_client_method());
+  if (!ctx)
+    throw std::runtime_error("Cannot create TLS context");
+  // OpenSSL writes to the socket without MSG_NOSIGNAL, so a write to a
+  // connection closed by the bridge would raise SIGPIPE and kill the gateway
+  signal(SIGPIPE, SIG_IGN);
+  // the bridge is authenticated by the pinned certificate
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  // the request data are gathered anew from segments when retrying a write
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  // bridge closes idle connections without close_notify, which would be
+  // a fatal error making the session non-resumable (HTTP framing guards
+  // against truncation)
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, new_session);
+  return ctx;
+}
+
+bool hue_sensor_command_posix::tls_supported() noexcept
+{
+  return true;
+}
+
+void hue_sensor_command_posix::enable_tls(const uint8_t* fingerprint)
+{
+  tls_ = true;
+  memcpy(fingerprint_, fingerprint, sizeof(fingerprint_));
+}
+
+bool hue_sensor_command_posix::handshake()
+{
+  if (!ssl_) {
+    ssl_ = SSL_new(tls_context());
+    if (!ssl_)
+      throw std::runtime_error("Cannot create TLS connection");
+    SSL_set_fd(ssl_, fd_);
+    SSL_set_app_data(ssl_, this);
+    if (session_)
+      SSL_set_session(ssl_, session_);
+    SSL_set_connect_state(ssl_);
+  }
+  ERR_clear_error();
+  auto res = SSL_do_handshake(ssl_);
+  if (res == 1) {
+    if (check_certificate())
+      return true;
+  } else {
+    auto err = SSL_get_error(ssl_, res);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+      want_read_ = err == SSL_ERROR_WANT_READ;
+      return false;
+    }
+    auto ip_addr = reinterpret_cast<const unsigned char*>(&ip_);
+    char reason[128];
+    ERR_error_string_n(ERR_peek_last_error(), reason, sizeof(reason));
+    syslog_printf(LOG_ERR, "EnOcean bridge %u.%u.%u.%u: TLS handshake failed: %s",
+        ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3],
+        ERR_peek_last_error() ? reason : strerror(errno));
+  }
+  close_connection();
+  connection_closed();
+  return false;
+}
+
+bool hue_sensor_command_posix::check_certificate() noexcept
+{
+  auto cert = SSL_get_peer_certificate(ssl_);
+  uint8_t md[EVP_MAX_MD_SIZE];
+  unsigned md_len = 0;
+  bool ok = cert && X509_digest(cert, EVP_sha256(), md, &md_len) && md_len == sizeof(fingerprint_);
+  if (cert)
+    X509_free(cert);
+
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&ip_);
+  char hex[2 * sizeof(fingerprint_) + 1];
+  for (unsigned i = 0; ok && i < md_len; ++i)
+    snprintf(hex + 2 * i, 3, "%02x", md[i]);
+  if (!ok) {
+    syslog_printf(LOG_ERR, "EnOcean bridge %u.%u.%u.%u: cannot get TLS certificate",
+        ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3]);
+  } else if (memcmp(fingerprint_, md, sizeof(fingerprint_)) != 0) {
+    syslog_printf(LOG_ERR, "EnOcean bridge %u.%u.%u.%u: TLS certificate %s does not match the pinned one",
+        ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], hex);
+    ok = false;
+  }
+  if (!ok && session_) {
+    SSL_SESSION_free(session_);
+    session_ = nullptr;
+  }
+  return ok;
+}
+
+int hue_sensor_command_posix::new_session(ssl_st* ssl, ssl_session_st* session) noexcept
+{
+  auto self = reinterpret_cast<hue_sensor_command_posix*>(SSL_get_app_data(ssl));
+  if (self->session_)
+    SSL_SESSION_free(self->session_);
+  self->session_ = session;
+  return 1; // keep the reference
+}
+
+#else
+
+bool hue_sensor_command_posix::tls_supported() noexcept
+{
+  return false;
+}
+
+void hue_sensor_command_posix::enable_tls(const uint8_t*)
+{
+  throw std::runtime_error("HTTPS support not compiled in");
+}
+
+#endif
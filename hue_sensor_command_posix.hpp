@@ -24,6 +24,17 @@
 #pragma once
 
 #include "embedded/hue_sensor_command.hpp"
+#include "event_loop.hpp"
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include <sys/types.h>
+
+struct ssl_ctx_st;
+struct ssl_st;
+struct ssl_session_st;
 
 class hue_sensor_command_posix : public hue_sensor_command
 {
@@ -44,12 +55,96 @@ public:
     hue_sensor_command(ip, api_key, sensor_id)
   {}
 
+  ~hue_sensor_command_posix() noexcept;
+
+  hue_sensor_command_posix(const hue_sensor_command_posix&) = delete;
+  hue_sensor_command_posix& operator=(const hue_sensor_command_posix&) = delete;
+
+  /// Check whether HTTPS support is compiled in.
+  static bool tls_supported() noexcept;
+
+  /*!
+   * @brief Connect to the bridge via HTTPS.
+   *
+   * @param fingerprint SHA-256 fingerprint of the bridge certificate (32 bytes).
+   *
+   * Hue bridges use self-signed certificates, so the identity of the bridge
+   * is checked by pinning the certificate instead of validating its chain.
+   * Any other certificate is refused before a request is sent.
+   * TLS sessions are resumed on reconnect to avoid full handshakes.
+   */
+  void enable_tls(const uint8_t* fingerprint);
+
+  /// Check whether connecting via HTTPS.
+  bool tls() const noexcept { return tls_; }
+
+  /// Get SHA-256 fingerprint of the bridge certificate (@c nullptr if not connecting via HTTPS).
+  const uint8_t* fingerprint() const noexcept { return tls_ ? fingerprint_ : nullptr; }
+
+  /// Connect to another TCP port than the default one (80 or 443), e.g., of a local test bridge.
+  void set_port(uint16_t port) noexcept { port_ = port; }
+
+  /// Get TCP port to connect to.
+  uint16_t port() const noexcept { return port_ ? port_ : (tls_ ? 443 : 80); }
+
+  /// Use the same transport settings as another handler for the same bridge.
+  void copy_settings(const hue_sensor_command_posix& other) noexcept;
+
+  /*!
+   * @brief Set ID of the bridge to resolve its address by.
+   *
+   * @param id bridge ID (16 hex digits), which must stay valid.
+   */
+  void set_bridge_id(const char* id) noexcept { bridge_id_ = id; }
+
+  /// Get ID of the bridge, if its address is resolved (empty otherwise).
+  const char* bridge_id() const noexcept { return bridge_id_; }
+
+  /*!
+   * @brief Precompile requests for direct actions.
+   *
+   * @param actions pairs of resource path after the API key and JSON body.
+   *    An empty body denotes a GET request of the resource.
+   */
+  void set_actions(const std::vector<std::pair<std::string, std::string>>& actions);
+
+  /*!
+   * @brief Precompile a request and add it as a direct action.
+   *
+   * @param method HTTP method of the request.
+   * @param resource resource path after the API key.
+   * @param body JSON body (empty for none).
+   * @return index of the action.
+   */
+  uint16_t add_action(const char* method, const char* resource, const char* body);
+
+  /*!
+   * @brief Send a direct action to another resource.
+   *
+   * Used to bind actions to resources known only after startup, without
+   * allocating memory. The new request prefix must not be longer than the
+   * original one (plus room for a longer address).
+   *
+   * @param action index of the action.
+   * @param resource new resource path after the API key.
+   * @return @c false, if the new prefix doesn't fit.
+   */
+  bool bind_action(uint16_t action, const char* resource) noexcept;
+
   /// Get FD to poll on, if any.
   int get_fd() const noexcept { return fd_; }
 
   /// Get events to poll for.
   short get_events() const noexcept;
 
+  /*!
+   * @brief Watch the connection in an event loop, which calls poll() on events.
+   *
+   * @param loop event loop, which must outlive the handler, or @c nullptr
+   *    to let the caller poll.
+   */
+  void set_event_loop(event_loop* loop) noexcept;
+
   /// Process events on file descriptor.
   virtual void poll() override;
 
@@ -58,8 +153,83 @@ public:
 
 private:
   /// Start connecting to the remote side.
-  virtual bool start_connect() override;
+  virtual connect_result start_connect() override;
+
+  /// Close the current connection, if any.
+  virtual void close_connection() noexcept override;
+
+  /// Report a request failed by the bridge.
+  virtual void report_failure(const queue_element& command, uint16_t status, uint16_t error_type) noexcept override;
+
+  /// Report a change of reachability of the bridge.
+  virtual void report_reachability(timestamp_t backoff) noexcept override;
+
+  /// Update interest in events in the event loop.
+  virtual void update_interest() noexcept override;
+
+  /// Patch the Host header of precompiled direct actions for a new address.
+  virtual void render_actions() noexcept override;
+
+  /// Log a socket error and close the connection.
+  void socket_error(const char* what) noexcept;
+
+  /// Process events on file descriptor, before rescheduling the timeout.
+  void handle_events();
+
+  /// Check the result of connecting, return true if connected.
+  bool check_connect();
+
+  /// Write request data, return size written, 0 if it would block or -1 if connection was closed.
+  ssize_t write_data();
+
+  /// Read response data, return size read, 0 if it would block or -1 if connection was closed.
+  ssize_t read_data(char* buffer, size_t size);
+
+  /// Continue TLS handshake, return true when done.
+  bool handshake();
+
+  /// Check the certificate presented by the bridge against the pinned one.
+  bool check_certificate() noexcept;
+
+  /// Get TLS context shared by all bridges.
+  static ssl_ctx_st* tls_context();
+
+  /// Callback of OpenSSL to store a new session for resumption.
+  static int new_session(ssl_st* ssl, ssl_session_st* session) noexcept;
 
   /// File descriptor of the current connection, if any.
   int fd_ = -1;
+  /// TCP port to connect to (0 for the default one).
+  uint16_t port_ = 0;
+  /// Set if connecting via HTTPS.
+  bool tls_ = false;
+  /// Set if TLS handshake waits for data to read.
+  bool want_read_ = false;
+  /// SHA-256 fingerprint of the bridge certificate.
+  uint8_t fingerprint_[32];
+  /// TLS connection, if any.
+  ssl_st* ssl_ = nullptr;
+  /// TLS session to resume, if any.
+  ssl_session_st* session_ = nullptr;
+  /// ID of the bridge, if its address is resolved.
+  const char* bridge_id_ = "";
+  /// Rendered prefixes and tails of direct actions.
+  std::vector<std::string> action_data_;
+  /// Precompiled requests of direct actions.
+  std::vector<action_request> action_requests_;
+
+  /// Handler of events on the connection.
+  class watcher : public event_loop::handler
+  {
+  public:
+    explicit watcher(hue_sensor_command_posix& parent) noexcept : parent_(parent) {}
+
+  private:
+    virtual void ready(uint32_t) override { parent_.poll(); }
+
+    hue_sensor_command_posix& parent_;
+  };
+
+  /// Handler of events in the event loop, if any.
+  watcher watcher_{*this};
 };
@@ -0,0 +1,729 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "light_state_cache.hpp"
+#include "syslog_posix.hpp"
+
+#include <stdexcept>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+#endif
+
+light_state_cache::light_state_cache(const hue_sensor_command_posix& bridge) :
+  bridge_(bridge),
+  connection_(bridge.ip(), bridge.api_key(), bridge.sensor_id())
+{
+  connection_.copy_settings(bridge);
+  connection_.set_deadline(FETCH_DEADLINE);
+  connection_.set_response_timeout(FETCH_TIMEOUT);
+  // state of all lights and groups, fetched after connecting the event stream
+  connection_.set_actions({ { "lights", std::string() }, { "groups", std::string() } });
+  connection_.set_body_tokenizer(&snapshot_);
+}
+
+light_state_cache::~light_state_cache() noexcept
+{
+  close_stream();
+}
+
+void light_state_cache::track(bool group, uint16_t id)
+{
+  if (find(group, id))
+    return;
+  if (target_count_ == MAX_TARGETS)
+    throw std::runtime_error("Too many lights and groups with state actions");
+  auto& t = targets_[target_count_++];
+  memset(&t, 0, sizeof(t));
+  t.id = id;
+  t.group = group;
+}
+
+void light_state_cache::start() noexcept
+{
+  started_ = true;
+  deadline_ = connection_.timestamp();
+  arm_timer();
+}
+
+int light_state_cache::apply(const command_mapping::state_action& action) noexcept
+{
+  auto t = find(action.group, action.target);
+  if (!t)
+    return -1;
+  ++stats_.resolved;
+  if (!t->known)
+    ++stats_.unknown;
+  bool on = t->known && t->on;
+  size_t index;
+  switch (action.type) {
+    case command_mapping::state_action::kind::toggle:
+      index = on ? 1 : 0;
+      t->on = !on;
+      break;
+
+    case command_mapping::state_action::kind::step:
+      if (on) {
+        int bri = t->bri + action.step;
+        index = 1;
+        t->bri = uint8_t(bri < 1 ? 1 : bri > 254 ? 254 : bri);
+      } else if (action.step > 0) {
+        // brightening a light which is off switches it on at the step
+        index = 0;
+        t->on = true;
+        t->bri = uint8_t(action.step);
+      } else {
+        return -1;  // nothing to dim
+      }
+      break;
+
+    case command_mapping::state_action::kind::cycle:
+    {
+      // continue after the level matching the current state, start with the first one otherwise
+      auto count = action.levels.size();
+      index = 0;
+      for (size_t i = 0; i < count; ++i) {
+        auto level = action.levels[i];
+        if ((!level && !on) || (level && on && std::abs(int(level) - int(t->bri)) <= 2)) {
+          index = (i + 1) % count;
+          break;
+        }
+      }
+      auto level = action.levels[index];
+      t->on = level != 0;
+      if (level)
+        t->bri = level;
+      break;
+    }
+
+    default:
+      return -1;
+  }
+  t->known = true;
+  return action.actions[index];
+}
+
+void light_state_cache::readdress(uint32_t ip)
+{
+  connection_.readdress(ip);
+  if (state_ != state::idle) {
+    // the stream is bound to the old address
+    close_stream();
+    state_ = state::idle;
+  }
+  deadline_ = connection_.timestamp();
+  arm_timer();
+}
+
+void light_state_cache::set_event_loop(event_loop* loop) noexcept
+{
+  connection_.set_event_loop(loop);
+  watcher_.set_loop(loop);
+  update_interest();
+}
+
+short light_state_cache::get_events() const noexcept
+{
+  switch (state_) {
+    case state::connecting:
+    case state::sending:
+      return POLLOUT;
+    case state::handshake:
+      return want_read_ ? POLLIN : POLLOUT;
+    case state::headers:
+    case state::streaming:
+      return POLLIN;
+    default:
+      return 0;
+  }
+}
+
+void light_state_cache::set_timer_wheel(timer_wheel* wheel) noexcept
+{
+  if (wheel_)
+    wheel_->cancel(timer_);
+  wheel_ = wheel;
+  connection_.set_timer_wheel(wheel);
+  arm_timer();
+}
+
+void light_state_cache::check_timeouts(int64_t now) noexcept
+{
+  switch (state_) {
+    case state::idle:
+      if (started_ && now - deadline_ >= 0)
+        connect_stream(now);
+      break;
+
+    case state::connecting:
+    case state::handshake:
+    case state::sending:
+    case state::headers:
+      if (now - deadline_ >= 0)
+        fail("timed out connecting");
+      break;
+
+    case state::streaming:
+      break;  // kept alive by TCP keepalive
+  }
+  arm_timer();
+}
+
+void light_state_cache::arm_timer() noexcept
+{
+  update_interest();
+  if (!wheel_)
+    return;
+  if (state_ == state::streaming || (state_ == state::idle && !started_))
+    wheel_->cancel(timer_);
+  else
+    wheel_->schedule(timer_, deadline_);
+}
+
+light_state_cache::target* light_state_cache::find(bool group, uint16_t id) noexcept
+{
+  for (uint8_t i = 0; i < target_count_; ++i) {
+    auto& t = targets_[i];
+    if (t.id == id && t.group == group)
+      return &t;
+  }
+  return nullptr;
+}
+
+bool light_state_cache::update(bool group, uint16_t id, bool set_on, bool on, uint8_t bri) noexcept
+{
+  auto t = find(group, id);
+  if (!t)
+    return false;
+  if (set_on) {
+    t->on = on;
+    t->known = true;
+  }
+  if (bri)
+    t->bri = bri;
+  return true;
+}
+
+void light_state_cache::connect_stream(int64_t now) noexcept
+{
+  if (!connection_.ip()) {
+    // address not resolved yet
+    deadline_ = now + RETRY_INTERVAL;
+    return;
+  }
+  deadline_ = now + CONNECT_TIMEOUT;
+  status_ = 0;
+  header_len_ = 0;
+  framing_ = framing::raw;
+  line_ = line::start;
+  has_data_ = false;
+  want_read_ = false;
+  in_data_ = false;
+  request_sent_ = 0;
+  json_tokenizer::reset();
+
+  auto ip = connection_.ip();
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&ip);
+  auto len = snprintf(request_, sizeof(request_),
+      "GET /eventstream/clip/v2 HTTP/1.1\r\n"
+      "Host: %u.%u.%u.%u\r\n"
+      "hue-application-key: %s\r\n"
+      "Accept: text/event-stream\r\n"
+      "User-Agent: enocean-gw/0.1\r\n"
+      "\r\n",
+      ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], connection_.api_key());
+  if (len < 0 || size_t(len) >= sizeof(request_)) {
+    fail("request too long");
+    return;
+  }
+  request_len_ = uint16_t(len);
+
+  fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd_ < 0) {
+    fail("cannot create socket");
+    return;
+  }
+  // detect a silently dropped stream (the bridge sends no heartbeat)
+  int one = 1, idle = 30, interval = 10, count = 3;
+  setsockopt(fd_, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+  setsockopt(fd_, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+  setsockopt(fd_, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+  setsockopt(fd_, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+  auto flags = fcntl(fd_, F_GETFL);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = ip;
+  addr.sin_port = htons(connection_.port());
+  if (flags < 0 || fcntl(fd_, F_SETFL, flags | O_NONBLOCK) < 0 ||
+      (connect(fd_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0 && errno != EINPROGRESS))
+  {
+    fail("cannot connect");
+    return;
+  }
+  state_ = state::connecting;
+}
+
+void light_state_cache::poll() noexcept
+{
+  if (state_ == state::connecting) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+      if (err)
+        errno = err;
+      fail(strerror(errno));
+      return;
+    }
+    state_ = connection_.tls() ? state::handshake : state::sending;
+  }
+  if (state_ == state::handshake) {
+    if (!handshake())
+      return;
+    state_ = state::sending;
+  }
+  if (state_ == state::sending) {
+    send_request();
+    if (state_ != state::headers)
+      return;
+  }
+  if (state_ != state::headers && state_ != state::streaming)
+    return;
+
+  for (;;) {
+    char buffer[512];
+    ssize_t res;
+#ifdef WITH_TLS
+    if (ssl_) {
+      ERR_clear_error();
+      auto len = SSL_read(ssl_, buffer, sizeof(buffer));
+      if (len <= 0) {
+        auto err = SSL_get_error(ssl_, len);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+          return;
+        fail(err == SSL_ERROR_ZERO_RETURN ? "closed by the bridge" : "broken");
+        return;
+      }
+      res = len;
+    } else
+#endif
+    {
+      res = ::read(fd_, buffer, sizeof(buffer));
+      if (res < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          fail(strerror(errno));
+        return;
+      }
+      if (res == 0) {
+        fail("closed by the bridge");
+        return;
+      }
+    }
+    process(buffer, size_t(res));
+    if (state_ == state::idle)
+      return;   // failed
+  }
+}
+
+void light_state_cache::send_request() noexcept
+{
+  while (request_sent_ < request_len_) {
+    ssize_t res;
+#ifdef WITH_TLS
+    if (ssl_) {
+      ERR_clear_error();
+      auto len = SSL_write(ssl_, request_ + request_sent_, int(request_len_ - request_sent_));
+      if (len <= 0) {
+        auto err = SSL_get_error(ssl_, len);
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+          fail("cannot send request");
+        return;
+      }
+      res = len;
+    } else
+#endif
+    {
+      res = ::send(fd_, request_ + request_sent_, request_len_ - request_sent_, MSG_NOSIGNAL);
+      if (res < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+          fail(strerror(errno));
+        return;
+      }
+    }
+    request_sent_ = uint16_t(request_sent_ + res);
+  }
+  state_ = state::headers;
+}
+
+void light_state_cache::process(const char* data, size_t size) noexcept
+{
+  for (size_t i = 0; i < size && state_ != state::idle; ++i) {
+    char c = data[i];
+    if (state_ == state::headers || framing_ == framing::chunk_size) {
+      if (c != '\n') {
+        if (c != '\r' && header_len_ < sizeof(header_) - 1)
+          header_[header_len_++] = c;
+        continue;
+      }
+      header_[header_len_] = 0;
+      if (state_ == state::headers) {
+        header_line();
+      } else {
+        // chunk extensions are ignored by strtoul()
+        remaining_ = uint32_t(strtoul(header_, nullptr, 16));
+        if (!remaining_) {
+          fail("stream ended by the bridge");
+          return;
+        }
+        framing_ = framing::chunk_data;
+      }
+      header_len_ = 0;
+      continue;
+    }
+    switch (framing_) {
+      case framing::chunk_data:
+        stream_char(c);
+        if (!--remaining_)
+          framing_ = framing::chunk_end;
+        break;
+      case framing::chunk_end:
+        if (c == '\n')
+          framing_ = framing::chunk_size;
+        break;
+      default:
+        stream_char(c);
+        break;
+    }
+  }
+}
+
+void light_state_cache::header_line() noexcept
+{
+  if (!status_) {
+    unsigned status;
+    if (sscanf(header_, "HTTP/%*u.%*u %u", &status) != 1 || !status || status > 999) {
+      fail("malformed response");
+      return;
+    }
+    status_ = uint16_t(status);
+    return;
+  }
+  if (header_len_) {
+    if (!strncasecmp(header_, "transfer-encoding:", 18) && strcasestr(header_ + 18, "chunked"))
+      framing_ = framing::chunk_size;
+    return;
+  }
+
+  // end of headers
+  if (status_ != 200) {
+    char what[32];
+    snprintf(what, sizeof(what), "HTTP status %u", unsigned(status_));
+    fail(what);
+    return;
+  }
+  state_ = state::streaming;
+  ++stats_.connects;
+  auto ip = connection_.ip();
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&ip);
+  syslog_printf(LOG_INFO, "EnOcean bridge %u.%u.%u.%u: event stream connected, fetching state of %u lights/groups",
+      ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], unsigned(target_count_));
+  // changes while not connected were missed, so start from the current state
+  connection_.post_action(0, rate_limiter::priority::background);
+  connection_.post_action(1, rate_limiter::priority::background);
+}
+
+void light_state_cache::stream_char(char c) noexcept
+{
+  switch (line_) {
+    case line::start:
+      if (c == '\r')
+        return;
+      if (c == '\n') {
+        // empty line dispatches the event
+        if (has_data_) {
+          ++stats_.events;
+          has_data_ = false;
+          json_tokenizer::reset();
+        }
+        return;
+      }
+      if (c == ':') {
+        line_ = line::skip;   // comment
+        return;
+      }
+      field_len_ = 0;
+      line_ = line::field;
+      // fall through
+
+    case line::field:
+      if (c == ':') {
+        field_[field_len_] = 0;
+        line_ = strcmp(field_, "data") ? line::skip : line::data;
+      } else if (c == '\n') {
+        line_ = line::start;
+      } else if (field_len_ < sizeof(field_) - 1) {
+        field_[field_len_++] = c;
+      }
+      return;
+
+    case line::data:
+      // data of multiple lines are joined with newlines, which the tokenizer skips
+      if (c == '\n')
+        line_ = line::start;
+      if (c != '\r') {
+        has_data_ = true;
+        parse(&c, 1);
+      }
+      return;
+
+    case line::skip:
+      if (c == '\n')
+        line_ = line::start;
+      return;
+  }
+}
+
+void light_state_cache::handle_token(token type, const char* text, uint8_t) noexcept
+{
+  // [{"type":"update","data":[{"id_v1":"/lights/5","on":{"on":true},"dimming":{"brightness":50.0}}]}]
+  switch (depth()) {
+    case 2:
+      if (type == token::key)
+        in_data_ = !strcmp(text, "data");
+      break;
+
+    case 3:
+      if (!in_data_)
+        break;
+      if (type == token::begin_object) {
+        has_resource_ = false;
+        resource_has_on_ = false;
+        resource_bri_ = 0;
+        member_ = member::other;
+      } else if (type == token::end_object && has_resource_) {
+        if (update(resource_group_, resource_id_, resource_has_on_, resource_on_, resource_bri_))
+          ++stats_.updates;
+      }
+      break;
+
+    case 4:
+      if (!in_data_)
+        break;
+      if (type == token::key) {
+        if (!strcmp(text, "id_v1"))
+          member_ = member::id_v1;
+        else if (!strcmp(text, "on"))
+          member_ = member::on;
+        else if (!strcmp(text, "dimming"))
+          member_ = member::dimming;
+        else
+          member_ = member::other;
+        key_[0] = 0;
+      } else if (type == token::string && member_ == member::id_v1) {
+        unsigned id;
+        if (sscanf(text, "/lights/%u", &id) == 1)
+          resource_group_ = false;
+        else if (sscanf(text, "/groups/%u", &id) == 1)
+          resource_group_ = true;
+        else
+          break;
+        has_resource_ = id <= 0xffff;
+        resource_id_ = uint16_t(id);
+      }
+      break;
+
+    case 5:
+      if (!in_data_)
+        break;
+      if (type == token::key) {
+        snprintf(key_, sizeof(key_), "%s", text);
+      } else if (type == token::literal && member_ == member::on && !strcmp(key_, "on")) {
+        resource_has_on_ = true;
+        resource_on_ = text[0] == 't';
+      } else if (type == token::number && member_ == member::dimming && !strcmp(key_, "brightness")) {
+        // percent in v2, 1-254 in v1
+        auto bri = lround(atof(text) * 2.54);
+        resource_bri_ = uint8_t(bri < 1 ? 1 : bri > 254 ? 254 : bri);
+      }
+      break;
+  }
+}
+
+void light_state_cache::snapshot::handle_token(token type, const char* text, uint8_t) noexcept
+{
+  // {"5":{"state":{"on":true,"bri":127,...},...},...} for lights,
+  // {"1":{"state":{"all_on":false,"any_on":true},"action":{"on":true,"bri":254,...},...},...} for groups
+  switch (depth()) {
+    case 1:
+      if (type == token::key) {
+        auto id = strtoul(text, nullptr, 10);
+        entry_ = id <= 0xffff;
+        id_ = uint16_t(id);
+        group_ = false;
+        has_on_ = false;
+        bri_ = 0;
+      } else if (type == token::end_object && entry_) {
+        parent_.update(group_, id_, has_on_, on_, bri_);
+        entry_ = false;
+      }
+      break;
+
+    case 2:
+      if (type == token::key) {
+        in_state_ = !strcmp(text, "state");
+        in_action_ = !strcmp(text, "action");
+      }
+      break;
+
+    case 3:
+      if (type == token::key) {
+        snprintf(key_, sizeof(key_), "%s", text);
+      } else if (in_state_ && type == token::literal && !strcmp(key_, "on")) {
+        has_on_ = true;
+        on_ = text[0] == 't';
+      } else if (in_state_ && type == token::literal && !strcmp(key_, "any_on")) {
+        group_ = true;
+        has_on_ = true;
+        on_ = text[0] == 't';
+      } else if ((in_state_ || in_action_) && type == token::number && !strcmp(key_, "bri")) {
+        auto bri = atoi(text);
+        bri_ = uint8_t(bri < 1 ? 1 : bri > 254 ? 254 : bri);
+      }
+      break;
+  }
+}
+
+void light_state_cache::fail(const char* what) noexcept
+{
+  auto ip = connection_.ip();
+  auto ip_addr = reinterpret_cast<const unsigned char*>(&ip);
+  syslog_printf(LOG_WARNING, "EnOcean bridge %u.%u.%u.%u: event stream: %s, retrying in %lld s",
+      ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], what, (long long)(RETRY_INTERVAL / 1000));
+  ++stats_.failures;
+  close_stream();
+  state_ = state::idle;
+  deadline_ = connection_.timestamp() + RETRY_INTERVAL;
+}
+
+#ifdef WITH_TLS
+
+ssl_ctx_st* light_state_cache::tls_context()
+{
+  static SSL_CTX* ctx = nullptr;
+  if (ctx)
+    return ctx;
+  ctx = SSL_CTX_new(TLS_client_method());
+  if (!ctx)
+    throw std::runtime_error("Cannot create TLS context");
+  // the bridge is authenticated by the certificate pinned by its connection
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
+  return ctx;
+}
+
+bool light_state_cache::handshake() noexcept
+{
+  if (!ssl_) {
+    try {
+      ssl_ = SSL_new(tls_context());
+    } catch (std::exception&) {
+    }
+    if (!ssl_) {
+      fail("cannot create TLS connection");
+      return false;
+    }
+    SSL_set_fd(ssl_, fd_);
+    SSL_set_connect_state(ssl_);
+  }
+  ERR_clear_error();
+  auto res = SSL_do_handshake(ssl_);
+  if (res != 1) {
+    auto err = SSL_get_error(ssl_, res);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+      want_read_ = err == SSL_ERROR_WANT_READ;
+    else
+      fail("TLS handshake failed");
+    return false;
+  }
+  auto pinned = bridge_.fingerprint();
+  if (!pinned) {
+    // never send the API key to a bridge which wasn't authenticated
+    fail("no pinned TLS certificate");
+    return false;
+  }
+  auto cert = SSL_get_peer_certificate(ssl_);
+  uint8_t md[EVP_MAX_MD_SIZE];
+  unsigned md_len = 0;
+  bool ok = cert && X509_digest(cert, EVP_sha256(), md, &md_len) && md_len == 32 && !memcmp(pinned, md, 32);
+  if (cert)
+    X509_free(cert);
+  if (!ok)
+    fail("TLS certificate does not match the pinned one");
+  return ok;
+}
+
+void light_state_cache::close_stream() noexcept
+{
+  if (ssl_) {
+    SSL_free(ssl_);
+    ssl_ = nullptr;
+  }
+  if (fd_ >= 0) {
+    watcher_.forget();
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+#else
+
+bool light_state_cache::handshake() noexcept
+{
+  fail("HTTPS support not compiled in");
+  return false;
+}
+
+void light_state_cache::close_stream() noexcept
+{
+  if (fd_ >= 0) {
+    watcher_.forget();
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+#endif
@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Cache of on/brightness state of lights and groups of a Hue bridge.
+ */
+#pragma once
+
+#include "hue_sensor_command_posix.hpp"
+#include "command_mapping.hpp"
+#include "embedded/json_tokenizer.hpp"
+
+struct ssl_st;
+struct ssl_ctx_st;
+
+/*!
+ * @brief Cache of on/brightness state of lights and groups of a Hue bridge.
+ *
+ * Actions like toggling a light depend on its current state. Instead of
+ * building them from rules on the bridge, the state of lights and groups
+ * targeted by such actions is kept in a compact table, so the action can
+ * be resolved locally and sent as one direct action.
+ *
+ * The table is updated incrementally from the event stream of the bridge
+ * (server-sent events of the v2 API, <tt>GET /eventstream/clip/v2</tt>),
+ * which is kept open over its own connection. Changes are matched to
+ * targets by their v1 ID (<tt>id_v1</tt>). Events are not stored by the
+ * bridge, so after each (re)connect of the stream, the state of lights
+ * and groups is fetched once via the v1 API. There is no periodic polling.
+ * Resolved actions update the table right away, so a fast second press
+ * sees the effect of the first one.
+ *
+ * The stream and the responses are parsed while they arrive, without
+ * allocating memory.
+ */
+class light_state_cache : private json_tokenizer
+{
+public:
+  /// Maximum count of tracked lights and groups.
+  static constexpr uint8_t MAX_TARGETS = 64;
+  /// Give up connecting the event stream after 5 seconds.
+  static constexpr int64_t CONNECT_TIMEOUT = 5000;
+  /// Reconnect a failed event stream after 10 seconds.
+  static constexpr int64_t RETRY_INTERVAL = 10000;
+
+  /// Statistics of the cache.
+  struct statistics
+  {
+    uint32_t events;        ///< Events received.
+    uint32_t updates;       ///< Updates of tracked targets by events.
+    uint32_t connects;      ///< Event streams established.
+    uint32_t failures;      ///< Failed or broken event streams.
+    uint32_t resolved;      ///< Actions resolved.
+    uint32_t unknown;       ///< Actions resolved without known state.
+  };
+
+  /*!
+   * @brief Construct state cache of a bridge.
+   *
+   * @param bridge connection to the bridge, whose address and settings to use,
+   *    which must stay valid (the stream checks its pinned certificate).
+   */
+  explicit light_state_cache(const hue_sensor_command_posix& bridge);
+
+  virtual ~light_state_cache() noexcept;
+
+  light_state_cache(const light_state_cache&) = delete;
+  light_state_cache& operator=(const light_state_cache&) = delete;
+
+  /// Track state of a light or group before start(), throw if too many.
+  void track(bool group, uint16_t id);
+
+  /// Start connecting the event stream.
+  void start() noexcept;
+
+  /*!
+   * @brief Resolve an action by the state of its target and update the state.
+   *
+   * An unknown state is handled as off.
+   *
+   * @param action action on a tracked target.
+   * @return index of the direct action to send or -1 if none.
+   */
+  int apply(const command_mapping::state_action& action) noexcept;
+
+  /// Connect to another address of the bridge.
+  void readdress(uint32_t ip);
+
+  /// Get connection used to fetch the state after connecting the event stream.
+  hue_sensor_command_posix& connection() noexcept { return connection_; }
+
+  /// Get FD of the event stream to poll on, if any.
+  int get_fd() const noexcept { return fd_; }
+
+  /// Get events to poll for.
+  short get_events() const noexcept;
+
+  /*!
+   * @brief Watch the event stream and the connection in an event loop.
+   *
+   * @param loop event loop, which must outlive the cache, or @c nullptr
+   *    to let the caller poll.
+   */
+  void set_event_loop(event_loop* loop) noexcept;
+
+  /*!
+   * @brief Schedule reconnects and connect timeouts in a timer wheel.
+   *
+   * The connection fetching the state is scheduled in the same wheel.
+   *
+   * @param wheel timer wheel, which must outlive the cache.
+   */
+  void set_timer_wheel(timer_wheel* wheel) noexcept;
+
+  /// Process data of the event stream.
+  void poll() noexcept;
+
+  /// Get statistics.
+  const statistics& stats() const noexcept { return stats_; }
+
+private:
+  /// Deadline for fetching the state (in milliseconds).
+  static constexpr int64_t FETCH_DEADLINE = 10000;
+  /// Timeout for receiving the state of all lights or groups (in milliseconds).
+  static constexpr int64_t FETCH_TIMEOUT = 15000;
+
+  /// State of a light or group.
+  struct target
+  {
+    uint16_t id;        ///< Light or group ID.
+    bool group;         ///< Set for a group.
+    bool known;         ///< Set if the state is known.
+    bool on;            ///< Set if on (any light on for groups).
+    uint8_t bri;        ///< Brightness (1-254).
+  };
+
+  /// State of the event stream.
+  enum class state : uint8_t
+  {
+    idle,         ///< Not connected, waiting to retry.
+    connecting,   ///< TCP connection in progress.
+    handshake,    ///< TLS handshake in progress.
+    sending,      ///< Sending the request.
+    headers,      ///< Reading status line and headers.
+    streaming     ///< Reading events.
+  };
+
+  /// Framing of the response body.
+  enum class framing : uint8_t
+  {
+    raw,          ///< Body terminated by EOF.
+    chunk_size,   ///< Reading chunk size line.
+    chunk_data,   ///< Reading chunk data.
+    chunk_end     ///< Reading CRLF after chunk data.
+  };
+
+  /// Position in a line of the event stream.
+  enum class line : uint8_t
+  {
+    start,        ///< At the start of a line.
+    field,        ///< Reading field name.
+    data,         ///< Reading value of a data field.
+    skip          ///< Skipping the rest of the line.
+  };
+
+  /// Member of a resource in an event being parsed.
+  enum class member : uint8_t
+  {
+    other, id_v1, on, dimming
+  };
+
+  /// Tokenizer of the state fetched via the v1 API.
+  class snapshot : public json_tokenizer
+  {
+  public:
+    explicit snapshot(light_state_cache& parent) noexcept : parent_(parent) {}
+
+  private:
+    virtual void handle_token(token type, const char* text, uint8_t size) noexcept override;
+
+    light_state_cache& parent_;
+    /// Set if inside of an entry.
+    bool entry_ = false;
+    /// ID of the current light or group.
+    uint16_t id_ = 0;
+    /// Set if inside of the state object of the entry.
+    bool in_state_ = false;
+    /// Set if inside of the action object of a group.
+    bool in_action_ = false;
+    /// Current key.
+    char key_[8] = "";
+    /// Set if the entry is a group (has any_on).
+    bool group_ = false;
+    /// Set if the on state was parsed.
+    bool has_on_ = false;
+    /// Set if on.
+    bool on_ = false;
+    /// Brightness (0 if not known).
+    uint8_t bri_ = 0;
+  };
+
+  /// Handle a token of an event.
+  virtual void handle_token(token type, const char* text, uint8_t size) noexcept override;
+
+  /// Find a tracked target, return @c nullptr if not tracked.
+  target* find(bool group, uint16_t id) noexcept;
+
+  /// Update a tracked target, if any (bri 0 keeps brightness).
+  bool update(bool group, uint16_t id, bool set_on, bool on, uint8_t bri) noexcept;
+
+  /// Timer calling check_timeouts().
+  class timeout : public timer_wheel::timer
+  {
+  public:
+    explicit timeout(light_state_cache& parent) noexcept : parent_(parent) {}
+
+  private:
+    virtual void expired(int64_t now) override { parent_.check_timeouts(now); }
+
+    light_state_cache& parent_;
+  };
+
+  /// Handle timeouts and reconnects.
+  void check_timeouts(int64_t now) noexcept;
+
+  /// Update interest in events and schedule the timer for the next timeout, if any.
+  void arm_timer() noexcept;
+
+  /// Start connecting the event stream.
+  void connect_stream(int64_t now) noexcept;
+
+  /// Continue TLS handshake, return true when done.
+  bool handshake() noexcept;
+
+  /// Send the request.
+  void send_request() noexcept;
+
+  /// Process data of the response.
+  void process(const char* data, size_t size) noexcept;
+
+  /// Process complete line of the response header.
+  void header_line() noexcept;
+
+  /// Process a character of the event stream.
+  void stream_char(char c) noexcept;
+
+  /// Log a failure, close the stream and retry later.
+  void fail(const char* what) noexcept;
+
+  /// Close the stream, if any.
+  void close_stream() noexcept;
+
+  /// Update interest in events of the event stream in the event loop.
+  void update_interest() noexcept { watcher_.watch(fd_, uint32_t(get_events())); }
+
+  /// Get TLS context shared by all event streams.
+  static ssl_ctx_st* tls_context();
+
+  /// Bridge whose settings to use.
+  const hue_sensor_command_posix& bridge_;
+  /// Connection to fetch the state.
+  hue_sensor_command_posix connection_;
+  /// Tokenizer of the fetched state.
+  snapshot snapshot_{*this};
+  /// Tracked lights and groups.
+  target targets_[MAX_TARGETS];
+  /// Count of tracked lights and groups.
+  uint8_t target_count_ = 0;
+  /// Set if started.
+  bool started_ = false;
+  /// State of the event stream.
+  state state_ = state::idle;
+  /// Framing of the response body.
+  framing framing_ = framing::raw;
+  /// Position in the current line of the event stream.
+  line line_ = line::start;
+  /// Set if the current event has data.
+  bool has_data_ = false;
+  /// Set if TLS handshake waits for data to read.
+  bool want_read_ = false;
+  /// HTTP status of the response.
+  uint16_t status_ = 0;
+  /// Remaining length of the current chunk.
+  uint32_t remaining_ = 0;
+  /// Socket of the event stream, if any.
+  int fd_ = -1;
+  /// TLS connection, if any.
+  ssl_st* ssl_ = nullptr;
+  /// Time of the next connect attempt or of the connect timeout.
+  int64_t deadline_ = 0;
+  /// Request to send.
+  char request_[256];
+  /// Length of the request.
+  uint16_t request_len_ = 0;
+  /// Bytes of the request sent.
+  uint16_t request_sent_ = 0;
+  /// Current line of the response header or chunk size (truncated).
+  char header_[64];
+  /// Length of the current header line.
+  uint8_t header_len_ = 0;
+  /// Name of the current field of the event stream (truncated).
+  char field_[8];
+  /// Length of the name of the current field.
+  uint8_t field_len_ = 0;
+  /// Set if inside of the data array of an event.
+  bool in_data_ = false;
+  /// Member of the resource being parsed.
+  member member_ = member::other;
+  /// Key inside of the member being parsed.
+  char key_[12];
+  /// Set if the v1 ID of the resource was parsed.
+  bool has_resource_ = false;
+  /// v1 ID of the resource.
+  uint16_t resource_id_ = 0;
+  /// Set if the resource is a group.
+  bool resource_group_ = false;
+  /// Set if on state of the resource was parsed.
+  bool resource_has_on_ = false;
+  /// On state of the resource.
+  bool resource_on_ = false;
+  /// Brightness of the resource (0 if not parsed).
+  uint8_t resource_bri_ = 0;
+  /// Statistics.
+  statistics stats_ = {};
+  /// Timer wheel to schedule timeouts in, if any.
+  timer_wheel* wheel_ = nullptr;
+  /// Timer of the next timeout.
+  timeout timer_{*this};
+
+  /// Handler of events on the event stream.
+  class watcher : public event_loop::handler
+  {
+  public:
+    explicit watcher(light_state_cache& parent) noexcept : parent_(parent) {}
+
+  private:
+    virtual void ready(uint32_t) override
+    {
+      parent_.poll();
+      parent_.arm_timer();
+    }
+
+    light_state_cache& parent_;
+  };
+
+  /// Handler of events in the event loop, if any.
+  watcher watcher_{*this};
+};
@@ -18,12 +18,14 @@
  */
 
 #include "enocean_to_hue_bridge.hpp"
+#include "syslog_posix.hpp"
 
+#include <cctype>
 #include <iostream>
+#include <string>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/wait.h>
-#include <syslog.h>
 
 static int64_t timestamp() noexcept
 {
@@ -35,7 +37,50 @@ static int64_t timestamp() noexcept
 static void usage(const char* name)
 {
   std::cerr << "Usage: " << name <<
-      " <usb300 port> <mapping file> <bridge IP> <API key> <sensor ID> [<bridge IP> <API key> <sensor ID>]...\n";
+      " <usb300 port> <mapping file> <bridge IP> <API key> <sensor ID> [<bridge IP> <API key> <sensor ID>]...\n"
+      "Bridge IP can be specified as https://<IP>/<SHA-256 certificate fingerprint> to use HTTPS.\n"
+      "Instead of bridge IP, the bridge ID (16 hex digits) can be specified to find the bridge via mDNS.\n";
+}
+
+/// Check whether a bridge address is a bridge ID.
+static bool is_bridge_id(const std::string& address) noexcept
+{
+  if (address.size() != 16)
+    return false;
+  for (auto c : address) {
+    if (!isxdigit(static_cast<unsigned char>(c)))
+      return false;
+  }
+  return true;
+}
+
+/// Parse hex certificate fingerprint, optionally with colons between bytes.
+static bool parse_fingerprint(const char* str, uint8_t* fingerprint, size_t size) noexcept
+{
+  size_t len = 0;
+  int nibble = -1;
+  for (; *str; ++str) {
+    int digit;
+    if (*str >= '0' && *str <= '9')
+      digit = *str - '0';
+    else if (*str >= 'a' && *str <= 'f')
+      digit = *str - 'a' + 10;
+    else if (*str >= 'A' && *str <= 'F')
+      digit = *str - 'A' + 10;
+    else if (*str == ':' && nibble < 0)
+      continue;
+    else
+      return false;
+    if (nibble < 0) {
+      nibble = digit;
+    } else {
+      if (len == size)
+        return false;
+      fingerprint[len++] = uint8_t(nibble * 16 + digit);
+      nibble = -1;
+    }
+  }
+  return len == size && nibble < 0;
 }
 
 int main(int argc, const char** argv)
@@ -50,14 +95,47 @@ int main(int argc, const char** argv)
   argv += 3;
   argc -= 3;
   std::deque<hue_sensor_command_posix> bridges;
+  std::deque<std::string> bridge_ids;
   while (argc >= 3) {
     if (bridges.size() == 8) {
       std::cerr << "At most 8 bridges are supported\n";
       usage(progname);
       return 1;
     }
+    std::string address = argv[0];
+    bool tls = false;
+    uint8_t fingerprint[32];
+    if (address.compare(0, 8, "https://") == 0) {
+      if (!hue_sensor_command_posix::tls_supported()) {
+        std::cerr << "HTTPS support not compiled in\n";
+        return 1;
+      }
+      tls = true;
+      address.erase(0, 8);
+      auto slash = address.find('/');
+      if (slash == std::string::npos) {
+        // the API key must not be sent to a bridge which wasn't authenticated
+        std::cerr << "SHA-256 certificate fingerprint missing in '" << argv[0] << "'\n";
+        usage(progname);
+        return 1;
+      }
+      if (!parse_fingerprint(address.c_str() + slash + 1, fingerprint, sizeof(fingerprint))) {
+        std::cerr << "Cannot parse SHA-256 certificate fingerprint in '" << argv[0] << "'\n";
+        usage(progname);
+        return 1;
+      }
+      address.resize(slash);
+    }
     struct in_addr bridge_addr;
-    if (!inet_aton(argv[0], &bridge_addr)) {
+    const char* bridge_id = nullptr;
+    if (is_bridge_id(address)) {
+      // resolved by bridge ID at runtime
+      for (auto& c : address)
+        c = char(tolower(c));
+      bridge_ids.push_back(address);
+      bridge_id = bridge_ids.back().c_str();
+      bridge_addr.s_addr = 0;
+    } else if (!inet_aton(address.c_str(), &bridge_addr)) {
       std::cerr << "Cannot parse bridge IP address '" << argv[0] << "'\n";
       usage(progname);
       return 1;
@@ -73,6 +151,10 @@ int main(int argc, const char** argv)
     }
     sensor_id = int(id);
     bridges.emplace_back(bridge_addr.s_addr, argv[1], sensor_id);
+    if (tls)
+      bridges.back().enable_tls(fingerprint);
+    if (bridge_id)
+      bridges.back().set_bridge_id(bridge_id);
     argv += 3;
     argc -= 3;
   }
@@ -83,8 +165,8 @@ int main(int argc, const char** argv)
     return 1;
   }
 
-  setlogmask(LOG_UPTO(LOG_INFO));
-  openlog("enocean_to_hue", LOG_CONS | LOG_PID | LOG_PERROR, LOG_LOCAL1);
+  syslog_setmask(LOG_UPTO(LOG_INFO));
+  syslog_open("enocean_to_hue", LOG_CONS | LOG_PID | LOG_PERROR, LOG_LOCAL1);
 
   uint32_t respawn_cnt = 0;
   for (;;)
@@ -93,25 +175,25 @@ int main(int argc, const char** argv)
     auto pid = fork();
     if (!pid) {
       // child process, run the bridge
-      openlog("enocean_to_hue", LOG_CONS | LOG_PID | LOG_PERROR, LOG_LOCAL1);
+      syslog_open("enocean_to_hue", LOG_CONS | LOG_PID | LOG_PERROR, LOG_LOCAL1);
       try {
         enocean_to_hue_bridge bridge(serial_port, bridges, config_file);
         bridge.run_poll_loop();
       } catch (std::exception& e) {
-        syslog(LOG_ERR, "EnOcean ERROR: %s", e.what());
+        syslog_printf(LOG_ERR, "EnOcean ERROR: %s", e.what());
       }
       return 1;
     }
 
     // parent process, wait for child
-    syslog(LOG_INFO, "EnOcean Started child process %d", pid);
+    syslog_printf(LOG_INFO, "EnOcean Started child process %d", pid);
     int status;
     auto cpid = wait(&status);
     auto end_time = timestamp();
     auto delta = end_time - start_time;
-    syslog(LOG_ERR, "EnOcean Child process %d exited with status %d after %lld ms", cpid, status, delta);
+    syslog_printf(LOG_ERR, "EnOcean Child process %d exited with status %d after %lld ms", cpid, status, (long long)delta);
     if (pid != cpid) {
-      syslog(LOG_ERR, "EnOcean Wrong PID %d of terminated process, expected %d", cpid, pid);
+      syslog_printf(LOG_ERR, "EnOcean Wrong PID %d of terminated process, expected %d", cpid, pid);
       return 1;
     }
 
@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "master_cluster.hpp"
+#include "syslog_posix.hpp"
+
+#include <cstring>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+void master_cluster::configure(
+    int fd, const uint32_t* addrs, const uint16_t* ports, uint8_t count,
+    uint8_t self, timestamp_t window, timestamp_t now) noexcept
+{
+  fd_ = fd;
+  count_ = count;
+  self_ = self;
+  window_ = window < 40 ? 40 : window;  // need some time for heartbeats
+  next_heartbeat_ = 0;
+  configured_ = now;
+  memcpy(addrs_, addrs, count * sizeof(addrs_[0]));
+  memcpy(ports_, ports, count * sizeof(ports_[0]));
+  memset(seen_, 0, sizeof(seen_));
+  memset(offset_, 0, sizeof(offset_));
+  memset(commands_, 0, sizeof(commands_));
+  last_sender_ = 0;
+}
+
+bool master_cluster::is_alive(uint8_t master, timestamp_t now) const noexcept
+{
+  if (master == self_)
+    return true;
+  if (!seen_[master])
+    return now - configured_ < window_;  // give peers a window to send their heartbeats
+  return now - last_seen_[master] < window_;
+}
+
+uint8_t master_cluster::owner(uint32_t sender, timestamp_t now) const noexcept
+{
+  auto start = uint8_t(sender % count_);
+  for (uint8_t i = 0; i < count_; ++i) {
+    auto master = uint8_t((start + i) % count_);
+    if (is_alive(master, now))
+      return master;
+  }
+  return self_; // not reached, self is always alive
+}
+
+master_cluster::entry& master_cluster::find(uint32_t sender, int32_t value, timestamp_t now)
+{
+  entry* victim = nullptr;
+  for (auto& e : commands_) {
+    if (e.sender == sender && e.value == value && (e.pending || now - e.deadline < 0))
+      return e;
+    if (!victim || !e.sender || (victim->sender && e.deadline - victim->deadline < 0))
+      victim = &e;  // prefer free entry, else the one with earliest deadline
+  }
+  if (victim->sender && victim->pending) {
+    // table full of pending commands, don't lose the oldest one
+    post(victim->sender, victim->value, victim->bridge_set, victim->priority);
+    handled(victim->sender, victim->value, now);
+  }
+  memset(victim, 0, sizeof(*victim));
+  return *victim;
+}
+
+bool master_cluster::command(uint32_t sender, int32_t value, uint8_t bridge_set,
+    rate_limiter::priority priority, timestamp_t now)
+{
+  if (!enabled())
+    return true;
+
+  auto& e = find(sender, value, now);
+  if (e.sender && !e.pending) {
+    // another master already posted it
+    syslog_printf(LOG_INFO, "EnOcean cluster: command %d already handled by a peer", value);
+    return false;
+  }
+
+  auto o = owner(sender, now);
+  if (o == self_) {
+    handled(sender, value, now);
+    memset(&e, 0, sizeof(e));
+    return true;
+  }
+
+  // wait for the owner's note
+  e.sender = sender;
+  e.value = value;
+  e.bridge_set = bridge_set;
+  e.priority = priority;
+  e.owner = o;
+  e.pending = true;
+  e.deadline = now + window_;
+  e.received = now;
+  syslog_printf(LOG_INFO, "EnOcean cluster: command %d pending for master %u", value, o + 1);
+  return false;
+}
+
+bool master_cluster::message(const void* data, size_t size, timestamp_t now)
+{
+  if (size != sizeof(note))
+    return false;
+  note msg;
+  memcpy(&msg, data, sizeof(msg));
+  if (msg.magic != MAGIC)
+    return false;
+  if (msg.master >= count_ || msg.master == self_)
+    return true;  // ignore invalid or own message
+
+  // the message with the shortest delay gives the best estimate of the
+  // peer's clock, re-estimate after the peer was silent (e.g., restarted)
+  auto timestamp = ntohl(msg.timestamp);
+  auto offset = int32_t(timestamp - uint32_t(now));
+  if (!seen_[msg.master] || !is_alive(msg.master, now) || offset - offset_[msg.master] > 0)
+    offset_[msg.master] = offset;
+  seen_[msg.master] = true;
+  last_seen_[msg.master] = now;
+  auto sender = ntohl(msg.sender);
+  if (msg.type == message_type::handled || sender) {
+    auto value = int32_t(ntohl(uint32_t(msg.value)));
+    // age of the note on own clock, regardless of its transport delay
+    auto handled_time = timestamp - ntohs(msg.age);
+    auto age = int32_t(uint32_t(now) + uint32_t(offset_[msg.master]) - handled_time);
+    if (age < 0)
+      age = 0;
+    if (age >= window_) {
+      syslog_printf(LOG_INFO, "EnOcean cluster: ignoring stale note of command %d from master %u, age %d ms",
+          value, msg.master + 1, int(age));
+      return true;
+    }
+    auto& e = find(sender, value, now);
+    e.sender = sender;
+    e.value = value;
+    e.pending = false;
+    e.deadline = now - age + window_;
+  }
+  return true;
+}
+
+void master_cluster::forward(const enocean_event& event) noexcept
+{
+  if (enabled())
+    send_to_peers(&event, sizeof(event.hdr) + event.hdr.total_size());
+}
+
+void master_cluster::send_to_peers(const void* data, size_t size) noexcept
+{
+  for (uint8_t i = 0; i < count_; ++i) {
+    if (i == self_)
+      continue;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = addrs_[i];
+    addr.sin_port = ports_[i];
+    // lost messages are handled by timeouts, so ignore errors
+    sendto(fd_, data, size, MSG_DONTWAIT, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+  }
+}
+
+void master_cluster::send(message_type type, uint32_t sender, int32_t value, timestamp_t now,
+    uint16_t age) noexcept
+{
+  note msg;
+  msg.magic = MAGIC;
+  msg.type = type;
+  msg.master = self_;
+  msg.age = htons(age);
+  msg.sender = htonl(sender);
+  msg.value = int32_t(htonl(uint32_t(value)));
+  msg.timestamp = htonl(uint32_t(now));
+  send_to_peers(&msg, sizeof(msg));
+}
+
+void master_cluster::handled(uint32_t sender, int32_t value, timestamp_t now) noexcept
+{
+  send(message_type::handled, sender, value, now);
+  last_sender_ = sender;
+  last_value_ = value;
+  last_time_ = now;
+}
+
+void master_cluster::poll(timestamp_t now)
+{
+  if (!enabled())
+    return;
+  if (now - next_heartbeat_ >= 0) {
+    // repeat the last note within the window, in case it was lost
+    auto age = now - last_time_;
+    if (last_sender_ && age < window_ && age < 65536)
+      send(message_type::heartbeat, last_sender_, last_value_, now, uint16_t(age));
+    else
+      send(message_type::heartbeat, 0, 0, now);
+    next_heartbeat_ = now + window_ / 4;
+  }
+  for (auto& e : commands_) {
+    if (!e.pending || now - e.deadline < 0)
+      continue;
+    auto o = owner(e.sender, now);
+    if (o == self_ || o == e.owner || now - e.received >= count_ * window_) {
+      // owner is silent about this command or it is pending too long, take over
+      syslog_printf(LOG_WARNING, "EnOcean cluster: taking over command %d from master %u",
+          e.value, e.owner + 1);
+      post(e.sender, e.value, e.bridge_set, e.priority);
+      handled(e.sender, e.value, now);
+      memset(&e, 0, sizeof(e));
+    } else {
+      // owner died, wait for the new owner
+      e.owner = o;
+      e.deadline = now + window_;
+    }
+  }
+}
+
+master_cluster::timestamp_t master_cluster::next_timeout(timestamp_t now) const noexcept
+{
+  timestamp_t timeout = 600000;
+  if (!enabled())
+    return timeout;
+  auto delta = next_heartbeat_ - now;
+  if (delta < timeout)
+    timeout = delta;
+  for (auto& e : commands_) {
+    if (e.pending && e.deadline - now < timeout)
+      timeout = e.deadline - now;
+  }
+  return timeout < 0 ? 0 : timeout;
+}
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Cluster of active/active masters sharing duplicate suppression.
+ */
+#pragma once
+
+#include "embedded/enocean.hpp"
+#include "embedded/hue_sensor_command.hpp"
+#include "embedded/rate_limiter.hpp"
+
+#include <cstddef>
+
+/*!
+ * @brief Cluster of active/active masters sharing duplicate suppression.
+ *
+ * Repeaters send telegrams to all masters and masters forward telegrams
+ * received locally to their peers, so every master sees every telegram.
+ * For each sender, the owner is the first live master in an order rotated
+ * by the sender ID. The owner posts the command immediately and sends an
+ * "already handled" note (sender, value, timestamp) to its peers. Other
+ * masters keep the command pending until the note arrives and drop it.
+ * So there is no extra round trip in the common case.
+ *
+ * Masters send heartbeats to each other every quarter of the window.
+ * A master which was not heard from within the window is considered dead.
+ * After configuration, peers are considered alive for one window until
+ * their heartbeats arrive, so a restarted master doesn't post commands
+ * owned by its peers.
+ * If a pending command doesn't get its note within the window, the owner
+ * is recomputed and the command is posted by the new owner, so a master
+ * takes over within one duplicate filter window. A command is pending for
+ * at most one window per master, then this master takes over regardless.
+ *
+ * Heartbeats repeat the last handled note within the window, so a single
+ * lost note doesn't cause a duplicate post. Masters' clocks are not
+ * synchronized, so the clock offset of each peer is estimated from its
+ * messages with the shortest delay. Notes older than the window, e.g.,
+ * delayed or reordered ones, are ignored and a note only suppresses the
+ * command until the window since it was handled ends.
+ *
+ * All messages are sent over the proxy UDP socket.
+ */
+class master_cluster
+{
+public:
+  using timestamp_t = hue_sensor_command::timestamp_t;
+
+  /// Maximum count of masters in the cluster.
+  static constexpr uint8_t MAX_MASTERS = 8;
+  /// Maximum count of commands tracked at once.
+  static constexpr uint8_t MAX_COMMANDS = 32;
+
+  virtual ~master_cluster() noexcept {}
+
+  /*!
+   * @brief Configure the cluster.
+   *
+   * @param fd UDP socket to send messages on.
+   * @param addrs,ports addresses and ports of all masters (in network order) in cluster order.
+   * @param count count of masters.
+   * @param self index of this master.
+   * @param window duplicate filter window in milliseconds.
+   * @param now current timestamp.
+   */
+  void configure(int fd, const uint32_t* addrs, const uint16_t* ports, uint8_t count,
+                 uint8_t self, timestamp_t window, timestamp_t now) noexcept;
+
+  /// Check whether the cluster is active.
+  bool enabled() const noexcept { return count_ > 1; }
+
+  /*!
+   * @brief Decide whether to post a new command.
+   *
+   * @param sender,value,bridge_set,priority command to post.
+   * @param now current timestamp.
+   * @return @c true, if this master shall post the command now, @c false
+   *    if the command was already handled or is pending for its owner.
+   */
+  bool command(uint32_t sender, int32_t value, uint8_t bridge_set, rate_limiter::priority priority,
+               timestamp_t now);
+
+  /*!
+   * @brief Handle a message received on the proxy socket.
+   *
+   * @param data,size message data.
+   * @param now current timestamp.
+   * @return @c true, if this was a cluster message, @c false otherwise.
+   */
+  bool message(const void* data, size_t size, timestamp_t now);
+
+  /// Forward a locally-received telegram to peers.
+  void forward(const enocean_event& event) noexcept;
+
+  /// Send heartbeats and process expired pending commands.
+  void poll(timestamp_t now);
+
+  /// Get milliseconds until next call to poll() is needed.
+  timestamp_t next_timeout(timestamp_t now) const noexcept;
+
+private:
+  /// Post a command of a sender taken over from a silent owner.
+  virtual void post(uint32_t sender, int32_t value, uint8_t bridge_set, rate_limiter::priority priority) = 0;
+
+  /// Message types.
+  enum class message_type : uint8_t
+  {
+    heartbeat,    ///< Master is alive.
+    handled       ///< Command was posted by the sending master.
+  };
+
+  /// Message exchanged between masters.
+  struct note
+  {
+    uint32_t magic;         ///< Magic to recognize cluster messages.
+    message_type type;      ///< Message type.
+    uint8_t master;         ///< Index of sending master.
+    uint16_t age;           ///< Milliseconds since the command was handled (for repeated notes).
+    uint32_t sender;        ///< Sender of the handled telegram (0 if none).
+    int32_t value;          ///< Value posted.
+    uint32_t timestamp;     ///< Timestamp of the sending master.
+  };
+
+  /// State of a tracked command.
+  struct entry
+  {
+    uint32_t sender;        ///< Sender ID (0 if unused).
+    int32_t value;          ///< Value to post.
+    timestamp_t deadline;   ///< Deadline for pending command or expiry of handled one.
+    timestamp_t received;   ///< Time when the pending command was received.
+    uint8_t bridge_set;     ///< Bridges to post to.
+    rate_limiter::priority priority;  ///< Priority class of the command.
+    uint8_t owner;          ///< Owner the command is waiting for.
+    bool pending;           ///< Pending, waiting for the owner's note.
+  };
+
+  /// Magic number of cluster messages.
+  static constexpr uint32_t MAGIC = 0x4e434845; // "EHCN"
+
+  /// Determine owner of a sender.
+  uint8_t owner(uint32_t sender, timestamp_t now) const noexcept;
+
+  /// Check whether a master is alive.
+  bool is_alive(uint8_t master, timestamp_t now) const noexcept;
+
+  /// Find tracked command or a free entry for a new one.
+  entry& find(uint32_t sender, int32_t value, timestamp_t now);
+
+  /// Send raw data to all peers.
+  void send_to_peers(const void* data, size_t size) noexcept;
+
+  /// Send a message to all peers.
+  void send(message_type type, uint32_t sender, int32_t value, timestamp_t now, uint16_t age = 0) noexcept;
+
+  /// Inform peers about a command posted by this master.
+  void handled(uint32_t sender, int32_t value, timestamp_t now) noexcept;
+
+  /// Socket to send on.
+  int fd_ = -1;
+  /// Count of masters.
+  uint8_t count_ = 0;
+  /// Index of this master.
+  uint8_t self_ = 0;
+  /// Window for duplicates and liveness.
+  timestamp_t window_ = 200;
+  /// Time of next heartbeat.
+  timestamp_t next_heartbeat_ = 0;
+  /// Time when the cluster was configured.
+  timestamp_t configured_ = 0;
+  /// Addresses of masters (network order).
+  uint32_t addrs_[MAX_MASTERS];
+  /// Ports of masters (network order).
+  uint16_t ports_[MAX_MASTERS];
+  /// Time when a master was last heard from.
+  timestamp_t last_seen_[MAX_MASTERS];
+  /// Whether the master was ever heard from.
+  bool seen_[MAX_MASTERS];
+  /// Estimated clock of a master minus own clock.
+  int32_t offset_[MAX_MASTERS];
+  /// Sender of the last command handled by this master (0 if none).
+  uint32_t last_sender_ = 0;
+  /// Value of the last command handled by this master.
+  int32_t last_value_ = 0;
+  /// Time when the last command was handled by this master.
+  timestamp_t last_time_ = 0;
+  /// Tracked commands.
+  entry commands_[MAX_COMMANDS];
+};
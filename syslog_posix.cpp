@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "syslog_posix.hpp"
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <ctime>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+static int s_fd = -1;
+static int s_logopt = 0;
+static int s_facility = LOG_USER;
+static int s_mask = 0xff;
+static char s_ident[32] = "";
+
+static void syslog_connect()
+{
+  if (s_fd >= 0)
+    close(s_fd);
+  s_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (s_fd < 0)
+    return;
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, "/dev/log", sizeof(addr.sun_path) - 1);
+  if (connect(s_fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0) {
+    close(s_fd);
+    s_fd = -1;
+  }
+}
+
+void syslog_open(const char* ident, int logopt, int facility)
+{
+  strncpy(s_ident, ident, sizeof(s_ident) - 1);
+  s_ident[sizeof(s_ident) - 1] = 0;
+  s_logopt = logopt;
+  s_facility = facility;
+  syslog_connect();
+
+  // initialize time zone now, so formatting time later doesn't allocate
+  tzset();
+}
+
+void syslog_setmask(int mask)
+{
+  s_mask = mask;
+}
+
+void syslog_printf(int priority, const char* message, ...)
+{
+  if (!(LOG_MASK(LOG_PRI(priority)) & s_mask))
+    return;
+  if (!(priority & LOG_FACMASK))
+    priority |= s_facility;
+
+  char buffer[1024];
+  time_t now = time(nullptr);
+  struct tm tm;
+  localtime_r(&now, &tm);
+  auto len = snprintf(buffer, sizeof(buffer), "<%d>", priority);
+  len += strftime(buffer + len, sizeof(buffer) - len, "%h %e %T ", &tm);
+  auto msg_start = len;
+  if (s_logopt & LOG_PID)
+    len += snprintf(buffer + len, sizeof(buffer) - len, "%s[%d]: ", s_ident, int(getpid()));
+  else
+    len += snprintf(buffer + len, sizeof(buffer) - len, "%s: ", s_ident);
+
+  va_list arglist;
+  va_start(arglist, message);
+  len += vsnprintf(buffer + len, sizeof(buffer) - len, message, arglist);
+  va_end(arglist);
+  if (size_t(len) >= sizeof(buffer))
+    len = sizeof(buffer) - 1;
+
+  if (s_logopt & LOG_PERROR) {
+    struct iovec iov[2];
+    iov[0].iov_base = buffer + msg_start;
+    iov[0].iov_len = size_t(len - msg_start);
+    iov[1].iov_base = const_cast<char*>("\n");
+    iov[1].iov_len = 1;
+    if (writev(STDERR_FILENO, iov, 2) < 0) {
+      // nothing we can do
+    }
+  }
+
+  if (s_fd < 0)
+    syslog_connect();
+  if (s_fd >= 0 && send(s_fd, buffer, size_t(len), MSG_NOSIGNAL) >= 0)
+    return;
+
+  // syslog daemon may have been restarted, reconnect and retry once
+  syslog_connect();
+  if (s_fd >= 0 && send(s_fd, buffer, size_t(len), MSG_NOSIGNAL) >= 0)
+    return;
+
+  if ((s_logopt & LOG_CONS) && !(s_logopt & LOG_PERROR)) {
+    buffer[len] = '\n';
+    if (write(STDERR_FILENO, buffer + msg_start, size_t(len + 1 - msg_start)) < 0) {
+      // nothing we can do
+    }
+  }
+}
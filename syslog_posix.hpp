@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Allocation-free syslog client for POSIX systems.
+ *
+ * The C library's syslog() may allocate memory to format the message,
+ * so we send messages to the local syslog socket ourselves, formatting
+ * them on the stack. Priorities, facilities and options are the same
+ * as for syslog() (LOG_PID, LOG_CONS and LOG_PERROR are respected).
+ */
+#pragma once
+
+#include <syslog.h>
+
+/*!
+ * @brief Set syslog identifier and options.
+ *
+ * @param ident identifier/tag to send with each message.
+ * @param logopt bitmask log options, see openlog().
+ * @param facility default facility to log on.
+ */
+void syslog_open(const char* ident, int logopt, int facility);
+
+/*!
+ * @brief Set mask of priorities to log.
+ *
+ * @param mask mask, e.g., LOG_UPTO(LOG_INFO).
+ */
+void syslog_setmask(int mask);
+
+/*!
+ * @brief Log message to syslog.
+ *
+ * @param priority message priority, optionally OR-ed with facility.
+ * @param message message to log (printf-format).
+ */
+void syslog_printf(int priority, const char* message, ...) __attribute__((format(printf, 2, 3)));
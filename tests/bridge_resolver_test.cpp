@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Test of resolving bridge addresses via mDNS against a local responder.
+ *
+ * Only resolution via mDNS is implemented (no SSDP), so the responder
+ * stands in for the mDNS part of a Hue bridge.
+ */
+
+#include "test_support.hpp"
+#include "mdns_responder.hpp"
+#include "fake_hue_bridge.hpp"
+#include "bridge_resolver.hpp"
+#include "hue_sensor_command_posix.hpp"
+
+#include <cstdio>
+
+/// Bridge ID announced by the responder.
+static constexpr char BRIDGE_ID[] = "001788fffe123456";
+
+/// Resolver watched in the test loop, recording resolved addresses.
+class test_resolver : public bridge_resolver, public event_loop::handler
+{
+public:
+  explicit test_resolver(test_loop& loop, uint16_t port)
+  {
+    open(test_ip("127.0.0.1"), port);
+    add_bridge(0, "001788FFFE123456");
+    set_timer_wheel(&loop.wheel());
+    set_loop(&loop.loop());
+    watch(get_fd(), EPOLLIN);
+  }
+
+  ~test_resolver() noexcept
+  {
+    forget();
+  }
+
+  /// Count of resolutions so far.
+  unsigned count = 0;
+  /// Last resolved address.
+  uint32_t address = 0;
+  /// Connection to readdress on resolution, if any.
+  hue_sensor_command* connection = nullptr;
+
+private:
+  virtual void ready(uint32_t) override { poll(); }
+
+  virtual void resolved(uint8_t index, uint32_t ip) override
+  {
+    CHECK(index == 0);
+    ++count;
+    address = ip;
+    if (connection)
+      connection->readdress(ip);
+  }
+};
+
+/// Resolve the bridge, get a new address on the next resolution and on an announcement.
+static void test_resolve()
+{
+  test_loop loop;
+  mdns_responder responder(loop, BRIDGE_ID, test_ip("127.0.0.2"));
+  test_resolver resolver(loop, responder.port());
+
+  auto now = test_now();
+  resolver.resolve(0, now);
+  CHECK(loop.run_until([&] { return resolver.count == 1; }, 2000));
+  CHECK(resolver.address == test_ip("127.0.0.2"));
+  CHECK(responder.queries() == 1);
+
+  // not resolved again within the minimum interval
+  responder.set_address(test_ip("127.0.0.3"));
+  resolver.resolve(0, now + 1000);
+  loop.run_for(100);
+  CHECK(responder.queries() == 1);
+
+  // DHCP lease changed the address
+  resolver.resolve(0, now + bridge_resolver::MIN_INTERVAL);
+  CHECK(loop.run_until([&] { return resolver.count == 2; }, 2000));
+  CHECK(resolver.address == test_ip("127.0.0.3"));
+
+  // bridges announce address changes on their own
+  responder.set_address(test_ip("127.0.0.4"));
+  responder.announce();
+  CHECK(loop.run_until([&] { return resolver.count == 3; }, 2000));
+  CHECK(resolver.address == test_ip("127.0.0.4"));
+}
+
+/// Keep the address, if nobody answers.
+static void test_no_response()
+{
+  test_loop loop;
+  mdns_responder responder(loop, BRIDGE_ID, 0);
+  test_resolver resolver(loop, responder.port());
+
+  resolver.resolve(0, test_now());
+  CHECK(loop.run_until([&] { return loop.wheel().size() == 0; },
+      bridge_resolver::QUERY_INTERVAL * (bridge_resolver::MAX_QUERIES + 1)));
+  CHECK(responder.queries() == bridge_resolver::MAX_QUERIES);
+  CHECK(resolver.count == 0);
+}
+
+/// Ignore responses of other bridges.
+static void test_other_bridge()
+{
+  test_loop loop;
+  mdns_responder responder(loop, "001788fffe654321", test_ip("127.0.0.2"));
+  test_resolver resolver(loop, responder.port());
+
+  resolver.resolve(0, test_now());
+  loop.run_for(300);
+  CHECK(responder.queries() == 1);
+  CHECK(resolver.count == 0);
+}
+
+/// Move a connection with requests in flight to the new address of the bridge.
+static void test_readdress()
+{
+  test_loop loop;
+  fake_hue_bridge old_bridge(loop, test_ip("127.0.0.2"));
+  fake_hue_bridge new_bridge(loop, test_ip("127.0.0.3"), old_bridge.port());
+  old_bridge.set_delay(500);
+  mdns_responder responder(loop, BRIDGE_ID, test_ip("127.0.0.2"));
+  test_resolver resolver(loop, responder.port());
+
+  hue_sensor_command_posix connection(test_ip("127.0.0.2"), "key", 5);
+  connection.set_port(old_bridge.port());
+  connection.set_deadline(5000);
+  connection.set_actions({ { "lights/1/state", "{\"on\":true}" } });
+  connection.set_event_loop(&loop.loop());
+  connection.set_timer_wheel(&loop.wheel());
+  resolver.connection = &connection;
+  resolver.resolve(0, test_now());
+  CHECK(loop.run_until([&] { return resolver.count == 1; }, 2000));
+
+  for (int i = 1; i <= 4; ++i)
+    connection.post(i);
+  CHECK(loop.run_until([&] { return old_bridge.requests().size() == 4; }, 2000));
+
+  // bridge got a new address while requests are in flight
+  responder.set_address(test_ip("127.0.0.3"));
+  responder.announce();
+  CHECK(loop.run_until([&] { return resolver.count == 2; }, 2000));
+  connection.post(5);
+  connection.post_action(0);
+  CHECK(loop.run_until([&] { return connection.stats().succeeded == 6; }, 5000));
+
+  // requests in flight were sent again in order, all rendered for the new address
+  CHECK(old_bridge.answered() == 0);
+  auto& requests = new_bridge.requests();
+  CHECK(requests.size() == 6);
+  for (int i = 0; i < 5; ++i) {
+    CHECK(requests[i].line == "PUT /api/key/sensors/5 HTTP/1.1");
+    CHECK(requests[i].body == "{\"state\":{\"status\": " + std::to_string(i + 1) + "}}");
+  }
+  CHECK(requests[5].line == "PUT /api/key/lights/1/state HTTP/1.1");
+  for (auto& r : requests)
+    CHECK(r.host == "127.0.0.3");
+}
+
+int main()
+{
+  test_resolve();
+  test_no_response();
+  test_other_bridge();
+  test_readdress();
+  printf("bridge_resolver_test passed\n");
+  return 0;
+}
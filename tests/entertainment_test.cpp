@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Test of streaming to an entertainment area against a local fake bridge.
+ */
+
+#include "test_support.hpp"
+#include "fake_hue_bridge.hpp"
+#include "fake_entertainment_endpoint.hpp"
+#include "hue_entertainment.hpp"
+
+#include <cstdio>
+
+#ifdef WITH_TLS
+
+/// Address of the fake bridge, the streaming port is fixed.
+static constexpr char BRIDGE_IP[] = "127.0.0.5";
+/// API key of the application.
+static constexpr char API_KEY[] = "app-key";
+/// Client key of the application.
+static constexpr char CLIENT_KEY[] = "00112233445566778899aabbccddeeff";
+
+/// Activate streaming, establish the session and stream frames with colors shown.
+static void test_stream()
+{
+  test_loop loop;
+  fake_hue_bridge bridge(loop, test_ip(BRIDGE_IP));
+  fake_entertainment_endpoint endpoint(loop, test_ip(BRIDGE_IP), API_KEY, CLIENT_KEY);
+  hue_sensor_command_posix connection(test_ip(BRIDGE_IP), API_KEY, 5);
+  connection.set_port(bridge.port());
+
+  hue_entertainment stream(connection, { 7, CLIENT_KEY });
+  stream.add_light(3);
+  stream.add_light(4);
+  stream.set_event_loop(&loop.loop());
+  stream.set_timer_wheel(&loop.wheel());
+  command_mapping::light_color red = { 3, 255, 0, 0 };
+  CHECK(!stream.show(&red, 1));
+  CHECK(stream.stats().dropped == 1);
+
+  stream.start();
+  CHECK(loop.run_until([&] { return stream.stats().sessions == 1; }, 2000));
+  CHECK(bridge.requests().size() == 1);
+  CHECK(bridge.requests()[0].line == "PUT /api/app-key/groups/7 HTTP/1.1");
+  CHECK(bridge.requests()[0].body == "{\"stream\":{\"active\":true}}");
+  CHECK(loop.run_until([&] { return endpoint.established(); }, 1000));
+
+  // a frame is sent immediately and repeated at the stream rate
+  CHECK(stream.show(&red, 1));
+  auto start = endpoint.frames().size();
+  loop.run_for(200);
+  auto& frames = endpoint.frames();
+  CHECK(frames.size() - start >= 8);
+  auto& frame = frames.back();
+  CHECK(frame.size() == 16 + 9);
+  CHECK(frame.compare(0, 9, "HueStream") == 0);
+  CHECK(frame[9] == 1 && frame[10] == 0);
+  // only the light shown so far, red at full scale
+  const char light[] = { 0, 0, 3, char(0xff), char(0xff), 0, 0, 0, 0 };
+  CHECK(frame.compare(16, 9, light, 9) == 0);
+  CHECK(stream.stats().failures == 0);
+}
+
+/// Don't stream with a client key the bridge doesn't know.
+static void test_wrong_key()
+{
+  test_loop loop;
+  fake_hue_bridge bridge(loop, test_ip(BRIDGE_IP));
+  fake_entertainment_endpoint endpoint(loop, test_ip(BRIDGE_IP), API_KEY, "ffeeddccbbaa99887766554433221100");
+  hue_sensor_command_posix connection(test_ip(BRIDGE_IP), API_KEY, 5);
+  connection.set_port(bridge.port());
+
+  hue_entertainment stream(connection, { 7, CLIENT_KEY });
+  stream.add_light(3);
+  stream.set_event_loop(&loop.loop());
+  stream.set_timer_wheel(&loop.wheel());
+  stream.start();
+  // DTLS drops records failing authentication, so the handshake times out
+  CHECK(loop.run_until([&] { return stream.stats().failures == 1; }, hue_entertainment::HANDSHAKE_TIMEOUT + 1000));
+  CHECK(stream.stats().sessions == 0);
+  CHECK(endpoint.frames().empty());
+}
+
+int main()
+{
+  test_stream();
+  test_wrong_key();
+  printf("entertainment_test passed\n");
+  return 0;
+}
+
+#else
+
+int main()
+{
+  printf("entertainment_test skipped, built without DTLS support\n");
+  return 0;
+}
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "fake_entertainment_endpoint.hpp"
+
+#ifdef WITH_TLS
+
+#include "hue_entertainment.hpp"
+
+#include <stdexcept>
+#include <system_error>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+fake_entertainment_endpoint::fake_entertainment_endpoint(test_loop& loop, uint32_t ip, const char* api_key,
+    const char* client_key) :
+  api_key_(api_key)
+{
+  for (size_t i = 0; i < sizeof(psk_); ++i) {
+    unsigned byte;
+    if (sscanf(client_key + 2 * i, "%2x", &byte) != 1)
+      throw std::runtime_error("Cannot parse client key of the endpoint");
+    psk_[i] = uint8_t(byte);
+  }
+  ctx_ = SSL_CTX_new(DTLS_server_method());
+  if (!ctx_)
+    throw std::runtime_error("Cannot create DTLS context of the endpoint");
+  // same protocol and cipher suite as the bridge
+  SSL_CTX_set_min_proto_version(ctx_, DTLS1_2_VERSION);
+  SSL_CTX_set_max_proto_version(ctx_, DTLS1_2_VERSION);
+  SSL_CTX_set_cipher_list(ctx_, "PSK-AES128-GCM-SHA256");
+  SSL_CTX_set_psk_server_callback(ctx_, psk_server);
+
+  fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (fd_ < 0) {
+    SSL_CTX_free(ctx_);
+    throw std::system_error(errno, std::generic_category(), "Cannot create endpoint socket");
+  }
+  int one = 1;
+  setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = ip;
+  addr.sin_port = htons(hue_entertainment::PORT);
+  if (bind(fd_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0) {
+    auto err = errno;
+    close(fd_);
+    SSL_CTX_free(ctx_);
+    throw std::system_error(err, std::generic_category(), "Cannot bind endpoint socket");
+  }
+  set_loop(&loop.loop());
+  watch(fd_, EPOLLIN);
+}
+
+fake_entertainment_endpoint::~fake_entertainment_endpoint() noexcept
+{
+  close_session();
+  forget();
+  close(fd_);
+  SSL_CTX_free(ctx_);
+}
+
+bool fake_entertainment_endpoint::accept() noexcept
+{
+  // peek at the first datagram to learn the client, then talk only to it
+  struct sockaddr_in peer;
+  socklen_t peer_len = sizeof(peer);
+  char byte;
+  if (recvfrom(fd_, &byte, sizeof(byte), MSG_PEEK, reinterpret_cast<sockaddr*>(&peer), &peer_len) < 0)
+    return false;
+  if (connect(fd_, reinterpret_cast<const sockaddr*>(&peer), sizeof(peer)) < 0)
+    return false;
+  ssl_ = SSL_new(ctx_);
+  auto bio = BIO_new_dgram(fd_, BIO_NOCLOSE);
+  if (!ssl_ || !bio) {
+    if (bio)
+      BIO_free(bio);
+    close_session();
+    return false;
+  }
+  BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, &peer);
+  SSL_set_bio(ssl_, bio, bio);
+  SSL_set_app_data(ssl_, this);
+  SSL_set_accept_state(ssl_);
+  return true;
+}
+
+void fake_entertainment_endpoint::close_session() noexcept
+{
+  if (ssl_) {
+    SSL_free(ssl_);   // frees the BIO, too
+    ssl_ = nullptr;
+  }
+  established_ = false;
+  if (fd_ >= 0) {
+    // accept datagrams from any client again
+    struct sockaddr addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sa_family = AF_UNSPEC;
+    connect(fd_, &addr, sizeof(addr));
+  }
+}
+
+void fake_entertainment_endpoint::ready(uint32_t)
+{
+  if (!ssl_ && !accept())
+    return;
+  ERR_clear_error();
+  if (!established_) {
+    auto res = SSL_do_handshake(ssl_);
+    if (res != 1) {
+      auto err = SSL_get_error(ssl_, res);
+      if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+        ++failures_;
+        close_session();
+      }
+      return;
+    }
+    established_ = true;
+  }
+  for (;;) {
+    char buffer[512];
+    auto res = SSL_read(ssl_, buffer, sizeof(buffer));
+    if (res > 0) {
+      frames_.emplace_back(buffer, size_t(res));
+      continue;
+    }
+    auto err = SSL_get_error(ssl_, res);
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+      close_session();  // closed by the client
+    return;
+  }
+}
+
+unsigned fake_entertainment_endpoint::psk_server(ssl_st* ssl, const char* identity, unsigned char* psk,
+    unsigned max_psk_len) noexcept
+{
+  auto self = reinterpret_cast<fake_entertainment_endpoint*>(SSL_get_app_data(ssl));
+  if (self->api_key_ != identity || sizeof(self->psk_) > max_psk_len)
+    return 0;
+  memcpy(psk, self->psk_, sizeof(self->psk_));
+  return sizeof(self->psk_);
+}
+
+#endif
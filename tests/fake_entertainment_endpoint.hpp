@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Local stand-in of the entertainment streaming endpoint of a Hue bridge.
+ */
+#pragma once
+
+#include "test_support.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifdef WITH_TLS
+
+struct ssl_ctx_st;
+struct ssl_st;
+
+/*!
+ * @brief Local stand-in of the entertainment streaming endpoint of a Hue bridge.
+ *
+ * Listens on UDP port 2100 of a loopback address and accepts one DTLS 1.2
+ * session with a pre-shared key, identified by the API key of the
+ * application, like a Hue bridge with an active entertainment stream.
+ * All frames received are recorded.
+ */
+class fake_entertainment_endpoint : public event_loop::handler
+{
+public:
+  /*!
+   * @brief Start listening.
+   *
+   * @param loop loop of the test, which must outlive the endpoint.
+   * @param ip IP address to listen on (network order).
+   * @param api_key API key of the application, the PSK identity.
+   * @param client_key client key of the application, the PSK (32 hex digits).
+   */
+  fake_entertainment_endpoint(test_loop& loop, uint32_t ip, const char* api_key, const char* client_key);
+
+  ~fake_entertainment_endpoint() noexcept;
+
+  fake_entertainment_endpoint(const fake_entertainment_endpoint&) = delete;
+  fake_entertainment_endpoint& operator=(const fake_entertainment_endpoint&) = delete;
+
+  /// Check whether a session is established.
+  bool established() const noexcept { return established_; }
+
+  /// Get count of failed handshakes.
+  unsigned failures() const noexcept { return failures_; }
+
+  /// Get frames received so far.
+  const std::vector<std::string>& frames() const noexcept { return frames_; }
+
+private:
+  virtual void ready(uint32_t events) override;
+
+  /// Start a session with the sender of the next datagram.
+  bool accept() noexcept;
+
+  /// Close the session, so the next datagram starts a new one.
+  void close_session() noexcept;
+
+  /// Callback of OpenSSL to find the PSK of an identity.
+  static unsigned psk_server(ssl_st* ssl, const char* identity, unsigned char* psk, unsigned max_psk_len) noexcept;
+
+  /// Socket.
+  int fd_ = -1;
+  /// DTLS context.
+  ssl_ctx_st* ctx_ = nullptr;
+  /// DTLS session, if any.
+  ssl_st* ssl_ = nullptr;
+  /// Set when the session is established.
+  bool established_ = false;
+  /// Count of failed handshakes.
+  unsigned failures_ = 0;
+  /// PSK identity.
+  std::string api_key_;
+  /// Pre-shared key.
+  uint8_t psk_[16];
+  /// Frames received.
+  std::vector<std::string> frames_;
+};
+
+#endif
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "fake_hue_bridge.hpp"
+
+#include <stdexcept>
+#include <system_error>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifdef WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#endif
+
+fake_hue_bridge::fake_hue_bridge(test_loop& loop, uint32_t ip, uint16_t port) :
+  loop_(loop)
+{
+  fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd_ < 0)
+    throw std::system_error(errno, std::generic_category(), "Cannot create bridge socket");
+  int one = 1;
+  setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = ip;
+  addr.sin_port = htons(port);
+  socklen_t addr_len = sizeof(addr);
+  if (bind(fd_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd_, 16) < 0 ||
+      getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &addr_len) < 0)
+  {
+    auto err = errno;
+    ::close(fd_);
+    throw std::system_error(err, std::generic_category(), "Cannot listen on bridge socket");
+  }
+  port_ = ntohs(addr.sin_port);
+  listener_.set_loop(&loop_.loop());
+  listener_.watch(fd_, EPOLLIN);
+}
+
+fake_hue_bridge::~fake_hue_bridge() noexcept
+{
+  stop();
+#ifdef WITH_TLS
+  if (tls_)
+    SSL_CTX_free(tls_);
+#endif
+}
+
+#ifdef WITH_TLS
+
+void fake_hue_bridge::enable_tls()
+{
+  if (tls_)
+    return;
+  // self-signed certificate with a fresh key, pinned by the client
+  EVP_PKEY* key = nullptr;
+  auto key_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  bool ok = key_ctx && EVP_PKEY_keygen_init(key_ctx) > 0 &&
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(key_ctx, NID_X9_62_prime256v1) > 0 &&
+      EVP_PKEY_keygen(key_ctx, &key) > 0;
+  EVP_PKEY_CTX_free(key_ctx);
+  auto cert = X509_new();
+  if (ok && cert) {
+    auto name = X509_get_subject_name(cert);
+    ok = X509_set_version(cert, 2) && ASN1_INTEGER_set(X509_get_serialNumber(cert), 1) &&
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0) && X509_gmtime_adj(X509_getm_notAfter(cert), 86400) &&
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+            reinterpret_cast<const unsigned char*>("001788fffe123456"), -1, -1, 0) &&
+        X509_set_issuer_name(cert, name) && X509_set_pubkey(cert, key) && X509_sign(cert, key, EVP_sha256());
+  }
+  unsigned md_len = 0;
+  ok = ok && X509_digest(cert, EVP_sha256(), fingerprint_, &md_len) && md_len == sizeof(fingerprint_);
+  auto ctx = ok ? SSL_CTX_new(TLS_server_method()) : nullptr;
+  ok = ctx && SSL_CTX_use_certificate(ctx, cert) > 0 && SSL_CTX_use_PrivateKey(ctx, key) > 0;
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  if (!ok) {
+    SSL_CTX_free(ctx);
+    throw std::runtime_error("Cannot create TLS context of the bridge");
+  }
+  tls_ = ctx;
+}
+
+#endif
+
+void fake_hue_bridge::close_connections() noexcept
+{
+  for (auto& c : connections_)
+    c->close();
+}
+
+void fake_hue_bridge::stop() noexcept
+{
+  close_connections();
+  if (fd_ >= 0) {
+    listener_.forget();
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+void fake_hue_bridge::listener::ready(uint32_t)
+{
+  for (;;) {
+    auto fd = accept4(parent_.fd_, nullptr, nullptr, SOCK_NONBLOCK);
+    if (fd < 0)
+      return;
+    // answer without waiting for acknowledgments, like the bridge
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    auto number = unsigned(parent_.connections_.size() + 1);
+    parent_.connections_.emplace_back(new connection(parent_, fd, number));
+  }
+}
+
+fake_hue_bridge::connection::connection(fake_hue_bridge& parent, int fd, unsigned number) :
+  parent_(parent),
+  fd_(fd),
+  number_(number)
+{
+#ifdef WITH_TLS
+  if (parent_.tls_) {
+    ssl_ = SSL_new(parent_.tls_);
+    if (!ssl_)
+      throw std::runtime_error("Cannot create TLS connection of the bridge");
+    SSL_set_fd(ssl_, fd_);
+    SSL_set_accept_state(ssl_);
+  }
+#endif
+  set_loop(&parent_.loop_.loop());
+  watch(fd_, EPOLLIN);
+}
+
+fake_hue_bridge::connection::~connection() noexcept
+{
+  close();
+}
+
+void fake_hue_bridge::connection::close() noexcept
+{
+  if (fd_ < 0)
+    return;
+  parent_.loop_.wheel().cancel(timer_);
+  forget();
+#ifdef WITH_TLS
+  if (ssl_) {
+    SSL_free(ssl_);
+    ssl_ = nullptr;
+  }
+#endif
+  ::close(fd_);
+  fd_ = -1;
+  pending_.clear();
+}
+
+void fake_hue_bridge::connection::ready(uint32_t)
+{
+  if (receive())
+    parse(test_now());
+}
+
+bool fake_hue_bridge::connection::receive()
+{
+  char buffer[4096];
+#ifdef WITH_TLS
+  if (ssl_) {
+    if (!SSL_is_init_finished(ssl_)) {
+      auto res = SSL_do_handshake(ssl_);
+      if (res != 1) {
+        auto err = SSL_get_error(ssl_, res);
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+          close();  // e.g., the client rejected the certificate
+        return false;
+      }
+      if (SSL_session_reused(ssl_))
+        ++parent_.resumed_;
+    }
+    // read all decrypted data, records may be buffered in the TLS connection
+    bool received = false;
+    for (;;) {
+      auto len = SSL_read(ssl_, buffer, sizeof(buffer));
+      if (len > 0) {
+        input_.append(buffer, size_t(len));
+        received = true;
+        continue;
+      }
+      auto err = SSL_get_error(ssl_, len);
+      if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+        close();  // closed by the client or reset
+      return received;
+    }
+  }
+#endif
+  auto len = recv(fd_, buffer, sizeof(buffer), 0);
+  if (len <= 0) {
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return false;
+    close();  // closed by the client or reset
+    return false;
+  }
+  input_.append(buffer, size_t(len));
+  return true;
+}
+
+bool fake_hue_bridge::connection::send_response(const std::string& response)
+{
+  // responses are small, so they fit into the socket buffer
+#ifdef WITH_TLS
+  if (ssl_)
+    return SSL_write(ssl_, response.data(), int(response.size())) == int(response.size());
+#endif
+  return send(fd_, response.data(), response.size(), MSG_NOSIGNAL) == ssize_t(response.size());
+}
+
+void fake_hue_bridge::connection::parse(int64_t now)
+{
+  for (;;) {
+    auto end = input_.find("\r\n\r\n");
+    if (end == std::string::npos)
+      break;
+    auto header = input_.substr(0, end + 2);
+    size_t length = 0;
+    auto pos = header.find("\r\nContent-Length: ");
+    if (pos != std::string::npos)
+      length = size_t(atoi(header.c_str() + pos + 18));
+    if (input_.size() < end + 4 + length)
+      break;    // body not complete yet
+
+    request r;
+    r.line = header.substr(0, header.find("\r\n"));
+    pos = header.find("\r\nHost: ");
+    if (pos != std::string::npos)
+      r.host = header.substr(pos + 8, header.find("\r\n", pos + 8) - pos - 8);
+    r.body = input_.substr(end + 4, length);
+    r.connection = number_;
+    r.received = now;
+    r.answered = 0;
+    input_.erase(0, end + 4 + length);
+
+    // requests are processed one after another, unless concurrent
+    auto start = now;
+    if (!parent_.concurrent_ && !pending_.empty() && pending_.back().second - now > 0)
+      start = pending_.back().second;
+    pending_.emplace_back(parent_.requests_.size(), start + parent_.delay_);
+    parent_.requests_.push_back(r);
+  }
+  respond(now);
+}
+
+void fake_hue_bridge::connection::respond(int64_t now)
+{
+  while (!pending_.empty() && pending_.front().second - now <= 0) {
+    auto& r = parent_.requests_[pending_.front().first];
+    pending_.pop_front();
+    std::string response = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: ";
+    response += std::to_string(parent_.body_.size()) + "\r\n\r\n" + parent_.body_;
+    if (!send_response(response)) {
+      close();
+      return;
+    }
+    r.answered = now;
+    ++parent_.answered_;
+  }
+  if (!pending_.empty())
+    parent_.loop_.wheel().schedule(timer_, pending_.front().second);
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Fake Hue bridge answering HTTP requests on a local socket.
+ */
+#pragma once
+
+#include "test_support.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct ssl_ctx_st;
+struct ssl_st;
+
+/*!
+ * @brief Fake Hue bridge answering HTTP requests on a local socket.
+ *
+ * The bridge keeps connections alive and answers requests on each
+ * connection in order, each one after a configurable processing time.
+ * By default, requests on a connection are processed one after another,
+ * like on a real bridge. Alternatively, pipelined requests are processed
+ * concurrently, so the processing time stands for the network latency.
+ * All requests are recorded. It runs in the event loop and timer wheel
+ * of the test.
+ *
+ * With TLS enabled, the bridge serves HTTPS with a self-signed
+ * certificate, like a real bridge, and resumes sessions.
+ */
+class fake_hue_bridge
+{
+public:
+  /// Request received by the bridge.
+  struct request
+  {
+    std::string line;       ///< Request line, e.g., "PUT /api/key/sensors/5 HTTP/1.1".
+    std::string host;       ///< Value of the Host header.
+    std::string body;       ///< Request body.
+    unsigned connection;    ///< Connection the request was received on (counted from 1).
+    int64_t received;       ///< Time the request was received.
+    int64_t answered;       ///< Time the request was answered (0 if not yet).
+  };
+
+  /*!
+   * @brief Start listening.
+   *
+   * @param loop loop of the test, which must outlive the bridge.
+   * @param ip IP address to listen on (network order).
+   * @param port TCP port to listen on (0 for an ephemeral one).
+   */
+  fake_hue_bridge(test_loop& loop, uint32_t ip, uint16_t port = 0);
+
+  ~fake_hue_bridge() noexcept;
+
+  fake_hue_bridge(const fake_hue_bridge&) = delete;
+  fake_hue_bridge& operator=(const fake_hue_bridge&) = delete;
+
+  /// Get the TCP port the bridge listens on.
+  uint16_t port() const noexcept { return port_; }
+
+  /// Set processing time in milliseconds of each request.
+  void set_delay(int64_t delay) noexcept { delay_ = delay; }
+
+  /// Process pipelined requests concurrently instead of one after another.
+  void set_concurrent(bool concurrent) noexcept { concurrent_ = concurrent; }
+
+#ifdef WITH_TLS
+  /// Serve HTTPS instead of HTTP on connections accepted from now on.
+  void enable_tls();
+
+  /// Get SHA-256 fingerprint of the certificate (32 bytes).
+  const uint8_t* fingerprint() const noexcept { return fingerprint_; }
+
+  /// Get count of TLS handshakes which resumed a session.
+  unsigned resumed() const noexcept { return resumed_; }
+#endif
+
+  /// Set body of responses.
+  void set_body(const std::string& body) { body_ = body; }
+
+  /// Get requests received so far.
+  const std::vector<request>& requests() const noexcept { return requests_; }
+
+  /// Get count of requests answered so far.
+  size_t answered() const noexcept { return answered_; }
+
+  /// Get count of connections accepted so far.
+  unsigned connections() const noexcept { return unsigned(connections_.size()); }
+
+  /// Close all connections, but keep listening, like a bridge closing idle connections.
+  void close_connections() noexcept;
+
+  /// Stop listening and close all connections, like a bridge going down.
+  void stop() noexcept;
+
+private:
+  /// Handler of the listening socket.
+  class listener : public event_loop::handler
+  {
+  public:
+    explicit listener(fake_hue_bridge& parent) noexcept : parent_(parent) {}
+
+  private:
+    virtual void ready(uint32_t events) override;
+
+    /// Bridge accepting connections.
+    fake_hue_bridge& parent_;
+  };
+
+  /// Accepted connection.
+  class connection : public event_loop::handler
+  {
+  public:
+    connection(fake_hue_bridge& parent, int fd, unsigned number);
+    ~connection() noexcept;
+
+    /// Close the connection.
+    void close() noexcept;
+
+  private:
+    /// Timer sending responses which are due.
+    class responder : public timer_wheel::timer
+    {
+    public:
+      explicit responder(connection& parent) noexcept : parent_(parent) {}
+
+    private:
+      virtual void expired(int64_t now) override { parent_.respond(now); }
+
+      /// Connection to respond on.
+      connection& parent_;
+    };
+
+    virtual void ready(uint32_t events) override;
+
+    /// Receive data, return @c false if nothing was received.
+    bool receive();
+
+    /// Send a response, return @c false on error.
+    bool send_response(const std::string& response);
+
+    /// Parse complete requests from the input buffer.
+    void parse(int64_t now);
+
+    /// Send responses due by now.
+    void respond(int64_t now);
+
+    /// Bridge which accepted the connection.
+    fake_hue_bridge& parent_;
+    /// Socket (negative if closed).
+    int fd_;
+    /// Number of the connection (counted from 1).
+    unsigned number_;
+    /// TLS connection, if serving HTTPS.
+    ssl_st* ssl_ = nullptr;
+    /// Data received, but not parsed yet.
+    std::string input_;
+    /// Indices of requests waiting for their response, with their due time.
+    std::deque<std::pair<size_t, int64_t>> pending_;
+    /// Timer of the next response.
+    responder timer_{*this};
+  };
+
+  /// Loop of the test.
+  test_loop& loop_;
+  /// Listening socket (negative if stopped).
+  int fd_ = -1;
+  /// Port listening on.
+  uint16_t port_ = 0;
+  /// Processing time of each request.
+  int64_t delay_ = 0;
+  /// Set to process pipelined requests concurrently.
+  bool concurrent_ = false;
+  /// Count of requests answered.
+  size_t answered_ = 0;
+  /// Body of responses.
+  std::string body_ = "[{\"success\":{\"/sensors/5/state/status\":1}}]";
+  /// TLS context, if serving HTTPS.
+  ssl_ctx_st* tls_ = nullptr;
+  /// SHA-256 fingerprint of the certificate.
+  uint8_t fingerprint_[32] = {};
+  /// Count of TLS handshakes which resumed a session.
+  unsigned resumed_ = 0;
+  /// Requests received.
+  std::vector<request> requests_;
+  /// Connections accepted.
+  std::vector<std::unique_ptr<connection>> connections_;
+  /// Handler of the listening socket.
+  listener listener_{*this};
+};
@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Test of the portable gateway core with a stub mapping and fake bridges.
+ */
+
+#include "test_support.hpp"
+#include "embedded/gateway_core.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+/// Current time of the test, advanced explicitly.
+static gateway_core::timestamp_t s_now = 1000;
+
+/// Command handler which sends requests to memory and answers them right away.
+class fake_bridge : public hue_sensor_command
+{
+public:
+  fake_bridge() noexcept : hue_sensor_command(0x0100007f, "key", 5) {}
+
+  /// Values posted to the sensor.
+  std::vector<int32_t> values;
+  /// Count of connections opened.
+  unsigned connects = 0;
+
+  /// Send all requests and answer them.
+  virtual void poll() override
+  {
+    const char* data;
+    size_t size;
+    while (get_state() == state::sending && send_segment(0, data, size)) {
+      sent_.append(data, size);
+      data_sent(size);
+    }
+    static constexpr char RESPONSE[] =
+        "HTTP/1.1 200 OK\r\nContent-Length: 43\r\n\r\n[{\"success\":{\"/sensors/5/state/status\":1}}]";
+    while (busy())
+      response_received(RESPONSE, sizeof(RESPONSE) - 1);
+    for (size_t pos; (pos = sent_.find("\"status\": ")) != std::string::npos; ) {
+      values.push_back(int32_t(atoi(sent_.c_str() + pos + 10)));
+      sent_.erase(0, pos + 10);
+    }
+  }
+
+  virtual timestamp_t timestamp() noexcept override { return s_now; }
+
+private:
+  virtual connect_result start_connect() override
+  {
+    ++connects;
+    return connect_result::connected;
+  }
+
+  virtual void close_connection() noexcept override {}
+
+  /// Requests sent, but not parsed yet.
+  std::string sent_;
+};
+
+/// Gateway core with a stub mapping, declining commands on request.
+class test_core : public gateway_core
+{
+public:
+  /// Mapping of senders to values (posted to bridges 1 and 3).
+  std::map<uint32_t, int32_t> mapping;
+  /// Set to decline commands, e.g., like a master whose peer posts them.
+  bool decline = false;
+  /// Count of commands suppressed as duplicates.
+  unsigned suppressed_count = 0;
+
+protected:
+  virtual void map(const enocean_event&, command& cmd) override
+  {
+    auto i = mapping.find(cmd.sender);
+    if (i == mapping.end())
+      return;
+    cmd.value = i->second + cmd.button;
+    cmd.bridge_set = 0x05;
+  }
+
+  virtual void suppressed(const command&) noexcept override { ++suppressed_count; }
+
+  virtual bool accept(const command&) override { return !decline; }
+};
+
+/// Build a switch telegram pressing the top left button.
+static enocean_event press(uint32_t sender, uint8_t repeater_count = 0)
+{
+  enocean_event event;
+  memset(&event, 0, sizeof(event));
+  auto& e = event.erp1.switch_event;
+  e.event_type = enocean_erp1_type::SWITCH;
+  e.button_state = 0x30;
+  e.sender.set(uint8_t(sender >> 24), uint8_t(sender >> 16), uint8_t(sender >> 8), uint8_t(sender));
+  e.status = uint8_t(0x30 | repeater_count);
+  return event;
+}
+
+/// Gateway core with bridges 1 to 3 and a duplicate filter.
+struct fixture
+{
+  fixture()
+  {
+    filter.set_window(200);
+    core.set_filter(&filter);
+    for (uint8_t i = 0; i < 3; ++i)
+      core.set_bridge(i, &bridges[i]);
+    core.mapping[0xfef237a0] = 10;
+  }
+
+  /// Handle an event and let the bridges process their requests.
+  gateway_core::result handle(const enocean_event& event, const char* receiver = nullptr)
+  {
+    auto res = core.handle_event(event, receiver ? test_ip(receiver) : 0, s_now);
+    for (auto& b : bridges)
+      b.poll();
+    return res;
+  }
+
+  duplicate_filter filter;
+  fake_bridge bridges[3];
+  test_core core;
+};
+
+/// An event of an unknown sender posts nothing.
+static void test_unmapped()
+{
+  fixture f;
+  CHECK(f.handle(press(0x01020304)) == gateway_core::result::unmapped);
+  CHECK(f.core.event_count() == 1);
+  for (auto& b : f.bridges) {
+    CHECK(b.values.empty());
+    CHECK(b.connects == 0);
+  }
+}
+
+/// A mapped event is posted to the bridges of its bridge set only.
+static void test_posted()
+{
+  fixture f;
+  CHECK(f.handle(press(0xfef237a0)) == gateway_core::result::posted);
+  CHECK(f.bridges[0].values == std::vector<int32_t>{ 11 });
+  CHECK(f.bridges[1].values.empty());
+  CHECK(f.bridges[1].connects == 0);
+  CHECK(f.bridges[2].values == std::vector<int32_t>{ 11 });
+  CHECK(f.bridges[0].stats().succeeded == 1);
+}
+
+/// A copy via another receive path is suppressed, a press via the same path is not.
+static void test_duplicate()
+{
+  fixture f;
+  CHECK(f.handle(press(0xfef237a0)) == gateway_core::result::posted);
+
+  // the same telegram forwarded by a repeater within the window
+  s_now += 50;
+  CHECK(f.handle(press(0xfef237a0, 1), "192.168.1.20") == gateway_core::result::duplicate);
+  CHECK(f.core.suppressed_count == 1);
+  CHECK(f.bridges[0].values.size() == 1);
+
+  // another press received locally again is genuine, even if fast
+  s_now += 50;
+  CHECK(f.handle(press(0xfef237a0)) == gateway_core::result::posted);
+  CHECK(f.bridges[0].values.size() == 2);
+
+  // a copy via another path after the window is a new press
+  s_now += 300;
+  CHECK(f.handle(press(0xfef237a0, 1), "192.168.1.20") == gateway_core::result::posted);
+  CHECK(f.bridges[0].values.size() == 3);
+  CHECK(f.core.suppressed_count == 1);
+}
+
+/// A declined command is not posted, but its copies are still suppressed.
+static void test_declined()
+{
+  fixture f;
+  f.core.decline = true;
+  CHECK(f.handle(press(0xfef237a0)) == gateway_core::result::declined);
+  for (auto& b : f.bridges)
+    CHECK(b.values.empty());
+
+  s_now += 50;
+  f.core.decline = false;
+  CHECK(f.handle(press(0xfef237a0, 1), "192.168.1.20") == gateway_core::result::duplicate);
+  for (auto& b : f.bridges)
+    CHECK(b.values.empty());
+}
+
+int main()
+{
+  test_unmapped();
+  test_posted();
+  test_duplicate();
+  test_declined();
+  printf("gateway_core_test passed\n");
+  return 0;
+}
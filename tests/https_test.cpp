@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Test of HTTPS connections with a pinned certificate against a local fake bridge.
+ */
+
+#include "test_support.hpp"
+#include "fake_hue_bridge.hpp"
+#include "hue_sensor_command_posix.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef WITH_TLS
+
+/// Set up a connection to the fake bridge over HTTPS with given fingerprint.
+static void setup(hue_sensor_command_posix& connection, test_loop& loop, fake_hue_bridge& bridge,
+                  const uint8_t* fingerprint)
+{
+  connection.set_port(bridge.port());
+  connection.enable_tls(fingerprint);
+  connection.set_deadline(1000);
+  connection.set_event_loop(&loop.loop());
+  connection.set_timer_wheel(&loop.wheel());
+}
+
+/// Post over HTTPS to a bridge with the pinned certificate, resume the session on reconnect.
+static void test_pinned()
+{
+  test_loop loop;
+  fake_hue_bridge bridge(loop, test_ip("127.0.0.1"));
+  bridge.enable_tls();
+  hue_sensor_command_posix connection(test_ip("127.0.0.1"), "key", 5);
+  setup(connection, loop, bridge, bridge.fingerprint());
+
+  connection.post(1);
+  CHECK(loop.run_until([&] { return connection.stats().succeeded == 1; }, 2000));
+  CHECK(bridge.requests().size() == 1);
+  CHECK(bridge.requests()[0].body == "{\"state\":{\"status\": 1}}");
+  CHECK(bridge.resumed() == 0);
+
+  // the bridge closes the idle connection, the next one resumes the session
+  bridge.close_connections();
+  loop.run_for(50);
+  connection.post(2);
+  CHECK(loop.run_until([&] { return connection.stats().succeeded == 2; }, 2000));
+  CHECK(bridge.connections() == 2);
+  CHECK(bridge.requests().size() == 2);
+  CHECK(bridge.requests()[1].connection == 2);
+  CHECK(bridge.resumed() == 1);
+}
+
+/// Don't send requests to a bridge presenting another certificate.
+static void test_wrong_fingerprint()
+{
+  test_loop loop;
+  fake_hue_bridge bridge(loop, test_ip("127.0.0.1"));
+  bridge.enable_tls();
+  uint8_t fingerprint[32];
+  memcpy(fingerprint, bridge.fingerprint(), sizeof(fingerprint));
+  fingerprint[0] ^= 1;
+  hue_sensor_command_posix connection(test_ip("127.0.0.1"), "key", 5);
+  setup(connection, loop, bridge, fingerprint);
+
+  connection.post(1);
+  CHECK(loop.run_until([&] { return bridge.connections() > 0; }, 2000));
+  loop.run_for(1500);
+  CHECK(connection.stats().succeeded == 0);
+  CHECK(bridge.requests().empty());
+}
+
+int main()
+{
+  test_pinned();
+  test_wrong_fingerprint();
+  printf("https_test passed\n");
+  return 0;
+}
+
+#else
+
+int main()
+{
+  printf("https_test skipped, built without HTTPS support\n");
+  return 0;
+}
+
+#endif
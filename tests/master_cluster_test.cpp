@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Test of a cluster of masters exchanging messages on the loopback interface.
+ */
+
+#include "test_support.hpp"
+#include "master_cluster.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <system_error>
+#include <vector>
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/// Count of masters in the cluster.
+static constexpr uint8_t MASTERS = 3;
+/// Duplicate filter window.
+static constexpr int64_t WINDOW = 200;
+
+/// Master of a cluster on its own UDP socket, recording posted commands.
+class test_master : public master_cluster, public event_loop::handler
+{
+public:
+  explicit test_master(test_loop& loop) : loop_(loop)
+  {
+    fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd_ < 0)
+      throw std::system_error(errno, std::system_category(), "cannot create master socket");
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = test_ip("127.0.0.1");
+    socklen_t len = sizeof(addr);
+    if (bind(fd_, reinterpret_cast<sockaddr*>(&addr), len) < 0 ||
+        getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &len) < 0)
+      throw std::system_error(errno, std::system_category(), "cannot bind master socket");
+    port_ = addr.sin_port;
+    set_loop(&loop_.loop());
+    watch(fd_, EPOLLIN);
+  }
+
+  ~test_master() noexcept
+  {
+    forget();
+    close(fd_);
+  }
+
+  /// Get port in network order.
+  uint16_t port() const noexcept { return port_; }
+
+  /// Configure the cluster of given masters.
+  void start(const std::vector<std::unique_ptr<test_master>>& masters, uint8_t self)
+  {
+    uint32_t addrs[MASTERS];
+    uint16_t ports[MASTERS];
+    for (uint8_t i = 0; i < MASTERS; ++i) {
+      addrs[i] = test_ip("127.0.0.1");
+      ports[i] = masters[i]->port();
+    }
+    configure(fd_, addrs, ports, MASTERS, self, WINDOW, test_now());
+    silent_ = false;
+    arm();
+  }
+
+  /// Stop processing and sending messages, like a crashed master.
+  void silence() noexcept
+  {
+    silent_ = true;
+    loop_.wheel().cancel(timer_);
+  }
+
+  /// Receive a command like the gateway, counting it if posted immediately.
+  void receive(uint32_t sender, int32_t value)
+  {
+    if (silent_)
+      return;
+    if (command(sender, value, 1, rate_limiter::priority::normal, test_now()))
+      posted.push_back(value);
+    arm();
+  }
+
+  /// Values posted by this master, immediately or after a takeover.
+  std::vector<int32_t> posted;
+  /// Values posted after a takeover.
+  std::vector<int32_t> taken_over;
+
+private:
+  /// Timer polling the cluster.
+  class poller : public timer_wheel::timer
+  {
+  public:
+    explicit poller(test_master& parent) noexcept : parent_(parent) {}
+
+  private:
+    virtual void expired(int64_t now) override
+    {
+      parent_.poll(now);
+      parent_.arm();
+    }
+
+    /// Master to poll.
+    test_master& parent_;
+  };
+
+  virtual void ready(uint32_t) override
+  {
+    char buffer[256];
+    for (;;) {
+      auto size = recv(fd_, buffer, sizeof(buffer), 0);
+      if (size < 0)
+        return;
+      if (!silent_)
+        message(buffer, size_t(size), test_now());
+    }
+  }
+
+  virtual void post(uint32_t, int32_t value, uint8_t, rate_limiter::priority) override
+  {
+    posted.push_back(value);
+    taken_over.push_back(value);
+  }
+
+  /// Schedule the next poll.
+  void arm() noexcept
+  {
+    auto now = test_now();
+    loop_.wheel().schedule(timer_, now + next_timeout(now));
+  }
+
+  /// Loop of the test.
+  test_loop& loop_;
+  /// UDP socket.
+  int fd_ = -1;
+  /// Port in network order.
+  uint16_t port_ = 0;
+  /// Set when silenced.
+  bool silent_ = false;
+  /// Timer polling the cluster.
+  poller timer_{*this};
+};
+
+/// Create and start a cluster of masters.
+static std::vector<std::unique_ptr<test_master>> make_cluster(test_loop& loop)
+{
+  std::vector<std::unique_ptr<test_master>> masters;
+  for (uint8_t i = 0; i < MASTERS; ++i)
+    masters.emplace_back(new test_master(loop));
+  for (uint8_t i = 0; i < MASTERS; ++i)
+    masters[i]->start(masters, i);
+  return masters;
+}
+
+/// Count how often a value was posted by all masters.
+static unsigned count_posts(const std::vector<std::unique_ptr<test_master>>& masters, int32_t value)
+{
+  unsigned count = 0;
+  for (auto& m : masters) {
+    for (auto v : m->posted)
+      count += v == value;
+  }
+  return count;
+}
+
+/// Each command received by all masters is posted exactly once, by the owner of its sender.
+static void test_exactly_once()
+{
+  test_loop loop;
+  auto masters = make_cluster(loop);
+  loop.run_for(WINDOW);
+
+  for (int32_t value = 1; value <= 12; ++value) {
+    auto sender = uint32_t(0x01800000 + value);
+    for (auto& m : masters)
+      m->receive(sender, value);
+    loop.run_for(20);
+  }
+  loop.run_for(2 * WINDOW);
+
+  for (int32_t value = 1; value <= 12; ++value) {
+    CHECK(count_posts(masters, value) == 1);
+    auto& owner = masters[uint32_t(0x01800000 + value) % MASTERS];
+    CHECK(std::find(owner->posted.begin(), owner->posted.end(), value) != owner->posted.end());
+  }
+  for (auto& m : masters)
+    CHECK(m->taken_over.empty());
+}
+
+/// A command of a silent master is posted exactly once by the next master within the window.
+static void test_takeover()
+{
+  test_loop loop;
+  auto masters = make_cluster(loop);
+  loop.run_for(WINDOW);
+
+  masters[1]->silence();
+  auto sender = uint32_t(0x01800001);  // owned by master 1
+  CHECK(sender % MASTERS == 1);
+  auto start = test_now();
+  for (auto& m : masters)
+    m->receive(sender, 42);
+  CHECK(count_posts(masters, 42) == 0);
+  CHECK(loop.run_until([&] { return count_posts(masters, 42) > 0; }, 2 * WINDOW));
+  auto elapsed = test_now() - start;
+  printf("silent master taken over after %lld ms\n", (long long)elapsed);
+  CHECK(elapsed <= WINDOW + 20);
+  CHECK(masters[2]->taken_over.size() == 1);
+
+  // the other master got the note, so there is no second post
+  loop.run_for(2 * WINDOW);
+  CHECK(count_posts(masters, 42) == 1);
+
+  // further commands of the sender are posted immediately by the new owner
+  for (auto& m : masters)
+    m->receive(sender, 43);
+  CHECK(masters[2]->posted.back() == 43);
+  loop.run_for(2 * WINDOW);
+  CHECK(count_posts(masters, 43) == 1);
+}
+
+/// A restarted master doesn't post commands owned by its peers.
+static void test_restart()
+{
+  test_loop loop;
+  auto masters = make_cluster(loop);
+  loop.run_for(WINDOW);
+
+  masters[1]->start(masters, 1);
+  auto sender = uint32_t(0x01800002);  // owned by master 2
+  for (auto& m : masters)
+    m->receive(sender, 7);
+  CHECK(masters[1]->posted.empty());
+  loop.run_for(2 * WINDOW);
+  CHECK(count_posts(masters, 7) == 1);
+  CHECK(masters[2]->posted.size() == 1);
+}
+
+int main()
+{
+  test_exactly_once();
+  test_takeover();
+  test_restart();
+  printf("master_cluster_test passed\n");
+  return 0;
+}
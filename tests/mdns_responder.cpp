@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "mdns_responder.hpp"
+
+#include <system_error>
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/// Append a DNS name given as dotted labels.
+static void append_name(std::string& msg, const std::string& name)
+{
+  size_t start = 0;
+  while (start < name.size()) {
+    auto dot = name.find('.', start);
+    if (dot == std::string::npos)
+      dot = name.size();
+    msg += char(dot - start);
+    msg.append(name, start, dot - start);
+    start = dot + 1;
+  }
+  msg += '\0';
+}
+
+/// Append a resource record.
+static void append_record(std::string& msg, const std::string& name, uint16_t type, const std::string& data)
+{
+  append_name(msg, name);
+  const char fixed[] = {
+    char(type >> 8), char(type),
+    char(0x80), 1,          // IN, cache flush
+    0, 0, 0, 120,           // TTL
+    char(data.size() >> 8), char(data.size())
+  };
+  msg.append(fixed, sizeof(fixed));
+  msg += data;
+}
+
+mdns_responder::mdns_responder(test_loop& loop, const char* bridge_id, uint32_t ip) :
+  bridge_id_(bridge_id),
+  ip_(ip)
+{
+  fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (fd_ < 0)
+    throw std::system_error(errno, std::generic_category(), "Cannot create mDNS responder socket");
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  if (bind(fd_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &addr_len) < 0)
+  {
+    auto err = errno;
+    close(fd_);
+    throw std::system_error(err, std::generic_category(), "Cannot bind mDNS responder socket");
+  }
+  port_ = ntohs(addr.sin_port);
+  set_loop(&loop.loop());
+  watch(fd_, EPOLLIN);
+}
+
+mdns_responder::~mdns_responder() noexcept
+{
+  forget();
+  close(fd_);
+}
+
+void mdns_responder::ready(uint32_t)
+{
+  for (;;) {
+    uint8_t msg[1500];
+    struct sockaddr_in remote;
+    socklen_t addr_len = sizeof(remote);
+    auto len = recvfrom(fd_, msg, sizeof(msg), 0, reinterpret_cast<sockaddr*>(&remote), &addr_len);
+    if (len < 0)
+      return;
+    if (len < 12 || (msg[2] & 0x80))
+      continue;   // not a query
+    ++queries_;
+    peer_ip_ = remote.sin_addr.s_addr;
+    peer_port_ = remote.sin_port;
+    if (ip_)
+      respond(msg);
+  }
+}
+
+void mdns_responder::announce()
+{
+  static const uint8_t id[2] = { 0, 0 };
+  if (peer_ip_ && ip_)
+    respond(id);
+}
+
+void mdns_responder::respond(const uint8_t* id)
+{
+  // instance and host names are derived from the bridge ID like on a real bridge
+  auto suffix = bridge_id_.substr(10);
+  auto instance = "Philips Hue - " + suffix + "._hue._tcp.local";
+  auto host = bridge_id_.substr(0, 6) + suffix + ".local";
+
+  std::string msg;
+  const char header[] = {
+    char(id[0]), char(id[1]),
+    char(0x84), 0,          // authoritative response
+    0, 0,                   // no questions
+    0, 1,                   // one answer
+    0, 0,                   // no authority
+    0, 3                    // three additional records
+  };
+  msg.append(header, sizeof(header));
+
+  std::string ptr;
+  append_name(ptr, instance);
+  append_record(msg, "_hue._tcp.local", 12, ptr);
+  std::string txt;
+  txt += char(9 + bridge_id_.size());
+  txt += "bridgeid=" + bridge_id_;
+  txt += "\x0emodelid=BSB002";
+  append_record(msg, instance, 16, txt);
+  std::string srv("\0\0\0\0\x01\xbb", 6);   // priority, weight, port 443
+  append_name(srv, host);
+  append_record(msg, instance, 33, srv);
+  append_record(msg, host, 1, std::string(reinterpret_cast<const char*>(&ip_), 4));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = peer_ip_;
+  addr.sin_port = peer_port_;
+  sendto(fd_, msg.data(), msg.size(), 0, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+}
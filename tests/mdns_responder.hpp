@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Local stand-in of a Hue bridge answering mDNS queries.
+ */
+#pragma once
+
+#include "test_support.hpp"
+
+#include <cstdint>
+#include <string>
+
+/*!
+ * @brief Local stand-in of a Hue bridge answering mDNS queries.
+ *
+ * Listens on an ephemeral UDP port of the loopback interface and answers
+ * PTR queries for <tt>_hue._tcp.local</tt> with the PTR, TXT (bridge ID),
+ * SRV and A records of the bridge, like a Hue bridge does on the mDNS group.
+ */
+class mdns_responder : public event_loop::handler
+{
+public:
+  /*!
+   * @brief Start listening.
+   *
+   * @param loop loop of the test, which must outlive the responder.
+   * @param bridge_id bridge ID to announce (16 hex digits).
+   * @param ip address of the bridge to announce (network order, 0 to stay silent).
+   */
+  mdns_responder(test_loop& loop, const char* bridge_id, uint32_t ip);
+
+  ~mdns_responder() noexcept;
+
+  /// Get the UDP port to send queries to.
+  uint16_t port() const noexcept { return port_; }
+
+  /// Change the address of the bridge announced in responses (0 to stay silent).
+  void set_address(uint32_t ip) noexcept { ip_ = ip; }
+
+  /// Get count of queries received so far.
+  unsigned queries() const noexcept { return queries_; }
+
+  /// Send an unsolicited response to the source of the last query, e.g., after an address change.
+  void announce();
+
+private:
+  virtual void ready(uint32_t events) override;
+
+  /// Send a response with given ID to the source of the last query.
+  void respond(const uint8_t* id);
+
+  /// Socket.
+  int fd_ = -1;
+  /// Port of the socket.
+  uint16_t port_ = 0;
+  /// Bridge ID.
+  std::string bridge_id_;
+  /// Address of the bridge (network order).
+  uint32_t ip_;
+  /// Count of queries received.
+  unsigned queries_ = 0;
+  /// Address of the last querier (network order, 0 if none).
+  uint32_t peer_ip_ = 0;
+  /// Port of the last querier (network order).
+  uint16_t peer_port_ = 0;
+};
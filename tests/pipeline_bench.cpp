@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Benchmark of pipelining and concurrent connections against a local fake bridge.
+ *
+ * Measures command throughput with one request in flight vs. pipelined
+ * requests on one connection, and completion time of a burst of queued
+ * commands on one or several connections per bridge. Prints the results
+ * and fails, if pipelining or more connections don't help.
+ */
+
+#include "test_support.hpp"
+#include "fake_hue_bridge.hpp"
+#include "hue_sensor_command_posix.hpp"
+
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+/// Latency of the fake bridge for the pipelining benchmark.
+static constexpr int64_t LATENCY = 20;
+/// Count of bursts of button presses.
+static constexpr int BURSTS = 50;
+/// Count of commands per burst.
+static constexpr int BURST_SIZE = 4;
+/// Processing time of each request for the connection benchmark.
+static constexpr int64_t PROCESSING_TIME = 100;
+/// Count of direct action targets for the connection benchmark.
+static constexpr int TARGETS = 8;
+
+/// Create a connection to the fake bridge, running in the test loop.
+static std::unique_ptr<hue_sensor_command_posix> make_connection(test_loop& loop, fake_hue_bridge& bridge)
+{
+  std::unique_ptr<hue_sensor_command_posix> connection(new hue_sensor_command_posix(test_ip("127.0.0.1"), "key", 5));
+  connection->set_port(bridge.port());
+  connection->set_deadline(10000);
+  std::vector<std::pair<std::string, std::string>> actions;
+  for (int i = 0; i < TARGETS; ++i)
+    actions.emplace_back("lights/" + std::to_string(i + 1) + "/state", "{\"on\":true}");
+  connection->set_actions(actions);
+  connection->set_event_loop(&loop.loop());
+  connection->set_timer_wheel(&loop.wheel());
+  return connection;
+}
+
+/*!
+ * @brief Send bursts of sensor updates to a bridge answering each request after a latency.
+ *
+ * @param pipelined if set, post a whole burst at once, otherwise post
+ *    the next command after the previous one succeeded.
+ * @return commands per second.
+ */
+static double run_bursts(bool pipelined)
+{
+  test_loop loop;
+  fake_hue_bridge bridge(loop, test_ip("127.0.0.1"));
+  bridge.set_delay(LATENCY);
+  bridge.set_concurrent(true);
+  auto connection = make_connection(loop, bridge);
+
+  auto start = test_now();
+  uint32_t sent = 0;
+  for (int burst = 0; burst < BURSTS; ++burst) {
+    for (int i = 0; i < BURST_SIZE; ++i) {
+      connection->post(int32_t(++sent));
+      if (!pipelined)
+        CHECK(loop.run_until([&] { return connection->stats().succeeded == sent; }, 2000));
+    }
+    CHECK(loop.run_until([&] { return connection->stats().succeeded == sent; }, 2000));
+  }
+  auto elapsed = test_now() - start;
+  CHECK(bridge.requests().size() == sent);
+  return sent * 1000.0 / double(elapsed);
+}
+
+/*!
+ * @brief Post a burst of queued commands over several connections to a bridge processing requests serially.
+ *
+ * Direct actions are spread over connections by their target and the
+ * sensor update uses the first connection, like in the gateway.
+ *
+ * @param count count of connections.
+ * @return time in milliseconds until all commands completed.
+ */
+static int64_t run_connections(unsigned count)
+{
+  test_loop loop;
+  fake_hue_bridge bridge(loop, test_ip("127.0.0.1"));
+  bridge.set_delay(PROCESSING_TIME);
+  std::vector<std::unique_ptr<hue_sensor_command_posix>> connections;
+  for (unsigned i = 0; i < count; ++i)
+    connections.push_back(make_connection(loop, bridge));
+
+  auto start = test_now();
+  for (int i = 0; i < TARGETS; ++i)
+    connections[(i + 1) % count]->post_action(uint16_t(i));
+  connections[0]->post(1);
+  auto done = [&] {
+    uint32_t succeeded = 0;
+    for (auto& c : connections)
+      succeeded += c->stats().succeeded;
+    return succeeded == TARGETS + 1;
+  };
+  CHECK(loop.run_until(done, 5000));
+  auto elapsed = test_now() - start;
+  CHECK(bridge.connections() == count);
+  return elapsed;
+}
+
+int main()
+{
+  auto sequential = run_bursts(false);
+  auto pipelined = run_bursts(true);
+  printf("%d bursts of %d commands, bridge latency %d ms: %.0f commands/s with one request in flight, %.0f commands/s pipelined\n",
+         BURSTS, BURST_SIZE, int(LATENCY), sequential, pipelined);
+  CHECK(pipelined > 2 * sequential);
+
+  int64_t times[3];
+  unsigned counts[3] = { 1, 2, 4 };
+  for (int i = 0; i < 3; ++i)
+    times[i] = run_connections(counts[i]);
+  printf("%d queued commands, bridge processing %d ms per request: %lld/%lld/%lld ms with 1/2/4 connections\n",
+         TARGETS + 1, int(PROCESSING_TIME), (long long)times[0], (long long)times[1], (long long)times[2]);
+  CHECK(times[1] < times[0] * 3 / 4);
+  CHECK(times[2] < times[1] * 3 / 4);
+
+  printf("pipeline_bench passed\n");
+  return 0;
+}
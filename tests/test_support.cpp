@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+#include "test_support.hpp"
+#include "syslog_posix.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <ctime>
+
+#include <arpa/inet.h>
+
+void test_failed(const char* file, int line, const char* what)
+{
+  fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+  exit(1);
+}
+
+int64_t test_now() noexcept
+{
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return tp.tv_nsec / 1000000 + tp.tv_sec * 1000;
+}
+
+uint32_t test_ip(const char* address)
+{
+  struct in_addr addr;
+  if (!inet_aton(address, &addr))
+    throw std::runtime_error("Cannot parse IP address");
+  return addr.s_addr;
+}
+
+test_loop::test_loop() :
+  wheel_(test_now())
+{
+  syslog_open("test", LOG_PERROR, LOG_USER);
+}
+
+bool test_loop::run_until(const std::function<bool()>& done, int64_t timeout)
+{
+  auto deadline = test_now() + timeout;
+  while (!done()) {
+    auto now = test_now();
+    if (now - deadline >= 0)
+      return false;
+    auto delta = wheel_.next_timeout(now, deadline - now);
+    loop_.wait(now + (delta < deadline - now ? delta : deadline - now));
+    loop_.dispatch();
+    wheel_.advance(test_now());
+  }
+  return true;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2018-2019 Ivan Schréter (schreter@gmx.net)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This copyright notice MUST APPEAR in all copies of the software!
+ */
+
+/*!
+ * @file
+ * @brief Helpers of tests running against local fake bridges.
+ */
+#pragma once
+
+#include "event_loop.hpp"
+#include "embedded/timer_wheel.hpp"
+
+#include <cstdint>
+#include <functional>
+
+/// Fail the test, if a condition doesn't hold.
+#define CHECK(cond) \
+  do { if (!(cond)) test_failed(__FILE__, __LINE__, #cond); } while (0)
+
+/// Report a failed check and exit with an error.
+[[noreturn]] void test_failed(const char* file, int line, const char* what);
+
+/// Get current time in milliseconds on the clock of hue_sensor_command_posix::timestamp().
+int64_t test_now() noexcept;
+
+/// Parse a dotted IPv4 address to network order.
+uint32_t test_ip(const char* address);
+
+/*!
+ * @brief Event loop with a timer wheel, run like the main loop of the gateway.
+ */
+class test_loop
+{
+public:
+  /// Create the loop, logging to stderr.
+  test_loop();
+
+  /// Get the event loop to watch file descriptors in.
+  event_loop& loop() noexcept { return loop_; }
+
+  /// Get the timer wheel to schedule timeouts in.
+  timer_wheel& wheel() noexcept { return wheel_; }
+
+  /*!
+   * @brief Process events and timers until a condition holds.
+   *
+   * @param done condition checked after each iteration.
+   * @param timeout time in milliseconds to give up after.
+   * @return @c true, if the condition holds, @c false on timeout.
+   */
+  bool run_until(const std::function<bool()>& done, int64_t timeout);
+
+  /// Process events and timers for given time in milliseconds.
+  void run_for(int64_t time) { run_until([] { return false; }, time); }
+
+private:
+  /// Event loop.
+  event_loop loop_;
+  /// Timer wheel.
+  timer_wheel wheel_;
+};